@@ -9,19 +9,20 @@
 # Usage:         This script will be launched by a system init script and runs 
 #                as a daemon application
 #
-# Last modified: 13/07/2015
+# Last modified: 17/10/2026
 #
 ##################################################################################
 
-VERSION="0.1"
+VERSION="0.3"
 
 # load generic configuration parameters
 . /etc/geofox.conf
 
 # Settings used by Modbus TCP client
 IP_ADDR=127.0.0.1
-TCP_BASEPORT=5000
-OPERATION=1
+TCP_BASEPORT=5000   # subscriptions are served by the modules, not by the gateway
+OPERATION=4         # subscribe to register changes
+MAX_BLOCK=125       # max registers of a subscription
 
 # Web API handling
 API_MODULE="alarm.php"
@@ -34,6 +35,7 @@ DEV_ALARM_NUMBER=3
 LOGCMD="logger -i -t alarm_scanner"
 
 VALIDALMLIST="/tmp/valid_alarm_registers.txt"
+FIFO="/tmp/alarm_monitor.fifo"
 
 #rmdir /tmp/modbus_client_lock &> /dev/null
 echo "Alarm monitor (ver $VERSION) starting with parameters $AMON_INFRAREAD_DELAY $AMON_INFRALOOP_DELAY"
@@ -44,8 +46,8 @@ if [[ -z $API_KEY ]]; then
   exit 1
 fi
 
-# extract valid alarm registers for this plant
-awk '/AL/' $REGISTER_LIST > $VALIDALMLIST
+# extract valid alarm registers for this plant, sorted by slave and address
+awk '/AL/' $REGISTER_LIST | sort -t$'\t' -k2,2n -k3,3n > $VALIDALMLIST
 
 # parse the list to extract valid registers and their parameters
 IDX=0
@@ -57,13 +59,6 @@ while read LINE; do
   ADDR=`echo $LINE | cut -f3`
   NAME=`echo $LINE | cut -f4`
 
-  # The Modbus TCP server only handles the address range [0 - 8200],
-  # therefore we need to adjust the register addresses which come in  
-  # range [40000 - 48200] (e.g. NIBE40 Modbus module)
-  if [ $ADDR -gt 40000 ]; then
-    ADDR=$(($ADDR-40000))
-  fi
-  
   SLAVES["$IDX"]=$SLAVE
   ADDRESSES["$IDX"]=$ADDR
   REGNAMES["$IDX"]=$NAME
@@ -72,72 +67,99 @@ done < $VALIDALMLIST
 unset IFS
 rm $VALIDALMLIST
 
+# group contiguous registers of a slave into blocks, one subscription
+# each (connections and subscriptions of the modules are limited)
+BLK=0
+for i in "${!REGNAMES[@]}"
+  do
+    if [[ $BLK -gt 0 && ${SLAVES[$i]} == ${BLK_SLAVE[$BLK]} && 
+          ${ADDRESSES[$i]} -eq $((${BLK_ADDR[$BLK]}+${BLK_COUNT[$BLK]})) && 
+          ${BLK_COUNT[$BLK]} -lt $MAX_BLOCK ]]; then
+      BLK_COUNT[$BLK]=$((${BLK_COUNT[$BLK]}+1))
+    else
+      BLK=$(($BLK+1))
+      BLK_SLAVE[$BLK]=${SLAVES[$i]}
+      BLK_ADDR[$BLK]=${ADDRESSES[$i]}
+      BLK_COUNT[$BLK]=1
+      BLK_FIRST[$BLK]=$i
+    fi
+  done
+
+
+###############################################################
+#
+# Subscribe to the alarm register blocks: each subscription 
+# prints "<BLK> <ADDR> <VALUE>" to the FIFO for the registers 
+# of the block whenever one of them changes and is renewed 
+# after AMON_INFRALOOP_DELAY seconds if the connection to the 
+# module is lost
+#
+###############################################################
+rm -f $FIFO
+mkfifo $FIFO
+exec 3<>$FIFO
+trap 'kill 0' EXIT
+
+for b in "${!BLK_SLAVE[@]}"
+  do
+    (
+      while :
+        do
+          $MODBUS_CLIENT $IP_ADDR $(($TCP_BASEPORT+${BLK_SLAVE[$b]})) $OPERATION ${BLK_SLAVE[$b]} ${BLK_ADDR[$b]} ${BLK_COUNT[$b]}
+          sleep $AMON_INFRALOOP_DELAY
+        done | sed -u -n "s/^\([0-9]*\): [0-9A-F]*: *\(.*\)$/$b \1 \2/p"
+    ) >$FIFO &
+    sleep $AMON_INFRAREAD_DELAY
+  done
+
 
 ###############################################################
 #
 # Main loop: 
-# Read registers periodically and send alarm notification
-# on changes
+# Wait for register changes and send alarm notification
 #
 ###############################################################
-while :
+while read b ADDR TEMPREG <&3
   do
-  TIME=`date '+%s'`
-  
-  # Calculate start time for next cycle
-  NEXT_CYCLE_START=$(date --date="now + $AMON_INFRALOOP_DELAY seconds" +%s)
-
-  # Read one register at a time
-  for i in "${!REGNAMES[@]}"
-    do
-      #echo "reading ${REGNAMES[$i]}"
-      TEMPREG=`$MODBUS_CLIENT $IP_ADDR $(($TCP_BASEPORT+${SLAVES[$i]})) $OPERATION ${SLAVES[$i]} ${ADDRESSES[$i]} | grep ^${ADDRESSES[$i]} | cut -d: -f3 | tr -d ' '`
-      #echo "RESULT: $TEMPREG"
-      
-      # Create and send WebAPI request
-      if [[ ! -z $TEMPREG ]]; then
-      
-        if [[ ${OLDVALUES[$i]} != -1 && ${OLDVALUES[$i]} != $TEMPREG  ]]; then
-        
-          # Register names need to be converted to DB field names
-          REGNAME=${REGNAMES[$i]}
-          REGNAME=$(echo $REGNAME | sed 's/ /_/g')
-          REGNAME=$(echo $REGNAME | sed 's/-/_/g')
-          REGNAME=$(echo $REGNAME | sed 's/\.//g')
-          REGNAME=$(echo $REGNAME | awk '{print tolower($0)}')
-
-          # Create HTTP request body
-          DATA="apikey=$API_KEY&plant_id=$PLANTID&time=$TIME&alarm=$DEV_ALARM_NUMBER&json={$REGNAME:$TEMPREG}"
-          #echo "DATA: $DATA"
-
-          # Send HTTP request
-          $CURL -m 30 -k -s -o $TMPFILE "$TELEGEA_API/$API_MODULE?$DATA"
-
-          # Check curl exit code
-          EC=$?
-          if [ $EC -eq 0 ]; then
+    i=$((${BLK_FIRST[$b]}+$ADDR-${BLK_ADDR[$b]}))
+    TIME=`date '+%s'`
+    #echo "RESULT: ${REGNAMES[$i]} $TEMPREG"
+    
+    # Create and send WebAPI request
+    if [[ ! -z $TEMPREG ]]; then
+    
+      if [[ ${OLDVALUES[$i]} != -1 && ${OLDVALUES[$i]} != $TEMPREG  ]]; then
       
-            # Check for transmission or API errors
-            if [ $(cat $TMPFILE | wc |  awk '{print $2}') -ne 1 ]; then
-              API_ERR_CNT=$(($API_ERR_CNT+1))
-              $LOGCMD "Error sending data to WebAPI! Error count: $API_ERR_CNT"
-            fi
-          else
-            $LOGCMD "Error $EC reported by curl"
+        # Register names need to be converted to DB field names
+        REGNAME=${REGNAMES[$i]}
+        REGNAME=$(echo $REGNAME | sed 's/ /_/g')
+        REGNAME=$(echo $REGNAME | sed 's/-/_/g')
+        REGNAME=$(echo $REGNAME | sed 's/\.//g')
+        REGNAME=$(echo $REGNAME | awk '{print tolower($0)}')
+
+        # Create HTTP request body
+        DATA="apikey=$API_KEY&plant_id=$PLANTID&time=$TIME&alarm=$DEV_ALARM_NUMBER&json={$REGNAME:$TEMPREG}"
+        #echo "DATA: $DATA"
+
+        # Send HTTP request
+        $CURL -m 30 -k -s -o $TMPFILE "$TELEGEA_API/$API_MODULE?$DATA"
+
+        # Check curl exit code
+        EC=$?
+        if [ $EC -eq 0 ]; then
+    
+          # Check for transmission or API errors
+          if [ $(cat $TMPFILE | wc |  awk '{print $2}') -ne 1 ]; then
+            API_ERR_CNT=$(($API_ERR_CNT+1))
+            $LOGCMD "Error sending data to WebAPI! Error count: $API_ERR_CNT"
           fi
+        else
+          $LOGCMD "Error $EC reported by curl"
         fi
-        
-        # Save last value
-        OLDVALUES[$i]=$TEMPREG
-      fi 
+      fi
       
-      sleep $AMON_INFRAREAD_DELAY 
-    done
-  
-  # wait for next update period
-  TIME_TO_WAIT=$(($NEXT_CYCLE_START-$(date +%s)))
-  if [ $TIME_TO_WAIT -gt 0 ]; then
-    sleep $TIME_TO_WAIT
-  fi
-
-done
+      # Save last value
+      OLDVALUES[$i]=$TEMPREG
+    fi 
+    
+  done
@@ -0,0 +1,93 @@
+#! /bin/bash
+##################################################################################
+#
+# Author:        Ondrej Wisniewski
+#
+# Description:   Create a simulated GPIO character device with the gpio-sim
+#                kernel module (Linux 5.17 or later, run as root), to run
+#                pulsecountd with "-c <chip>" on any Linux box without the
+#                device hardware. Unlike the simulated sysfs directory of
+#                gpio_sysfs_sim.sh, the lines signal timestamped edges.
+#                pulsecount_sim -c <NAME> generates pulse trains on the lines.
+#
+# Usage:         gpio_sim.sh create <NAME> <LINES>
+#                   create the chip and print its name (e.g. gpiochip2)
+#                gpio_sim.sh set <NAME> <LINE> <0|1>
+#                   set the input value of a line
+#                gpio_sim.sh pulse <NAME> <LINE> <COUNT> [<WIDTH_S>]
+#                   generate COUNT active low pulses on a line
+#                gpio_sim.sh remove <NAME>
+#                   remove the chip
+#
+#                With the gpio-mockup module (older kernels) the lines of
+#                /dev/gpiochipN are set by writing 0 or 1 to
+#                /sys/kernel/debug/gpio-mockup/gpiochipN/<LINE> instead.
+#
+# Last modified: 17/10/2026
+#
+##################################################################################
+
+CONFIGFS=/sys/kernel/config/gpio-sim
+
+usage()
+{
+  echo "usage: $0 create <NAME> <LINES>"
+  echo "       $0 set <NAME> <LINE> <0|1>"
+  echo "       $0 pulse <NAME> <LINE> <COUNT> [<WIDTH_S>]"
+  echo "       $0 remove <NAME>"
+  exit 1
+}
+
+# Set a line by pulling it up or down
+set_line()
+{
+  local DEV=$(cat $CONFIGFS/$1/dev_name)
+  local CHIP=$(cat $CONFIGFS/$1/bank0/chip_name)
+  local PULL=pull-down
+  [ "$3" == "1" ] && PULL=pull-up
+  echo $PULL > /sys/devices/platform/$DEV/$CHIP/sim_gpio$2/pull
+}
+
+[ $# -lt 2 ] && usage
+NAME=$2
+
+case "$1" in
+  create)
+    [ $# -lt 3 ] && usage
+    modprobe gpio-sim || exit 1
+    mkdir $CONFIGFS/$NAME || exit 1
+    mkdir $CONFIGFS/$NAME/bank0
+    echo $3 > $CONFIGFS/$NAME/bank0/num_lines
+    echo 1 > $CONFIGFS/$NAME/live || exit 1
+    # Inputs idle high as with the pull-ups of the device
+    for (( LINE=0; LINE<$3; LINE++ ))
+      do
+        set_line $NAME $LINE 1
+      done
+    cat $CONFIGFS/$NAME/bank0/chip_name
+    ;;
+  set)
+    [ $# -lt 4 ] && usage
+    set_line $NAME $3 $4
+    ;;
+  pulse)
+    [ $# -lt 4 ] && usage
+    WIDTH=${5:-0.05}
+    for (( i=0; i<$4; i++ ))
+      do
+        set_line $NAME $3 0
+        sleep $WIDTH
+        set_line $NAME $3 1
+        sleep $WIDTH
+      done
+    ;;
+  remove)
+    echo 0 > $CONFIGFS/$NAME/live
+    rmdir $CONFIGFS/$NAME/bank0 $CONFIGFS/$NAME
+    ;;
+  *)
+    usage
+    ;;
+esac
+
+exit 0
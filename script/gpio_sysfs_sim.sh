@@ -0,0 +1,42 @@
+#! /bin/bash
+##################################################################################
+#
+# Author:        Ondrej Wisniewski
+#
+# Description:   Create a simulated GPIO sysfs directory, to run the status,
+#                control and pulse counter modules on any Linux box without
+#                the device hardware (e.g. for benchmarks with
+#                geomon_modbustcp_bench)
+#
+# Usage:         gpio_sysfs_sim.sh <DIR> <PIN> [<PIN> ...]
+#
+#                Build the modules with "make GPIO_SIM=<DIR>" and start them
+#                with the same pins. Input values can be changed by writing
+#                to <DIR>/gpio<PIN>/value. Edges are not signalled, except
+#                to pulsecountd which takes every write as an edge.
+#                pulsecount_sim generates pulse trains on the pins.
+#
+# Last modified: 17/10/2026
+#
+##################################################################################
+
+if [ $# -lt 2 ]; then
+  echo "usage: $0 <DIR> <PIN> [<PIN> ...]"
+  exit 1
+fi
+
+DIR=$1
+shift
+
+mkdir -p $DIR || exit 1
+touch $DIR/export $DIR/unexport
+
+for PIN in "$@"
+  do
+    mkdir -p $DIR/gpio$PIN
+    echo none > $DIR/gpio$PIN/edge
+    echo in > $DIR/gpio$PIN/direction
+    echo 0 > $DIR/gpio$PIN/value
+  done
+
+exit 0
@@ -41,8 +41,13 @@
 # version: 0.16 Minor changes for coexistance with alarm handler script
 # date:    2015/07/13
 # changed by: Ondrej Wisniewski
+#
+# version: 0.17 NIBE40 register addresses are passed unchanged, the Modbus 
+#               servers handle the full address range
+# date:    2026/10/17
+# changed by: Ondrej Wisniewski
 
-VERSION="0.16"
+VERSION="0.17"
 
 
 # load generic configuration parameters
@@ -50,7 +55,7 @@ VERSION="0.16"
 
 # Settings used by Modbus TCP client
 IP_ADDR=127.0.0.1
-TCP_BASEPORT=5000
+TCP_BASEPORT=5000   # not used if MODBUS_GATEWAY_PORT is set
 OPERATION=1
 
 # Web API handling
@@ -84,13 +89,6 @@ while read LINE; do
    DIV=`echo $LINE | cut -f5`
   SIGN=`echo $LINE | cut -f7`
 
-  # The Modbus TCP server only handles the address range [0 - 8200],
-  # therefore we need to adjust the register addresses which come in  
-  # range [40000 - 48200] (e.g. NIBE40 Modbus module)
-  if [ $ADDR -gt 40000 ]; then
-    ADDR=$(($ADDR-40000))
-  fi
-  
   SLAVES["$IDX"]=$SLAVE
   ADDRESSES["$IDX"]=$ADDR
   DIVISORS["$IDX"]=$DIV 
@@ -160,8 +158,8 @@ while :
   # Read one 16 bit register at a time
   for i in "${!REGNAMES[@]}"
     do
-      #echo "CHECKING: $MODBUS_CLIENT $IP_ADDR $(($TCP_BASEPORT+${SLAVES[$i]})) $OPERATION ${SLAVES[$i]} ${ADDRESSES[$i]}"
-      TEMPREG=`$MODBUS_CLIENT $IP_ADDR $(($TCP_BASEPORT+${SLAVES[$i]})) $OPERATION ${SLAVES[$i]} ${ADDRESSES[$i]} | grep ^${ADDRESSES[$i]} | cut -d: -f3 | tr -d ' '`
+      #echo "CHECKING: $MODBUS_CLIENT $IP_ADDR ${MODBUS_GATEWAY_PORT:-$(($TCP_BASEPORT+${SLAVES[$i]}))} $OPERATION ${SLAVES[$i]} ${ADDRESSES[$i]}"
+      TEMPREG=`$MODBUS_CLIENT $IP_ADDR ${MODBUS_GATEWAY_PORT:-$(($TCP_BASEPORT+${SLAVES[$i]}))} $OPERATION ${SLAVES[$i]} ${ADDRESSES[$i]} | grep ^${ADDRESSES[$i]} | cut -d: -f3 | tr -d ' '`
     
       #echo "RESULT: $TEMPREG"
       #$LOGCMD "RESULT: $TEMPREG"
@@ -0,0 +1,232 @@
+#!/usr/bin/awk -f
+#
+# Register map code generator
+#
+# Compiles the Modbus register list (telegea_mbreg_list.txt, tab separated,
+# one header line) into the C header telegea_mbreg.h with static constant
+# tables: slave address, register address, divisor, signedness, size,
+# access, selection, name and package of each register, plus an index by
+# slave and address, so modules and pollers look up a register by array
+# indexing instead of parsing the list at runtime.
+#
+# Usage: awk -F'\t' -f mbreg_gen.awk telegea_mbreg_list.txt > telegea_mbreg.h
+#
+# Author: O. Wisniewski
+# Version: 0.2
+# Date: 2026/10/17
+#
+# Copyright 2013-2015, DEK Italia
+#
+# This file is part of the Telegea platform.
+#
+# Telegea is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Columns of the register list
+BEGIN {
+   COL_SELECTED = 1
+   COL_SLAVE    = 2
+   COL_ADDR     = 3
+   COL_NAME     = 4
+   COL_DIVISOR  = 5
+   COL_TYPE     = 6
+   COL_SIGNED   = 7
+   COL_SIZE     = 8
+   COL_PACKAGE  = 11
+
+   n = 0
+   max_slave = 0
+   errors = 0
+}
+
+# Print an error and fail at the end
+function error(msg)
+{
+   printf("%s:%d: %s\n", FILENAME, FNR, msg) > "/dev/stderr"
+   errors++
+}
+
+# Quote a string as C string literal
+function c_string(s)
+{
+   gsub(/\\/, "\\\\", s)
+   gsub(/"/, "\\\"", s)
+   return "\"" s "\""
+}
+
+# Skip the header line and empty lines
+FNR == 1 || /^[ \t\r]*$/ { next }
+
+{
+   sub(/\r$/, "")
+
+   if (($COL_SLAVE !~ /^[0-9]+$/) || ($COL_SLAVE < 1) || ($COL_SLAVE > 247)) {
+      error("invalid slave address '" $COL_SLAVE "'")
+      next
+   }
+   if (($COL_ADDR !~ /^[0-9]+$/) || ($COL_ADDR > 65535)) {
+      error("invalid register address '" $COL_ADDR "'")
+      next
+   }
+
+   if ($COL_SELECTED == "SI")
+      sel = "MBREG_SCANNED"
+   else if ($COL_SELECTED == "AL")
+      sel = "MBREG_ALARM"
+   else
+      sel = "MBREG_UNUSED"
+
+   div = $COL_DIVISOR
+   if ((div !~ /^[0-9]+$/) || (div < 1)) {
+      error("invalid divisor '" div "'")
+      next
+   }
+   size = $COL_SIZE
+   if ((size != 8) && (size != 16) && (size != 32)) {
+      error("invalid size '" size "'")
+      next
+   }
+
+   slave = $COL_SLAVE + 0
+   addr = $COL_ADDR + 0
+   if ((slave, addr) in index_of) {
+      error("duplicate register " slave ":" addr)
+      next
+   }
+   index_of[slave, addr] = n
+   if (!(slave in max_addr) || (addr > max_addr[slave]))
+      max_addr[slave] = addr
+   if (!(slave in min_addr) || (addr < min_addr[slave]))
+      min_addr[slave] = addr
+   if (slave > max_slave)
+      max_slave = slave
+
+   entry[n] = sprintf("   { %3d, %5d, %5d, %d, %2d, %d, %-14s %s, %s }", slave, addr, div,
+                      ($COL_SIGNED == "S"), size, ($COL_TYPE ~ /W/), sel ",",
+                      c_string($COL_NAME), c_string($COL_PACKAGE))
+   n++
+}
+
+END {
+   if (n == 0)
+      error("no registers")
+   if (errors)
+      exit 1
+
+   print "/*"
+   print " * Telegea Modbus register map"
+   print " * - generated by mbreg_gen.awk from " FILENAME ", do not edit"
+   print " */"
+   print "#ifndef _TELEGEA_MBREG_H_"
+   print "#define _TELEGEA_MBREG_H_"
+   print ""
+   print "#include <stddef.h>"
+   print "#include <stdint.h>"
+   print ""
+   print "/* Selection of a register for the plant */"
+   print "typedef enum {"
+   print "   MBREG_UNUSED,                        /* NO */"
+   print "   MBREG_SCANNED,                       /* SI: logged by the register scanner */"
+   print "   MBREG_ALARM                          /* AL: logged and monitored for alarms */"
+   print "} mbreg_sel_t;"
+   print ""
+   print "/* Register of the register list */"
+   print "typedef struct {"
+   print "   uint8_t slave;                       /* slave address of the module */"
+   print "   uint16_t addr;                       /* register address */"
+   print "   uint16_t divisor;                    /* value = raw value / divisor */"
+   print "   uint8_t is_signed;                   /* raw value is signed */"
+   print "   uint8_t size;                        /* size of the value in bits */"
+   print "   uint8_t writable;"
+   print "   uint8_t selected;                    /* mbreg_sel_t */"
+   print "   const char *name;"
+   print "   const char *package;                 /* register package (group) */"
+   print "} mbreg_t;"
+   print ""
+   print "/* Registers in the order of the register list */"
+   printf("#define MBREG_COUNT %d\n", n)
+   print "static const mbreg_t mbreg_table[MBREG_COUNT] = {"
+   for (i=0; i<n; i++)
+      printf("%s%s\n", entry[i], (i < n-1) ? "," : "")
+   print "};"
+   print ""
+   print "/* Index in mbreg_table by register address minus the lowest address"
+   print " * of the slave (mbreg_index_base), per slave (-1 if not listed) */"
+   printf("#define MBREG_MAX_SLAVE %d\n", max_slave)
+   for (s=1; s<=max_slave; s++) {
+      if (!(s in max_addr))
+         continue
+      printf("static const int16_t mbreg_index_%d[%d] = {", s, max_addr[s] - min_addr[s] + 1)
+      for (a=min_addr[s]; a<=max_addr[s]; a++) {
+         if ((a - min_addr[s]) % 16 == 0)
+            printf("\n  ")
+         printf(" %2d%s", ((s, a) in index_of) ? index_of[s, a] : -1, (a < max_addr[s]) ? "," : "")
+      }
+      print "\n};"
+   }
+   print "static const int16_t *const mbreg_index[MBREG_MAX_SLAVE+1] = {"
+   for (s=0; s<=max_slave; s++)
+      printf("   %s%s\n", (s in max_addr) ? "mbreg_index_" s : "NULL", (s < max_slave) ? "," : "")
+   print "};"
+   print "static const uint16_t mbreg_index_base[MBREG_MAX_SLAVE+1] = {"
+   for (s=0; s<=max_slave; s++)
+      printf("   %d%s\n", (s in min_addr) ? min_addr[s] : 0, (s < max_slave) ? "," : "")
+   print "};"
+   print "static const uint16_t mbreg_index_len[MBREG_MAX_SLAVE+1] = {"
+   for (s=0; s<=max_slave; s++)
+      printf("   %d%s\n", (s in max_addr) ? max_addr[s] - min_addr[s] + 1 : 0, (s < max_slave) ? "," : "")
+   print "};"
+   print ""
+   print "/**********************************************************"
+   print " * Function: mbreg_lookup()"
+   print " *"
+   print " * Description:"
+   print " *           Look up a register of the register list"
+   print " *"
+   print " * Returns:  pointer to the register, NULL if not listed"
+   print " *********************************************************/"
+   print "static inline const mbreg_t *mbreg_lookup(int slave, int addr)"
+   print "{"
+   print "   if ((slave < 0) || (slave > MBREG_MAX_SLAVE))"
+   print "   {"
+   print "      return NULL;"
+   print "   }"
+   print "   addr -= mbreg_index_base[slave];"
+   print "   if ((addr < 0) || (addr >= mbreg_index_len[slave]) || (mbreg_index[slave][addr] < 0))"
+   print "   {"
+   print "      return NULL;"
+   print "   }"
+   print "   return &mbreg_table[mbreg_index[slave][addr]];"
+   print "}"
+   print ""
+   print "/**********************************************************"
+   print " * Function: mbreg_value()"
+   print " *"
+   print " * Description:"
+   print " *           Convert the raw value of a register (the low"
+   print " *           size bits of raw) to its scaled value"
+   print " *********************************************************/"
+   print "static inline double mbreg_value(const mbreg_t *reg, uint32_t raw)"
+   print "{"
+   print "   if (reg->size < 32) raw &= (1UL << reg->size) - 1;"
+   print ""
+   print "   if (reg->is_signed && (raw & (1UL << (reg->size - 1))))"
+   print "   {"
+   print "      return -(double)((~raw + 1) & (0xFFFFFFFFUL >> (32 - reg->size))) / reg->divisor;"
+   print "   }"
+   print "   return (double)raw / reg->divisor;"
+   print "}"
+   print ""
+   print "#endif"
+}
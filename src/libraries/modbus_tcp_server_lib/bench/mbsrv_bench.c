@@ -0,0 +1,156 @@
+/*
+ * Modbus TCP server library micro-benchmark
+ * - measures the CPU cost of handling one request inside the library,
+ *   without any socket I/O
+ * - compares it with the cost of allocating, zeroing and freeing the 
+ *   libmodbus register mapping, which versions <= 0.3 of the library
+ *   did for every single request
+ * 
+ * Build instructions:
+ *   make -C .. static
+ *   make
+ * 
+ * Usage:
+ *   mbsrv_bench [<iterations>]
+ * 
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ * 
+ * Copyright 2013-2015, DEK Italia
+ * 
+ * This file is part of the Telegea platform.
+ * 
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <modbus.h>
+
+#include "modbustcp_server_lib.h"
+#include "modbustcp_server_int.h"
+
+#define DEFAULT_ITERATIONS 1000000
+
+/* Size of the register mapping allocated per request by libmbsrv <= 0.3 */
+#define OLD_MAX_REG 8200
+
+#define SLAVE_ADDR 1
+
+
+/**********************************************************
+ * Function: read_regs()
+ * 
+ * Description:
+ *           Dummy "Read registers" callback
+ *********************************************************/
+static int read_regs(int start_addr, int count, uint16_t *reg_vals)
+{
+   int i;
+   
+   for (i=0; i<count; i++) reg_vals[i] = start_addr + i;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: elapsed_ns()
+ * 
+ * Description:
+ *           Time between two timestamps in nanoseconds
+ *********************************************************/
+static double elapsed_ns(struct timespec start, struct timespec end)
+{
+   return (end.tv_sec - start.tv_sec)*1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+
+/**********************************************************
+ * Function: bench_request()
+ * 
+ * Description:
+ *           Measure the average time to process one read
+ *           request of <count> registers, optionally doing 
+ *           the per request mapping allocation of libmbsrv 0.3
+ * 
+ * Returns:  time per request in nanoseconds
+ *********************************************************/
+static double bench_request(long iterations, int count, int with_mapping)
+{
+   uint8_t query[12] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x06, SLAVE_ADDR, 0x03, 0x00, 0x01, 0x00, 0x00 };
+   uint8_t reply[MODBUS_TCP_MAX_ADU_LENGTH];
+   struct timespec start, end;
+   volatile int sink = 0;
+   long i;
+   
+   query[11] = count;
+   
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (i=0; i<iterations; i++)
+   {
+      if (with_mapping)
+      {
+         modbus_mapping_t *mb_mapping = modbus_mapping_new(0, 0, OLD_MAX_REG, 0);
+         
+         sink += mbsrv_process_request(query, sizeof(query), 0, reply);
+         mb_mapping->tab_registers[1] = reply[9];
+         modbus_mapping_free(mb_mapping);
+      }
+      else
+      {
+         sink += mbsrv_process_request(query, sizeof(query), 0, reply);
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   
+   return elapsed_ns(start, end) / iterations;
+}
+
+
+/**********************************************************
+ * 
+ * Main function
+ * 
+ *********************************************************/
+int main(int argc, char* argv[])
+{
+   long iterations = DEFAULT_ITERATIONS;
+   int counts[] = { 1, 16, 125 };
+   unsigned int i;
+   
+   if (argc > 1) iterations = atol(argv[1]);
+   if (iterations <= 0)
+   {
+      printf("usage: %s [<iterations>]\n", argv[0]);
+      return 1;
+   }
+   
+   mbsrv_set_callbacks(SLAVE_ADDR, read_regs, NULL);
+   
+   printf("Modbus TCP server library benchmark, %ld iterations per test\n\n", iterations);
+   printf("%-10s %18s %18s %10s\n", "registers", "with mapping [ns]", "current [ns]", "speedup");
+   
+   for (i=0; i<sizeof(counts)/sizeof(counts[0]); i++)
+   {
+      double t_old = bench_request(iterations, counts[i], 1);
+      double t_new = bench_request(iterations, counts[i], 0);
+      
+      printf("%-10d %18.1f %18.1f %9.1fx\n", counts[i], t_old, t_new, t_old/t_new);
+   }
+   
+   return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Modbus TCP server library transport benchmark
+ * - measures the round trip time of Modbus requests sent to a server
+ *   over loopback TCP and over its Unix domain socket
+ * - the server runs in a child process, requests are sent one at a
+ *   time (like the polling scripts do) on a persistent connection
+ *
+ * Build instructions:
+ *   make -C .. static
+ *   make
+ *
+ * Usage:
+ *   mbsrv_transport_bench [<requests> [<slave addr>]]
+ *
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <modbus.h>
+
+#include "modbustcp_server_lib.h"
+#include "modbustcp_server_int.h"
+
+#define DEFAULT_REQUESTS 100000
+
+/* Slave address of the benchmark server (port 5000 + slave address),
+ * choose one which isn't used by a running module
+ */
+#define DEFAULT_SLAVE_ADDR 9
+
+
+/**********************************************************
+ * Function: read_regs()
+ *
+ * Description:
+ *           Dummy "Read registers" callback
+ *********************************************************/
+static int read_regs(int start_addr, int count, uint16_t *reg_vals)
+{
+   int i;
+
+   for (i=0; i<count; i++) reg_vals[i] = start_addr + i;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: elapsed_ns()
+ *
+ * Description:
+ *           Time between two timestamps in nanoseconds
+ *********************************************************/
+static double elapsed_ns(struct timespec start, struct timespec end)
+{
+   return (end.tv_sec - start.tv_sec)*1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+
+/**********************************************************
+ * Function: connect_server()
+ *
+ * Description:
+ *           Connect to the benchmark server via TCP or via
+ *           its Unix domain socket, retrying while it starts
+ *
+ * Returns:  socket on success
+ *          -1 otherwise
+ *********************************************************/
+static int connect_server(int tcp_port, int use_unix)
+{
+   struct sockaddr_in in_addr;
+   struct sockaddr_un un_addr;
+   struct sockaddr *addr;
+   socklen_t addr_len;
+   int retry;
+   int s;
+   int one = 1;
+
+   if (use_unix)
+   {
+      mbsrv_unix_addr(NULL, tcp_port, &un_addr, &addr_len);
+      addr = (struct sockaddr *)&un_addr;
+   }
+   else
+   {
+      memset(&in_addr, 0, sizeof(in_addr));
+      in_addr.sin_family = AF_INET;
+      in_addr.sin_port = htons(tcp_port);
+      in_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      addr = (struct sockaddr *)&in_addr;
+      addr_len = sizeof(in_addr);
+   }
+
+   for (retry=0; retry<50; retry++)
+   {
+      s = socket(addr->sa_family, SOCK_STREAM, 0);
+      if (s == -1) return -1;
+
+      if (connect(s, addr, addr_len) == 0)
+      {  /* Same as libmodbus does for TCP connections */
+         if (!use_unix) setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+         return s;
+      }
+
+      close(s);
+      usleep(100000);
+   }
+
+   return -1;
+}
+
+
+/**********************************************************
+ * Function: bench_transport()
+ *
+ * Description:
+ *           Measure the average round trip time of a read
+ *           request of <count> registers
+ *
+ * Returns:  time per request in microseconds
+ *          -1 on error
+ *********************************************************/
+static double bench_transport(int s, long requests, int slave_addr, int count)
+{
+   uint8_t query[12] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0x00, 0x03, 0x00, 0x01, 0x00, 0x00 };
+   uint8_t reply[MODBUS_TCP_MAX_ADU_LENGTH];
+   int reply_length = MBAP_HEADER_LENGTH + 2 + 2*count;
+   struct timespec start, end;
+   long i;
+   int n, rc;
+
+   query[6] = slave_addr;
+   query[11] = count;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (i=0; i<requests; i++)
+   {
+      query[0] = i >> 8;
+      query[1] = i & 0xFF;
+
+      if (send(s, query, sizeof(query), MSG_NOSIGNAL) != sizeof(query)) return -1;
+
+      for (n=0; n<reply_length; n+=rc)
+      {
+         rc = recv(s, &reply[n], reply_length - n, 0);
+         if (rc <= 0) return -1;
+      }
+      if (reply[7] != 0x03) return -1;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   return elapsed_ns(start, end) / requests / 1000;
+}
+
+
+/**********************************************************
+ *
+ * Main function
+ *
+ *********************************************************/
+int main(int argc, char* argv[])
+{
+   long requests = DEFAULT_REQUESTS;
+   int slave_addr = DEFAULT_SLAVE_ADDR;
+   int tcp_port;
+   int counts[] = { 1, 16, 125 };
+   int s_tcp, s_unix;
+   unsigned int i;
+   pid_t server_pid;
+
+   if (argc > 1) requests = atol(argv[1]);
+   if (argc > 2) slave_addr = atoi(argv[2]);
+   if ((requests <= 0) || (slave_addr < 1) || (slave_addr > 247))
+   {
+      printf("usage: %s [<requests> [<slave addr>]]\n", argv[0]);
+      return 1;
+   }
+   tcp_port = MODBUSTCP_SERVER_PORT_BASE + slave_addr;
+
+   /* Run the server in a child process */
+   server_pid = fork();
+   if (server_pid == 0)
+   {
+      modbustcp_server_blk(slave_addr, read_regs, NULL);
+      _exit(1);
+   }
+
+   s_tcp = connect_server(tcp_port, 0);
+   s_unix = connect_server(tcp_port, 1);
+   if ((s_tcp == -1) || (s_unix == -1))
+   {
+      printf("Failed to connect to the server on port %d: %s\n", tcp_port, strerror(errno));
+      kill(server_pid, SIGTERM);
+      return 1;
+   }
+
+   printf("Modbus server transport benchmark, %ld requests per test\n\n", requests);
+   printf("%-10s %18s %18s %10s\n", "registers", "TCP [us]", "Unix socket [us]", "speedup");
+
+   for (i=0; i<sizeof(counts)/sizeof(counts[0]); i++)
+   {
+      double t_tcp = bench_transport(s_tcp, requests, slave_addr, counts[i]);
+      double t_unix = bench_transport(s_unix, requests, slave_addr, counts[i]);
+
+      if ((t_tcp < 0) || (t_unix < 0))
+      {
+         printf("Request failed\n");
+         break;
+      }
+      printf("%-10d %18.2f %18.2f %9.2fx\n", counts[i], t_tcp, t_unix, t_tcp/t_unix);
+   }
+
+   close(s_tcp);
+   close(s_unix);
+   kill(server_pid, SIGTERM);
+   waitpid(server_pid, NULL, 0);
+
+   return 0;
+}
@@ -0,0 +1,378 @@
+/*
+ * Modbus TCP server library
+ * - register cache with configurable time to live (TTL)
+ * - coalescing of concurrent reads of the same register
+ * 
+ * Registers in a cached address range are read via the callback
+ * function only if the cached value is older than the TTL of the
+ * range. Independent from the TTL, a value read by the callback is
+ * also returned to all requests which were received before the 
+ * read completed, so concurrent requests for the same register 
+ * share a single (possibly slow) backend read.
+ * 
+ * The cache is shared by the server loop and the worker threads
+ * handling slow registers, it is protected by a mutex which is not
+ * held while calling the callback function.
+ * 
+ * Author: O. Wisniewski
+ * Version: 0.5
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ * 
+ * This file is part of the Telegea platform.
+ * 
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "modbustcp_server_lib.h"
+#include "modbustcp_server_int.h"
+
+/* Max number of cached address ranges */
+#define MAX_CACHE_RANGES 8
+
+/* Backend reads taking longer than this (in ms) make the server
+ * collect requests which arrived in the meantime, so they can 
+ * share the value just read
+ */
+#define SLOW_READ_TIME 10
+
+
+/* Cached register value */
+typedef struct {
+   uint16_t val;
+   uint8_t  valid;
+   uint64_t read_done;        /* time the value was read (in ms) */
+} cache_entry_t;
+
+/* Cached address range */
+typedef struct {
+   int first_addr;
+   int last_addr;
+   int ttl;                   /* time to live (in ms) */
+   cache_entry_t *entries;    /* one entry per register */
+} cache_range_t;
+
+static cache_range_t cache_ranges[MAX_CACHE_RANGES];
+static int num_cache_ranges = 0;
+
+/* Completion time of the last slow backend read (0 if none pending) */
+static uint64_t slow_read_done = 0;
+
+/* Protects the cache entries and statistics */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Statistics */
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+static unsigned long cache_coalesced = 0;
+
+
+/**********************************************************
+ * Function: find_entry()
+ * 
+ * Description:
+ *           Find the cache entry for a register address
+ * 
+ * Returns:  pointer to cache entry, with TTL of its range
+ *           NULL if the register is not cached
+ *********************************************************/
+static cache_entry_t* find_entry(int addr, int *ttl)
+{
+   int i;
+   
+   for (i=0; i<num_cache_ranges; i++)
+   {
+      if ((addr >= cache_ranges[i].first_addr) && (addr <= cache_ranges[i].last_addr))
+      {
+         *ttl = cache_ranges[i].ttl;
+         return &cache_ranges[i].entries[addr - cache_ranges[i].first_addr];
+      }
+   }
+   return NULL;
+}
+
+
+/**********************************************************
+ * Function: lookup()
+ * 
+ * Description:
+ *           Get a register value from the cache, if the
+ *           cached value is still valid for a request 
+ *           received at time rx_time. With val NULL only
+ *           checks for a hit, without counting it.
+ * 
+ * Returns:  1 on cache hit, 0 otherwise
+ *********************************************************/
+static int lookup(int addr, uint64_t rx_time, uint64_t now, uint16_t *val)
+{
+   cache_entry_t *entry;
+   int ttl;
+   
+   entry = find_entry(addr, &ttl);
+   if ((entry == NULL) || !entry->valid) return 0;
+   
+   if (entry->read_done + ttl > now)
+   {  /* Value is younger than the TTL */
+      if (val) cache_hits++;
+   }
+   else if (entry->read_done >= rx_time)
+   {  /* Value was read while the request was already waiting */
+      if (val) cache_coalesced++;
+   }
+   else
+   {
+      return 0;
+   }
+   
+   if (val) *val = entry->val;
+   return 1;
+}
+
+
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_server_cache()
+ * 
+ * DESCRIPTION: 
+ *           Enables caching for a range of register addresses
+ * 
+ * PARAMETERS: 
+ *           first_addr - first register address of the range
+ *           last_addr  - last register address of the range
+ *           ttl        - time to live of cached values (in ms)
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ * 
+ *******************************************************************/
+int modbustcp_server_cache(int first_addr, int last_addr, int ttl)
+{
+   cache_range_t *range;
+   
+   if ((num_cache_ranges == MAX_CACHE_RANGES) || (first_addr < 0) || 
+       (last_addr < first_addr) || (ttl < 0))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid cache range %d-%d (TTL %d ms)", 
+                                              first_addr, last_addr, ttl);
+      return -1;
+   }
+   
+   range = &cache_ranges[num_cache_ranges];
+   range->entries = calloc(last_addr - first_addr + 1, sizeof(cache_entry_t));
+   if (range->entries == NULL)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Failed to allocate cache for range %d-%d", 
+                                                        first_addr, last_addr);
+      return -1;
+   }
+   range->first_addr = first_addr;
+   range->last_addr = last_addr;
+   range->ttl = ttl;
+   num_cache_ranges++;
+   
+   return 0;
+}
+
+
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_server_cache_stats()
+ * 
+ * DESCRIPTION: 
+ *           Gets the cache statistics
+ * 
+ * PARAMETERS: 
+ *           hits      - number of reads served within the TTL
+ *           coalesced - number of reads served by the backend 
+ *                       read of a concurrent request
+ *           misses    - number of cached registers read via the
+ *                       callback function
+ * 
+ *******************************************************************/
+void modbustcp_server_cache_stats(unsigned long *hits, unsigned long *coalesced, unsigned long *misses)
+{
+   pthread_mutex_lock(&cache_lock);
+   *hits = cache_hits;
+   *coalesced = cache_coalesced;
+   *misses = cache_misses;
+   pthread_mutex_unlock(&cache_lock);
+}
+
+
+/**********************************************************
+ * Function: mbsrv_cache_hit()
+ * 
+ * Description:
+ *           Check if a read request can be served entirely
+ *           from the cache
+ * 
+ * Returns:  1 if all registers are cached and valid
+ *           0 otherwise
+ *********************************************************/
+int mbsrv_cache_hit(int start_addr, int count, uint64_t rx_time)
+{
+   int i;
+   uint64_t now = mbsrv_time_ms();
+   
+   if (num_cache_ranges == 0) return 0;
+   
+   pthread_mutex_lock(&cache_lock);
+   for (i=0; i<count; i++)
+   {
+      if (!lookup(start_addr+i, rx_time, now, NULL)) break;
+   }
+   pthread_mutex_unlock(&cache_lock);
+   
+   return i == count;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_cache_read()
+ * 
+ * Description:
+ *           Read a block of registers, using cached values
+ *           where possible. Registers not found in the 
+ *           cache are read via the callback function, in
+ *           as few calls as possible.
+ * 
+ * Parameters:
+ *           start_addr - first register address
+ *           count      - number of registers
+ *           reg_vals   - register values (out)
+ *           rx_time    - time the request was received (in ms)
+ *           read_cb    - "Read registers" callback function
+ * 
+ * Returns:  0 on success
+ *          -1 if the callback function failed
+ *********************************************************/
+int mbsrv_cache_read(int start_addr, int count, uint16_t *reg_vals, 
+                     uint64_t rx_time, modbustcp_read_blk_cb_t read_cb)
+{
+   int i, k;
+   int ttl;
+   uint64_t now;
+   uint64_t read_start;
+   cache_entry_t *entry;
+   
+   if (num_cache_ranges == 0)
+   {
+      return (*read_cb)(start_addr, count, reg_vals);
+   }
+   
+   now = mbsrv_time_ms();
+   i = 0;
+   pthread_mutex_lock(&cache_lock);
+   while (i < count)
+   {
+      if (lookup(start_addr+i, rx_time, now, &reg_vals[i]))
+      {
+         i++;
+         continue;
+      }
+      
+      /* Collect following registers which also need to be read */
+      k = i+1;
+      while ((k < count) && !lookup(start_addr+k, rx_time, now, &reg_vals[k])) k++;
+      
+      pthread_mutex_unlock(&cache_lock);
+      if ((*read_cb)(start_addr+i, k-i, &reg_vals[i]) != 0) return -1;
+      pthread_mutex_lock(&cache_lock);
+      
+      /* Save read values in the cache (a slow read in a worker 
+       * thread doesn't hold up the server loop)
+       */
+      read_start = now;
+      now = mbsrv_time_ms();
+      for (; i<k; i++)
+      {
+         entry = find_entry(start_addr+i, &ttl);
+         if (entry)
+         {
+            entry->val = reg_vals[i];
+            entry->valid = 1;
+            entry->read_done = now;
+            cache_misses++;
+            if ((now - read_start >= SLOW_READ_TIME) && !mbsrv_pool_worker()) slow_read_done = now;
+         }
+      }
+      
+      /* Register k (if any) was a hit and is already filled in */
+      i = k+1;
+   }
+   pthread_mutex_unlock(&cache_lock);
+   
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_cache_invalidate()
+ * 
+ * Description:
+ *           Invalidate the cached values of a block of 
+ *           registers (e.g. after writing them)
+ *********************************************************/
+void mbsrv_cache_invalidate(int start_addr, int count)
+{
+   int i;
+   int ttl;
+   cache_entry_t *entry;
+   
+   pthread_mutex_lock(&cache_lock);
+   for (i=0; i<count; i++)
+   {
+      entry = find_entry(start_addr+i, &ttl);
+      if (entry) entry->valid = 0;
+   }
+   pthread_mutex_unlock(&cache_lock);
+}
+
+
+/**********************************************************
+ * Function: mbsrv_cache_slow_read()
+ * 
+ * Description:
+ *           Check if a slow backend read of cached registers
+ *           was performed since the last call
+ * 
+ * Parameters:
+ *           read_done - completion time of the read (out)
+ * 
+ * Returns:  1 if a slow read was performed, 0 otherwise
+ *********************************************************/
+int mbsrv_cache_slow_read(uint64_t *read_done)
+{
+   int rc = 0;
+   
+   pthread_mutex_lock(&cache_lock);
+   if (slow_read_done != 0)
+   {
+      *read_done = slow_read_done;
+      slow_read_done = 0;
+      rc = 1;
+   }
+   pthread_mutex_unlock(&cache_lock);
+   
+   return rc;
+}
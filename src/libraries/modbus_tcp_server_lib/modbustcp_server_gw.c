@@ -0,0 +1,568 @@
+/*
+ * Modbus TCP server library
+ * - gateway mode: forwarding of requests to backend Modbus TCP servers
+ *
+ * Requests for a unit identifier with a route are forwarded to the
+ * backend server of the route over a persistent connection, which
+ * is shared by all clients of the gateway. The transaction id of a
+ * forwarded request is replaced by one unique on the backend
+ * connection, so replies can be matched to the client and request
+ * they belong to, even with several requests in flight.
+ *
+ * Author: O. Wisniewski
+ * Version: 0.6
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "modbustcp_server_lib.h"
+#include "modbustcp_server_int.h"
+
+/* Max number of backend servers */
+#define MAX_BACKENDS 8
+
+/* Max number of requests in flight per backend server */
+#define MAX_PENDING 16
+
+/* Time (in ms) to wait for the reply of a backend server, above the
+ * slowest backend (DHT reads of sensord, RTU bus timeout of mbrtud)
+ * and not longer than the response timeout of the client (15 s)
+ */
+#define BACKEND_TMO 14000
+
+
+/* Request forwarded to a backend server */
+typedef struct {
+   int used;
+   uint16_t tid;                           /* transaction id on the backend connection */
+   uint16_t client_tid;                    /* transaction id of the client request */
+   uint8_t unit;
+   uint8_t function;
+   connection_t *conn;                     /* client connection of the request */
+   unsigned int conn_id;                   /* id of the client connection */
+   uint64_t sent;                          /* time the request was forwarded (in ms) */
+} pending_t;
+
+/* Backend server connection */
+typedef struct {
+   mbsrv_ev_kind_t kind;                   /* MBSRV_EV_BACKEND */
+   int fd;                                 /* socket, -1 if not connected */
+   int connecting;                         /* connect() still in progress */
+   struct sockaddr_storage addr;           /* TCP or Unix domain socket address */
+   socklen_t addr_len;
+   char name[64];                          /* address for log messages */
+   uint16_t next_tid;
+   pending_t pending[MAX_PENDING];
+   int rx_len;
+   uint8_t rx_buf[MODBUS_TCP_MAX_ADU_LENGTH];
+   int tx_len;
+   uint8_t tx_buf[MAX_PENDING*MODBUS_TCP_MAX_ADU_LENGTH];
+} backend_t;
+
+static backend_t backends[MAX_BACKENDS];
+static int num_backends = 0;
+
+/* Backend server of each unit, NULL if the unit is not routed */
+static backend_t *routes[MBSRV_MAX_UNITS];
+
+
+/**********************************************************
+ * Function: complete_request()
+ *
+ * Description:
+ *           Free a pending request and send an exception
+ *           reply to its client (if still connected and
+ *           exception_code is not 0)
+ *********************************************************/
+static void complete_request(pending_t *p, uint8_t exception_code)
+{
+   if ((p->conn->fd != -1) && (p->conn->id == p->conn_id))
+   {
+      if (exception_code)
+      {
+         mbsrv_send_exception(p->conn, p->client_tid, p->unit, p->function, exception_code);
+      }
+      p->conn->in_flight--;
+   }
+   p->used = 0;
+}
+
+
+/**********************************************************
+ * Function: update_events()
+ *
+ * Description:
+ *           Watch a backend connection for writability
+ *           only while there is data to send
+ *********************************************************/
+static void update_events(backend_t *b)
+{
+   struct epoll_event ev;
+
+   ev.events = EPOLLIN | EPOLLRDHUP;
+   if (b->connecting || (b->tx_len > 0)) ev.events |= EPOLLOUT;
+   ev.data.ptr = b;
+   epoll_ctl(mbsrv_epoll_fd, EPOLL_CTL_MOD, b->fd, &ev);
+}
+
+
+/**********************************************************
+ * Function: close_backend()
+ *
+ * Description:
+ *           Close a backend connection and fail all its
+ *           pending requests with exception_code
+ *********************************************************/
+static void close_backend(backend_t *b, uint8_t exception_code)
+{
+   int i;
+
+   if (b->fd != -1)
+   {
+      close(b->fd);
+      b->fd = -1;
+   }
+   b->connecting = 0;
+   b->rx_len = 0;
+   b->tx_len = 0;
+
+   for (i=0; i<MAX_PENDING; i++)
+   {
+      if (b->pending[i].used) complete_request(&b->pending[i], exception_code);
+   }
+}
+
+
+/**********************************************************
+ * Function: connect_backend()
+ *
+ * Description:
+ *           Start a non blocking connect to a backend server
+ *
+ * Returns:  0 on success
+ *          -1 otherwise
+ *********************************************************/
+static int connect_backend(backend_t *b)
+{
+   struct epoll_event ev;
+
+   b->fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (b->fd == -1) goto fail;
+
+   if (connect(b->fd, (struct sockaddr *)&b->addr, b->addr_len) == 0)
+   {
+      b->connecting = 0;
+   }
+   else if (errno == EINPROGRESS)
+   {
+      b->connecting = 1;
+   }
+   else goto fail;
+
+   ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+   ev.data.ptr = b;
+   if (epoll_ctl(mbsrv_epoll_fd, EPOLL_CTL_ADD, b->fd, &ev) == -1) goto fail;
+
+   return 0;
+
+fail:
+   syslog(LOG_DAEMON | LOG_ERR, "Gateway: connection to %s failed: %s", b->name, strerror(errno));
+   if (b->fd != -1) close(b->fd);
+   b->fd = -1;
+   b->connecting = 0;
+   return -1;
+}
+
+
+/**********************************************************
+ * Function: flush_backend()
+ *
+ * Description:
+ *           Send as much of the buffered requests as the
+ *           backend connection accepts
+ *
+ * Returns:  0 on success
+ *          -1 if the connection failed
+ *********************************************************/
+static int flush_backend(backend_t *b)
+{
+   int rc;
+
+   while (b->tx_len > 0)
+   {
+      rc = send(b->fd, b->tx_buf, b->tx_len, MSG_NOSIGNAL);
+      if (rc == -1)
+      {
+         if (errno == EINTR) continue;
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+         return -1;
+      }
+      b->tx_len -= rc;
+      memmove(b->tx_buf, &b->tx_buf[rc], b->tx_len);
+   }
+
+   update_events(b);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: handle_replies()
+ *
+ * Description:
+ *           Send every complete reply found in the receive
+ *           buffer of a backend connection to the client of
+ *           the matching request
+ *
+ * Returns:  0 on success
+ *          -1 if the backend sent an invalid frame
+ *********************************************************/
+static int handle_replies(backend_t *b)
+{
+   int i;
+
+   while (b->rx_len >= MBAP_HEADER_LENGTH)
+   {
+      uint16_t tid = (b->rx_buf[0] << 8) | b->rx_buf[1];
+      int protocol_id = (b->rx_buf[2] << 8) | b->rx_buf[3];
+      int mbap_length = (b->rx_buf[4] << 8) | b->rx_buf[5];
+      int frame_length = MBAP_HEADER_LENGTH - 1 + mbap_length;
+
+      if ((protocol_id != 0) || (mbap_length < 2) || (mbap_length > MBAP_LENGTH_MAX))
+      {
+         return -1;
+      }
+
+      if (b->rx_len < frame_length) break;
+
+      /* Replies without a matching request (e.g. timed out) are dropped */
+      for (i=0; i<MAX_PENDING; i++)
+      {
+         pending_t *p = &b->pending[i];
+
+         if (!p->used || (p->tid != tid)) continue;
+
+         if ((p->conn->fd != -1) && (p->conn->id == p->conn_id))
+         {
+            b->rx_buf[0] = p->client_tid >> 8;
+            b->rx_buf[1] = p->client_tid & 0xFF;
+            mbsrv_send_reply(p->conn, b->rx_buf, frame_length);
+         }
+         complete_request(p, 0);
+         break;
+      }
+
+      b->rx_len -= frame_length;
+      memmove(b->rx_buf, &b->rx_buf[frame_length], b->rx_len);
+   }
+
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_gw_handle_event()
+ *
+ * Description:
+ *           Handle an epoll event of a backend connection
+ *********************************************************/
+void mbsrv_gw_handle_event(void *backend, uint32_t events)
+{
+   backend_t *b = (backend_t *)backend;
+   int rc;
+   int err;
+   socklen_t len = sizeof(err);
+
+   if (b->fd == -1) return;
+
+   if (b->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+   {  /* Result of the non blocking connect */
+      if ((getsockopt(b->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) || (err != 0))
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Gateway: connection to %s failed: %s", b->name, strerror(err));
+         close_backend(b, MODBUS_EXCEPTION_GATEWAY_TARGET);
+         return;
+      }
+      b->connecting = 0;
+   }
+
+   if (events & EPOLLIN)
+   {  /* Replies from the backend */
+      while (1)
+      {
+         rc = read(b->fd, &b->rx_buf[b->rx_len], sizeof(b->rx_buf) - b->rx_len);
+         if (rc == -1)
+         {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+         }
+         if (rc <= 0)
+         {  /* Connection closed by backend, reconnect with next request */
+            close_backend(b, MODBUS_EXCEPTION_GATEWAY_TARGET);
+            return;
+         }
+
+         b->rx_len += rc;
+         if (handle_replies(b) == -1)
+         {
+            syslog(LOG_DAEMON | LOG_ERR, "Gateway: invalid reply from %s", b->name);
+            close_backend(b, MODBUS_EXCEPTION_GATEWAY_TARGET);
+            return;
+         }
+      }
+   }
+
+   if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+   {
+      close_backend(b, MODBUS_EXCEPTION_GATEWAY_TARGET);
+      return;
+   }
+
+   if (!b->connecting && (flush_backend(b) == -1))
+   {
+      close_backend(b, MODBUS_EXCEPTION_GATEWAY_TARGET);
+   }
+}
+
+
+/**********************************************************
+ * Function: mbsrv_gw_routed()
+ *
+ * Description:
+ *           Check if a unit is routed to a backend server
+ *
+ * Returns:  1 if routed, 0 otherwise
+ *********************************************************/
+int mbsrv_gw_routed(int unit)
+{
+   return routes[unit] != NULL;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_gw_forward()
+ *
+ * Description:
+ *           Forward a request to the backend server of its
+ *           unit. If it cannot be forwarded, an exception
+ *           reply is sent to the client.
+ *
+ * Returns:  0 if the request was handled
+ *          -1 if the unit is not routed
+ *********************************************************/
+int mbsrv_gw_forward(connection_t *conn, const uint8_t *query, int query_length)
+{
+   backend_t *b = routes[query[MBAP_HEADER_LENGTH-1]];
+   uint16_t client_tid = (query[0] << 8) | query[1];
+   uint8_t unit = query[MBAP_HEADER_LENGTH-1];
+   uint8_t function = query[MBAP_HEADER_LENGTH];
+   pending_t *p = NULL;
+   int i;
+
+   if (b == NULL) return -1;
+
+   /* Notifications of a backend cannot be matched to a client */
+   if (function == MODBUSTCP_FC_SUBSCRIBE)
+   {
+      mbsrv_send_exception(conn, client_tid, unit, function, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+      return 0;
+   }
+
+   for (i=0; i<MAX_PENDING; i++)
+   {
+      if (!b->pending[i].used)
+      {
+         p = &b->pending[i];
+         break;
+      }
+   }
+   if ((p == NULL) || (b->tx_len + query_length > sizeof(b->tx_buf)))
+   {  /* Too many requests in flight */
+      mbsrv_send_exception(conn, client_tid, unit, function, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+      return 0;
+   }
+
+   if ((b->fd == -1) && (connect_backend(b) == -1))
+   {
+      mbsrv_send_exception(conn, client_tid, unit, function, MODBUS_EXCEPTION_GATEWAY_TARGET);
+      return 0;
+   }
+
+   p->used = 1;
+   p->tid = b->next_tid++;
+   p->client_tid = client_tid;
+   p->unit = unit;
+   p->function = function;
+   p->conn = conn;
+   p->conn_id = conn->id;
+   p->sent = mbsrv_time_ms();
+   conn->in_flight++;
+
+   /* Queue the request with the backend transaction id */
+   memcpy(&b->tx_buf[b->tx_len], query, query_length);
+   b->tx_buf[b->tx_len] = p->tid >> 8;
+   b->tx_buf[b->tx_len+1] = p->tid & 0xFF;
+   b->tx_len += query_length;
+
+   if (!b->connecting && (flush_backend(b) == -1))
+   {
+      close_backend(b, MODBUS_EXCEPTION_GATEWAY_TARGET);
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_gw_check_timeouts()
+ *
+ * Description:
+ *           Fail the requests waiting for their reply for
+ *           too long. The backend connection stays open for
+ *           the other requests, a late reply does not match
+ *           any request anymore and is dropped.
+ *********************************************************/
+void mbsrv_gw_check_timeouts(void)
+{
+   int i, j;
+   uint64_t now = mbsrv_time_ms();
+
+   for (i=0; i<num_backends; i++)
+   {
+      backend_t *b = &backends[i];
+
+      for (j=0; j<MAX_PENDING; j++)
+      {
+         if (b->pending[j].used && (now - b->pending[j].sent > BACKEND_TMO))
+         {
+            syslog(LOG_DAEMON | LOG_NOTICE, "Gateway: no reply from %s to request of unit %d", 
+                                            b->name, b->pending[j].unit);
+            complete_request(&b->pending[j], MODBUS_EXCEPTION_GATEWAY_TARGET);
+         }
+      }
+   }
+}
+
+
+/**********************************************************
+ * Function: mbsrv_gw_close()
+ *
+ * Description:
+ *           Close all backend connections
+ *********************************************************/
+void mbsrv_gw_close(void)
+{
+   int i;
+
+   for (i=0; i<num_backends; i++)
+   {
+      close_backend(&backends[i], 0);
+   }
+}
+
+
+/********************************************************************
+ *
+ * PUBLIC FUNCTION:
+ *           modbustcp_server_route()
+ *
+ * DESCRIPTION:
+ *           Routes all requests for a unit to a backend Modbus TCP
+ *           server. Units sharing the same backend server share a
+ *           single connection to it.
+ *
+ * PARAMETERS:
+ *           slave_addr - Modbus slave address (unit identifier)
+ *           ip_addr    - IP address of the backend server
+ *           tcp_port   - TCP port of the backend server
+ *
+ * RETURN:   0 on success
+ *          -1 otherwise
+ *
+ *******************************************************************/
+int modbustcp_server_route(int slave_addr, const char *ip_addr, int tcp_port)
+{
+   struct sockaddr_storage addr;
+   struct sockaddr_in *in_addr = (struct sockaddr_in *)&addr;
+   socklen_t addr_len;
+   backend_t *b;
+   int i;
+
+   if ((slave_addr < 1) || (slave_addr >= MBSRV_MAX_UNITS))
+   {
+      return -1;
+   }
+
+   memset(&addr, 0, sizeof(addr));
+   if (strncmp(ip_addr, "unix", 4) == 0)
+   {  /* Unix domain socket: "unix" or "unix:<name>" */
+      if (((ip_addr[4] != '\0') && (ip_addr[4] != ':')) ||
+          (mbsrv_unix_addr(ip_addr[4] ? &ip_addr[5] : NULL, tcp_port, 
+                           (struct sockaddr_un *)&addr, &addr_len) == -1))
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Gateway: invalid address %s for unit %d", ip_addr, slave_addr);
+         return -1;
+      }
+   }
+   else
+   {
+      in_addr->sin_family = AF_INET;
+      in_addr->sin_port = htons(tcp_port);
+      addr_len = sizeof(*in_addr);
+      if (inet_pton(AF_INET, ip_addr, &in_addr->sin_addr) != 1)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Gateway: invalid address %s for unit %d", ip_addr, slave_addr);
+         return -1;
+      }
+   }
+
+   /* Find backend with same address or add a new one */
+   for (i=0; i<num_backends; i++)
+   {
+      if ((backends[i].addr_len == addr_len) && 
+          (memcmp(&backends[i].addr, &addr, addr_len) == 0)) break;
+   }
+   if (i == num_backends)
+   {
+      if (num_backends == MAX_BACKENDS)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Gateway: too many backend servers");
+         return -1;
+      }
+      b = &backends[num_backends++];
+      b->kind = MBSRV_EV_BACKEND;
+      b->fd = -1;
+      b->addr = addr;
+      b->addr_len = addr_len;
+      snprintf(b->name, sizeof(b->name), "%s:%d", ip_addr, tcp_port);
+   }
+
+   routes[slave_addr] = &backends[i];
+   return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * Modbus TCP server library
+ * - internal definitions and functions, not part of the public interface
+ *   (shared by the library modules and used by the benchmark tools 
+ *   linked to the static library)
+ * 
+ * Author: O. Wisniewski
+ * Version: 0.10
+ * Date: 2026/10/17
+ * 
+ */
+#ifndef _MODBUSTCP_SERVER_INT_H_
+#define _MODBUSTCP_SERVER_INT_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <modbus.h>
+
+#include "modbustcp_server_lib.h"
+
+/* Modbus application protocol (MBAP) header */
+#define MBAP_HEADER_LENGTH 7
+#define MBAP_LENGTH_MAX    (MODBUS_TCP_MAX_ADU_LENGTH - MBAP_HEADER_LENGTH + 1)
+
+/* Size of the reply buffer of a client connection, limits the
+ * number of replies queued or requests in flight per connection
+ */
+#define MBSRV_TX_BUF_SIZE (8*MODBUS_TCP_MAX_ADU_LENGTH)
+
+/* Highest register address */
+#define MBSRV_MAX_ADDR 0xFFFF
+
+/* Number of Modbus unit identifiers */
+#define MBSRV_MAX_UNITS 256
+
+/* Kind of object registered in the epoll set 
+ * (first member of every such object)
+ */
+typedef enum {
+   MBSRV_EV_LISTEN,
+   MBSRV_EV_CLIENT,
+   MBSRV_EV_BACKEND,
+   MBSRV_EV_POOL
+} mbsrv_ev_kind_t;
+
+/* Client connection structure */
+typedef struct {
+   mbsrv_ev_kind_t kind;                   /* MBSRV_EV_CLIENT */
+   int fd;                                 /* socket, -1 if slot is unused */
+   unsigned int id;                        /* changes every time the slot is reused */
+   int rx_len;                             /* bytes in receive buffer */
+   uint8_t rx_buf[MODBUS_TCP_MAX_ADU_LENGTH];
+   time_t last_activity;                   /* time of last received data */
+   time_t rx_started;                      /* time first byte of pending request arrived */
+   uint64_t rx_time;                       /* time (in ms) buffered data was received */
+   uint64_t rx_us;                         /* time (in us) buffered data was read */
+   int tx_len;                             /* bytes in reply buffer */
+   uint8_t tx_buf[MBSRV_TX_BUF_SIZE];
+   uint64_t tx_queued_us;                  /* time (in us) oldest queued reply was queued */
+   int in_flight;                          /* requests waiting for a reply */
+   int blocked;                            /* request handling stopped, no room for replies */
+   int closing;                            /* closed by client, replies still to send */
+   uint32_t events;                        /* events watched by epoll */
+} connection_t;
+
+/* The epoll set of the server loop */
+extern int mbsrv_epoll_fd;
+
+/********************************************************************
+ * 
+ * FUNCTION: 
+ *           mbsrv_unix_addr()
+ * 
+ * DESCRIPTION: 
+ *           Builds the address of a Unix domain socket
+ * 
+ * PARAMETERS: 
+ *           name     - socket name, '@' prefix for the abstract 
+ *                      namespace (NULL for MODBUSTCP_SERVER_UNIX_NAME)
+ *           tcp_port - TCP port the default name is built with
+ *           addr     - address to fill
+ *           addr_len - length of the address
+ * 
+ * RETURN:   0 on success
+ *          -1 if the name is too long
+ * 
+ *******************************************************************/
+int mbsrv_unix_addr(const char *name, int tcp_port, struct sockaddr_un *addr, socklen_t *addr_len);
+
+/********************************************************************
+ * 
+ * FUNCTION: 
+ *           mbsrv_process_request()
+ * 
+ * DESCRIPTION: 
+ *           Performs the operation of one complete Modbus TCP 
+ *           request via the registered callback functions and 
+ *           builds the reply frame
+ * 
+ * PARAMETERS: 
+ *           query        - complete request frame (MBAP + PDU)
+ *           query_length - length of the request frame
+ *           rx_time      - time the request was received (in ms)
+ *           reply        - buffer of MODBUS_TCP_MAX_ADU_LENGTH
+ *                          bytes for the reply frame
+ * 
+ * RETURN:   length of the reply frame
+ * 
+ *******************************************************************/
+int mbsrv_process_request(const uint8_t *query, int query_length, uint64_t rx_time, uint8_t *reply);
+
+/********************************************************************
+ * 
+ * FUNCTION: 
+ *           mbsrv_set_callbacks()
+ * 
+ * DESCRIPTION: 
+ *           Sets own slave address and block callback functions
+ *           without starting the server loop
+ * 
+ *******************************************************************/
+void mbsrv_set_callbacks(int own_slave_addr, modbustcp_read_blk_cb_t read_cb_fun, 
+                                             modbustcp_write_blk_cb_t write_cb_fun);
+
+/********************************************************************
+ * 
+ * FUNCTION: 
+ *           mbsrv_time_ms()
+ * 
+ * DESCRIPTION: 
+ *           Gets the monotonic time in milliseconds
+ * 
+ *******************************************************************/
+uint64_t mbsrv_time_ms(void);
+uint64_t mbsrv_time_us(void);
+
+/********************************************************************
+ * 
+ * FUNCTION: 
+ *           mbsrv_send_reply()
+ * 
+ * DESCRIPTION: 
+ *           Queues a reply frame for a client connection, the 
+ *           queued replies are sent by the server loop
+ * 
+ *******************************************************************/
+void mbsrv_send_reply(connection_t *conn, const uint8_t *reply, int reply_length);
+
+/********************************************************************
+ * 
+ * FUNCTION: 
+ *           mbsrv_send_exception()
+ * 
+ * DESCRIPTION: 
+ *           Queues an exception reply for a request with the given
+ *           transaction id, unit identifier and function code
+ * 
+ *******************************************************************/
+void mbsrv_send_exception(connection_t *conn, uint16_t tid, uint8_t unit,
+                          uint8_t function, uint8_t exception_code);
+
+/********************************************************************
+ * 
+ * FUNCTION: 
+ *           mbsrv_tx_free()
+ * 
+ * DESCRIPTION: 
+ *           Gets the room in the reply buffer of a client connection
+ *           which is not reserved for the replies of requests in
+ *           flight (for unsolicited frames)
+ * 
+ *******************************************************************/
+int mbsrv_tx_free(connection_t *conn);
+
+/********************************************************************
+ * 
+ * FUNCTION: 
+ *           mbsrv_scan_request()
+ * 
+ * DESCRIPTION: 
+ *           Performs a read request without client connection for
+ *           the subscriptions, the reply is passed to 
+ *           mbsrv_sub_scan_done() (later if handled by the worker
+ *           pool)
+ * 
+ *******************************************************************/
+void mbsrv_scan_request(const uint8_t *query, int query_length);
+
+/********************************************************************
+ * 
+ * FUNCTIONS: 
+ *           mbsrv_cache_read()
+ *           mbsrv_cache_hit()
+ *           mbsrv_cache_invalidate()
+ *           mbsrv_cache_slow_read()
+ * 
+ * DESCRIPTION: 
+ *           Register cache (see modbustcp_server_cache.c)
+ * 
+ *******************************************************************/
+int mbsrv_cache_read(int start_addr, int count, uint16_t *reg_vals, 
+                     uint64_t rx_time, modbustcp_read_blk_cb_t read_cb);
+int mbsrv_cache_hit(int start_addr, int count, uint64_t rx_time);
+void mbsrv_cache_invalidate(int start_addr, int count);
+int mbsrv_cache_slow_read(uint64_t *read_done);
+
+/********************************************************************
+ * 
+ * FUNCTIONS: 
+ *           mbsrv_map_callbacks()
+ *           mbsrv_map_check()
+ * 
+ * DESCRIPTION: 
+ *           Register directory of our own slave 
+ *           (see modbustcp_server_map.c)
+ * 
+ *******************************************************************/
+void mbsrv_map_callbacks(modbustcp_read_blk_cb_t *read_cb, modbustcp_write_blk_cb_t *write_cb);
+int mbsrv_map_check(int start_addr, int count, int write);
+
+/********************************************************************
+ * 
+ * FUNCTIONS: 
+ *           mbsrv_gw_routed()
+ *           mbsrv_gw_forward()
+ *           mbsrv_gw_handle_event()
+ *           mbsrv_gw_check_timeouts()
+ *           mbsrv_gw_close()
+ * 
+ * DESCRIPTION: 
+ *           Forwarding of requests to backend servers in gateway 
+ *           mode (see modbustcp_server_gw.c)
+ * 
+ *******************************************************************/
+int mbsrv_gw_routed(int unit);
+int mbsrv_gw_forward(connection_t *conn, const uint8_t *query, int query_length);
+void mbsrv_gw_handle_event(void *backend, uint32_t events);
+void mbsrv_gw_check_timeouts(void);
+void mbsrv_gw_close(void);
+
+/********************************************************************
+ * 
+ * FUNCTIONS: 
+ *           mbsrv_pool_start()
+ *           mbsrv_pool_submit()
+ *           mbsrv_pool_handle_event()
+ *           mbsrv_pool_worker()
+ *           mbsrv_pool_stop()
+ * 
+ * DESCRIPTION: 
+ *           Worker pool handling requests on slow registers
+ *           (see modbustcp_server_pool.c)
+ * 
+ *******************************************************************/
+int mbsrv_pool_start(void);
+int mbsrv_pool_submit(connection_t *conn, const uint8_t *query, int query_length, 
+                      uint64_t rx_time, int cached);
+void mbsrv_pool_handle_event(void);
+int mbsrv_pool_worker(void);
+void mbsrv_pool_stop(void);
+
+/********************************************************************
+ * 
+ * FUNCTIONS: 
+ *           mbsrv_sub_request()
+ *           mbsrv_sub_scan()
+ *           mbsrv_sub_scan_done()
+ *           mbsrv_sub_active()
+ * 
+ * DESCRIPTION: 
+ *           Subscriptions to register changes 
+ *           (see modbustcp_server_sub.c)
+ * 
+ *******************************************************************/
+int mbsrv_sub_request(connection_t *conn, const uint8_t *query, int query_length);
+int mbsrv_sub_scan(void);
+void mbsrv_sub_scan_done(const uint8_t *query, const uint8_t *reply, int reply_length);
+int mbsrv_sub_active(const connection_t *conn);
+
+/********************************************************************
+ * 
+ * FUNCTIONS: 
+ *           mbsrv_stats_start()
+ *           mbsrv_stats_request()
+ *           mbsrv_stats_reply()
+ *           mbsrv_stats_check()
+ * 
+ * DESCRIPTION: 
+ *           Latency statistics, written on SIGUSR1
+ *           (see modbustcp_server_stats.c)
+ * 
+ *******************************************************************/
+void mbsrv_stats_start(int tcp_port);
+void mbsrv_stats_request(const uint8_t *query, int query_length,
+                         uint64_t rx_us, uint64_t start_us, uint64_t end_us);
+void mbsrv_stats_reply(uint64_t queued_us);
+void mbsrv_stats_check(void);
+
+/********************************************************************
+ * 
+ * FUNCTIONS: 
+ *           mbsrv_trace_start()
+ *           mbsrv_trace_request()
+ *           mbsrv_trace_check()
+ * 
+ * DESCRIPTION: 
+ *           Request trace, switched on and off by SIGUSR2
+ *           (see modbustcp_server_trace.c)
+ * 
+ *******************************************************************/
+void mbsrv_trace_start(int tcp_port);
+void mbsrv_trace_request(unsigned int conn_id, const uint8_t *query, int query_length,
+                         uint64_t rx_us, uint8_t exception_code);
+void mbsrv_trace_check(void);
+
+#endif
@@ -8,8 +8,8 @@
  *   make install
  * 
  * Author: O. Wisniewski
- * Version: 0.3
- * Date: 2014/07/23
+ * Version: 0.10
+ * Date: 2026/10/17
  * 
  * TODO: handle termination signal and cleanup before existing
  *
@@ -98,252 +98,1462 @@ int main(void)
 #endif
 
 
+
+
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <modbus.h>
 
 #include "modbustcp_server_lib.h"
+#include "modbustcp_server_int.h"
+
+#define VERSION "0.9"
+
+/* Max number of simultaneously open client connections */
+#define MAX_CONNECTIONS 32
 
-#define VERSION "0.3"
+/* Backlog of the listen socket */
+#define LISTEN_BACKLOG 16
 
-/* For the NIBE Modbus40 module we need to handle register
- * addresses in the range [40001 - 48198]. To save memory
- * we map these to [1 - 8198].
- * For all the other modules, an address range [1 - 16]
- * is sufficient.
+/* Connections without any traffic are closed after IDLE_TMO
+ * seconds (unless they have subscriptions, their client only
+ * receives notify frames), connections which stopped in the
+ * middle of a request are closed after PARTIAL_TMO seconds
  */
-#define MAX_REG 8200
+#define IDLE_TMO    60
+#define PARTIAL_TMO 5
+
+/* Interval of the timeout check (in ms) */
+#define TMO_CHECK_INTERVAL 1000
+
+/* Max number of events handled per epoll_wait() call */
+#define MAX_EVENTS 64
+
+/* Length of an exception reply frame */
+#define EXCEPTION_LENGTH 9
 
 #define DEBUG 0
 
 
-/* Modbus request structure */
+/* Register access callbacks of a unit served by this process */
 typedef struct {
-   uint8_t slave_addr;
-   uint8_t fc;
-   uint8_t reg_addr_hi;
-   uint8_t reg_addr_lo;
-   uint8_t reg_val_hi;
-   uint8_t reg_val_lo;
-} modbus_request_t;
+   int local;                              /* unit is served by this process */
+   modbustcp_read_blk_cb_t  read_cb;
+   modbustcp_write_blk_cb_t write_cb;
+} unit_t;
 
 /* Flag to indicate exit from main loop */
 static int cont=1;
 
+/* The epoll set of the server loop */
+int mbsrv_epoll_fd=-1;
 
+/* Client connection table */
+static connection_t connections[MAX_CONNECTIONS];
 
-/********************************************************************
+/* Listen socket */
+typedef struct {
+   mbsrv_ev_kind_t kind;                   /* MBSRV_EV_LISTEN */
+   int fd;
+} listener_t;
+
+/* TCP and Unix domain listen sockets */
+static listener_t tcp_listener  = { MBSRV_EV_LISTEN, -1 };
+static listener_t unix_listener = { MBSRV_EV_LISTEN, -1 };
+
+/* Flag to indicate data was read by prefetch_requests() */
+static int prefetched=0;
+
+/* Own Modbus slave address (0 in gateway mode) */
+static int own_slave;
+
+/* Units served by this process, indexed by unit identifier */
+static unit_t units[MBSRV_MAX_UNITS];
+
+/* Single register callbacks (when started via modbustcp_server()) */
+static int (*legacy_read_cb)(int, int*);
+static int (*legacy_write_cb)(int, int);
+
+
+/**********************************************************
+ * Function: now_sec()
  * 
- * PUBLIC FUNCTION: 
- *           modbustcp_server()
+ * Description:
+ *           Get monotonic time in seconds
  * 
- * DESCRIPTION: 
- *           Handles the communication with Modbus TCP clients and
- *           performs requested Read or Write operations via callback
- *           functions (provided as input paramters)
+ * Returns:  current time (in s)
+ *********************************************************/
+static time_t now_sec(void)
+{
+   struct timespec ts;
+   
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_time_ms()
  * 
- *           Supported Modbus operations:
- *           - Read Holding Registers (FC 0x03)
- *           - Read Input Registers   (FC 0x04)
- *           - Write Single Register  (FC 0x06)
+ * Description:
+ *           Get monotonic time in milliseconds
  * 
- * PARAMETERS: 
- *           own_slave_addr - Own Modbus slave address
- *           read_cb_fun    - function pointer to Read register handler
- *           write_cb_fun   - function pointer to Write register handler
+ * Returns:  current time (in ms)
+ *********************************************************/
+uint64_t mbsrv_time_ms(void)
+{
+   struct timespec ts;
+   
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_time_us()
  * 
- * RETURN:   0 on success
- *          -1 otherwise
+ * Description:
+ *           Get monotonic time in microseconds
  * 
- *******************************************************************/
-int modbustcp_server(int own_slave_addr, int (*read_cb_fun)(int, int*), int (*write_cb_fun)(int, int))
+ * Returns:  current time (in us)
+ *********************************************************/
+uint64_t mbsrv_time_us(void)
 {
-   int socket, accept_socket;
-   int header_length;
-   modbus_t *ctx; 
-   int tcp_port = MODBUSTCP_SERVER_PORT_BASE + own_slave_addr;
-   int num_connections=1;
+   struct timespec ts;
    
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+/**********************************************************
+ * Function: close_connection()
+ * 
+ * Description:
+ *           Close client connection and free its slot
+ *           (closing the socket also removes it from
+ *           the epoll set)
+ *********************************************************/
+static void close_connection(connection_t *conn)
+{
+   close(conn->fd);
+   conn->fd = -1;
+   conn->rx_len = 0;
+   conn->tx_len = 0;
+   conn->in_flight = 0;
+   conn->blocked = 0;
+   conn->closing = 0;
+}
+
+
+/**********************************************************
+ * Function: update_events()
+ * 
+ * Description:
+ *           Watch a client connection for new requests 
+ *           unless request handling is blocked, and for
+ *           writability while replies are queued
+ *********************************************************/
+static void update_events(connection_t *conn)
+{
+   struct epoll_event ev;
    
-   openlog("modbus server", LOG_PID|LOG_CONS, LOG_USER);
-   syslog(LOG_DAEMON | LOG_NOTICE, "Starting Modbus server for slave #%d (version %s using libmodbus %s)\n", 
-                                                          own_slave_addr, VERSION, LIBMODBUS_VERSION_STRING);
+   ev.events = 0;
+   if (!conn->closing) ev.events |= EPOLLRDHUP;
+   if (!conn->blocked && !conn->closing) ev.events |= EPOLLIN;
+   if (conn->tx_len > 0) ev.events |= EPOLLOUT;
    
-   syslog(LOG_DAEMON | LOG_NOTICE, "Listening on port %d\n", tcp_port);
+   if (ev.events != conn->events)
+   {
+      ev.data.ptr = conn;
+      epoll_ctl(mbsrv_epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+      conn->events = ev.events;
+   }
+}
 
-   /* Create new connection context */
-   ctx = modbus_new_tcp("127.0.0.1", tcp_port);
-   
-#if DEBUG
-   modbus_set_debug(ctx, TRUE);  
-#endif
+
+/**********************************************************
+ * Function: tx_room()
+ * 
+ * Description:
+ *           Check if the reply buffer of a client connection
+ *           has room for the reply of one more request, in
+ *           addition to the replies of requests in flight
+ * 
+ * Returns:  1 if there is room, 0 otherwise
+ *********************************************************/
+static int tx_room(connection_t *conn)
+{
+   return conn->tx_len + (conn->in_flight + 1) * MODBUS_TCP_MAX_ADU_LENGTH <= MBSRV_TX_BUF_SIZE;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_tx_free()
+ * 
+ * Description:
+ *           Get the room in the reply buffer of a client
+ *           connection not reserved for requests in flight
+ * 
+ * Returns:  number of bytes
+ *********************************************************/
+int mbsrv_tx_free(connection_t *conn)
+{
+   return MBSRV_TX_BUF_SIZE - conn->tx_len - conn->in_flight * MODBUS_TCP_MAX_ADU_LENGTH;
+}
+
+
+/**********************************************************
+ * Function: flush_connection()
+ * 
+ * Description:
+ *           Send as much of the queued replies as the client
+ *           connection accepts
+ * 
+ * Returns:  0 if the connection stays open
+ *          -1 if the connection was closed
+ *********************************************************/
+static int flush_connection(connection_t *conn)
+{
+   int rc;
    
-   /* Get header length */
-   header_length = modbus_get_header_length(ctx);
+   while (conn->tx_len > 0)
+   {
+      rc = send(conn->fd, conn->tx_buf, conn->tx_len, MSG_NOSIGNAL);
+      if (rc == -1)
+      {
+         if (errno == EINTR) continue;
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+         syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: Failed to send reply to the client: %s", 
+                                                              own_slave, strerror(errno));
+         close_connection(conn);
+         return -1;
+      }
+      conn->tx_len -= rc;
+      memmove(conn->tx_buf, &conn->tx_buf[rc], conn->tx_len);
+      if (conn->tx_len == 0) mbsrv_stats_reply(conn->tx_queued_us);
+   }
    
-   /* Create the listen socket */
-   socket = modbus_tcp_listen(ctx, num_connections);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: finish_connection()
+ * 
+ * Description:
+ *           Handle the close of a connection by the client.
+ *           The connection is closed as soon as the replies
+ *           to all requests received are sent.
+ * 
+ * Returns:  -1 (connection closed or closing)
+ *********************************************************/
+static int finish_connection(connection_t *conn)
+{
+   if (flush_connection(conn) == -1) return -1;
    
+   if ((conn->tx_len > 0) || (conn->in_flight > 0) || conn->blocked)
+   {
+      conn->closing = 1;
+   }
+   else
+   {
+      close_connection(conn);
+   }
+   return -1;
+}
+
+
+/**********************************************************
+ * Function: accept_connections()
+ * 
+ * Description:
+ *           Accept all pending client connections and
+ *           add them to the epoll set
+ *********************************************************/
+static void accept_connections(int listen_fd)
+{
+   int fd;
+   int i;
+   struct epoll_event ev;
    
-   /***** Main server loop *****/
-   while (cont)
+   while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
    {
-      uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
-      int rc;
+      /* Find free connection slot */
+      for (i=0; i<MAX_CONNECTIONS; i++)
+      {
+         if (connections[i].fd == -1) break;
+      }
       
-      /* Wait for incoming connections */
-      accept_socket = modbus_tcp_accept(ctx, &socket);
-      if (accept_socket == -1) 
-      { 
-         cont = 0;
-         syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: modbus_tcp_accept() failed; %s", 
-                                          own_slave_addr, modbus_strerror(errno));
-      } 
-            
-      /* Receive data from client */    
-      rc = modbus_receive(ctx, query);      /* rc is the query size */
-      if (rc == -1) 
-      { 
-         syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: modbus_receive() failed: %s", 
-                                       own_slave_addr, modbus_strerror(errno));
+      if (i == MAX_CONNECTIONS)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: too many connections, rejecting client", 
+                                                                            own_slave);
+         close(fd);
+         continue;
       }
-      else 
-      { 
-         /* Get information from request buffer */
-         modbus_request_t *modbus_request;
-         int slave_addr;
-         int operation;
-         int reg_addr;
-         int reg_val;
-         unsigned int exception_code;
-         modbus_mapping_t *mb_mapping;
-         
-         modbus_request = (modbus_request_t *)&query[header_length-1];
-         
-         slave_addr = modbus_request->slave_addr;
-         operation  = modbus_request->fc;
-         reg_addr   = (int)modbus_request->reg_addr_hi<<8 | (int)modbus_request->reg_addr_lo;
-         reg_val    = (int)modbus_request->reg_val_hi<<8 | (int)modbus_request->reg_val_lo;
-         
-         exception_code = 0;
-         
+      
+      ev.events = EPOLLIN | EPOLLRDHUP;
+      ev.data.ptr = &connections[i];
+      if (epoll_ctl(mbsrv_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: epoll_ctl() failed: %s", 
+                                          own_slave, strerror(errno));
+         close(fd);
+         continue;
+      }
+      
+      connections[i].fd = fd;
+      connections[i].id++;
+      connections[i].events = ev.events;
+      connections[i].rx_len = 0;
+      connections[i].last_activity = now_sec();
+   }
+   
+   if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: accept() failed: %s", 
+                                       own_slave, strerror(errno));
+   }
+}
+
+
+/**********************************************************
+ * Function: mbsrv_unix_addr()
+ * 
+ * Description:
+ *           Build the address of a Unix domain socket, a
+ *           leading '@' in the name selects the abstract
+ *           namespace
+ * 
+ * Returns:  0 on success
+ *          -1 if the name is too long
+ *********************************************************/
+int mbsrv_unix_addr(const char *name, int tcp_port, struct sockaddr_un *addr, socklen_t *addr_len)
+{
+   char buf[sizeof(addr->sun_path)];
+   int len;
+   
+   if (name == NULL)
+   {
+      snprintf(buf, sizeof(buf), MODBUSTCP_SERVER_UNIX_NAME, tcp_port);
+      name = buf;
+   }
+   
+   len = strlen(name);
+   if (len >= sizeof(addr->sun_path)) return -1;
+   
+   memset(addr, 0, sizeof(*addr));
+   addr->sun_family = AF_UNIX;
+   memcpy(addr->sun_path, name, len);
+   if (name[0] == '@')
+   {  /* Abstract socket, the name isn't null terminated */
+      addr->sun_path[0] = '\0';
+      *addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+   }
+   else
+   {
+      *addr_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: unix_listen()
+ * 
+ * Description:
+ *           Create the Unix domain listen socket for a
+ *           server listening on tcp_port
+ * 
+ * Returns:  socket on success
+ *          -1 otherwise
+ *********************************************************/
+static int unix_listen(int tcp_port)
+{
+   struct sockaddr_un addr;
+   socklen_t addr_len;
+   int fd;
+   
+   if (mbsrv_unix_addr(NULL, tcp_port, &addr, &addr_len) == -1) return -1;
+   
+   fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (fd == -1) return -1;
+   
+   /* Remove a stale socket file left by a previous run */
+   if (addr.sun_path[0] != '\0') unlink(addr.sun_path);
+   
+   if ((bind(fd, (struct sockaddr *)&addr, addr_len) == -1) ||
+       (listen(fd, LISTEN_BACKLOG) == -1))
+   {
+      close(fd);
+      return -1;
+   }
+   
+   return fd;
+}
+
+
+/**********************************************************
+ * Function: legacy_read_blk()
+ * 
+ * Description:
+ *           Block read handler used with the single 
+ *           register callback of modbustcp_server(). 
+ *           Calls the callback once per register.
+ *********************************************************/
+static int legacy_read_blk(int start_addr, int count, uint16_t *reg_vals)
+{
+   int i;
+   int reg_val;
+   
+   for (i=0; i<count; i++)
+   {
+      if ((*legacy_read_cb)(start_addr+i, &reg_val) != 0) return -1;
+      reg_vals[i] = (uint16_t)reg_val;
+   }
+   
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: legacy_write_blk()
+ * 
+ * Description:
+ *           Block write handler used with the single 
+ *           register callback of modbustcp_server(). 
+ *           Calls the callback once per register.
+ *********************************************************/
+static int legacy_write_blk(int start_addr, int count, const uint16_t *reg_vals)
+{
+   int i;
+   
+   for (i=0; i<count; i++)
+   {
+      if ((*legacy_write_cb)(start_addr+i, reg_vals[i]) != 0) return -1;
+   }
+   
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: check_range()
+ * 
+ * Description:
+ *           Check quantity and address range of a block
+ *           of registers in a request. For our own slave
+ *           the registers must also be in the register
+ *           directory (if used).
+ * 
+ * Returns:  0 if valid, Modbus exception code otherwise
+ *********************************************************/
+static unsigned int check_range(int reg_addr, int count, int max_count, int own_unit, int write)
+{
+   if ((count < 1) || (count > max_count))
+   {
+      return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+   }
+   if ((reg_addr + count - 1 > MBSRV_MAX_ADDR) ||
+       (own_unit && !mbsrv_map_check(reg_addr, count, write)))
+   {
+      return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: put_reg_vals()
+ * 
+ * Description:
+ *           Copy register values into a reply buffer
+ *           (big endian, preceded by the byte count)
+ * 
+ * Returns:  number of bytes written
+ *********************************************************/
+static int put_reg_vals(uint8_t *dst, const uint16_t *reg_vals, int count)
+{
+   int i;
+   
+   dst[0] = 2*count;
+   for (i=0; i<count; i++)
+   {
+      dst[1+2*i] = reg_vals[i] >> 8;
+      dst[2+2*i] = reg_vals[i] & 0xFF;
+   }
+   return 1 + 2*count;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_process_request()
+ * 
+ * Description:
+ *           Perform the operation of one complete Modbus
+ *           request using the block callback functions
+ *           and build the reply. No memory is allocated,
+ *           register values are kept in a small buffer 
+ *           on the stack and the reply is written to the
+ *           buffer provided by the caller.
+ * 
+ * Parameters:
+ *           query        - complete request frame (MBAP + PDU)
+ *           query_length - length of the request frame
+ *           rx_time      - time the request was received (in ms)
+ *           reply        - buffer of MODBUS_TCP_MAX_ADU_LENGTH
+ *                          bytes for the reply frame
+ * 
+ * Returns:  length of the reply frame
+ *********************************************************/
+int mbsrv_process_request(const uint8_t *query, int query_length, uint64_t rx_time, uint8_t *reply)
+{
+   /* Get information from request buffer */
+   const uint8_t *pdu;
+   uint8_t *rsp;
+   int pdu_length;
+   int rsp_length;
+   int slave_addr;
+   int operation;
+   int reg_addr;
+   int reg_cnt;
+   int wr_addr;
+   int wr_cnt;
+   int i;
+   uint16_t reg_vals[MODBUS_MAX_READ_REGISTERS];
+   unsigned int exception_code;
+   modbustcp_read_blk_cb_t  read_blk_cb;
+   modbustcp_write_blk_cb_t write_blk_cb;
+   int own_unit;
+   
+   /* pdu points to the unit identifier followed by the function code and data */
+   pdu = &query[MBAP_HEADER_LENGTH-1];
+   pdu_length = query_length - MBAP_HEADER_LENGTH + 1;
+   rsp = &reply[MBAP_HEADER_LENGTH-1];
+   rsp_length = 0;
+   
+   slave_addr = pdu[0];
+   operation  = pdu[1];
+   reg_addr   = (pdu_length >= 4) ? ((int)pdu[2]<<8 | (int)pdu[3]) : 0;
+   reg_cnt    = (pdu_length >= 6) ? ((int)pdu[4]<<8 | (int)pdu[5]) : 0;
+   
+   exception_code = 0;
+   
 #if DEBUG
-         printf("DBG: received request for slave %d, op %d, addr %d, reg_val %d\n", 
-                                         slave_addr, operation, reg_addr, reg_val); 
+   printf("DBG: received request for slave %d, op %d, addr %d, cnt/val %d\n", 
+                                   slave_addr, operation, reg_addr, reg_cnt); 
 #endif
-         
-         /* Initialise new response data structure */
-         mb_mapping = modbus_mapping_new(0,0,MAX_REG,0);
-         if (mb_mapping == NULL) 
+   
+   /* Check if slave address matches with one of the units served 
+    * by this process. For compatibility, a request for an unknown 
+    * unit is still handled by our own slave.
+    * TODO: should we respond with an exception here ?
+    */
+   if (!units[slave_addr].local && (own_slave != 0))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: slave address %d doesn't match our own address", 
+                                                                        own_slave, slave_addr);
+      slave_addr = own_slave;
+   }
+   read_blk_cb = units[slave_addr].read_cb;
+   write_blk_cb = units[slave_addr].write_cb;
+   
+   /* The register cache and directory hold the registers of our own slave */
+   own_unit = (own_slave != 0) && (slave_addr == own_slave);
+   
+   /* Perform requested operation using provided callback functions */
+   if (!units[slave_addr].local)
+   {  /* No unit with this address (gateway mode) */
+      exception_code = MODBUS_EXCEPTION_GATEWAY_PATH;
+   }
+   else switch (operation)
+   {
+      case 0x03:  /* FC Read Holding Registers */
+      case 0x04:  /* FC Read Input Registers */
+         if (pdu_length != 6)
          {
-            syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: Failed to allocate the mapping: %s", 
-                                                 own_slave_addr, modbus_strerror(errno));
-            modbus_free(ctx);
-            return -1;
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
          }
-         
-         /* Check if slave address matches with our own address 
-          * TODO: should we respond with an exception here ?
-          */
-         if (slave_addr != own_slave_addr)
+         else if (read_blk_cb == NULL) 
+         {  /* Function for this operation is not defined */
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+         }
+         else if ((exception_code = check_range(reg_addr, reg_cnt, MODBUS_MAX_READ_REGISTERS, own_unit, 0)) == 0)
          {
-            syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: slave address %d doesn't match our own address", 
-                                                                         own_slave_addr, slave_addr);
+            /* Call the "Read registers" handler function (via the cache) */ 
+            if ((own_unit ? mbsrv_cache_read(reg_addr, reg_cnt, reg_vals, rx_time, read_blk_cb) 
+                        : (*read_blk_cb)(reg_addr, reg_cnt, reg_vals)) != 0)
+            {  /* Error during register read occured */
+               exception_code = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
+            }
+            else
+            {  /* Copy read values into response buffer */
+               rsp_length = 2 + put_reg_vals(&rsp[2], reg_vals, reg_cnt);
+            }
          }
-         
-         /* Perform requested operation using provided callback functions */
-         switch (operation)
+         break;	
+   
+      case 0x06:  /* FC Write single register */
+         if (pdu_length != 6)
          {
-            case 0x03:  /* FC Read Holding Registers */
-            case 0x04:  /* FC Read Input Registers */
-               if (reg_addr < MAX_REG) 
-               {
-                  if (read_cb_fun) 
-                  {
-                     /* Call the "Read register" handler function */ 
-                     if ((*read_cb_fun)(reg_addr, &reg_val) != 0)
-                     {  /* Error during register read occured */
-                        exception_code = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
-                     }
-                     else
-                     {  /* Copy read value into response buffer */
-                        mb_mapping->tab_registers[reg_addr] = reg_val;
-                     }
-                  }
-                  else
-                  { /* Function for this operation is not defined */
-                     exception_code = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
-                  }         
-               }
-               else
-               {  /* Register address out of range */
-                  exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
-               }
-               break;	
-         
-            case 0x06:  /* FC Write single register */
-               if (reg_addr < MAX_REG) 
-               {
-                  if (write_cb_fun) 
-                  {
-                     /* Call the "Write register" handler function */
-                     if ((*write_cb_fun)(reg_addr, reg_val) != 0)
-                     {  
-                        /* Error during register write occured */
-                        exception_code = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
-                     }
-                  }
-                  else
-                  {  /* Function for this operation is not defined */
-                     exception_code = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
-                  }         
-               }
-               else
-               {  /* Register address out of range */
-                  exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
-               }
-               break;
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+         }
+         else if (write_blk_cb == NULL) 
+         {  /* Function for this operation is not defined */
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+         }
+         else if ((exception_code = check_range(reg_addr, 1, 1, own_unit, 1)) == 0)
+         {
+            /* Call the "Write registers" handler function */
+            reg_vals[0] = (uint16_t)reg_cnt;
+            if (own_unit) mbsrv_cache_invalidate(reg_addr, 1);
+            if ((*write_blk_cb)(reg_addr, 1, reg_vals) != 0)
+            {  /* Error during register write occured */
+               exception_code = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
+            }
+            else
+            {  /* Response is an echo of the request */
+               memcpy(&rsp[2], &pdu[2], 4);
+               rsp_length = 6;
+            }
+         }
+         break;
       
-            default:
-               printf("MODBUS_TCP_SERVER: Invalid operation %d\n", operation);
-               exception_code = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
-               
-         } //end switch statement
-   
-         /* Send reply to client */
-         if (exception_code == 0)
+      case 0x10:  /* FC Write Multiple Registers */
+         if ((pdu_length < 7) || (pdu[6] != 2*reg_cnt) || (pdu_length != 7 + 2*reg_cnt))
          {
-            rc = modbus_reply(ctx, query, rc, mb_mapping);
-            if (rc == -1) 
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+         }
+         else if (write_blk_cb == NULL) 
+         {  /* Function for this operation is not defined */
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+         }
+         else if ((exception_code = check_range(reg_addr, reg_cnt, MODBUS_MAX_WRITE_REGISTERS, own_unit, 1)) == 0)
+         {
+            for (i=0; i<reg_cnt; i++)
             {
-               syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: Failed to send reply to the client: %s", 
-                                                        own_slave_addr, modbus_strerror(errno));
+               reg_vals[i] = (uint16_t)pdu[7+2*i]<<8 | pdu[8+2*i];
+            }
+            /* Call the "Write registers" handler function */
+            if (own_unit) mbsrv_cache_invalidate(reg_addr, reg_cnt);
+            if ((*write_blk_cb)(reg_addr, reg_cnt, reg_vals) != 0)
+            {  /* Error during register write occured */
+               exception_code = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
             }
+            else
+            {  /* Response contains start address and quantity */
+               memcpy(&rsp[2], &pdu[2], 4);
+               rsp_length = 6;
+            }
+         }
+         break;
+      
+      case 0x17:  /* FC Read/Write Multiple Registers */
+         wr_addr = (pdu_length >= 8)  ? ((int)pdu[6]<<8 | (int)pdu[7]) : 0;
+         wr_cnt  = (pdu_length >= 10) ? ((int)pdu[8]<<8 | (int)pdu[9]) : 0;
+         if ((pdu_length < 11) || (pdu[10] != 2*wr_cnt) || (pdu_length != 11 + 2*wr_cnt))
+         {
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
          }
-         else
+         else if ((read_blk_cb == NULL) || (write_blk_cb == NULL))
+         {  /* Function for this operation is not defined */
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+         }
+         else if (((exception_code = check_range(wr_addr, wr_cnt, MODBUS_MAX_RW_WRITE_REGISTERS, own_unit, 1)) == 0) &&
+                  ((exception_code = check_range(reg_addr, reg_cnt, MODBUS_MAX_READ_REGISTERS, own_unit, 0)) == 0))
          {
-            rc = modbus_reply_exception(ctx, query, exception_code);
-            if (rc == -1) 
+            /* The write operation is performed before the read */
+            for (i=0; i<wr_cnt; i++)
             {
-               syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: Failed to send exception reply to the client: %s", 
-                                                        own_slave_addr, modbus_strerror(errno));
+               reg_vals[i] = (uint16_t)pdu[11+2*i]<<8 | pdu[12+2*i];
+            }
+            if (own_unit) mbsrv_cache_invalidate(wr_addr, wr_cnt);
+            if ((*write_blk_cb)(wr_addr, wr_cnt, reg_vals) != 0)
+            {  /* Error during register write occured */
+               exception_code = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
+            }
+            else if ((own_unit ? mbsrv_cache_read(reg_addr, reg_cnt, reg_vals, mbsrv_time_ms(), read_blk_cb) 
+                             : (*read_blk_cb)(reg_addr, reg_cnt, reg_vals)) != 0)
+            {  /* Error during register read occured */
+               exception_code = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
+            }
+            else
+            {  /* Copy read values into response buffer */
+               rsp_length = 2 + put_reg_vals(&rsp[2], reg_vals, reg_cnt);
             }
          }
-         modbus_mapping_free(mb_mapping); 
-      }
-      
-      close(accept_socket);
-      
-   } // end of main server loop
+         break;
+         
+      default:
+         printf("MODBUS_TCP_SERVER: Invalid operation %d\n", operation);
+         exception_code = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+         
+   } //end switch statement
 
-   syslog(LOG_DAEMON | LOG_NOTICE, "Exiting Modbus server for slave #%d", own_slave_addr);
+   /* Build the reply: MBAP header with same transaction id, 
+    * unit id and function code (with error flag on exception)
+    */
+   rsp[0] = pdu[0];
+   if (exception_code == 0)
+   {
+      rsp[1] = operation;
+   }
+   else
+   {
+      rsp[1] = operation | 0x80;
+      rsp[2] = exception_code;
+      rsp_length = 3;
+   }
+   memcpy(reply, query, 4);
+   reply[4] = rsp_length >> 8;
+   reply[5] = rsp_length & 0xFF;
+   
+   return MBAP_HEADER_LENGTH - 1 + rsp_length;
+}
 
-   close(socket);
-   modbus_close(ctx);
+
+/**********************************************************
+ * Function: mbsrv_send_reply()
+ * 
+ * Description:
+ *           Queue a reply frame for a client connection.
+ *           Replies are sent in the order their requests
+ *           completed, all replies queued during one loop
+ *           iteration with a single send() call.
+ *********************************************************/
+void mbsrv_send_reply(connection_t *conn, const uint8_t *reply, int reply_length)
+{
+   /* Never happens, room for replies is reserved before 
+    * handling a request 
+    */
+   if (conn->tx_len + reply_length > MBSRV_TX_BUF_SIZE)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: reply buffer overflow, reply dropped", own_slave);
+      return;
+   }
+   
+   if (conn->tx_len == 0) conn->tx_queued_us = mbsrv_time_us();
+   memcpy(&conn->tx_buf[conn->tx_len], reply, reply_length);
+   conn->tx_len += reply_length;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_send_exception()
+ * 
+ * Description:
+ *           Queue an exception reply for a request to a
+ *           client connection
+ *********************************************************/
+void mbsrv_send_exception(connection_t *conn, uint16_t tid, uint8_t unit,
+                          uint8_t function, uint8_t exception_code)
+{
+   uint8_t reply[EXCEPTION_LENGTH];
+   
+   reply[0] = tid >> 8;
+   reply[1] = tid & 0xFF;
+   reply[2] = 0;
+   reply[3] = 0;
+   reply[4] = 0;
+   reply[5] = 3;
+   reply[6] = unit;
+   reply[7] = function | 0x80;
+   reply[8] = exception_code;
+   
+   mbsrv_send_reply(conn, reply, EXCEPTION_LENGTH);
+}
+
+
+/**********************************************************
+ * Function: handle_request()
+ * 
+ * Description:
+ *           Handle one complete Modbus request and send
+ *           the reply to the client. Requests for units
+ *           routed to a backend server are forwarded,
+ *           requests on slow registers are handed to the
+ *           worker pool. Subscribe requests are handled
+ *           by the subscriptions.
+ *********************************************************/
+static void handle_request(connection_t *conn, const uint8_t *query, int query_length)
+{
+   uint8_t reply[MODBUS_TCP_MAX_ADU_LENGTH];
+   int reply_length;
+   int unit = query[MBAP_HEADER_LENGTH-1];
+   int own_unit;
+   uint64_t start_us;
+   
+   if (mbsrv_gw_forward(conn, query, query_length) == 0) return;
+   
+   if (mbsrv_sub_request(conn, query, query_length) == 0) return;
+   
+   /* Same as in mbsrv_process_request() */
+   own_unit = (own_slave != 0) && (!units[unit].local || (unit == own_slave));
+   if (mbsrv_pool_submit(conn, query, query_length, conn->rx_time, own_unit) == 0) return;
+   
+   start_us = mbsrv_time_us();
+   reply_length = mbsrv_process_request(query, query_length, conn->rx_time, reply);
+   mbsrv_stats_request(query, query_length, conn->rx_us, start_us, mbsrv_time_us());
+   mbsrv_trace_request(conn->id, query, query_length, conn->rx_us,
+                       (reply[MBAP_HEADER_LENGTH] & 0x80) ? reply[MBAP_HEADER_LENGTH+1] : 0);
+   mbsrv_send_reply(conn, reply, reply_length);
+}
+
+
+/**********************************************************
+ * Function: mbsrv_scan_request()
+ * 
+ * Description:
+ *           Perform a read of subscribed registers, on slow
+ *           registers via the worker pool
+ *********************************************************/
+void mbsrv_scan_request(const uint8_t *query, int query_length)
+{
+   uint8_t reply[MODBUS_TCP_MAX_ADU_LENGTH];
+   int reply_length;
+   int unit = query[MBAP_HEADER_LENGTH-1];
+   int own_unit;
+   uint64_t now = mbsrv_time_ms();
+   uint64_t start_us;
+   
+   own_unit = (own_slave != 0) && (!units[unit].local || (unit == own_slave));
+   if (mbsrv_pool_submit(NULL, query, query_length, now, own_unit) == 0) return;
+   
+   start_us = mbsrv_time_us();
+   reply_length = mbsrv_process_request(query, query_length, now, reply);
+   mbsrv_stats_request(query, query_length, start_us, start_us, mbsrv_time_us());
+   mbsrv_sub_scan_done(query, reply, reply_length);
+}
+
+
+/**********************************************************
+ * Function: prefetch_requests()
+ * 
+ * Description:
+ *           Read data which arrived during a slow backend
+ *           read from all client connections, without 
+ *           handling it yet. The data is marked as received
+ *           at the completion time of the backend read, so
+ *           requests for the same registers can share the
+ *           value just read. Closed connections are left
+ *           to the main loop.
+ *********************************************************/
+static void prefetch_requests(uint64_t rx_time)
+{
+   int i;
+   int rc;
+   
+   for (i=0; i<MAX_CONNECTIONS; i++)
+   {
+      connection_t *conn = &connections[i];
+      
+      if ((conn->fd == -1) || conn->blocked || (conn->rx_len == sizeof(conn->rx_buf))) continue;
+      
+      rc = read(conn->fd, &conn->rx_buf[conn->rx_len], sizeof(conn->rx_buf) - conn->rx_len);
+      if (rc > 0)
+      {
+         if (conn->rx_len == 0) conn->rx_started = now_sec();
+         conn->rx_len += rc;
+         conn->rx_time = rx_time;
+         conn->rx_us = mbsrv_time_us();
+         conn->last_activity = now_sec();
+         prefetched = 1;
+      }
+   }
+}
+
+
+/**********************************************************
+ * Function: handle_buffered_requests()
+ * 
+ * Description:
+ *           Handle every complete request found in the
+ *           receive buffer of a client connection. If the
+ *           reply buffer is full and cannot be sent, request
+ *           handling is blocked until the client has read
+ *           the queued replies.
+ * 
+ * Returns:  0 if the connection stays open
+ *          -1 if the connection was closed
+ *********************************************************/
+static int handle_buffered_requests(connection_t *conn)
+{
+   uint64_t read_done;
+   
+   while (conn->rx_len >= MBAP_HEADER_LENGTH)
+   {
+      int protocol_id = (conn->rx_buf[2] << 8) | conn->rx_buf[3];
+      int mbap_length = (conn->rx_buf[4] << 8) | conn->rx_buf[5];
+      int frame_length = MBAP_HEADER_LENGTH - 1 + mbap_length;
+      
+      if ((protocol_id != 0) || (mbap_length < 2) || (mbap_length > MBAP_LENGTH_MAX))
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: invalid MBAP header, closing connection", 
+                                                                                own_slave);
+         close_connection(conn);
+         return -1;
+      }
+      
+      if (conn->rx_len < frame_length) break;
+      
+      /* Make room for the reply */
+      if (!tx_room(conn))
+      {
+         if (flush_connection(conn) == -1) return -1;
+         if (!tx_room(conn))
+         {
+            conn->blocked = 1;
+            break;
+         }
+      }
+      
+      handle_request(conn, conn->rx_buf, frame_length);
+      
+      /* Remove the handled request from the receive buffer */
+      conn->rx_len -= frame_length;
+      memmove(conn->rx_buf, &conn->rx_buf[frame_length], conn->rx_len);
+      conn->rx_started = now_sec();
+      
+      /* Collect requests which arrived during a slow register read */
+      if (mbsrv_cache_slow_read(&read_done))
+      {
+         prefetch_requests(read_done);
+      }
+   }
+   
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: receive_requests()
+ * 
+ * Description:
+ *           Read available data from a client connection
+ *           and handle every complete request found in
+ *           the receive buffer
+ * 
+ * Returns:  0 if the connection stays open
+ *          -1 if the connection was closed (or is closing)
+ *********************************************************/
+static int receive_requests(connection_t *conn)
+{
+   int rc;
+   
+   /* Drain the socket */
+   while (1)
+   {
+      /* Handle requests already in the receive buffer first, 
+       * they may have been collected during a slow register read 
+       */
+      if (handle_buffered_requests(conn) == -1) return -1;
+      if (conn->blocked) break;
+      
+      rc = read(conn->fd, &conn->rx_buf[conn->rx_len], sizeof(conn->rx_buf) - conn->rx_len);
+      if (rc == 0)
+      {  /* Connection closed by client */
+         return finish_connection(conn);
+      }
+      if (rc == -1)
+      {
+         if (errno == EINTR) continue;
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+         syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: read() failed: %s", 
+                                          own_slave, strerror(errno));
+         close_connection(conn);
+         return -1;
+      }
+      
+      if (conn->rx_len == 0) conn->rx_started = now_sec();
+      conn->rx_len += rc;
+      conn->rx_time = mbsrv_time_ms();
+      conn->rx_us = mbsrv_time_us();
+      conn->last_activity = now_sec();
+   }
+   
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: handle_prefetched_requests()
+ * 
+ * Description:
+ *           Handle requests collected by prefetch_requests(),
+ *           the sockets they were read from are not reported
+ *           by epoll anymore
+ *********************************************************/
+static void handle_prefetched_requests(void)
+{
+   int i;
+   
+   while (prefetched)
+   {
+      prefetched = 0;
+      for (i=0; i<MAX_CONNECTIONS; i++)
+      {
+         if (connections[i].fd != -1) handle_buffered_requests(&connections[i]);
+      }
+   }
+}
+
+
+/**********************************************************
+ * Function: flush_connections()
+ * 
+ * Description:
+ *           Send the replies queued during this loop iteration
+ *           and resume request handling on blocked connections
+ *           with room for replies again
+ *********************************************************/
+static void flush_connections(void)
+{
+   int i;
+   
+   for (i=0; i<MAX_CONNECTIONS; i++)
+   {
+      connection_t *conn = &connections[i];
+      
+      if (conn->fd == -1) continue;
+      
+      if (flush_connection(conn) == -1) continue;
+      
+      if (conn->blocked && tx_room(conn))
+      {
+         conn->blocked = 0;
+         if (handle_buffered_requests(conn) == -1) continue;
+         if (flush_connection(conn) == -1) continue;
+      }
+      
+      if (conn->closing && !conn->blocked && (conn->tx_len == 0) && (conn->in_flight == 0))
+      {  /* All replies sent to a client which closed the connection */
+         close_connection(conn);
+         continue;
+      }
+      
+      update_events(conn);
+   }
+}
+
+
+/**********************************************************
+ * Function: check_timeouts()
+ * 
+ * Description:
+ *           Close idle connections without subscriptions
+ *           and connections with an incomplete request
+ *           pending for too long
+ *********************************************************/
+static void check_timeouts(void)
+{
+   int i;
+   time_t now = now_sec();
+   
+   for (i=0; i<MAX_CONNECTIONS; i++)
+   {
+      connection_t *conn = &connections[i];
+      
+      if (conn->fd == -1) continue;
+      
+      if ((conn->rx_len > 0) && !conn->blocked && (now - conn->rx_started > PARTIAL_TMO))
+      {
+         syslog(LOG_DAEMON | LOG_NOTICE, "Slave #%d: incomplete request timed out, closing connection", 
+                                                                                        own_slave);
+         close_connection(conn);
+      }
+      else if ((now - conn->last_activity > IDLE_TMO) && !mbsrv_sub_active(conn))
+      {
+         close_connection(conn);
+      }
+   }
+}
+
+
+/**********************************************************
+ * Function: mbsrv_set_callbacks()
+ * 
+ * Description:
+ *           Set own slave address and block callbacks
+ *********************************************************/
+void mbsrv_set_callbacks(int own_slave_addr, modbustcp_read_blk_cb_t read_cb_fun, 
+                                             modbustcp_write_blk_cb_t write_cb_fun)
+{
+   own_slave = own_slave_addr;
+   mbsrv_map_callbacks(&read_cb_fun, &write_cb_fun);
+   modbustcp_server_add_unit(own_slave_addr, read_cb_fun, write_cb_fun);
+}
+
+
+/**********************************************************
+ * Function: server_loop()
+ * 
+ * Description:
+ *           Create the listen socket and serve the clients
+ *           until the server is terminated
+ * 
+ * Returns:  0 on success
+ *          -1 otherwise
+ *********************************************************/
+static int server_loop(int tcp_port)
+{
+   int i;
+   modbus_t *ctx; 
+   struct epoll_event ev;
+   time_t last_tmo_check;
+   int scan_wait = -1;
+   
+   
+   syslog(LOG_DAEMON | LOG_NOTICE, "Listening on port %d\n", tcp_port);
+
+   /* Create new connection context */
+   ctx = modbus_new_tcp("127.0.0.1", tcp_port);
+   if (ctx == NULL)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: Failed to create Modbus context: %s", 
+                                                   own_slave, modbus_strerror(errno));
+      return -1;
+   }
+   
+#if DEBUG
+   modbus_set_debug(ctx, TRUE);  
+#endif
+   
+   /* Create the listen socket */
+   tcp_listener.fd = modbus_tcp_listen(ctx, LISTEN_BACKLOG);
+   if (tcp_listener.fd == -1)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: modbus_tcp_listen() failed: %s", 
+                                            own_slave, modbus_strerror(errno));
+      modbus_free(ctx);
+      return -1;
+   }
+   fcntl(tcp_listener.fd, F_SETFL, fcntl(tcp_listener.fd, F_GETFL) | O_NONBLOCK);
+   
+   /* Create the epoll set, watching the listen socket */
+   mbsrv_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   ev.events = EPOLLIN;
+   ev.data.ptr = &tcp_listener;
+   if ((mbsrv_epoll_fd == -1) || (epoll_ctl(mbsrv_epoll_fd, EPOLL_CTL_ADD, tcp_listener.fd, &ev) == -1))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: epoll setup failed: %s", 
+                                            own_slave, strerror(errno));
+      close(tcp_listener.fd);
+      modbus_free(ctx);
+      return -1;
+   }
+   
+   /* Local clients can also connect via the Unix domain socket, 
+    * the server works without it though 
+    */
+   unix_listener.fd = unix_listen(tcp_port);
+   ev.data.ptr = &unix_listener;
+   if ((unix_listener.fd == -1) || 
+       (epoll_ctl(mbsrv_epoll_fd, EPOLL_CTL_ADD, unix_listener.fd, &ev) == -1))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: Unix domain socket setup failed: %s", 
+                                                         own_slave, strerror(errno));
+      if (unix_listener.fd != -1) close(unix_listener.fd);
+      unix_listener.fd = -1;
+   }
+   
+   /* Without the worker pool slow registers are handled inline */
+   mbsrv_pool_start();
+   
+   for (i=0; i<MAX_CONNECTIONS; i++)
+   {
+      connections[i].kind = MBSRV_EV_CLIENT;
+      connections[i].fd = -1;
+   }
+   last_tmo_check = now_sec();
+   
+   /* Writing to a connection closed by the client must not kill us */
+   signal(SIGPIPE, SIG_IGN);
+   
+   /* Statistics are written on SIGUSR1 */
+   mbsrv_stats_start(tcp_port);
+   
+   /* Requests are traced while switched on by SIGUSR2 */
+   mbsrv_trace_start(tcp_port);
+   
+   
+   /***** Main server loop *****/
+   while (cont)
+   {
+      struct epoll_event events[MAX_EVENTS];
+      int nfds;
+      int timeout = TMO_CHECK_INTERVAL;
+      
+      /* Write the statistics or switch tracing if requested 
+       * (SIGUSR1 and SIGUSR2 interrupt epoll_wait) */
+      mbsrv_stats_check();
+      mbsrv_trace_check();
+      
+      /* Wake up in time for the next read of subscribed registers */
+      if ((scan_wait != -1) && (scan_wait < timeout)) timeout = scan_wait;
+      
+      /* Wait for incoming connections or data */
+      nfds = epoll_wait(mbsrv_epoll_fd, events, MAX_EVENTS, timeout);
+      if (nfds == -1)
+      {
+         if (errno == EINTR) continue;
+         cont = 0;
+         syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: epoll_wait() failed; %s", 
+                                               own_slave, strerror(errno));
+         break;
+      }
+      
+      for (i=0; i<nfds; i++)
+      {
+         mbsrv_ev_kind_t *kind = (mbsrv_ev_kind_t *)events[i].data.ptr;
+         connection_t *conn;
+         
+         if (*kind == MBSRV_EV_LISTEN)
+         {  /* Activity on a listen socket */
+            accept_connections(((listener_t *)kind)->fd);
+            continue;
+         }
+         
+         if (*kind == MBSRV_EV_BACKEND)
+         {  /* Reply from (or connection to) a backend server */
+            mbsrv_gw_handle_event(kind, events[i].events);
+            continue;
+         }
+         
+         if (*kind == MBSRV_EV_POOL)
+         {  /* Requests on slow registers completed */
+            mbsrv_pool_handle_event();
+            continue;
+         }
+         
+         conn = (connection_t *)kind;
+         if (conn->fd == -1) continue;
+         
+         /* Queued replies (EPOLLOUT) are sent by flush_connections() */
+         if (events[i].events & EPOLLIN)
+         {  /* Data from client (or orderly shutdown) */
+            if (receive_requests(conn) == -1)
+               continue;
+         }
+         
+         if (events[i].events & (EPOLLERR | EPOLLHUP))
+         {  /* Connection broken */
+            close_connection(conn);
+         }
+         else if (events[i].events & EPOLLRDHUP)
+         {  /* Connection closed by client */
+            finish_connection(conn);
+         }
+      }
+      
+      /* Handle requests which arrived during slow register reads */
+      handle_prefetched_requests();
+      
+      /* Read subscribed registers and report changes */
+      scan_wait = mbsrv_sub_scan();
+      
+      /* Send the replies */
+      flush_connections();
+      
+      /* Close connections which timed out */
+      if (now_sec() != last_tmo_check)
+      {
+         check_timeouts();
+         mbsrv_gw_check_timeouts();
+         last_tmo_check = now_sec();
+      }
+      
+   } // end of main server loop
+
+   mbsrv_pool_stop();
+   
+   for (i=0; i<MAX_CONNECTIONS; i++)
+   {
+      if (connections[i].fd != -1) close_connection(&connections[i]);
+   }
+   mbsrv_gw_close();
+   close(mbsrv_epoll_fd);
+   mbsrv_epoll_fd = -1;
+   if (unix_listener.fd != -1) close(unix_listener.fd);
+   unix_listener.fd = -1;
+   close(tcp_listener.fd);
+   tcp_listener.fd = -1;
+   modbus_close(ctx);
    modbus_free(ctx);
    return 0;
 }
+
+
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_server_blk()
+ * 
+ * DESCRIPTION: 
+ *           Handles the communication with Modbus TCP clients and
+ *           performs requested Read or Write operations via block
+ *           callback functions (provided as input paramters)
+ * 
+ *           Supported Modbus operations:
+ *           - Read Holding Registers          (FC 0x03)
+ *           - Read Input Registers            (FC 0x04)
+ *           - Write Single Register           (FC 0x06)
+ *           - Write Multiple Registers        (FC 0x10)
+ *           - Read/Write Multiple Registers   (FC 0x17)
+ *           - Subscribe to register changes   (FC 0x41)
+ * 
+ *           Multiple clients are served at the same time by an
+ *           epoll based event loop. Connections stay open for any
+ *           number of requests until the client closes them or
+ *           they time out.
+ * 
+ * PARAMETERS: 
+ *           own_slave_addr - Own Modbus slave address
+ *           read_cb_fun    - function pointer to Read registers handler
+ *           write_cb_fun   - function pointer to Write registers handler
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ * 
+ *******************************************************************/
+int modbustcp_server_blk(int own_slave_addr, modbustcp_read_blk_cb_t read_cb_fun, 
+                                             modbustcp_write_blk_cb_t write_cb_fun)
+{
+   int rc;
+   
+   
+   openlog("modbus server", LOG_PID|LOG_CONS, LOG_USER);
+   syslog(LOG_DAEMON | LOG_NOTICE, "Starting Modbus server for slave #%d (version %s using libmodbus %s)\n", 
+                                                          own_slave_addr, VERSION, LIBMODBUS_VERSION_STRING);
+   
+   if ((own_slave_addr < 1) || (own_slave_addr >= MBSRV_MAX_UNITS))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid slave address %d", own_slave_addr);
+      return -1;
+   }
+   mbsrv_set_callbacks(own_slave_addr, read_cb_fun, write_cb_fun);
+   
+   rc = server_loop(MODBUSTCP_SERVER_PORT_BASE + own_slave_addr);
+
+   syslog(LOG_DAEMON | LOG_NOTICE, "Exiting Modbus server for slave #%d", own_slave_addr);
+   return rc;
+}
+
+
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_server_add_unit()
+ * 
+ * DESCRIPTION: 
+ *           Adds a unit linked into this process to the units 
+ *           served by modbustcp_gateway()
+ * 
+ * PARAMETERS: 
+ *           slave_addr   - Modbus slave address (unit identifier)
+ *           read_cb_fun  - function pointer to Read registers handler
+ *           write_cb_fun - function pointer to Write registers handler
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ * 
+ *******************************************************************/
+int modbustcp_server_add_unit(int slave_addr, modbustcp_read_blk_cb_t read_cb_fun, 
+                                              modbustcp_write_blk_cb_t write_cb_fun)
+{
+   if ((slave_addr < 1) || (slave_addr >= MBSRV_MAX_UNITS))
+   {
+      return -1;
+   }
+   
+   units[slave_addr].local = 1;
+   units[slave_addr].read_cb = read_cb_fun;
+   units[slave_addr].write_cb = write_cb_fun;
+   return 0;
+}
+
+
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_gateway()
+ * 
+ * DESCRIPTION: 
+ *           Serves all units over a single Modbus TCP port. 
+ *           Requests are dispatched by unit identifier to the
+ *           units added with modbustcp_server_add_unit() or 
+ *           forwarded to the backend server of their route.
+ *           Modules without a route or local unit are reached
+ *           via the Unix domain socket of their own port.
+ * 
+ * PARAMETERS: 
+ *           tcp_port - TCP port to listen on
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ * 
+ *******************************************************************/
+int modbustcp_gateway(int tcp_port)
+{
+   int rc;
+   int unit;
+   
+   
+   openlog("modbus gateway", LOG_PID|LOG_CONS, LOG_USER);
+   syslog(LOG_DAEMON | LOG_NOTICE, "Starting Modbus gateway (version %s using libmodbus %s)\n", 
+                                                              VERSION, LIBMODBUS_VERSION_STRING);
+   
+   own_slave = 0;
+   for (unit=MODBUS_SLAVE_SENSOR_MODULE; unit<=MODBUS_SLAVE_CUSTOM_MODULE; unit++)
+   {
+      if (!units[unit].local && !mbsrv_gw_routed(unit))
+      {
+         modbustcp_server_route(unit, "unix", MODBUSTCP_SERVER_PORT_BASE + unit);
+      }
+   }
+   
+   rc = server_loop(tcp_port);
+
+   syslog(LOG_DAEMON | LOG_NOTICE, "Exiting Modbus gateway");
+   return rc;
+}
+
+
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_server()
+ * 
+ * DESCRIPTION: 
+ *           Same as modbustcp_server_blk() but using callback
+ *           functions which handle one single register. For
+ *           requests on multiple registers the callbacks are
+ *           called once for each register.
+ * 
+ * PARAMETERS: 
+ *           own_slave_addr - Own Modbus slave address
+ *           read_cb_fun    - function pointer to Read register handler
+ *           write_cb_fun   - function pointer to Write register handler
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ * 
+ *******************************************************************/
+int modbustcp_server(int own_slave_addr, int (*read_cb_fun)(int, int*), int (*write_cb_fun)(int, int))
+{
+   legacy_read_cb = read_cb_fun;
+   legacy_write_cb = write_cb_fun;
+   
+   return modbustcp_server_blk(own_slave_addr, 
+                               read_cb_fun ? legacy_read_blk : NULL,
+                               write_cb_fun ? legacy_write_blk : NULL);
+}
\ No newline at end of file
@@ -11,8 +11,50 @@
 #ifndef _MODBUSTCP_SERVER_LIB_H_
 #define _MODBUSTCP_SERVER_LIB_H_
 
+#include <stdint.h>
+
 #define MODBUSTCP_SERVER_PORT_BASE 5000
 
+/* Port of the gateway serving all slave modules */
+#define MODBUSTCP_GATEWAY_PORT 502
+
+/* Name of the Unix domain socket a server listens on in addition to 
+ * its TCP port (formatted with the TCP port number). A leading '@' 
+ * denotes a socket in the abstract namespace, otherwise it's a path
+ * in the filesystem.
+ */
+#define MODBUSTCP_SERVER_UNIX_NAME "@telegea-mbsrv-%d"
+
+/* File the latency statistics of a server are written to on SIGUSR1
+ * (formatted with the TCP port number)
+ */
+#define MODBUSTCP_SERVER_STATS_FILE "/tmp/modbustcp_server_%d.stats"
+
+/* File the requests of a server are traced to while tracing is switched
+ * on by SIGUSR2 (formatted with the TCP port number). Tracing stops at
+ * the next SIGUSR2 or when the file reaches MODBUSTCP_SERVER_TRACE_MAX bytes.
+ *
+ * Trace file format, all values little endian:
+ * header (MODBUSTCP_TRACE_HEADER_LENGTH bytes)
+ *   0  8  MODBUSTCP_TRACE_MAGIC
+ *   8  8  wall clock time of the trace start (in us since the epoch)
+ *  16  2  TCP port of the server
+ *  18  6  reserved
+ * one record per request (MODBUSTCP_TRACE_RECORD_LENGTH bytes + PDU)
+ *   0  8  time the request was received (in us since the trace start)
+ *   8  4  time until its reply was ready (in us)
+ *  12  2  id of the client connection (low 16 bits)
+ *  14  1  unit identifier
+ *  15  1  exception code of the reply, 0 for a normal reply
+ *  16  1  length of the PDU
+ *  17     PDU of the request (function code and data)
+ */
+#define MODBUSTCP_SERVER_TRACE_FILE "/tmp/modbustcp_server_%d.trace"
+#define MODBUSTCP_SERVER_TRACE_MAX  (64L*1024*1024)
+#define MODBUSTCP_TRACE_MAGIC         "MBTRACE1"
+#define MODBUSTCP_TRACE_HEADER_LENGTH 24
+#define MODBUSTCP_TRACE_RECORD_LENGTH 17
+
 /* Slave address list for known modules */
 #define MODBUS_SLAVE_SENSOR_MODULE  1
 #define MODBUS_SLAVE_COUNTER_MODULE 2
@@ -22,6 +64,34 @@
 #define MODBUS_SLAVE_SNMP_MODULE    6
 #define MODBUS_SLAVE_CUSTOM_MODULE  7
 
+/* User defined function codes for report by exception:
+ * 
+ * Subscribe:    request  <addr:2> <count:2> <deadband:2>
+ *               reply    <addr:2> <count:2>
+ * Notify:       <addr:2> <byte count:1> <values:2*count>
+ * 
+ * After a subscribe request the server sends a notify frame with
+ * the values of the <count> registers starting at <addr> whenever 
+ * one of them changed by more than <deadband> since it was last 
+ * reported (the first one with the current values). Notify frames 
+ * carry the transaction id of the subscribe request. A subscribe
+ * request for the same <addr> replaces the subscription, with a 
+ * <count> of 0 it's cancelled. Subscriptions end when the client
+ * closes the connection, or with a notify exception frame when
+ * the registers cannot be read anymore. A connection with
+ * subscriptions is not closed for being idle, its client doesn't
+ * need to send requests to keep it open.
+ */
+#define MODBUSTCP_FC_SUBSCRIBE 0x41
+#define MODBUSTCP_FC_NOTIFY    0x42
+
+/* Block register access callbacks:
+ * handle <count> consecutive registers starting at <start_addr>,
+ * return 0 on success, -1 otherwise
+ */
+typedef int (*modbustcp_read_blk_cb_t)(int start_addr, int count, uint16_t *reg_vals);
+typedef int (*modbustcp_write_blk_cb_t)(int start_addr, int count, const uint16_t *reg_vals);
+
 /********************************************************************
  * 
  * PUBLIC FUNCTION: 
@@ -33,20 +103,289 @@
  *           functions (provided as input paramters)
  * 
  *           Supported Modbus operations:
- *           - Read Holding Registers (FC 0x03)
- *           - Read Input Registers   (FC 0x04)
- *           - Write Single Register  (FC 0x06)
+ *           - Read Holding Registers          (FC 0x03)
+ *           - Read Input Registers            (FC 0x04)
+ *           - Write Single Register           (FC 0x06)
+ *           - Write Multiple Registers        (FC 0x10)
+ *           - Read/Write Multiple Registers   (FC 0x17)
+ *           - Subscribe to register changes   (FC 0x41, see above)
+ * 
+ *           For requests on multiple registers the callbacks are
+ *           called once for each register.
+ * 
+ *           The server listens on port MODBUSTCP_SERVER_PORT_BASE 
+ *           plus own slave address and serves multiple clients at
+ *           the same time. Connections are kept open for multiple
+ *           requests and closed after being idle for a while.
+ *           A client may send several requests without waiting for
+ *           the replies (pipelining). The replies are sent in the
+ *           order the requests complete, with the transaction id of
+ *           their request.
+ *           Local clients can also connect to the Unix domain socket
+ *           MODBUSTCP_SERVER_UNIX_NAME (same MBAP framing as TCP).
+ * 
+ * PARAMETERS: 
+ *           own_slave_addr - Own Modbus slave address
+ *           read_cb_fun    - function pointer to Read register handler
+ *           write_cb_fun   - function pointer to Write register handler
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ * 
+ *******************************************************************/
+int modbustcp_server(int own_slave_addr, int (*read_cb_fun)(int, int*), int (*write_cb_fun)(int, int));
+
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_server_blk()
+ * 
+ * DESCRIPTION: 
+ *           Same as modbustcp_server() but using block callback
+ *           functions, which handle a range of consecutive registers
+ *           with a single call. 
+ * 
+ *           Supported Modbus operations:
+ *           - Read Holding Registers          (FC 0x03)
+ *           - Read Input Registers            (FC 0x04)
+ *           - Write Single Register           (FC 0x06)
+ *           - Write Multiple Registers        (FC 0x10)
+ *           - Read/Write Multiple Registers   (FC 0x17)
+ *           - Subscribe to register changes   (FC 0x41, see above)
+ * 
+ * PARAMETERS: 
+ *           own_slave_addr - Own Modbus slave address
+ *           read_cb_fun    - function pointer to Read registers handler
+ *           write_cb_fun   - function pointer to Write registers handler
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ * 
+ *******************************************************************/
+int modbustcp_server_blk(int own_slave_addr, modbustcp_read_blk_cb_t read_cb_fun, 
+                                             modbustcp_write_blk_cb_t write_cb_fun);
+
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_server_map()
+ * 
+ * DESCRIPTION: 
+ *           Adds a range of register addresses with its own callback
+ *           functions to the register directory of the server. Must
+ *           be called before starting the server.
+ * 
+ *           The full register address range 0-65535 can be served.
+ *           A request accessing several ranges results in one callback
+ *           call per range. Registers outside all ranges are handled
+ *           by the callback functions given to modbustcp_server_blk()
+ *           or modbustcp_server(). If there are none, accessing these
+ *           registers results in exception 0x02 (illegal data address),
+ *           same as accessing a range without a callback function for
+ *           the requested operation.
+ * 
+ * PARAMETERS: 
+ *           first_addr   - first register address of the range
+ *           last_addr    - last register address of the range
+ *           read_cb_fun  - function pointer to Read registers handler
+ *                          (NULL for write only registers)
+ *           write_cb_fun - function pointer to Write registers handler
+ *                          (NULL for read only registers)
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise (invalid or overlapping range)
+ * 
+ *******************************************************************/
+int modbustcp_server_map(int first_addr, int last_addr, modbustcp_read_blk_cb_t read_cb_fun, 
+                                                        modbustcp_write_blk_cb_t write_cb_fun);
+
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_server_cache()
+ * 
+ * DESCRIPTION: 
+ *           Enables caching for a range of register addresses.
+ *           Must be called before starting the server.
+ * 
+ *           A cached register is read via the callback function
+ *           only if its cached value is older than the TTL. A value
+ *           read via the callback is also returned to all requests
+ *           for the same register which arrived while the read was
+ *           in progress, even with a TTL of 0.
+ *           Writing a register invalidates its cached value.
+ * 
+ * PARAMETERS: 
+ *           first_addr - first register address of the range
+ *           last_addr  - last register address of the range
+ *           ttl        - time to live of cached values (in ms)
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ * 
+ *******************************************************************/
+int modbustcp_server_cache(int first_addr, int last_addr, int ttl);
+
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_server_cache_stats()
+ * 
+ * DESCRIPTION: 
+ *           Gets the cache statistics
  * 
  * PARAMETERS: 
- *           tcp_port     - TCP port to listen for incoming requests
- *           read_cb_fun  - function pointer to Read register handler
- *           write_cb_fun - function pointer to Write register handler
+ *           hits      - number of register reads served within the TTL
+ *           coalesced - number of register reads served by the read
+ *                       of a concurrent request
+ *           misses    - number of cached registers read via the
+ *                       callback function
+ * 
+ *******************************************************************/
+void modbustcp_server_cache_stats(unsigned long *hits, unsigned long *coalesced, unsigned long *misses);
+
+/********************************************************************
+ *
+ * PUBLIC FUNCTION:
+ *           modbustcp_server_slow()
+ *
+ * DESCRIPTION:
+ *           Marks a range of register addresses as slow to access.
+ *           Must be called before starting the server.
+ *
+ *           Requests accessing a slow range are handled by a small
+ *           pool of worker threads, so requests for other registers
+ *           are still answered while a slow callback is running.
+ *           The callback functions must therefore be thread safe
+ *           for registers in different ranges. Requests on the same
+ *           slow range are handled one at a time, in the order they
+ *           were received. Reads of cached registers with a valid
+ *           value are answered without a worker.
+ *           When too many requests are waiting for a worker, further
+ *           requests are answered with exception 0x06 (slave device
+ *           busy).
+ *
+ * PARAMETERS:
+ *           first_addr - first register address of the range
+ *           last_addr  - last register address of the range
+ *
+ * RETURN:   0 on success
+ *          -1 otherwise
+ *
+ *******************************************************************/
+int modbustcp_server_slow(int first_addr, int last_addr);
+
+/********************************************************************
+ *
+ * PUBLIC FUNCTION:
+ *           modbustcp_server_stats_range()
+ *
+ * DESCRIPTION:
+ *           Adds a named range of register addresses to the latency
+ *           statistics. Must be called before starting the server.
+ *
+ *           The server records latency histograms of the requests it
+ *           handles per function code and per named range: the time
+ *           a request waited before being handled (receive) and the
+ *           time the callback functions took (callback). The time
+ *           replies waited to be sent to the clients is recorded for
+ *           all requests together. The slowest requests are kept
+ *           with their details.
+ *           The statistics are written to MODBUSTCP_SERVER_STATS_FILE
+ *           when the process receives SIGUSR1.
+ *
+ * PARAMETERS:
+ *           first_addr - first register address of the range
+ *           last_addr  - last register address of the range
+ *           name       - name of the range in the statistics
+ *
+ * RETURN:   0 on success
+ *          -1 otherwise
+ *
+ *******************************************************************/
+int modbustcp_server_stats_range(int first_addr, int last_addr, const char *name);
+
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_gateway()
+ * 
+ * DESCRIPTION: 
+ *           Serves the registers of all slave modules over a single
+ *           Modbus TCP port. Requests are dispatched by unit identifier
+ *           (slave address) to:
+ *           - a unit linked into this process, see 
+ *             modbustcp_server_add_unit()
+ *           - a backend Modbus TCP server, see modbustcp_server_route()
+ *           Known slave modules without a local unit or route are 
+ *           reached via the Unix domain socket of their own port
+ *           (MODBUSTCP_SERVER_PORT_BASE plus slave address).
+ * 
+ *           Like the servers of the slave modules, the gateway also
+ *           listens on the Unix domain socket MODBUSTCP_SERVER_UNIX_NAME.
+ * 
+ *           Backend connections are persistent and shared by all
+ *           clients. Subscriptions are only supported for local units.
+ *           Requests for unknown units are answered with
+ *           exception 0x0A (gateway path unavailable), requests to an 
+ *           unreachable backend, or not answered by the backend within
+ *           14 s, with exception 0x0B (gateway target device failed to
+ *           respond).
+ * 
+ * PARAMETERS: 
+ *           tcp_port - TCP port to listen on (MODBUSTCP_GATEWAY_PORT)
  * 
  * RETURN:   0 on success
  *          -1 otherwise
  * 
  *******************************************************************/
-int modbustcp_server(int tcp_port, int (*read_cb_fun)(int, int*), int (*write_cb_fun)(int, int));
+int modbustcp_gateway(int tcp_port);
 
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_server_add_unit()
+ * 
+ * DESCRIPTION: 
+ *           Adds a unit linked into this process, to be served by
+ *           modbustcp_gateway(). Must be called before starting the
+ *           gateway.
+ * 
+ * PARAMETERS: 
+ *           slave_addr   - Modbus slave address (unit identifier)
+ *           read_cb_fun  - function pointer to Read registers handler
+ *           write_cb_fun - function pointer to Write registers handler
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ * 
+ *******************************************************************/
+int modbustcp_server_add_unit(int slave_addr, modbustcp_read_blk_cb_t read_cb_fun, 
+                                              modbustcp_write_blk_cb_t write_cb_fun);
+
+/********************************************************************
+ * 
+ * PUBLIC FUNCTION: 
+ *           modbustcp_server_route()
+ * 
+ * DESCRIPTION: 
+ *           Routes the requests for a unit to a backend Modbus TCP 
+ *           server, to be used by modbustcp_gateway(). Must be called
+ *           before starting the gateway.
+ * 
+ * PARAMETERS: 
+ *           slave_addr - Modbus slave address (unit identifier)
+ *           ip_addr    - IP address of the backend server, or "unix" 
+ *                        to connect to the Unix domain socket of a 
+ *                        local server listening on tcp_port, or 
+ *                        "unix:<name>" for a Unix domain socket with
+ *                        the given name
+ *           tcp_port   - TCP port of the backend server
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ * 
+ *******************************************************************/
+int modbustcp_server_route(int slave_addr, const char *ip_addr, int tcp_port);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,286 @@
+/*
+ * Modbus TCP server library
+ * - register directory: address ranges with their own callback functions
+ *
+ * The directory covers the full 16 bit register address space, but
+ * only holds the ranges actually used by a module, sorted by address.
+ * A request is split into one callback call per range it accesses.
+ * Registers outside the ranges of the directory are handled by the
+ * callback functions given when starting the server (if any).
+ *
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "modbustcp_server_lib.h"
+#include "modbustcp_server_int.h"
+
+/* Max number of address ranges in the directory */
+#define MAX_MAP_RANGES 64
+
+
+/* Address range with its callbacks */
+typedef struct {
+   int first_addr;
+   int last_addr;
+   modbustcp_read_blk_cb_t  read_cb;
+   modbustcp_write_blk_cb_t write_cb;
+} map_range_t;
+
+/* Directory, sorted by address */
+static map_range_t map_ranges[MAX_MAP_RANGES];
+static int num_map_ranges = 0;
+
+/* Callbacks for registers outside the ranges */
+static modbustcp_read_blk_cb_t  default_read_cb = NULL;
+static modbustcp_write_blk_cb_t default_write_cb = NULL;
+
+
+/**********************************************************
+ * Function: find_range()
+ *
+ * Description:
+ *           Find the first range of the directory which
+ *           ends at or after a register address
+ *
+ * Returns:  index of the range
+ *           num_map_ranges if there is none
+ *********************************************************/
+static int find_range(int addr)
+{
+   int lo = 0;
+   int hi = num_map_ranges;
+
+   while (lo < hi)
+   {
+      int mid = (lo + hi) / 2;
+
+      if (map_ranges[mid].last_addr < addr)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return lo;
+}
+
+
+/**********************************************************
+ * Function: next_segment()
+ *
+ * Description:
+ *           Get the segment of a block of registers which
+ *           starts at addr and is handled by the same range
+ *           (or by the default callbacks)
+ *
+ * Returns:  number of registers in the segment, with the
+ *           range (NULL for registers outside all ranges)
+ *********************************************************/
+static int next_segment(int addr, int count, const map_range_t **range)
+{
+   int i = find_range(addr);
+   int end = addr + count;
+
+   if ((i < num_map_ranges) && (map_ranges[i].first_addr <= addr))
+   {  /* Inside range i */
+      *range = &map_ranges[i];
+      if (map_ranges[i].last_addr + 1 < end) end = map_ranges[i].last_addr + 1;
+   }
+   else
+   {  /* In the gap before range i */
+      *range = NULL;
+      if ((i < num_map_ranges) && (map_ranges[i].first_addr < end)) end = map_ranges[i].first_addr;
+   }
+
+   return end - addr;
+}
+
+
+/**********************************************************
+ * Function: map_read()
+ *
+ * Description:
+ *           "Read registers" callback of a unit with a
+ *           register directory, calls the callback of each
+ *           range accessed
+ *
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+static int map_read(int start_addr, int count, uint16_t *reg_vals)
+{
+   const map_range_t *range;
+   modbustcp_read_blk_cb_t read_cb;
+   int n;
+
+   while (count > 0)
+   {
+      n = next_segment(start_addr, count, &range);
+      read_cb = range ? range->read_cb : default_read_cb;
+
+      if ((read_cb == NULL) || ((*read_cb)(start_addr, n, reg_vals) != 0)) return -1;
+
+      start_addr += n;
+      reg_vals += n;
+      count -= n;
+   }
+
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: map_write()
+ *
+ * Description:
+ *           "Write registers" callback of a unit with a
+ *           register directory, calls the callback of each
+ *           range accessed
+ *
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+static int map_write(int start_addr, int count, const uint16_t *reg_vals)
+{
+   const map_range_t *range;
+   modbustcp_write_blk_cb_t write_cb;
+   int n;
+
+   while (count > 0)
+   {
+      n = next_segment(start_addr, count, &range);
+      write_cb = range ? range->write_cb : default_write_cb;
+
+      if ((write_cb == NULL) || ((*write_cb)(start_addr, n, reg_vals) != 0)) return -1;
+
+      start_addr += n;
+      reg_vals += n;
+      count -= n;
+   }
+
+   return 0;
+}
+
+
+/********************************************************************
+ *
+ * PUBLIC FUNCTION:
+ *           modbustcp_server_map()
+ *
+ * DESCRIPTION:
+ *           Adds a range of register addresses with its own
+ *           callback functions to the register directory
+ *
+ * PARAMETERS:
+ *           first_addr   - first register address of the range
+ *           last_addr    - last register address of the range
+ *           read_cb_fun  - function pointer to Read registers handler
+ *           write_cb_fun - function pointer to Write registers handler
+ *
+ * RETURN:   0 on success
+ *          -1 otherwise
+ *
+ *******************************************************************/
+int modbustcp_server_map(int first_addr, int last_addr, modbustcp_read_blk_cb_t read_cb_fun,
+                                                        modbustcp_write_blk_cb_t write_cb_fun)
+{
+   int i;
+
+   if ((num_map_ranges == MAX_MAP_RANGES) || (first_addr < 0) ||
+       (last_addr < first_addr) || (last_addr > MBSRV_MAX_ADDR))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid register range %d-%d", first_addr, last_addr);
+      return -1;
+   }
+
+   /* Ranges must not overlap */
+   i = find_range(first_addr);
+   if ((i < num_map_ranges) && (map_ranges[i].first_addr <= last_addr))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Register range %d-%d overlaps range %d-%d", first_addr,
+                             last_addr, map_ranges[i].first_addr, map_ranges[i].last_addr);
+      return -1;
+   }
+
+   memmove(&map_ranges[i+1], &map_ranges[i], (num_map_ranges - i) * sizeof(map_ranges[0]));
+   map_ranges[i].first_addr = first_addr;
+   map_ranges[i].last_addr = last_addr;
+   map_ranges[i].read_cb = read_cb_fun;
+   map_ranges[i].write_cb = write_cb_fun;
+   num_map_ranges++;
+
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_map_callbacks()
+ *
+ * Description:
+ *           If the register directory is used, make the
+ *           given callbacks the default ones for registers
+ *           outside its ranges and replace them by the
+ *           callbacks of the directory
+ *********************************************************/
+void mbsrv_map_callbacks(modbustcp_read_blk_cb_t *read_cb, modbustcp_write_blk_cb_t *write_cb)
+{
+   if (num_map_ranges == 0) return;
+
+   default_read_cb = *read_cb;
+   default_write_cb = *write_cb;
+   *read_cb = map_read;
+   *write_cb = map_write;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_map_check()
+ *
+ * Description:
+ *           Check if all registers of a block have a
+ *           callback function for the requested access
+ *
+ * Returns:  1 if all registers can be accessed
+ *           0 otherwise
+ *********************************************************/
+int mbsrv_map_check(int start_addr, int count, int write)
+{
+   const map_range_t *range;
+   int n;
+
+   if (num_map_ranges == 0) return 1;
+
+   while (count > 0)
+   {
+      n = next_segment(start_addr, count, &range);
+      if (range ? (write ? range->write_cb == NULL : range->read_cb == NULL)
+                : (write ? default_write_cb == NULL : default_read_cb == NULL))
+      {
+         return 0;
+      }
+      start_addr += n;
+      count -= n;
+   }
+
+   return 1;
+}
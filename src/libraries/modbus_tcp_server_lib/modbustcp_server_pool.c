@@ -0,0 +1,543 @@
+/*
+ * Modbus TCP server library
+ * - worker pool for registers with slow callback functions
+ *
+ * Requests accessing a slow address range are not handled by the
+ * server loop but queued for a small pool of worker threads, so a
+ * slow sensor or field bus read doesn't hold up the requests for
+ * other registers. Requests accessing the same slow range are
+ * handled one at a time, in the order they were received. The
+ * replies of completed requests are handed back to the server
+ * loop, which is woken up via an eventfd in its epoll set.
+ *
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "modbustcp_server_lib.h"
+#include "modbustcp_server_int.h"
+
+/* Max number of slow address ranges */
+#define MAX_SLOW_RANGES 8
+
+/* Max number of worker threads, requests on the same slow range
+ * are serialized so there is no use for more workers than ranges
+ */
+#define MAX_WORKERS 4
+
+/* Max number of requests queued or handled by the workers,
+ * further requests are answered with exception 0x06 (busy)
+ */
+#define MAX_JOBS 16
+
+
+/* Slow address range */
+typedef struct {
+   int first_addr;
+   int last_addr;
+} slow_range_t;
+
+/* State of a job slot */
+typedef enum {
+   JOB_FREE,
+   JOB_QUEUED,
+   JOB_RUNNING,
+   JOB_DONE
+} job_state_t;
+
+/* Request handled by a worker */
+typedef struct {
+   job_state_t state;
+   uint32_t ranges;                        /* slow ranges accessed, bit mask */
+   connection_t *conn;                     /* client connection, NULL for a
+                                              subscription read */
+   unsigned int conn_id;                   /* id of the connection */
+   uint64_t rx_time;                       /* time the request was received */
+   uint64_t rx_us;                         /* same, in us */
+   uint64_t start_us;                      /* time the worker started the request */
+   uint64_t end_us;                        /* time the worker completed the request */
+   int query_length;
+   uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+   int reply_length;
+   uint8_t reply[MODBUS_TCP_MAX_ADU_LENGTH];
+} job_t;
+
+/* Completion event registered in the epoll set */
+typedef struct {
+   mbsrv_ev_kind_t kind;                   /* MBSRV_EV_POOL */
+   int fd;                                 /* eventfd */
+} pool_event_t;
+
+static slow_range_t slow_ranges[MAX_SLOW_RANGES];
+static int num_slow_ranges = 0;
+
+static pthread_t workers[MAX_WORKERS];
+static int num_workers = 0;
+
+/* Job slots and queued jobs (oldest first) */
+static job_t jobs[MAX_JOBS];
+static job_t *queue[MAX_JOBS];
+static int queue_len = 0;
+
+/* Slow ranges accessed by running jobs, bit mask */
+static uint32_t busy_ranges = 0;
+
+/* Flag to terminate the workers */
+static int stopping = 0;
+
+/* Protects all of the above, signals new and completed jobs */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static pool_event_t pool_event = { MBSRV_EV_POOL, -1 };
+
+/* Set in the worker threads */
+static __thread int in_worker = 0;
+
+
+/**********************************************************
+ * Function: addr_ranges()
+ *
+ * Description:
+ *           Get the slow ranges overlapping a range of
+ *           register addresses
+ *
+ * Returns:  bit mask of slow ranges
+ *********************************************************/
+static uint32_t addr_ranges(int start_addr, int count)
+{
+   uint32_t ranges = 0;
+   int i;
+
+   for (i=0; i<num_slow_ranges; i++)
+   {
+      if ((start_addr <= slow_ranges[i].last_addr) &&
+          (start_addr + count - 1 >= slow_ranges[i].first_addr))
+      {
+         ranges |= 1 << i;
+      }
+   }
+
+   return ranges;
+}
+
+
+/**********************************************************
+ * Function: request_ranges()
+ *
+ * Description:
+ *           Get the slow ranges accessed by a request,
+ *           malformed requests are left to the server loop
+ *
+ * Returns:  bit mask of slow ranges
+ *********************************************************/
+static uint32_t request_ranges(const uint8_t *query, int query_length)
+{
+   const uint8_t *pdu = &query[MBAP_HEADER_LENGTH-1];
+   int pdu_length = query_length - MBAP_HEADER_LENGTH + 1;
+   int reg_addr;
+   int reg_cnt;
+
+   if (pdu_length < 6) return 0;
+
+   reg_addr = (int)pdu[2]<<8 | (int)pdu[3];
+   reg_cnt  = (int)pdu[4]<<8 | (int)pdu[5];
+
+   switch (pdu[1])
+   {
+      case 0x03:  /* FC Read Holding Registers */
+      case 0x04:  /* FC Read Input Registers */
+      case 0x10:  /* FC Write Multiple Registers */
+         return addr_ranges(reg_addr, reg_cnt);
+
+      case 0x06:  /* FC Write single register */
+         return addr_ranges(reg_addr, 1);
+
+      case 0x17:  /* FC Read/Write Multiple Registers */
+         if (pdu_length < 10) return 0;
+         return addr_ranges(reg_addr, reg_cnt) |
+                addr_ranges((int)pdu[6]<<8 | (int)pdu[7], (int)pdu[8]<<8 | (int)pdu[9]);
+   }
+
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: next_job()
+ *
+ * Description:
+ *           Find the oldest queued job which can be run:
+ *           its slow ranges are neither accessed by a running
+ *           job nor by an older queued job
+ *           (call with pool_lock held)
+ *
+ * Returns:  queue index of the job
+ *          -1 if there is none
+ *********************************************************/
+static int next_job(void)
+{
+   uint32_t blocked = busy_ranges;
+   int i;
+
+   for (i=0; i<queue_len; i++)
+   {
+      if ((queue[i]->ranges & blocked) == 0) return i;
+      blocked |= queue[i]->ranges;
+   }
+
+   return -1;
+}
+
+
+/**********************************************************
+ * Function: worker()
+ *
+ * Description:
+ *           Worker thread, handles queued requests until
+ *           the pool is stopped
+ *********************************************************/
+static void* worker(void *arg)
+{
+   job_t *job;
+   uint64_t one = 1;
+   int i;
+
+   in_worker = 1;
+
+   pthread_mutex_lock(&pool_lock);
+   while (1)
+   {
+      while (!stopping && ((i = next_job()) == -1))
+      {
+         pthread_cond_wait(&pool_cond, &pool_lock);
+      }
+      if (stopping) break;
+
+      /* Take the job from the queue */
+      job = queue[i];
+      queue_len--;
+      memmove(&queue[i], &queue[i+1], (queue_len - i) * sizeof(queue[0]));
+      job->state = JOB_RUNNING;
+      busy_ranges |= job->ranges;
+      pthread_mutex_unlock(&pool_lock);
+
+      job->start_us = mbsrv_time_us();
+      job->reply_length = mbsrv_process_request(job->query, job->query_length,
+                                                job->rx_time, job->reply);
+      job->end_us = mbsrv_time_us();
+
+      pthread_mutex_lock(&pool_lock);
+      job->state = JOB_DONE;
+      busy_ranges &= ~job->ranges;
+
+      /* Jobs waiting for these ranges can run now */
+      pthread_cond_broadcast(&pool_cond);
+
+      /* Wake up the server loop */
+      if (write(pool_event.fd, &one, sizeof(one)) == -1)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Worker failed to signal completion: %s", strerror(errno));
+      }
+   }
+   pthread_mutex_unlock(&pool_lock);
+
+   return NULL;
+}
+
+
+/********************************************************************
+ *
+ * PUBLIC FUNCTION:
+ *           modbustcp_server_slow()
+ *
+ * DESCRIPTION:
+ *           Marks a range of register addresses as slow, requests
+ *           accessing them are handled by worker threads
+ *
+ * PARAMETERS:
+ *           first_addr - first register address of the range
+ *           last_addr  - last register address of the range
+ *
+ * RETURN:   0 on success
+ *          -1 otherwise
+ *
+ *******************************************************************/
+int modbustcp_server_slow(int first_addr, int last_addr)
+{
+   if ((num_slow_ranges == MAX_SLOW_RANGES) || (first_addr < 0) ||
+       (last_addr < first_addr))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid slow range %d-%d", first_addr, last_addr);
+      return -1;
+   }
+
+   slow_ranges[num_slow_ranges].first_addr = first_addr;
+   slow_ranges[num_slow_ranges].last_addr = last_addr;
+   num_slow_ranges++;
+
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_pool_start()
+ *
+ * Description:
+ *           Start the worker threads (if there are slow
+ *           ranges) and add the completion event to the
+ *           epoll set of the server loop. Without workers,
+ *           all requests are handled by the server loop.
+ *
+ * Returns:  0 on success
+ *          -1 otherwise
+ *********************************************************/
+int mbsrv_pool_start(void)
+{
+   struct epoll_event ev;
+   sigset_t all_signals, old_signals;
+   int n;
+
+   if (num_slow_ranges == 0) return 0;
+
+   pool_event.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   ev.events = EPOLLIN;
+   ev.data.ptr = &pool_event;
+   if ((pool_event.fd == -1) || (epoll_ctl(mbsrv_epoll_fd, EPOLL_CTL_ADD, pool_event.fd, &ev) == -1))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Worker pool setup failed: %s", strerror(errno));
+      if (pool_event.fd != -1) close(pool_event.fd);
+      pool_event.fd = -1;
+      return -1;
+   }
+
+   /* Signals are left to the thread running the server loop */
+   sigfillset(&all_signals);
+   pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+
+   n = (num_slow_ranges < MAX_WORKERS) ? num_slow_ranges : MAX_WORKERS;
+   for (num_workers=0; num_workers<n; num_workers++)
+   {
+      if (pthread_create(&workers[num_workers], NULL, worker, NULL) != 0)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Failed to create worker thread");
+         break;
+      }
+   }
+
+   pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+   if (num_workers == 0)
+   {
+      close(pool_event.fd);
+      pool_event.fd = -1;
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_pool_submit()
+ *
+ * Description:
+ *           Queue a request accessing slow ranges for the
+ *           worker threads. A read of cached registers with
+ *           valid values is left to the server loop, unless
+ *           an older request on the same ranges is pending.
+ *           If all job slots are in use, the request is
+ *           answered with exception 0x06 (busy).
+ *           Without client connection, the request is a read
+ *           of subscribed registers.
+ *
+ * Returns:  0 if the request was queued or answered
+ *          -1 if the request is to be handled by the caller
+ *********************************************************/
+int mbsrv_pool_submit(connection_t *conn, const uint8_t *query, int query_length, 
+                      uint64_t rx_time, int cached)
+{
+   uint32_t ranges;
+   uint32_t pending;
+   job_t *job = NULL;
+   int i;
+
+   if (num_workers == 0) return -1;
+
+   ranges = request_ranges(query, query_length);
+   if (ranges == 0) return -1;
+
+   pthread_mutex_lock(&pool_lock);
+
+   pending = busy_ranges;
+   for (i=0; i<queue_len; i++) pending |= queue[i]->ranges;
+
+   if (cached && !(ranges & pending) &&
+       ((query[7] == 0x03) || (query[7] == 0x04)) &&
+       mbsrv_cache_hit((int)query[8]<<8 | query[9], (int)query[10]<<8 | query[11], rx_time))
+   {
+      pthread_mutex_unlock(&pool_lock);
+      return -1;
+   }
+
+   for (i=0; i<MAX_JOBS; i++)
+   {
+      if (jobs[i].state == JOB_FREE)
+      {
+         job = &jobs[i];
+         break;
+      }
+   }
+
+   if (job == NULL)
+   {
+      pthread_mutex_unlock(&pool_lock);
+      if (conn == NULL)
+      {  /* Subscription read is retried later */
+         mbsrv_sub_scan_done(query, NULL, 0);
+         return 0;
+      }
+      mbsrv_send_exception(conn, (uint16_t)query[0]<<8 | query[1], query[6], query[7],
+                           MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+      mbsrv_trace_request(conn->id, query, query_length, conn->rx_us,
+                          MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+      return 0;
+   }
+
+   job->state = JOB_QUEUED;
+   job->ranges = ranges;
+   job->conn = conn;
+   job->conn_id = conn ? conn->id : 0;
+   job->rx_time = rx_time;
+   job->rx_us = conn ? conn->rx_us : mbsrv_time_us();
+   job->query_length = query_length;
+   memcpy(job->query, query, query_length);
+   queue[queue_len++] = job;
+   if (conn) conn->in_flight++;
+
+   pthread_cond_signal(&pool_cond);
+   pthread_mutex_unlock(&pool_lock);
+
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_pool_handle_event()
+ *
+ * Description:
+ *           Queue the replies of completed jobs for their
+ *           clients (if still connected) or pass them to the
+ *           subscriptions, and free the jobs
+ *********************************************************/
+void mbsrv_pool_handle_event(void)
+{
+   uint64_t count;
+   int i;
+
+   if (read(pool_event.fd, &count, sizeof(count)) == -1) return;
+
+   pthread_mutex_lock(&pool_lock);
+   for (i=0; i<MAX_JOBS; i++)
+   {
+      job_t *job = &jobs[i];
+
+      if (job->state != JOB_DONE) continue;
+
+      mbsrv_stats_request(job->query, job->query_length, job->rx_us, job->start_us, job->end_us);
+
+      if (job->conn == NULL)
+      {
+         mbsrv_sub_scan_done(job->query, job->reply, job->reply_length);
+      }
+      else if ((job->conn->fd != -1) && (job->conn->id == job->conn_id))
+      {
+         mbsrv_send_reply(job->conn, job->reply, job->reply_length);
+         mbsrv_trace_request(job->conn_id, job->query, job->query_length, job->rx_us,
+                             (job->reply[MBAP_HEADER_LENGTH] & 0x80) ? job->reply[MBAP_HEADER_LENGTH+1] : 0);
+         job->conn->in_flight--;
+      }
+      job->state = JOB_FREE;
+   }
+   pthread_mutex_unlock(&pool_lock);
+}
+
+
+/**********************************************************
+ * Function: mbsrv_pool_worker()
+ *
+ * Description:
+ *           Check if the calling thread is a worker
+ *
+ * Returns:  1 in a worker thread, 0 otherwise
+ *********************************************************/
+int mbsrv_pool_worker(void)
+{
+   return in_worker;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_pool_stop()
+ *
+ * Description:
+ *           Stop the worker threads, after they completed
+ *           the requests they are handling, and drop all
+ *           other jobs
+ *********************************************************/
+void mbsrv_pool_stop(void)
+{
+   int i;
+
+   if (num_workers == 0) return;
+
+   pthread_mutex_lock(&pool_lock);
+   stopping = 1;
+   pthread_cond_broadcast(&pool_cond);
+   pthread_mutex_unlock(&pool_lock);
+
+   for (i=0; i<num_workers; i++)
+   {
+      pthread_join(workers[i], NULL);
+   }
+   num_workers = 0;
+
+   for (i=0; i<MAX_JOBS; i++)
+   {
+      jobs[i].state = JOB_FREE;
+   }
+   queue_len = 0;
+   busy_ranges = 0;
+   stopping = 0;
+
+   close(pool_event.fd);
+   pool_event.fd = -1;
+}
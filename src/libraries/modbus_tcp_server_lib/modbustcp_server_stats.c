@@ -0,0 +1,475 @@
+/*
+ * Modbus TCP server library
+ * - latency statistics: histograms and slowest requests
+ *
+ * Each request handled by this process is timed in two phases:
+ * receive (from reading the request off the socket until its
+ * handling starts, i.e. waiting behind other requests or for a
+ * worker) and callback (the register access itself, including the
+ * cache). The phases are recorded in histograms per function code
+ * and per named address range. The time from queueing a reply until
+ * it is written to the socket is recorded for all requests together,
+ * as it only depends on the client. The slowest requests are kept
+ * with their details.
+ *
+ * On SIGUSR1 the statistics are written to MODBUSTCP_SERVER_STATS_FILE
+ * (formatted with the TCP port number), without stopping the server.
+ *
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <syslog.h>
+
+#include "modbustcp_server_lib.h"
+#include "modbustcp_server_int.h"
+
+/* Number of histogram buckets, upper bounds (in us) of all but the last */
+#define NUM_BUCKETS 16
+static const uint32_t bucket_limits[NUM_BUCKETS-1] = {
+   100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000,
+   100000, 200000, 500000, 1000000, 2000000, 5000000
+};
+static const char *bucket_names[NUM_BUCKETS] = {
+   "<0.1ms", "<0.2ms", "<0.5ms", "<1ms", "<2ms", "<5ms", "<10ms", "<20ms", "<50ms",
+   "<100ms", "<200ms", "<500ms", "<1s", "<2s", "<5s", ">=5s"
+};
+
+/* Max number of named address ranges */
+#define MAX_STATS_RANGES 8
+
+/* Max length of an address range name */
+#define RANGE_NAME_LEN 16
+
+/* Number of slowest requests kept */
+#define MAX_SLOWEST 16
+
+
+/* Latency histogram */
+typedef struct {
+   unsigned long count;
+   uint64_t sum;                           /* in us */
+   uint32_t max;                           /* in us */
+   unsigned long buckets[NUM_BUCKETS];
+} histogram_t;
+
+/* Latencies of the request phases */
+typedef struct {
+   histogram_t receive;
+   histogram_t callback;
+} req_stats_t;
+
+/* Named address range */
+typedef struct {
+   int first_addr;
+   int last_addr;
+   char name[RANGE_NAME_LEN];
+   req_stats_t stats;
+} stats_range_t;
+
+/* Details of a slow request */
+typedef struct {
+   time_t time;                            /* wall clock time of completion */
+   uint8_t unit;
+   uint8_t function;
+   int addr;
+   int count;
+   uint32_t receive;                       /* in us */
+   uint32_t callback;                      /* in us */
+} slow_request_t;
+
+/* Function codes with their own statistics, all others are
+ * recorded together in the entry after the last one
+ */
+static const uint8_t stats_functions[] = { 0x03, 0x04, 0x06, 0x10, 0x17 };
+#define NUM_FUNCTIONS (sizeof(stats_functions))
+
+static req_stats_t function_stats[NUM_FUNCTIONS + 1];
+static stats_range_t stats_ranges[MAX_STATS_RANGES];
+static int num_stats_ranges = 0;
+static histogram_t reply_stats;
+
+/* Slowest requests, unsorted */
+static slow_request_t slowest[MAX_SLOWEST];
+static int num_slowest = 0;
+
+static time_t stats_start;
+static int stats_port;
+static volatile sig_atomic_t dump_requested = 0;
+
+
+/**********************************************************
+ * Function: add_sample()
+ *
+ * Description:
+ *           Record a latency in a histogram
+ *********************************************************/
+static void add_sample(histogram_t *h, uint32_t us)
+{
+   int i = 0;
+
+   while ((i < NUM_BUCKETS-1) && (us >= bucket_limits[i])) i++;
+
+   h->buckets[i]++;
+   h->count++;
+   h->sum += us;
+   if (us > h->max) h->max = us;
+}
+
+
+/**********************************************************
+ * Function: request_block()
+ *
+ * Description:
+ *           Get the register block accessed by a request
+ *           (for FC 0x17 the read block, the write block is
+ *           at index 1)
+ *
+ * Returns:  number of registers, 0 if there is no block
+ *********************************************************/
+static int request_block(const uint8_t *query, int query_length, int index, int *addr)
+{
+   const uint8_t *p = &query[MBAP_HEADER_LENGTH + 1 + 4*index];
+
+   if (query_length < MBAP_HEADER_LENGTH + 5 + 4*index) return 0;
+
+   switch (query[MBAP_HEADER_LENGTH])
+   {
+      case 0x06:
+         if (index > 0) return 0;
+         *addr = (p[0] << 8) | p[1];
+         return 1;
+
+      case 0x03:
+      case 0x04:
+      case 0x10:
+      case 0x17:
+         if ((index > 0) && (query[MBAP_HEADER_LENGTH] != 0x17)) return 0;
+         *addr = (p[0] << 8) | p[1];
+         return (p[2] << 8) | p[3];
+
+      default:
+         return 0;
+   }
+}
+
+
+/**********************************************************
+ * Function: range_accessed()
+ *
+ * Description:
+ *           Check if a request accesses a named address range
+ *
+ * Returns:  1 if it does, 0 otherwise
+ *********************************************************/
+static int range_accessed(const stats_range_t *range, const uint8_t *query, int query_length)
+{
+   int addr = 0;
+   int count;
+   int i;
+
+   for (i=0; i<2; i++)
+   {
+      count = request_block(query, query_length, i, &addr);
+      if ((count > 0) && (addr <= range->last_addr) && (addr + count - 1 >= range->first_addr))
+      {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+
+/********************************************************************
+ *
+ * PUBLIC FUNCTION:
+ *           modbustcp_server_stats_range()
+ *
+ * DESCRIPTION:
+ *           Adds a named address range to the latency statistics
+ *
+ * PARAMETERS:
+ *           first_addr - first register address of the range
+ *           last_addr  - last register address of the range
+ *           name       - name of the range in the statistics
+ *
+ * RETURN:   0 on success
+ *          -1 otherwise
+ *
+ *******************************************************************/
+int modbustcp_server_stats_range(int first_addr, int last_addr, const char *name)
+{
+   stats_range_t *range;
+
+   if ((num_stats_ranges == MAX_STATS_RANGES) || (first_addr < 0) ||
+       (last_addr < first_addr) || (last_addr > MBSRV_MAX_ADDR))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid statistics range %d-%d", first_addr, last_addr);
+      return -1;
+   }
+
+   range = &stats_ranges[num_stats_ranges++];
+   range->first_addr = first_addr;
+   range->last_addr = last_addr;
+   snprintf(range->name, sizeof(range->name), "%s", name);
+
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_stats_request()
+ *
+ * Description:
+ *           Record the latencies of a request handled by
+ *           this process (called by the server loop only)
+ *
+ * Parameters:
+ *           query        - request frame
+ *           query_length - length of the request frame
+ *           rx_us        - time the request was received
+ *           start_us     - time its handling started
+ *           end_us       - time its reply was ready
+ *********************************************************/
+void mbsrv_stats_request(const uint8_t *query, int query_length,
+                         uint64_t rx_us, uint64_t start_us, uint64_t end_us)
+{
+   uint32_t receive = (start_us > rx_us) ? (uint32_t)(start_us - rx_us) : 0;
+   uint32_t callback = (uint32_t)(end_us - start_us);
+   slow_request_t *slow;
+   unsigned int f;
+   int i;
+
+   for (f=0; (f < NUM_FUNCTIONS) && (stats_functions[f] != query[MBAP_HEADER_LENGTH]); f++);
+   add_sample(&function_stats[f].receive, receive);
+   add_sample(&function_stats[f].callback, callback);
+
+   for (i=0; i<num_stats_ranges; i++)
+   {
+      if (range_accessed(&stats_ranges[i], query, query_length))
+      {
+         add_sample(&stats_ranges[i].stats.receive, receive);
+         add_sample(&stats_ranges[i].stats.callback, callback);
+      }
+   }
+
+   /* Keep the request if it's among the slowest */
+   if (num_slowest < MAX_SLOWEST)
+   {
+      slow = &slowest[num_slowest++];
+   }
+   else
+   {
+      slow = &slowest[0];
+      for (i=1; i<MAX_SLOWEST; i++)
+      {
+         if (slowest[i].receive + slowest[i].callback < slow->receive + slow->callback) slow = &slowest[i];
+      }
+      if (receive + callback <= slow->receive + slow->callback) return;
+   }
+
+   slow->time = time(NULL);
+   slow->unit = query[MBAP_HEADER_LENGTH-1];
+   slow->function = query[MBAP_HEADER_LENGTH];
+   slow->addr = 0;
+   slow->count = request_block(query, query_length, 0, &slow->addr);
+   slow->receive = receive;
+   slow->callback = callback;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_stats_reply()
+ *
+ * Description:
+ *           Record the time replies queued at queued_us took
+ *           to be written to the socket
+ *********************************************************/
+void mbsrv_stats_reply(uint64_t queued_us)
+{
+   add_sample(&reply_stats, (uint32_t)(mbsrv_time_us() - queued_us));
+}
+
+
+/**********************************************************
+ * Function: compare_slow()
+ *
+ * Description:
+ *           qsort() comparison, slowest request first
+ *********************************************************/
+static int compare_slow(const void *a, const void *b)
+{
+   const slow_request_t *sa = a;
+   const slow_request_t *sb = b;
+
+   return (int)(sb->receive + sb->callback > sa->receive + sa->callback) -
+          (int)(sb->receive + sb->callback < sa->receive + sa->callback);
+}
+
+
+/**********************************************************
+ * Function: write_histogram()
+ *
+ * Description:
+ *           Write one histogram line of the statistics
+ *********************************************************/
+static void write_histogram(FILE *f, const char *name, const char *phase, const histogram_t *h)
+{
+   int i;
+
+   if (h->count == 0) return;
+
+   fprintf(f, "%-16s %-8s %8lu %9.1f %9.1f ", name, phase, h->count,
+              (double)h->sum / h->count / 1000, (double)h->max / 1000);
+   for (i=0; i<NUM_BUCKETS; i++)
+   {
+      fprintf(f, " %7lu", h->buckets[i]);
+   }
+   fprintf(f, "\n");
+}
+
+
+/**********************************************************
+ * Function: write_stats()
+ *
+ * Description:
+ *           Write the statistics to the statistics file
+ *********************************************************/
+static void write_stats(void)
+{
+   char file_name[64];
+   char name[RANGE_NAME_LEN + 8];
+   char time_str[32];
+   slow_request_t sorted[MAX_SLOWEST];
+   unsigned long hits, coalesced, misses;
+   unsigned int f;
+   FILE *fp;
+   int i;
+
+   snprintf(file_name, sizeof(file_name), MODBUSTCP_SERVER_STATS_FILE, stats_port);
+   fp = fopen(file_name, "w");
+   if (fp == NULL)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Failed to write statistics to %s: %s", file_name, strerror(errno));
+      return;
+   }
+
+   fprintf(fp, "Modbus TCP server statistics, port %d, collected for %ld s\n\n",
+               stats_port, (long)(time(NULL) - stats_start));
+
+   fprintf(fp, "%-16s %-8s %8s %9s %9s ", "Requests", "Phase", "Count", "Avg ms", "Max ms");
+   for (i=0; i<NUM_BUCKETS; i++)
+   {
+      fprintf(fp, " %7s", bucket_names[i]);
+   }
+   fprintf(fp, "\n");
+
+   for (f=0; f<=NUM_FUNCTIONS; f++)
+   {
+      if (f < NUM_FUNCTIONS)
+         snprintf(name, sizeof(name), "FC 0x%02X", stats_functions[f]);
+      else
+         snprintf(name, sizeof(name), "FC other");
+      write_histogram(fp, name, "receive", &function_stats[f].receive);
+      write_histogram(fp, name, "callback", &function_stats[f].callback);
+   }
+   for (i=0; i<num_stats_ranges; i++)
+   {
+      write_histogram(fp, stats_ranges[i].name, "receive", &stats_ranges[i].stats.receive);
+      write_histogram(fp, stats_ranges[i].name, "callback", &stats_ranges[i].stats.callback);
+   }
+   write_histogram(fp, "All", "reply", &reply_stats);
+
+   modbustcp_server_cache_stats(&hits, &coalesced, &misses);
+   fprintf(fp, "\nCache: %lu hits, %lu coalesced, %lu misses\n", hits, coalesced, misses);
+
+   fprintf(fp, "\nSlowest requests:\n");
+   fprintf(fp, "%-19s %4s %4s %5s %5s %11s %11s\n", "Time", "Unit", "FC", "Addr", "Count",
+               "Receive ms", "Callback ms");
+   memcpy(sorted, slowest, num_slowest * sizeof(sorted[0]));
+   qsort(sorted, num_slowest, sizeof(sorted[0]), compare_slow);
+   for (i=0; i<num_slowest; i++)
+   {
+      strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&sorted[i].time));
+      fprintf(fp, "%-19s %4d 0x%02X %5d %5d %11.1f %11.1f\n", time_str, sorted[i].unit,
+                  sorted[i].function, sorted[i].addr, sorted[i].count,
+                  (double)sorted[i].receive / 1000, (double)sorted[i].callback / 1000);
+   }
+
+   fclose(fp);
+   syslog(LOG_DAEMON | LOG_NOTICE, "Statistics written to %s", file_name);
+}
+
+
+/**********************************************************
+ * Function: request_dump()
+ *
+ * Description:
+ *           SIGUSR1 handler, the statistics are written by
+ *           the server loop
+ *********************************************************/
+static void request_dump(int sig)
+{
+   dump_requested = 1;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_stats_start()
+ *
+ * Description:
+ *           Start collecting statistics and install the
+ *           SIGUSR1 handler (without SA_RESTART, so the
+ *           server loop is woken up)
+ *********************************************************/
+void mbsrv_stats_start(int tcp_port)
+{
+   struct sigaction sa;
+
+   stats_port = tcp_port;
+   stats_start = time(NULL);
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = request_dump;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGUSR1, &sa, NULL);
+}
+
+
+/**********************************************************
+ * Function: mbsrv_stats_check()
+ *
+ * Description:
+ *           Write the statistics if requested by SIGUSR1
+ *********************************************************/
+void mbsrv_stats_check(void)
+{
+   if (!dump_requested) return;
+
+   dump_requested = 0;
+   write_stats();
+}
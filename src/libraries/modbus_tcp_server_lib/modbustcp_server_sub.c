@@ -0,0 +1,366 @@
+/*
+ * Modbus TCP server library
+ * - report by exception: subscriptions to register changes
+ *
+ * A client subscribes to a block of registers with the user defined
+ * function code MODBUSTCP_FC_SUBSCRIBE. The server then reads the
+ * registers periodically (via the cache and the worker pool like any
+ * other request) and sends a MODBUSTCP_FC_NOTIFY frame over the same
+ * connection whenever a value moved by more than the deadband since
+ * it was last reported. Clients no longer need to poll registers which
+ * rarely change, and the polling load of the server only depends on
+ * the number of subscriptions, not on the number of clients.
+ *
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "modbustcp_server_lib.h"
+#include "modbustcp_server_int.h"
+
+/* Max number of subscriptions (of all clients) */
+#define MAX_SUBSCRIPTIONS 32
+
+/* Interval (in ms) the subscribed registers are read in. Registers
+ * which take longer to read are read less often, so that reading
+ * them takes at most 1/SCAN_LOAD_FACTOR of the time.
+ */
+#define SCAN_INTERVAL    500
+#define SCAN_LOAD_FACTOR 10
+
+/* Length of a subscribe request frame */
+#define SUBSCRIBE_LENGTH 14
+
+
+/* Subscription */
+typedef struct {
+   int used;
+   int scanning;                           /* read of the registers in progress */
+   connection_t *conn;                     /* client connection */
+   unsigned int conn_id;                   /* id of the connection */
+   uint16_t tid;                           /* transaction id of the subscribe request */
+   uint8_t unit;
+   int addr;
+   int count;
+   int deadband;
+   int valid;                              /* values were reported */
+   uint16_t vals[MODBUS_MAX_READ_REGISTERS];  /* last values reported */
+   uint64_t last_scan;                     /* time of last read (in ms) */
+   int interval;                           /* read interval (in ms) */
+} sub_t;
+
+static sub_t subs[MAX_SUBSCRIPTIONS];
+
+
+/**********************************************************
+ * Function: conn_alive()
+ *
+ * Description:
+ *           Check if the client of a subscription is still
+ *           connected and accepting replies
+ *
+ * Returns:  1 if connected, 0 otherwise
+ *********************************************************/
+static int conn_alive(const sub_t *sub)
+{
+   return (sub->conn->fd != -1) && (sub->conn->id == sub->conn_id) && !sub->conn->closing;
+}
+
+
+/**********************************************************
+ * Function: notify()
+ *
+ * Description:
+ *           Report the values of a subscription to its
+ *           client if any of them changed by more than the
+ *           deadband. If the reply buffer is full, the
+ *           values are reported after the next read.
+ *********************************************************/
+static void notify(sub_t *sub, const uint16_t *vals)
+{
+   uint8_t frame[MODBUS_TCP_MAX_ADU_LENGTH];
+   int frame_length = MBAP_HEADER_LENGTH + 4 + 2*sub->count;
+   int changed = !sub->valid;
+   int i;
+
+   for (i=0; i<sub->count && !changed; i++)
+   {
+      if (abs((int)vals[i] - (int)sub->vals[i]) > sub->deadband) changed = 1;
+   }
+   if (!changed) return;
+
+   if (mbsrv_tx_free(sub->conn) < frame_length) return;
+
+   frame[0] = sub->tid >> 8;
+   frame[1] = sub->tid & 0xFF;
+   frame[2] = 0;
+   frame[3] = 0;
+   frame[4] = (frame_length - MBAP_HEADER_LENGTH + 1) >> 8;
+   frame[5] = (frame_length - MBAP_HEADER_LENGTH + 1) & 0xFF;
+   frame[6] = sub->unit;
+   frame[7] = MODBUSTCP_FC_NOTIFY;
+   frame[8] = sub->addr >> 8;
+   frame[9] = sub->addr & 0xFF;
+   frame[10] = 2*sub->count;
+   for (i=0; i<sub->count; i++)
+   {
+      frame[11+2*i] = vals[i] >> 8;
+      frame[12+2*i] = vals[i] & 0xFF;
+   }
+   mbsrv_send_reply(sub->conn, frame, frame_length);
+
+   memcpy(sub->vals, vals, sub->count * sizeof(vals[0]));
+   sub->valid = 1;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_sub_active()
+ *
+ * Description:
+ *           Check if a connection has subscriptions
+ *
+ * Returns:  1 if it has, 0 otherwise
+ *********************************************************/
+int mbsrv_sub_active(const connection_t *conn)
+{
+   int i;
+
+   for (i=0; i<MAX_SUBSCRIPTIONS; i++)
+   {
+      if (subs[i].used && (subs[i].conn == conn) && (subs[i].conn_id == conn->id))
+         return 1;
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_sub_request()
+ *
+ * Description:
+ *           Handle a subscribe request. A subscription is
+ *           replaced by a new one of the same client for the
+ *           same start address, a register count of 0 just
+ *           cancels it. The reply is an echo of the start
+ *           address and count.
+ *
+ * Returns:  0 if the request was handled
+ *          -1 if it's not a subscribe request
+ *********************************************************/
+int mbsrv_sub_request(connection_t *conn, const uint8_t *query, int query_length)
+{
+   uint16_t tid = (query[0] << 8) | query[1];
+   uint8_t unit = query[MBAP_HEADER_LENGTH-1];
+   uint8_t reply[MBAP_HEADER_LENGTH + 5];
+   sub_t *sub = NULL;
+   int addr, count;
+   int i;
+
+   if (query[MBAP_HEADER_LENGTH] != MODBUSTCP_FC_SUBSCRIBE) return -1;
+
+   if (query_length != SUBSCRIBE_LENGTH)
+   {
+      mbsrv_send_exception(conn, tid, unit, MODBUSTCP_FC_SUBSCRIBE, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+      return 0;
+   }
+
+   addr  = (query[8] << 8) | query[9];
+   count = (query[10] << 8) | query[11];
+
+   if (count > MODBUS_MAX_READ_REGISTERS)
+   {
+      mbsrv_send_exception(conn, tid, unit, MODBUSTCP_FC_SUBSCRIBE, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+      return 0;
+   }
+   if (addr + count - 1 > MBSRV_MAX_ADDR)
+   {
+      mbsrv_send_exception(conn, tid, unit, MODBUSTCP_FC_SUBSCRIBE, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+      return 0;
+   }
+
+   /* Cancel the subscription of this client for the same registers */
+   for (i=0; i<MAX_SUBSCRIPTIONS; i++)
+   {
+      if (subs[i].used && (subs[i].conn == conn) && (subs[i].conn_id == conn->id) &&
+          (subs[i].unit == unit) && (subs[i].addr == addr))
+      {
+         subs[i].used = 0;
+      }
+   }
+
+   if (count > 0)
+   {
+      /* Slots with a read in progress are reused after its completion */
+      for (i=0; i<MAX_SUBSCRIPTIONS; i++)
+      {
+         if (!subs[i].used && !subs[i].scanning)
+         {
+            sub = &subs[i];
+            break;
+         }
+      }
+      if (sub == NULL)
+      {
+         mbsrv_send_exception(conn, tid, unit, MODBUSTCP_FC_SUBSCRIBE, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+         return 0;
+      }
+
+      sub->used = 1;
+      sub->conn = conn;
+      sub->conn_id = conn->id;
+      sub->tid = tid;
+      sub->unit = unit;
+      sub->addr = addr;
+      sub->count = count;
+      sub->deadband = (query[12] << 8) | query[13];
+      sub->valid = 0;
+      sub->last_scan = 0;
+      sub->interval = SCAN_INTERVAL;
+   }
+
+   /* Reply with start address and count, the first notification
+    * with the current values follows when they have been read
+    */
+   memcpy(reply, query, MBAP_HEADER_LENGTH + 5);
+   reply[5] = 6;
+   mbsrv_send_reply(conn, reply, sizeof(reply));
+
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_sub_scan()
+ *
+ * Description:
+ *           Read the registers of the subscriptions which
+ *           are due and drop the subscriptions of closed
+ *           connections
+ *
+ * Returns:  time (in ms) until the next read is due
+ *          -1 if there are no subscriptions
+ *********************************************************/
+int mbsrv_sub_scan(void)
+{
+   uint8_t query[MBAP_HEADER_LENGTH + 5];
+   uint64_t now = mbsrv_time_ms();
+   int next = -1;
+   int wait;
+   int i;
+
+   for (i=0; i<MAX_SUBSCRIPTIONS; i++)
+   {
+      sub_t *sub = &subs[i];
+
+      if (!sub->used) continue;
+
+      if (!conn_alive(sub))
+      {
+         sub->used = 0;
+         continue;
+      }
+
+      if (!sub->scanning && (now - sub->last_scan >= sub->interval))
+      {
+         /* Read request with the subscription index as transaction id */
+         query[0] = 0;
+         query[1] = i;
+         query[2] = 0;
+         query[3] = 0;
+         query[4] = 0;
+         query[5] = 6;
+         query[6] = sub->unit;
+         query[7] = 0x03;
+         query[8] = sub->addr >> 8;
+         query[9] = sub->addr & 0xFF;
+         query[10] = sub->count >> 8;
+         query[11] = sub->count & 0xFF;
+
+         sub->scanning = 1;
+         sub->last_scan = now;
+         mbsrv_scan_request(query, sizeof(query));
+      }
+
+      /* The subscription may be gone after a failed read */
+      if (!sub->used || sub->scanning) continue;
+
+      wait = (int)((int64_t)(sub->last_scan + sub->interval) - (int64_t)now);
+      if (wait < 0) wait = 0;
+      if ((next == -1) || (wait < next)) next = wait;
+   }
+
+   return next;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_sub_scan_done()
+ *
+ * Description:
+ *           Handle the reply of a read started by
+ *           mbsrv_sub_scan(), reply NULL if the read could
+ *           not be started (worker pool busy). The values
+ *           are reported if they changed, an exception ends
+ *           the subscription (reported to the client with
+ *           the notify function code, after a later read if
+ *           the reply buffer is full).
+ *********************************************************/
+void mbsrv_sub_scan_done(const uint8_t *query, const uint8_t *reply, int reply_length)
+{
+   sub_t *sub = &subs[query[1] % MAX_SUBSCRIPTIONS];
+   uint16_t vals[MODBUS_MAX_READ_REGISTERS];
+   int read_time;
+   int i;
+
+   sub->scanning = 0;
+   if (!sub->used || !conn_alive(sub) || (reply == NULL)) return;
+
+   read_time = mbsrv_time_ms() - sub->last_scan;
+   sub->interval = (SCAN_LOAD_FACTOR*read_time > SCAN_INTERVAL) ? SCAN_LOAD_FACTOR*read_time : SCAN_INTERVAL;
+
+   if (reply[7] & 0x80)
+   {
+      /* Room of the reply buffer may be reserved for replies in
+       * progress, report the exception after the next read then
+       */
+      if (mbsrv_tx_free(sub->conn) < MBAP_HEADER_LENGTH + 2) return;
+
+      syslog(LOG_DAEMON | LOG_NOTICE, "Subscription to registers %d-%d of unit %d ended by exception %d",
+                                      sub->addr, sub->addr + sub->count - 1, sub->unit, reply[8]);
+      mbsrv_send_exception(sub->conn, sub->tid, sub->unit, MODBUSTCP_FC_NOTIFY, reply[8]);
+      sub->used = 0;
+      return;
+   }
+
+   if (reply_length != MBAP_HEADER_LENGTH + 2 + 2*sub->count) return;
+
+   for (i=0; i<sub->count; i++)
+   {
+      vals[i] = (reply[9+2*i] << 8) | reply[10+2*i];
+   }
+   notify(sub, vals);
+}
@@ -0,0 +1,248 @@
+/*
+ * Modbus TCP server library
+ * - request trace: capture of the requests for replay
+ *
+ * While tracing is switched on (SIGUSR2 toggles it), every request
+ * answered by this process is appended to MODBUSTCP_SERVER_TRACE_FILE
+ * (formatted with the TCP port number) in the binary format described
+ * in modbustcp_server_lib.h: the time it was received, the connection
+ * it came from, unit, PDU (function code, addresses and written
+ * values), the time until its reply was ready and the exception code
+ * of the reply. Such a trace of real traffic can be replayed against a
+ * server with geomon_modbustcp_replay.
+ *
+ * Requests forwarded to a backend server are traced by the backend,
+ * subscriptions and the reads of subscribed registers are not traced.
+ *
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/time.h>
+
+#include "modbustcp_server_lib.h"
+#include "modbustcp_server_int.h"
+
+/* Max interval (in us) buffered records are written to the file in */
+#define FLUSH_INTERVAL 1000000
+
+static FILE *trace_fp = NULL;
+static char trace_name[64];
+static uint64_t trace_start_us;            /* monotonic time of the trace start */
+static uint64_t last_flush_us;
+static long trace_size;
+static int trace_port;
+static volatile sig_atomic_t toggle_requested = 0;
+
+
+/**********************************************************
+ * Function: put_le()
+ *
+ * Description:
+ *           Store a value little endian in n bytes
+ *********************************************************/
+static void put_le(uint8_t *p, uint64_t val, int n)
+{
+   int i;
+
+   for (i=0; i<n; i++)
+   {
+      p[i] = val & 0xFF;
+      val >>= 8;
+   }
+}
+
+
+/**********************************************************
+ * Function: trace_open()
+ *
+ * Description:
+ *           Create the trace file and write its header
+ *********************************************************/
+static void trace_open(void)
+{
+   uint8_t header[MODBUSTCP_TRACE_HEADER_LENGTH];
+   struct timeval tv;
+
+   snprintf(trace_name, sizeof(trace_name), MODBUSTCP_SERVER_TRACE_FILE, trace_port);
+   trace_fp = fopen(trace_name, "wb");
+   if (trace_fp == NULL)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Failed to create trace file %s: %s", trace_name, strerror(errno));
+      return;
+   }
+
+   gettimeofday(&tv, NULL);
+   trace_start_us = mbsrv_time_us();
+   last_flush_us = trace_start_us;
+
+   memset(header, 0, sizeof(header));
+   memcpy(header, MODBUSTCP_TRACE_MAGIC, 8);
+   put_le(&header[8], (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec, 8);
+   put_le(&header[16], trace_port, 2);
+   fwrite(header, sizeof(header), 1, trace_fp);
+   trace_size = sizeof(header);
+
+   syslog(LOG_DAEMON | LOG_NOTICE, "Tracing requests to %s", trace_name);
+}
+
+
+/**********************************************************
+ * Function: trace_close()
+ *
+ * Description:
+ *           Stop tracing and close the trace file
+ *********************************************************/
+static void trace_close(void)
+{
+   if (fclose(trace_fp) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Failed to write trace file %s: %s", trace_name, strerror(errno));
+   }
+   else
+   {
+      syslog(LOG_DAEMON | LOG_NOTICE, "Trace of %ld bytes written to %s", trace_size, trace_name);
+   }
+   trace_fp = NULL;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_trace_request()
+ *
+ * Description:
+ *           Record a request answered by this process if
+ *           tracing is on (called by the server loop only)
+ *
+ * Parameters:
+ *           conn_id        - id of the client connection
+ *           query          - request frame
+ *           query_length   - length of the request frame
+ *           rx_us          - time the request was received
+ *           exception_code - exception code of the reply,
+ *                            0 for a normal reply
+ *********************************************************/
+void mbsrv_trace_request(unsigned int conn_id, const uint8_t *query, int query_length,
+                         uint64_t rx_us, uint8_t exception_code)
+{
+   uint8_t record[MODBUSTCP_TRACE_RECORD_LENGTH];
+   int pdu_length = query_length - MBAP_HEADER_LENGTH;
+   uint64_t now;
+
+   if (trace_fp == NULL) return;
+
+   now = mbsrv_time_us();
+
+   /* Requests received before the trace started count from its start */
+   put_le(&record[0], (rx_us > trace_start_us) ? rx_us - trace_start_us : 0, 8);
+   put_le(&record[8], now - rx_us, 4);
+   put_le(&record[12], conn_id, 2);
+   record[14] = query[MBAP_HEADER_LENGTH-1];
+   record[15] = exception_code;
+   record[16] = pdu_length;
+
+   if ((fwrite(record, sizeof(record), 1, trace_fp) != 1) ||
+       (fwrite(&query[MBAP_HEADER_LENGTH], pdu_length, 1, trace_fp) != 1))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Failed to write trace file %s: %s", trace_name, strerror(errno));
+      trace_close();
+      return;
+   }
+   trace_size += sizeof(record) + pdu_length;
+
+   if (trace_size >= MODBUSTCP_SERVER_TRACE_MAX)
+   {
+      syslog(LOG_DAEMON | LOG_NOTICE, "Trace file %s reached its max size", trace_name);
+      trace_close();
+   }
+}
+
+
+/**********************************************************
+ * Function: request_toggle()
+ *
+ * Description:
+ *           SIGUSR2 handler, tracing is switched by the
+ *           server loop
+ *********************************************************/
+static void request_toggle(int sig)
+{
+   toggle_requested = 1;
+}
+
+
+/**********************************************************
+ * Function: mbsrv_trace_start()
+ *
+ * Description:
+ *           Install the SIGUSR2 handler (without SA_RESTART,
+ *           so the server loop is woken up). Tracing is off
+ *           until the first SIGUSR2.
+ *********************************************************/
+void mbsrv_trace_start(int tcp_port)
+{
+   struct sigaction sa;
+
+   trace_port = tcp_port;
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = request_toggle;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGUSR2, &sa, NULL);
+}
+
+
+/**********************************************************
+ * Function: mbsrv_trace_check()
+ *
+ * Description:
+ *           Switch tracing on or off if requested by SIGUSR2
+ *           and write the buffered records to the file once
+ *           in a while, so a trace is usable while it runs
+ *********************************************************/
+void mbsrv_trace_check(void)
+{
+   uint64_t now;
+
+   if (toggle_requested)
+   {
+      toggle_requested = 0;
+      if (trace_fp == NULL)
+         trace_open();
+      else
+         trace_close();
+   }
+
+   if (trace_fp == NULL) return;
+
+   now = mbsrv_time_us();
+   if (now - last_flush_us >= FLUSH_INTERVAL)
+   {
+      fflush(trace_fp);
+      last_flush_us = now;
+   }
+}
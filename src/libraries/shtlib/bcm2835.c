@@ -188,6 +188,27 @@ void bcm2835_gpio_set_eds(uint8_t pin)
     bcm2835_peri_write(paddr, value);
 }
 
+// Read the levels of several pins of the first bank at once
+uint32_t bcm2835_gpio_lev_multi(uint32_t mask)
+{
+    volatile uint32_t* paddr = gpio + BCM2835_GPLEV0/4;
+    return bcm2835_peri_read(paddr) & mask;
+}
+
+// See which of several pins of the first bank detected an event
+uint32_t bcm2835_gpio_eds_multi(uint32_t mask)
+{
+    volatile uint32_t* paddr = gpio + BCM2835_GPEDS0/4;
+    return bcm2835_peri_read(paddr) & mask;
+}
+
+// Write 1s to clear the EDS bits of several pins of the first bank
+void bcm2835_gpio_set_eds_multi(uint32_t mask)
+{
+    volatile uint32_t* paddr = gpio + BCM2835_GPEDS0/4;
+    bcm2835_peri_write(paddr, mask);
+}
+
 // Rising edge detect enable
 void bcm2835_gpio_ren(uint8_t pin)
 {
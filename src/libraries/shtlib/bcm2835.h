@@ -540,6 +540,21 @@ extern "C" {
     /// \param[in] pin GPIO number, or one of RPI_GPIO_P1_* from \ref RPiGPIOPin.
     extern void bcm2835_gpio_set_eds(uint8_t pin);
 
+    /// Reads the levels of the pins 0 to 31 with a single register read.
+    /// \param[in] mask Mask of the pins to read (bit n for GPIO n)
+    /// \return the levels of the pins in mask, bit set for HIGH
+    extern uint32_t bcm2835_gpio_lev_multi(uint32_t mask);
+
+    /// Event Detect Status of the pins 0 to 31 with a single register read.
+    /// \param[in] mask Mask of the pins to test (bit n for GPIO n)
+    /// \return the pins in mask which detected an event
+    extern uint32_t bcm2835_gpio_eds_multi(uint32_t mask);
+
+    /// Clears the Event Detect Status of the pins 0 to 31 in a mask
+    /// with a single register write.
+    /// \param[in] mask Mask of the pins to clear (bit n for GPIO n)
+    extern void bcm2835_gpio_set_eds_multi(uint32_t mask);
+
     /// Enable Rising Edge Detect Enable for the specified pin.
     /// When a rising edge is detected, sets the appropriate pin in Event Detect Status.
     /// The GPRENn registers use
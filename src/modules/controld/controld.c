@@ -50,9 +50,12 @@
 #define DEBUG 0
 
 /* GPIO sysfs interface */
-#define EXPORT_FILE    "/sys/class/gpio/export"
-#define UNEXPORT_FILE  "/sys/class/gpio/unexport"
-#define GPIO_BASE_FILE "/sys/class/gpio/gpio"
+#ifndef GPIO_SYSFS_DIR
+#define GPIO_SYSFS_DIR "/sys/class/gpio"
+#endif
+#define EXPORT_FILE    GPIO_SYSFS_DIR "/export"
+#define UNEXPORT_FILE  GPIO_SYSFS_DIR "/unexport"
+#define GPIO_BASE_FILE GPIO_SYSFS_DIR "/gpio"
 
 #define MAX_CONTROL_LINES 8
 
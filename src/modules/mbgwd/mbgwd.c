@@ -0,0 +1,121 @@
+/******************************************************************
+ *  Modbus gateway daemon for TeleGea device
+ *  
+ *  Author: Ondrej Wisniewski
+ *  
+ *  Features:
+ *  - Serves the registers of all slave modules over a single
+ *    Modbus TCP port, dispatching the requests by unit identifier
+ *  - Keeps one persistent connection to each slave module,
+ *    shared by all clients
+ * 
+ *  Build command:
+ *  gcc mbgwd.c -o mbgwd -lmbsrv `pkg-config --libs --cflags libmodbus`
+ *  
+ *  Changelog:
+ *   17-10-2026: Initial version
+ * 
+ * Copyright 2013-2015, DEK Italia
+ * 
+ * This file is part of the Telegea platform.
+ * 
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ * 
+ ******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "modbustcp_server_lib.h"
+
+
+#define VERSION "0.1"
+
+
+/**********************************************************
+ * Function: add_route()
+ * 
+ * Description:
+ *           Parse a route given as <unit>:<ip addr>[:<port>]
+ *           and add it to the gateway
+ * 
+ * Returns:  0 on success
+ *          -1 otherwise
+ *********************************************************/
+static int add_route(char *route)
+{
+   char *ip_addr;
+   char *port;
+   int unit;
+   
+   ip_addr = strchr(route, ':');
+   if (ip_addr == NULL) return -1;
+   *ip_addr++ = '\0';
+   unit = atoi(route);
+   
+   port = strchr(ip_addr, ':');
+   if (port != NULL) *port++ = '\0';
+   
+   return modbustcp_server_route(unit, ip_addr, 
+                                 port ? atoi(port) : MODBUSTCP_SERVER_PORT_BASE + unit);
+}
+
+
+/**********************************************************
+ * MAIN function
+ *********************************************************/
+int main(int argc, char* argv[])
+{   
+   int tcp_port = MODBUSTCP_GATEWAY_PORT;
+   int i;
+   
+   
+   if ((argc > 1) && (strcmp(argv[1], "-h") == 0))
+   {
+      printf("Usage:\n");
+      printf("  mbgwd [<tcp port> [<route> ...]]\n");
+      printf("      tcp port: port to listen on (optional, default: %d)\n", MODBUSTCP_GATEWAY_PORT);
+      printf("      route:    <unit>:<ip addr>[:<port>] of a Modbus TCP slave (optional,\n");
+      printf("                default: slave modules 1-7 on port %d+unit on localhost)\n", 
+                                                                  MODBUSTCP_SERVER_PORT_BASE);
+      return 0;
+   }
+
+   openlog("mbgwd", LOG_PID|LOG_CONS, LOG_USER);
+   syslog(LOG_DAEMON | LOG_NOTICE, "Starting Modbus gateway daemon (version %s)\n", VERSION);
+   
+   /* Parse input parameters */
+   if (argc > 1) tcp_port = atoi(argv[1]);
+   for (i=2; i<argc; i++)
+   {
+      if (add_route(argv[i]) != 0)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Invalid route %s\n", argv[i]);
+         return 1;
+      }
+   }
+   
+   /* Run the gateway (doesn't return unless an error occurs) */
+   if (modbustcp_gateway(tcp_port) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Modbus gateway failed\n");
+      return 2;
+   }
+   
+   syslog(LOG_DAEMON | LOG_NOTICE, "Exiting Modbus gateway daemon");
+   
+   return 0;
+}
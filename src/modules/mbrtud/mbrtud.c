@@ -13,6 +13,13 @@
  *   22-07-2014: Initial version
  *   12-11-2015: Added support for direction control of RS485 trasceiver
  *               (needs libmodbus > v3.1.2)
+ *   17-10-2026: Handle multi register requests with a single RTU request
+ *   17-10-2026: Query the RTU device in a worker thread of the Modbus
+ *               TCP server, requests to the other modules aren't delayed
+ *   17-10-2026: Full register address range, check address plus offset
+ *   17-10-2026: Latency statistics of the RTU bus
+ *   17-10-2026: Full NIBE addresses sent unchanged with the register
+ *               address offset of older configurations
  * 
  * Copyright 2013-2015, DEK Italia
  * 
@@ -46,7 +53,7 @@
 #include "modbustcp_server_lib.h"
 
 
-#define VERSION "0.2"
+#define VERSION "0.6"
 
 #define MODBUS_SLAVE_ADDRESS MODBUS_SLAVE_MBRTU_MODULE
 
@@ -55,9 +62,18 @@
 #define DEFAULT_SLAVE_ADDR    1
 #define DEFAULT_RTS_DELAY     100
 
+/* Highest Modbus register address */
+#define MAX_REG_ADDR          0xFFFF
+
+/* Register address offset of configurations before the full address
+ * range, when the scripts sent NIBE Modbus40 addresses minus 40000
+ */
+#define LEGACY_REG_ADDR_OFFSET 40000
+
 
 static modbus_t *mb;
 static int reg_addr_offset=0;
+static int offset_migrated=0;
 
 /*
  * Modbus register map of the Modbus RTU slave module:
@@ -98,79 +114,118 @@ static void doExit(int signum)
 
 
 /**********************************************************
- * FUNCTION: read_register_handler
+ * FUNCTION: deviceAddr
+ * 
+ * DESCRIPTION: 
+ *           Get the device address of a register block, the 
+ *           request address plus the address offset. With the
+ *           offset of older configurations the scripts' full
+ *           NIBE addresses (40000 and up) are sent unchanged,
+ *           the migration is logged once.
+ * 
+ * RETURN:   device address of the first register
+ *          -1 if the block is out of range
+ *********************************************************/
+static int deviceAddr(int addr, int count)
+{
+   int offset = reg_addr_offset;
+   
+   if ((offset == LEGACY_REG_ADDR_OFFSET) && (addr >= LEGACY_REG_ADDR_OFFSET))
+   {
+      if (!offset_migrated)
+      {
+         syslog(LOG_DAEMON | LOG_NOTICE, "Register %d is a full NIBE address, offset %d of an older "
+                                         "configuration not applied (set REGADDR_OFFSET=0)\n", 
+                                         addr, reg_addr_offset);
+         offset_migrated = 1;
+      }
+      offset = 0;
+   }
+   
+   if (addr + offset + count - 1 > MAX_REG_ADDR)
+   {
+      return -1;
+   }
+   return addr + offset;
+}
+
+
+/**********************************************************
+ * FUNCTION: read_registers_handler
  * 
  * DESCRIPTION: 
- *           Handles the read single register request
+ *           Handles the read registers request
  * 
  * PARAMETERS: 
- *           int reg_addr - register address to read from
- *           int* reg_val - pointer to register value
+ *           int addr       - first register address to read from
+ *           int count      - number of registers to read
+ *           uint16_t* vals - pointer to register values
  * 
  * RETURN:   0 on success
  *          -1 otherwise
  *********************************************************/
-int read_register_handler(int addr, int *reg_val_p)
+int read_registers_handler(int addr, int count, uint16_t *vals)
 {
    int rc=0;
-   uint16_t modbus_regs[2];
 
-   /* Check addr range */
-   /* TODO */
+   /* Check addr range (offset included) */
+   addr = deviceAddr(addr, count);
+   if (addr < 0)
+   {
+      return -1;
+   }
    
-   /* Read specified Modbus register value from RTU device. 
-    * We add an address offset (as specified by input parameter)
-    * to the original address from the request.
+   /* Read specified Modbus register values from RTU device 
+    * with a single request. We add an address offset (as 
+    * specified by input parameter) to the original address 
+    * from the request.
     * (needed e.g. for Modbus40 module
     */
-   addr += reg_addr_offset;
-   modbus_regs[0] = 0;
-   rc = modbus_read_registers(mb, addr, 1, modbus_regs);
-   //printf("read reg %d\n", addr);
-   if (rc != 1) 
+   rc = modbus_read_registers(mb, addr, count, vals);
+   //printf("read %d regs from %d\n", count, addr);
+   if (rc != count) 
    {
       return -1;
    } 
-   else 
-   {
-      *reg_val_p = modbus_regs[0];
-   }
    
    return 0;
 }
 
 
 /**********************************************************
- * FUNCTION: write_register_handler
+ * FUNCTION: write_registers_handler
  * 
  * DESCRIPTION: 
- *           Handles the write single register request
+ *           Handles the write registers request
  * 
  * PARAMETERS: 
- *           int reg_addr - register address to read from
- *           int* reg_val - register value
+ *           int addr             - first register address to write to
+ *           int count            - number of registers to write
+ *           const uint16_t* vals - register values
  * 
  * RETURN:   0 on success
  *          -1 otherwise
  *********************************************************/
-int write_register_handler(int addr, int reg_val)
+int write_registers_handler(int addr, int count, const uint16_t *vals)
 {
    int rc=0;
-   uint16_t modbus_regs[2];
    
-   /* Check addr range */
-   /* TODO */
+   /* Check addr range (offset included) */
+   addr = deviceAddr(addr, count);
+   if (addr < 0)
+   {
+      return -1;
+   }
    
-   /* Write specified Modbus register value to RTU device.
-    * We add an address offset (as specified by input parameter)
-    * to the original address from the request.
+   /* Write specified Modbus register values to RTU device
+    * with a single request. We add an address offset (as 
+    * specified by input parameter) to the original address 
+    * from the request.
     * (needed e.g. for Modbus40 module
     */
-   addr += reg_addr_offset;
-   modbus_regs[0] = reg_val;
-   rc = modbus_write_registers(mb, addr, 1, modbus_regs);
-   //printf("write reg %d\n", addr);
-   if (rc != 1) 
+   rc = modbus_write_registers(mb, addr, count, vals);
+   //printf("write %d regs to %d\n", count, addr);
+   if (rc != count) 
    {
       return -1;
    } 
@@ -214,6 +269,16 @@ int main(int argc, char* argv[])
    reg_addr_offset = atoi(argv[2]);
    strcat(serial_port,    argv[3]);
    if (argc>4) baud_rate = atoi(argv[4]);
+   
+   /* The scripts send the full addresses now, the old offset is only
+    * applied to addresses below it
+    */
+   if (reg_addr_offset == LEGACY_REG_ADDR_OFFSET)
+   {
+      syslog(LOG_DAEMON | LOG_NOTICE, "Register address offset %d of an older configuration, "
+                                      "not applied to full NIBE Modbus40 addresses\n", 
+                                      reg_addr_offset);
+   }
 
 # if 0
    printf("slave_addr=%d\n", slave_addr);
@@ -276,10 +341,19 @@ int main(int argc, char* argv[])
    
    //modbus_set_debug(mb, TRUE);
 
+   /* All registers are on the RTU device, which may take up to the 
+    * response timeout to answer. Requests are queued for a worker 
+    * thread and passed to the device one at a time.
+    */
+   modbustcp_server_slow(0, 0xFFFF);
+   
+   /* Latency statistics of the RTU bus (written on SIGUSR1) */
+   modbustcp_server_stats_range(0, 0xFFFF, "RTU bus");
+   
    /* Start Modbus TCP server loop */
-   modbustcp_server(MODBUS_SLAVE_ADDRESS,  // Modbus slave address
-                    read_register_handler, // Read register handler
-                    write_register_handler // Write register handler
+   modbustcp_server_blk(MODBUS_SLAVE_ADDRESS,   // Modbus slave address
+                        read_registers_handler, // Read registers handler
+                        write_registers_handler // Write registers handler
    );
    
    return 0;
@@ -0,0 +1,685 @@
+/*
+ * PURPOSE: Load generator and latency benchmark for the Modbus TCP servers
+ * of the Telegea modules. Opens several connections, sends a mix of read
+ * and write requests to one or more slave modules at a target rate and
+ * reports the throughput, latency percentiles and errors.
+ *
+ * USAGE = geomon_modbustcp_bench [options]
+ *
+ *   -h <IP_ADDR>  IP address of the device (default 127.0.0.1), or
+ *                 unix        = Unix domain socket of the local server
+ *                 unix:<NAME> = Unix domain socket <NAME>
+ *   -p <TCP_PORT> TCP port of all slaves, e.g. of the gateway (default:
+ *                 5000 plus slave address, i.e. each module's own port)
+ *   -u <SLAVES>   comma separated list of slave addresses (default 1),
+ *                 the connections are spread over the slaves
+ *   -c <CONN>     number of connections (default 1)
+ *   -r <RATE>     target rate in requests/s over all connections
+ *                 (default 0 = as fast as the servers answer)
+ *   -d <SEC>      duration in seconds (default 10)
+ *   -m <MIX>      request mix as <FC>:<WEIGHT>,... with FC 3, 4 or 6
+ *                 (default 3:100)
+ *   -a <ADDR>     register address or range <FIRST>-<LAST> (default 1)
+ *   -n <COUNT>    registers per read request (default 1)
+ *   -v <VALUE>    value written by FC 6 requests (default 0)
+ *   -t <MSEC>     reply timeout in ms (default 1000)
+ *   -j <FILE>     also write the results as JSON to FILE ("-" = stdout)
+ *
+ * Latencies are measured from the time a request was due according to
+ * the target rate, so requests delayed by a slow server are accounted for.
+ * Writes go to the real registers of the slave: only use FC 6 on
+ * registers which are safe to write.
+ *
+ * Build instructions:
+ * gcc geomon_modbustcp_bench.c -o geomon_modbustcp_bench
+ *
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define VERSION "0.1"
+
+/* Unix domain socket of a local server listening on a TCP port
+ * (same as MODBUSTCP_SERVER_UNIX_NAME of the Modbus TCP server library)
+ */
+#define UNIX_SOCKET_NAME "@telegea-mbsrv-%d"
+
+/* Port of a module is the base port plus its slave address */
+#define TCP_PORT_BASE 5000
+
+#define MAX_CONNECTIONS 256
+#define MAX_SLAVES      32
+#define MAX_READ_REGS   125
+
+/* Length of MBAP header and max frame length */
+#define MBAP_LENGTH 7
+#define MAX_ADU_LENGTH 260
+
+/* Function codes of the request mix */
+#define NUM_FUNCTIONS 3
+static const int functions[NUM_FUNCTIONS] = { 0x03, 0x04, 0x06 };
+
+
+/* Benchmark connection */
+typedef struct {
+  int fd;
+  int slave;
+  int port;
+  int busy;                     /* request sent, waiting for the reply */
+  uint16_t tid;                 /* transaction id of the request */
+  int function;                 /* index in functions[] */
+  uint64_t due_us;              /* time the request was due */
+  uint64_t sent_us;             /* time the request was sent */
+  int rx_len;
+  uint8_t rx_buf[MAX_ADU_LENGTH];
+} bench_conn_t;
+
+/* Latency sample */
+typedef struct {
+  uint32_t us;
+  uint8_t function;             /* index in functions[] */
+} sample_t;
+
+/* Results per function code */
+typedef struct {
+  unsigned long sent;
+  unsigned long ok;
+  unsigned long exceptions;
+  unsigned long timeouts;
+  unsigned long conn_errors;
+} counters_t;
+
+/* Latency percentiles (in ms) */
+typedef struct {
+  double p50, p95, p99, max;
+} percentiles_t;
+
+
+/* Settings */
+static const char *ip_addr = "127.0.0.1";
+static int tcp_port = 0;
+static int slaves[MAX_SLAVES] = { 1 };
+static int num_slaves = 1;
+static int num_conns = 1;
+static double rate = 0;
+static int duration = 10;
+static int weights[NUM_FUNCTIONS] = { 100, 0, 0 };
+static int first_addr = 1;
+static int last_addr = 1;
+static int reg_count = 1;
+static int write_value = 0;
+static int timeout_ms = 1000;
+static const char *json_file = NULL;
+
+static bench_conn_t conns[MAX_CONNECTIONS];
+static counters_t counters[NUM_FUNCTIONS];
+static sample_t *samples = NULL;
+static unsigned long num_samples = 0;
+static unsigned long max_samples = 0;
+
+
+/*
+ * Get monotonic time in microseconds.
+ */
+static uint64_t time_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+/*
+ * Connect to the server of a benchmark connection.
+ * Returns 0 on success or -1 on error.
+ */
+static int bench_connect(bench_conn_t *conn)
+{
+  struct sockaddr_un un_addr;
+  struct sockaddr_in in_addr;
+  char name[sizeof(un_addr.sun_path)];
+  const char *path;
+  socklen_t len;
+  int one = 1;
+
+  conn->busy = 0;
+  conn->rx_len = 0;
+
+  if ((strcmp(ip_addr, "unix") == 0) || (strncmp(ip_addr, "unix:", 5) == 0)) {
+    if (ip_addr[4]) {
+      path = &ip_addr[5];
+    }
+    else {
+      snprintf(name, sizeof(name), UNIX_SOCKET_NAME, conn->port);
+      path = name;
+    }
+    if (strlen(path) >= sizeof(un_addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    memset(&un_addr, 0, sizeof(un_addr));
+    un_addr.sun_family = AF_UNIX;
+    memcpy(un_addr.sun_path, path, strlen(path));
+    len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    if (path[0] == '@')
+      un_addr.sun_path[0] = '\0';
+    else
+      len++;
+
+    conn->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1)
+      return -1;
+    if (connect(conn->fd, (struct sockaddr *)&un_addr, len) == -1) {
+      close(conn->fd);
+      conn->fd = -1;
+      return -1;
+    }
+    return 0;
+  }
+
+  memset(&in_addr, 0, sizeof(in_addr));
+  in_addr.sin_family = AF_INET;
+  in_addr.sin_port = htons(conn->port);
+  if (inet_pton(AF_INET, ip_addr, &in_addr.sin_addr) != 1) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn->fd == -1)
+    return -1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(conn->fd, (struct sockaddr *)&in_addr, sizeof(in_addr)) == -1) {
+    close(conn->fd);
+    conn->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * Close a benchmark connection after an error and try to reconnect.
+ */
+static void bench_reconnect(bench_conn_t *conn)
+{
+  if (conn->fd != -1)
+    close(conn->fd);
+  conn->fd = -1;
+  bench_connect(conn);
+}
+
+
+/*
+ * Record the latency of a completed request.
+ */
+static void add_sample(int function, uint64_t us)
+{
+  if (num_samples == max_samples) {
+    sample_t *p;
+
+    max_samples = max_samples ? 2*max_samples : 65536;
+    p = realloc(samples, max_samples * sizeof(sample_t));
+    if (p == NULL) {
+      max_samples = num_samples;
+      return;
+    }
+    samples = p;
+  }
+  samples[num_samples].us = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+  samples[num_samples].function = function;
+  num_samples++;
+}
+
+
+/*
+ * Pick the function code of the next request according to the mix.
+ * Returns the index in functions[].
+ */
+static int pick_function(void)
+{
+  int total = 0;
+  int r;
+  int i;
+
+  for (i=0; i<NUM_FUNCTIONS; i++)
+    total += weights[i];
+  r = rand() % total;
+  for (i=0; i<NUM_FUNCTIONS-1; i++) {
+    if (r < weights[i])
+      break;
+    r -= weights[i];
+  }
+  return i;
+}
+
+
+/*
+ * Send the next request on a free connection.
+ */
+static void send_request(bench_conn_t *conn, uint64_t due_us)
+{
+  uint8_t frame[12];
+  int function = pick_function();
+  int count = (functions[function] == 0x06) ? 1 : reg_count;
+  int span = last_addr - first_addr - count + 2;
+  int addr = first_addr + ((span > 1) ? rand() % span : 0);
+
+  conn->tid++;
+  frame[0] = conn->tid >> 8;
+  frame[1] = conn->tid & 0xFF;
+  frame[2] = 0;
+  frame[3] = 0;
+  frame[4] = 0;
+  frame[5] = 6;
+  frame[6] = conn->slave;
+  frame[7] = functions[function];
+  frame[8] = addr >> 8;
+  frame[9] = addr & 0xFF;
+  if (functions[function] == 0x06) {
+    frame[10] = write_value >> 8;
+    frame[11] = write_value & 0xFF;
+  }
+  else {
+    frame[10] = count >> 8;
+    frame[11] = count & 0xFF;
+  }
+
+  counters[function].sent++;
+  if (send(conn->fd, frame, sizeof(frame), MSG_NOSIGNAL) != sizeof(frame)) {
+    counters[function].conn_errors++;
+    bench_reconnect(conn);
+    return;
+  }
+  conn->busy = 1;
+  conn->function = function;
+  conn->due_us = due_us;
+  conn->sent_us = time_us();
+}
+
+
+/*
+ * Read the reply of the request in flight on a connection.
+ */
+static void receive_reply(bench_conn_t *conn)
+{
+  int len;
+  int rc;
+
+  rc = read(conn->fd, &conn->rx_buf[conn->rx_len], sizeof(conn->rx_buf) - conn->rx_len);
+  if (rc <= 0) {
+    if ((rc == -1) && ((errno == EINTR) || (errno == EAGAIN)))
+      return;
+    if (conn->busy)
+      counters[conn->function].conn_errors++;
+    bench_reconnect(conn);
+    return;
+  }
+  conn->rx_len += rc;
+
+  if (conn->rx_len < MBAP_LENGTH)
+    return;
+  len = MBAP_LENGTH - 1 + ((conn->rx_buf[4] << 8) | conn->rx_buf[5]);
+  if ((len <= MBAP_LENGTH) || (len > MAX_ADU_LENGTH) || !conn->busy) {
+    /* Invalid or unexpected frame */
+    if (conn->busy)
+      counters[conn->function].conn_errors++;
+    bench_reconnect(conn);
+    return;
+  }
+  if (conn->rx_len < len)
+    return;
+
+  if (((conn->rx_buf[0] << 8) | conn->rx_buf[1]) != conn->tid) {
+    counters[conn->function].conn_errors++;
+    bench_reconnect(conn);
+    return;
+  }
+
+  if (conn->rx_buf[MBAP_LENGTH] & 0x80) {
+    counters[conn->function].exceptions++;
+  }
+  else {
+    counters[conn->function].ok++;
+    add_sample(conn->function, time_us() - conn->due_us);
+  }
+  conn->busy = 0;
+  conn->rx_len -= len;
+  memmove(conn->rx_buf, &conn->rx_buf[len], conn->rx_len);
+}
+
+
+/*
+ * qsort() comparison of latency samples.
+ */
+static int compare_samples(const void *a, const void *b)
+{
+  const sample_t *sa = a;
+  const sample_t *sb = b;
+
+  return (sa->us > sb->us) - (sa->us < sb->us);
+}
+
+
+/*
+ * Get the latency percentiles of a function code (-1 for all).
+ * The samples must be sorted.
+ */
+static percentiles_t get_percentiles(int function)
+{
+  percentiles_t p = { 0, 0, 0, 0 };
+  unsigned long n = 0;
+  unsigned long k = 0;
+  unsigned long i;
+
+  for (i=0; i<num_samples; i++) {
+    if ((function == -1) || (samples[i].function == function))
+      n++;
+  }
+  if (n == 0)
+    return p;
+
+  for (i=0; i<num_samples; i++) {
+    if ((function != -1) && (samples[i].function != function))
+      continue;
+    if (k == (n-1)*50/100)
+      p.p50 = samples[i].us / 1000.0;
+    if (k == (n-1)*95/100)
+      p.p95 = samples[i].us / 1000.0;
+    if (k == (n-1)*99/100)
+      p.p99 = samples[i].us / 1000.0;
+    p.max = samples[i].us / 1000.0;
+    k++;
+  }
+  return p;
+}
+
+
+/*
+ * Print the results as text and optionally as JSON.
+ */
+static void report(double elapsed)
+{
+  counters_t total;
+  percentiles_t p;
+  FILE *fp = NULL;
+  int i;
+
+  memset(&total, 0, sizeof(total));
+  for (i=0; i<NUM_FUNCTIONS; i++) {
+    total.sent += counters[i].sent;
+    total.ok += counters[i].ok;
+    total.exceptions += counters[i].exceptions;
+    total.timeouts += counters[i].timeouts;
+    total.conn_errors += counters[i].conn_errors;
+  }
+  qsort(samples, num_samples, sizeof(sample_t), compare_samples);
+
+  printf("Duration:    %.2f s, %d connections\n", elapsed, num_conns);
+  printf("Requests:    %lu sent, %lu ok, %lu exceptions, %lu timeouts, %lu connection errors\n",
+         total.sent, total.ok, total.exceptions, total.timeouts, total.conn_errors);
+  printf("Throughput:  %.1f requests/s\n", total.ok / elapsed);
+  printf("Latency ms:  %8s %8s %8s %8s %10s\n", "p50", "p95", "p99", "max", "ok");
+  for (i=-1; i<NUM_FUNCTIONS; i++) {
+    if ((i >= 0) && (counters[i].sent == 0))
+      continue;
+    p = get_percentiles(i);
+    if (i == -1)
+      printf("  all        ");
+    else
+      printf("  FC %02X      ", functions[i]);
+    printf("%8.2f %8.2f %8.2f %8.2f %10lu\n", p.p50, p.p95, p.p99, p.max,
+           (i == -1) ? total.ok : counters[i].ok);
+  }
+
+  if (json_file == NULL)
+    return;
+  if (strcmp(json_file, "-") == 0) {
+    fp = stdout;
+  }
+  else if ((fp = fopen(json_file, "w")) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", json_file, strerror(errno));
+    return;
+  }
+
+  p = get_percentiles(-1);
+  fprintf(fp, "{\"ip_addr\": \"%s\", \"connections\": %d, \"target_rate\": %.1f, \"duration_s\": %.3f,\n",
+          ip_addr, num_conns, rate, elapsed);
+  fprintf(fp, " \"sent\": %lu, \"ok\": %lu, \"exceptions\": %lu, \"timeouts\": %lu, \"conn_errors\": %lu,\n",
+          total.sent, total.ok, total.exceptions, total.timeouts, total.conn_errors);
+  fprintf(fp, " \"throughput\": %.1f,\n", total.ok / elapsed);
+  fprintf(fp, " \"latency_ms\": {\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n",
+          p.p50, p.p95, p.p99, p.max);
+  fprintf(fp, " \"functions\": {");
+  for (i=0; i<NUM_FUNCTIONS; i++) {
+    p = get_percentiles(i);
+    fprintf(fp, "%s\n  \"%d\": {\"sent\": %lu, \"ok\": %lu, \"exceptions\": %lu, \"timeouts\": %lu, "
+            "\"conn_errors\": %lu, \"latency_ms\": {\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f}}",
+            i ? "," : "", functions[i], counters[i].sent, counters[i].ok, counters[i].exceptions,
+            counters[i].timeouts, counters[i].conn_errors, p.p50, p.p95, p.p99, p.max);
+  }
+  fprintf(fp, "\n }\n}\n");
+
+  if (fp != stdout)
+    fclose(fp);
+}
+
+
+/*
+ * Parse the comma separated slave address list.
+ * Returns 0 on success or -1 on error.
+ */
+static int parse_slaves(char *arg)
+{
+  char *tok;
+
+  num_slaves = 0;
+  for (tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if (num_slaves == MAX_SLAVES)
+      return -1;
+    slaves[num_slaves] = atoi(tok);
+    if ((slaves[num_slaves] < 0) || (slaves[num_slaves] > 255))
+      return -1;
+    num_slaves++;
+  }
+  return (num_slaves > 0) ? 0 : -1;
+}
+
+
+/*
+ * Parse the request mix <FC>:<WEIGHT>,...
+ * Returns 0 on success or -1 on error.
+ */
+static int parse_mix(char *arg)
+{
+  char *tok;
+  int total = 0;
+  int fc, w;
+  int i;
+
+  memset(weights, 0, sizeof(weights));
+  for (tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if (sscanf(tok, "%i:%d", &fc, &w) != 2)
+      return -1;
+    for (i=0; (i < NUM_FUNCTIONS) && (functions[i] != fc); i++);
+    if ((i == NUM_FUNCTIONS) || (w < 0))
+      return -1;
+    weights[i] = w;
+    total += w;
+  }
+  return (total > 0) ? 0 : -1;
+}
+
+
+static void usage(const char *prog)
+{
+  printf("Modbus TCP benchmark, version %s\n", VERSION);
+  printf("usage: %s [-h <IP_ADDR>] [-p <TCP_PORT>] [-u <SLAVE>[,<SLAVE>...]] [-c <CONN>]\n", prog);
+  printf("          [-r <RATE>] [-d <SEC>] [-m <FC>:<WEIGHT>[,...]] [-a <FIRST>[-<LAST>]]\n");
+  printf("          [-n <COUNT>] [-v <VALUE>] [-t <MSEC>] [-j <FILE>]\n");
+  printf("       <IP_ADDR> can be \"unix\" or \"unix:<NAME>\" for a local Unix domain socket\n");
+  printf("       without -p each slave is reached on port %d plus its address\n", TCP_PORT_BASE);
+}
+
+
+int main(int argc, char* argv[])
+{
+  struct pollfd pfds[MAX_CONNECTIONS];
+  uint64_t start, end, now, next_due;
+  uint64_t interval = 0;
+  int wait_ms;
+  int opt;
+  int i;
+
+
+  /* Parse command line */
+  while ((opt = getopt(argc, argv, "h:p:u:c:r:d:m:a:n:v:t:j:")) != -1) {
+    switch (opt) {
+      case 'h': ip_addr = optarg; break;
+      case 'p': tcp_port = atoi(optarg); break;
+      case 'c': num_conns = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'd': duration = atoi(optarg); break;
+      case 'n': reg_count = atoi(optarg); break;
+      case 'v': write_value = atoi(optarg); break;
+      case 't': timeout_ms = atoi(optarg); break;
+      case 'j': json_file = optarg; break;
+      case 'u':
+        if (parse_slaves(optarg) == -1) {
+          fprintf(stderr, "Invalid slave address list\n");
+          return -1;
+        }
+        break;
+      case 'm':
+        if (parse_mix(optarg) == -1) {
+          fprintf(stderr, "Invalid request mix (function codes 3, 4, 6)\n");
+          return -1;
+        }
+        break;
+      case 'a':
+        if (sscanf(optarg, "%d-%d", &first_addr, &last_addr) == 1)
+          last_addr = first_addr;
+        break;
+      default:
+        usage(argv[0]);
+        return 0;
+    }
+  }
+  if ((num_conns < 1) || (num_conns > MAX_CONNECTIONS) || (duration < 1) || (rate < 0) ||
+      (reg_count < 1) || (reg_count > MAX_READ_REGS) || (timeout_ms < 1) ||
+      (first_addr < 0) || (last_addr < first_addr) || (last_addr > 0xFFFF)) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  /* Open the connections, spread over the slaves */
+  for (i=0; i<num_conns; i++) {
+    conns[i].slave = slaves[i % num_slaves];
+    conns[i].port = tcp_port ? tcp_port : TCP_PORT_BASE + conns[i].slave;
+    if (bench_connect(&conns[i]) == -1) {
+      fprintf(stderr, "Connection to %s : %d failed: %s\n", ip_addr, conns[i].port, strerror(errno));
+      return -1;
+    }
+  }
+
+  if (rate > 0)
+    interval = (uint64_t)(1000000 / rate);
+  start = time_us();
+  end = start + (uint64_t)duration * 1000000;
+  next_due = start;
+
+  /* Main loop: send requests when due and collect the replies */
+  while (1) {
+    int outstanding = 0;
+
+    now = time_us();
+
+    for (i=0; i<num_conns; i++) {
+      bench_conn_t *conn = &conns[i];
+
+      if (conn->fd == -1) {
+        if (now < end)
+          bench_connect(conn);
+        continue;
+      }
+      if (conn->busy && (now - conn->sent_us > (uint64_t)timeout_ms * 1000)) {
+        /* The reply may still come, so the connection is reopened */
+        counters[conn->function].timeouts++;
+        bench_reconnect(conn);
+        continue;
+      }
+      if (!conn->busy && (now < end) && (next_due <= now)) {
+        send_request(conn, (rate > 0) ? next_due : now);
+        if (rate > 0)
+          next_due += interval;
+      }
+      if (conn->busy)
+        outstanding++;
+    }
+
+    if ((now >= end) && (outstanding == 0))
+      break;
+
+    /* Wait for replies or until the next request is due */
+    wait_ms = 10;
+    if ((rate > 0) && (now < end)) {
+      wait_ms = (next_due > now) ? (int)((next_due - now + 999) / 1000) : 0;
+      if (wait_ms > 10)
+        wait_ms = 10;
+    }
+    for (i=0; i<num_conns; i++) {
+      pfds[i].fd = conns[i].fd;
+      pfds[i].events = POLLIN;
+    }
+    if (poll(pfds, num_conns, wait_ms) > 0) {
+      for (i=0; i<num_conns; i++) {
+        if ((conns[i].fd != -1) && (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)))
+          receive_reply(&conns[i]);
+      }
+    }
+  }
+
+  report((time_us() - start) / 1000000.0);
+
+  for (i=0; i<num_conns; i++) {
+    if (conns[i].fd != -1)
+      close(conns[i].fd);
+  }
+  free(samples);
+  return 0;
+}
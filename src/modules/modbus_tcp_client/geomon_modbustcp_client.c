@@ -2,17 +2,28 @@
  * Inspired by the random_test_client example in the modbus library
  *
  * PURPOSE: This program is launched from the command line, to read or write
- * one or multiple (in future versions!) registers of a Modbus device
+ * one or multiple registers of a Modbus device
  * through a TCP connection.
  *
- * USAGE = geomon_modbustcp_client <IP_ADDR> <TCP_PORT> <OP> <SLAVE> <ADDR> [<VALUE>]
+ * USAGE = geomon_modbustcp_client <IP_ADDR> <TCP_PORT> <OP> <SLAVE> <ADDR> [<VALUE>|<COUNT>] [<DEADBAND>]
+ *
+ * IP_ADDR: IP address of the Modbus device, or
+ *     unix        = Unix domain socket of the local server on <TCP_PORT>
+ *     unix:<NAME> = Unix domain socket <NAME> ('@' prefix for abstract namespace)
+ *
+ * OP: 1 = read single register
+ *     2 = write single register <VALUE>
+ *     3 = read <COUNT> consecutive registers with one request
+ *     4 = subscribe to changes of <COUNT> consecutive registers by more
+ *         than <DEADBAND> (default 0), the values are printed whenever
+ *         the server reports a change (until the connection is closed)
  *
  * Build instructions:
  * gcc geomon_modbustcp_client.c -o geomon_modbustcp_client `pkg-config --libs --cflags libmodbus`
  *
  * Author: O. Wisniewski
- * Version: 0.3
- * Date: 2015/02/17
+ * Version: 0.6
+ * Date: 2026/10/17
  * 
  * Copyright 2013-2015, DEK Italia
  * 
@@ -38,15 +49,155 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <modbus/modbus.h>
 
 #define DEBUG 0
 
-#define VERSION "0.3"
+#define VERSION "0.6"
 
 /* Server response timeout (in sec) */
 #define RESPONSE_TMO 15
 
+/* Unix domain socket of a local server listening on a TCP port 
+ * (same as MODBUSTCP_SERVER_UNIX_NAME of the Modbus TCP server library)
+ */
+#define UNIX_SOCKET_NAME "@telegea-mbsrv-%d"
+
+/* User defined function codes for report by exception
+ * (same as in the Modbus TCP server library)
+ */
+#define FC_SUBSCRIBE 0x41
+#define FC_NOTIFY    0x42
+
+/* Length of MBAP header */
+#define MBAP_LENGTH 7
+
+
+/*
+ * Connect to the Unix domain socket <name> (NULL for the one of the
+ * local server listening on <tcp_port>), a leading '@' denotes the
+ * abstract namespace.
+ * Returns the socket or -1 on error.
+ */
+static int unix_connect(const char *name, int tcp_port)
+{
+  struct sockaddr_un addr;
+  char buf[sizeof(addr.sun_path)];
+  int len;
+  int s;
+
+  if (name == NULL) {
+    snprintf(buf, sizeof(buf), UNIX_SOCKET_NAME, tcp_port);
+    name = buf;
+  }
+  len = strlen(name);
+  if (len >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, name, len);
+  if (name[0] == '@') 
+    addr.sun_path[0] = '\0';
+  else
+    len++;
+
+  s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s == -1) 
+    return -1;
+  if (connect(s, (struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + len) == -1) {
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+
+/*
+ * Read a complete frame (MBAP header and PDU) from socket s.
+ * Returns the frame length or -1 on error or closed connection.
+ */
+static int read_frame(int s, uint8_t *frame)
+{
+  int len = MBAP_LENGTH;
+  int pos = 0;
+  int rc;
+
+  while (pos < len) {
+    rc = read(s, &frame[pos], len - pos);
+    if (rc <= 0)
+      return -1;
+    pos += rc;
+    if ((pos == MBAP_LENGTH) && (len == MBAP_LENGTH)) {
+      len = MBAP_LENGTH - 1 + ((frame[4] << 8) | frame[5]);
+      if ((len <= MBAP_LENGTH) || (len > MODBUS_TCP_MAX_ADU_LENGTH))
+        return -1;
+    }
+  }
+  return len;
+}
+
+
+/*
+ * Subscribe to changes of reg_count registers starting at reg_addr
+ * and print their values whenever the server reports a change.
+ * Returns only when the subscription ended.
+ */
+static void subscribe(int s, const char *ip_addr, int tcp_port, int slave_addr,
+                      int reg_addr, int reg_count, int deadband)
+{
+  uint8_t frame[MODBUS_TCP_MAX_ADU_LENGTH];
+  int len;
+  int val;
+  int i;
+
+  frame[0] = 0;
+  frame[1] = 1;
+  frame[2] = 0;
+  frame[3] = 0;
+  frame[4] = 0;
+  frame[5] = 8;
+  frame[6] = slave_addr;
+  frame[7] = FC_SUBSCRIBE;
+  frame[8] = reg_addr >> 8;
+  frame[9] = reg_addr & 0xFF;
+  frame[10] = reg_count >> 8;
+  frame[11] = reg_count & 0xFF;
+  frame[12] = deadband >> 8;
+  frame[13] = deadband & 0xFF;
+  
+  if (write(s, frame, 14) != 14) {
+    printf("PLANT: %s %d 4 -1  ERR\n", ip_addr, tcp_port);
+    return;
+  }
+
+  /* Subscribe reply, then one notification per change */
+  len = read_frame(s, frame);
+  if ((len < MBAP_LENGTH + 1) || (frame[MBAP_LENGTH] != FC_SUBSCRIBE)) {
+    printf("PLANT: %s %d 4 -1  ERR\n", ip_addr, tcp_port);
+    return;
+  }
+  
+  while ((len = read_frame(s, frame)) > 0) {
+    if (frame[MBAP_LENGTH] != FC_NOTIFY)
+      break;
+    if (len != MBAP_LENGTH + 4 + 2*reg_count)
+      break;
+    printf("PLANT: %s %d 4\n", ip_addr, tcp_port);
+    for (i=0; i<reg_count; i++) {
+      val = (frame[MBAP_LENGTH+4+2*i] << 8) | frame[MBAP_LENGTH+5+2*i];
+      printf("%d: %X: %d\n", reg_addr+i, val, val);
+    }
+    fflush(stdout);
+  }
+  printf("PLANT: %s %d 4 -1  ERR\n", ip_addr, tcp_port);
+}
+
 
 int main(int argc, char* argv[])
 {
@@ -56,9 +207,15 @@ int main(int argc, char* argv[])
   int   operation;
   int   slave_addr;
   int   reg_addr;
+  int   reg_count=1;
+  int   deadband=0;
+  int   use_unix=0;
+  int   s;
   int   rc;
+  int   i;
   struct timeval timeout;
   uint16_t modbus_reg=0;
+  uint16_t modbus_regs[MODBUS_MAX_READ_REGISTERS];
 
   
   /* Parse command line */
@@ -74,16 +231,39 @@ int main(int argc, char* argv[])
     {
       modbus_reg = atoi(argv[6]);
     }
+    
+    if ((argc >= 7) && ((operation == 3) || (operation == 4)))
+    {
+      reg_count = atoi(argv[6]);
+      if ((reg_count < 1) || (reg_count > MODBUS_MAX_READ_REGISTERS))
+      {
+        fprintf(stderr, "Invalid register count %d (1-%d)\n", reg_count, MODBUS_MAX_READ_REGISTERS);
+        return -1;
+      }
+    }
+    
+    if ((argc == 8) && (operation == 4)) 
+    {
+      deadband = atoi(argv[7]);
+    }
   }
   else
   {
     printf("Modbus TCP client, version %s\n", VERSION);
-    printf("usage: %s <IP_ADDR> <TCP_PORT> <OP> <SLAVE> <ADDR> [<VALUE>] \n", argv[0]);
+    printf("usage: %s <IP_ADDR> <TCP_PORT> <OP> <SLAVE> <ADDR> [<VALUE>|<COUNT>] [<DEADBAND>] \n", argv[0]);
+    printf("       <IP_ADDR> can be \"unix\" or \"unix:<NAME>\" for a local Unix domain socket\n");
     return 0;
   }
+  
+  /* Local server reached via Unix domain socket ? */
+  if ((strcmp(ip_addr, "unix") == 0) || (strncmp(ip_addr, "unix:", 5) == 0)) {
+    use_unix = 1;
+  }
  
-  /* Create TCP connection context */
-  ctx = modbus_new_tcp(ip_addr, tcp_port);
+  /* Create TCP connection context (same MBAP framing is used
+   * on the Unix domain socket) 
+   */
+  ctx = modbus_new_tcp(use_unix ? "127.0.0.1" : ip_addr, tcp_port);
   
 #if DEBUG
   modbus_set_debug(ctx, TRUE);
@@ -98,7 +278,17 @@ int main(int argc, char* argv[])
   modbus_set_slave(ctx, slave_addr);
 
   /* Start TCP connection */
-  if (modbus_connect(ctx) == -1) {
+  if (use_unix) {
+    s = unix_connect(ip_addr[4] ? &ip_addr[5] : NULL, tcp_port);
+    if (s == -1) {
+      fprintf(stderr, "Unix socket connection to %s : %d failed: %s\n",
+	      ip_addr, tcp_port, strerror(errno));
+      modbus_free(ctx);
+      return -1;
+    }
+    modbus_set_socket(ctx, s);
+  }
+  else if (modbus_connect(ctx) == -1) {
     fprintf(stderr, "TCP Connection to %s : %d failed: %s\n",
 	    ip_addr, tcp_port, modbus_strerror(errno));
     modbus_free(ctx);
@@ -132,6 +322,24 @@ int main(int argc, char* argv[])
       }    
       break;
       
+    case 3:        /* Read multiple registers */
+      rc = modbus_read_registers(ctx, reg_addr, reg_count, modbus_regs);
+      if (rc != reg_count) {
+        printf("PLANT: %s %d %d %d  ERR\n", ip_addr, tcp_port, operation, rc); 
+        for (i=0; i<reg_count; i++)
+          printf("%d: ERR\n", reg_addr+i); 
+      } 
+      else {
+        printf("PLANT: %s %d %d\n", ip_addr, tcp_port, operation);
+        for (i=0; i<reg_count; i++)
+          printf("%d: %X: %d\n", reg_addr+i, modbus_regs[i], modbus_regs[i]);
+      }
+      break;
+      
+    case 4:        /* Subscribe to register changes */
+      subscribe(modbus_get_socket(ctx), ip_addr, tcp_port, slave_addr, reg_addr, reg_count, deadband);
+      break;
+      
     default:
       printf("PLANT: %s %d %d ERROR: Operation not supported\n", ip_addr, tcp_port, operation);
   }
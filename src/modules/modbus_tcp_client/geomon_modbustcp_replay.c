@@ -0,0 +1,764 @@
+/*
+ * PURPOSE: Replay of a request trace recorded by the Modbus TCP server
+ * library (see MODBUSTCP_SERVER_TRACE_FILE in modbustcp_server_lib.h)
+ * against a server, at the original speed or a multiple of it. Reports
+ * the latency percentiles of the replay next to the ones recorded in
+ * the trace, so a change can be judged against real traffic.
+ *
+ * USAGE = geomon_modbustcp_replay [options] <TRACE_FILE>
+ *
+ *   -h <IP_ADDR>  IP address of the server (default 127.0.0.1), or
+ *                 unix        = Unix domain socket of the local server
+ *                 unix:<NAME> = Unix domain socket <NAME>
+ *   -p <TCP_PORT> TCP port of the server (default: port of the trace)
+ *   -s <SPEED>    replay speed as a multiple of the original (default 1)
+ *   -c <CONN>     number of connections (default 8)
+ *   -w            also replay write requests (skipped by default)
+ *   -t <MSEC>     reply timeout in ms (default 1000)
+ *   -j <FILE>     also write the results as JSON to FILE ("-" = stdout)
+ *
+ * The requests of a client connection of the trace are sent in their
+ * original order over the same connection, the client connections are
+ * spread over the replay connections. Requests are sent when due
+ * without waiting for the replies of earlier ones, and latencies are
+ * measured from the time a request was due. Replies with a different
+ * exception code than in the trace are counted as mismatches.
+ *
+ * Build instructions:
+ * gcc geomon_modbustcp_replay.c -o geomon_modbustcp_replay
+ *
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "modbustcp_server_lib.h"
+
+#define VERSION "0.1"
+
+#define MAX_CONNECTIONS 256
+
+/* Max requests in flight per connection (a power of 2 dividing 65536,
+ * the slot of a request is its transaction id modulo this number)
+ */
+#define MAX_OUTSTANDING 64
+
+/* Length of MBAP header and max frame length */
+#define MBAP_LENGTH 7
+#define MAX_ADU_LENGTH 260
+#define MAX_PDU_LENGTH (MAX_ADU_LENGTH - MBAP_LENGTH)
+
+/* Function codes have 7 bits, bit 7 marks an exception */
+#define NUM_FUNCTIONS 128
+
+
+/* Request of the trace */
+typedef struct {
+  uint64_t time_us;             /* since the trace start */
+  uint32_t latency_us;
+  uint16_t conn_id;
+  uint8_t unit;
+  uint8_t exception;
+  uint8_t pdu_len;
+  uint8_t pdu[MAX_PDU_LENGTH];
+} trace_req_t;
+
+/* Request in flight */
+typedef struct {
+  int used;
+  uint8_t function;
+  uint8_t exception;            /* exception code in the trace */
+  uint64_t due_us;              /* time the request was due */
+  uint64_t sent_us;             /* time the request was sent */
+} slot_t;
+
+/* Replay connection */
+typedef struct {
+  int fd;
+  uint16_t tid;                 /* transaction id of the last request */
+  int outstanding;
+  slot_t slots[MAX_OUTSTANDING];
+  int rx_len;
+  uint8_t rx_buf[2*MAX_ADU_LENGTH];
+} replay_conn_t;
+
+/* Latency sample */
+typedef struct {
+  uint32_t us;
+  uint8_t function;
+} sample_t;
+
+/* Latency samples of the trace or the replay */
+typedef struct {
+  sample_t *samples;
+  unsigned long num;
+  unsigned long max;
+} sample_set_t;
+
+/* Results per function code */
+typedef struct {
+  unsigned long sent;
+  unsigned long ok;
+  unsigned long exceptions;
+  unsigned long mismatches;
+  unsigned long timeouts;
+  unsigned long conn_errors;
+  unsigned long skipped;
+} counters_t;
+
+/* Latency percentiles (in ms) */
+typedef struct {
+  double p50, p95, p99, max;
+} percentiles_t;
+
+
+/* Settings */
+static const char *ip_addr = "127.0.0.1";
+static int tcp_port = 0;
+static double speed = 1;
+static int num_conns = 8;
+static int writes = 0;
+static int timeout_ms = 1000;
+static const char *json_file = NULL;
+static const char *trace_file;
+
+static FILE *trace_fp;
+static uint64_t trace_start;    /* wall clock time (in us since the epoch) */
+static uint64_t trace_end_us;   /* time of the last request */
+
+static replay_conn_t conns[MAX_CONNECTIONS];
+static counters_t counters[NUM_FUNCTIONS];
+static sample_set_t trace_samples;
+static sample_set_t replay_samples;
+
+
+/*
+ * Get monotonic time in microseconds.
+ */
+static uint64_t time_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+/*
+ * Get a little endian value of n bytes.
+ */
+static uint64_t get_le(const uint8_t *p, int n)
+{
+  uint64_t val = 0;
+
+  while (n-- > 0)
+    val = (val << 8) | p[n];
+  return val;
+}
+
+
+/*
+ * Open the trace file and read its header.
+ * Returns 0 on success or -1 on error.
+ */
+static int trace_open(void)
+{
+  uint8_t header[MODBUSTCP_TRACE_HEADER_LENGTH];
+
+  trace_fp = fopen(trace_file, "rb");
+  if (trace_fp == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", trace_file, strerror(errno));
+    return -1;
+  }
+  if ((fread(header, sizeof(header), 1, trace_fp) != 1) ||
+      (memcmp(header, MODBUSTCP_TRACE_MAGIC, 8) != 0)) {
+    fprintf(stderr, "%s is not a Modbus TCP server trace\n", trace_file);
+    fclose(trace_fp);
+    return -1;
+  }
+  trace_start = get_le(&header[8], 8);
+  if (tcp_port == 0)
+    tcp_port = get_le(&header[16], 2);
+  return 0;
+}
+
+
+/*
+ * Read the next request of the trace.
+ * Returns 1 if a request was read, 0 at the end of the trace.
+ */
+static int trace_read(trace_req_t *req)
+{
+  uint8_t record[MODBUSTCP_TRACE_RECORD_LENGTH];
+
+  if (fread(record, sizeof(record), 1, trace_fp) != 1)
+    return 0;
+
+  req->time_us = get_le(&record[0], 8);
+  req->latency_us = get_le(&record[8], 4);
+  req->conn_id = get_le(&record[12], 2);
+  req->unit = record[14];
+  req->exception = record[15];
+  req->pdu_len = record[16];
+
+  /* A record cut short by the end of a running trace is ignored */
+  if ((req->pdu_len == 0) || (req->pdu_len > MAX_PDU_LENGTH) ||
+      (fread(req->pdu, req->pdu_len, 1, trace_fp) != 1))
+    return 0;
+
+  trace_end_us = req->time_us;
+  return 1;
+}
+
+
+/*
+ * Check if a request writes registers or coils.
+ */
+static int is_write(const trace_req_t *req)
+{
+  switch (req->pdu[0]) {
+    case 0x05:
+    case 0x06:
+    case 0x0F:
+    case 0x10:
+    case 0x15:
+    case 0x16:
+    case 0x17:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+
+/*
+ * Connect a replay connection to the server.
+ * Returns 0 on success or -1 on error.
+ */
+static int replay_connect(replay_conn_t *conn)
+{
+  struct sockaddr_un un_addr;
+  struct sockaddr_in in_addr;
+  char name[sizeof(un_addr.sun_path)];
+  const char *path;
+  socklen_t len;
+  int one = 1;
+
+  conn->rx_len = 0;
+
+  if ((strcmp(ip_addr, "unix") == 0) || (strncmp(ip_addr, "unix:", 5) == 0)) {
+    if (ip_addr[4]) {
+      path = &ip_addr[5];
+    }
+    else {
+      snprintf(name, sizeof(name), MODBUSTCP_SERVER_UNIX_NAME, tcp_port);
+      path = name;
+    }
+    if (strlen(path) >= sizeof(un_addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    memset(&un_addr, 0, sizeof(un_addr));
+    un_addr.sun_family = AF_UNIX;
+    memcpy(un_addr.sun_path, path, strlen(path));
+    len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    if (path[0] == '@')
+      un_addr.sun_path[0] = '\0';
+    else
+      len++;
+
+    conn->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1)
+      return -1;
+    if (connect(conn->fd, (struct sockaddr *)&un_addr, len) == -1) {
+      close(conn->fd);
+      conn->fd = -1;
+      return -1;
+    }
+    return 0;
+  }
+
+  memset(&in_addr, 0, sizeof(in_addr));
+  in_addr.sin_family = AF_INET;
+  in_addr.sin_port = htons(tcp_port);
+  if (inet_pton(AF_INET, ip_addr, &in_addr.sin_addr) != 1) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn->fd == -1)
+    return -1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(conn->fd, (struct sockaddr *)&in_addr, sizeof(in_addr)) == -1) {
+    close(conn->fd);
+    conn->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * Close a replay connection after an error, the requests in flight
+ * are counted as connection errors (or timeouts), and reconnect.
+ */
+static void replay_reconnect(replay_conn_t *conn, int timeout)
+{
+  int i;
+
+  for (i=0; i<MAX_OUTSTANDING; i++) {
+    if (!conn->slots[i].used)
+      continue;
+    if (timeout)
+      counters[conn->slots[i].function].timeouts++;
+    else
+      counters[conn->slots[i].function].conn_errors++;
+    conn->slots[i].used = 0;
+  }
+  conn->outstanding = 0;
+
+  if (conn->fd != -1)
+    close(conn->fd);
+  conn->fd = -1;
+  replay_connect(conn);
+}
+
+
+/*
+ * Record a latency sample.
+ */
+static void add_sample(sample_set_t *set, int function, uint64_t us)
+{
+  if (set->num == set->max) {
+    sample_t *p;
+
+    set->max = set->max ? 2*set->max : 65536;
+    p = realloc(set->samples, set->max * sizeof(sample_t));
+    if (p == NULL) {
+      set->max = set->num;
+      return;
+    }
+    set->samples = p;
+  }
+  set->samples[set->num].us = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+  set->samples[set->num].function = function;
+  set->num++;
+}
+
+
+/*
+ * Send a request of the trace, due at due_us.
+ * Returns 0 if the request was sent (or dropped after an error),
+ * -1 if its connection has too many requests in flight.
+ */
+static int send_request(const trace_req_t *req, uint64_t due_us)
+{
+  replay_conn_t *conn = &conns[req->conn_id % num_conns];
+  uint8_t frame[MAX_ADU_LENGTH];
+  uint16_t tid = conn->tid + 1;
+  slot_t *slot = &conn->slots[tid % MAX_OUTSTANDING];
+  int len = MBAP_LENGTH + req->pdu_len;
+  int function = req->pdu[0] & 0x7F;
+
+  if (slot->used)
+    return -1;
+
+  counters[function].sent++;
+  if (req->exception == 0)
+    add_sample(&trace_samples, function, req->latency_us);
+
+  if (conn->fd == -1) {
+    counters[function].conn_errors++;
+    replay_connect(conn);
+    return 0;
+  }
+
+  frame[0] = tid >> 8;
+  frame[1] = tid & 0xFF;
+  frame[2] = 0;
+  frame[3] = 0;
+  frame[4] = (req->pdu_len + 1) >> 8;
+  frame[5] = (req->pdu_len + 1) & 0xFF;
+  frame[6] = req->unit;
+  memcpy(&frame[7], req->pdu, req->pdu_len);
+
+  if (send(conn->fd, frame, len, MSG_NOSIGNAL) != len) {
+    counters[function].conn_errors++;
+    replay_reconnect(conn, 0);
+    return 0;
+  }
+  conn->tid = tid;
+  conn->outstanding++;
+  slot->used = 1;
+  slot->function = function;
+  slot->exception = req->exception;
+  slot->due_us = due_us;
+  slot->sent_us = time_us();
+  return 0;
+}
+
+
+/*
+ * Read the replies received on a connection.
+ */
+static void receive_replies(replay_conn_t *conn)
+{
+  slot_t *slot;
+  uint8_t exception;
+  uint16_t tid;
+  int len;
+  int rc;
+
+  rc = read(conn->fd, &conn->rx_buf[conn->rx_len], sizeof(conn->rx_buf) - conn->rx_len);
+  if (rc <= 0) {
+    if ((rc == -1) && ((errno == EINTR) || (errno == EAGAIN)))
+      return;
+    replay_reconnect(conn, 0);
+    return;
+  }
+  conn->rx_len += rc;
+
+  while (conn->rx_len >= MBAP_LENGTH) {
+    len = MBAP_LENGTH - 1 + ((conn->rx_buf[4] << 8) | conn->rx_buf[5]);
+    if ((len <= MBAP_LENGTH) || (len > MAX_ADU_LENGTH)) {
+      replay_reconnect(conn, 0);
+      return;
+    }
+    if (conn->rx_len < len)
+      return;
+
+    tid = (conn->rx_buf[0] << 8) | conn->rx_buf[1];
+    slot = &conn->slots[tid % MAX_OUTSTANDING];
+    if (!slot->used) {
+      /* Reply to an unknown request */
+      replay_reconnect(conn, 0);
+      return;
+    }
+
+    exception = (conn->rx_buf[MBAP_LENGTH] & 0x80) ? conn->rx_buf[MBAP_LENGTH+1] : 0;
+    if (exception)
+      counters[slot->function].exceptions++;
+    else
+      counters[slot->function].ok++;
+    if (exception != slot->exception)
+      counters[slot->function].mismatches++;
+    if (!exception)
+      add_sample(&replay_samples, slot->function, time_us() - slot->due_us);
+    slot->used = 0;
+    conn->outstanding--;
+
+    conn->rx_len -= len;
+    memmove(conn->rx_buf, &conn->rx_buf[len], conn->rx_len);
+  }
+}
+
+
+/*
+ * qsort() comparison of latency samples.
+ */
+static int compare_samples(const void *a, const void *b)
+{
+  const sample_t *sa = a;
+  const sample_t *sb = b;
+
+  return (sa->us > sb->us) - (sa->us < sb->us);
+}
+
+
+/*
+ * Get the latency percentiles of a function code (-1 for all).
+ * The samples must be sorted.
+ */
+static percentiles_t get_percentiles(const sample_set_t *set, int function)
+{
+  percentiles_t p = { 0, 0, 0, 0 };
+  unsigned long n = 0;
+  unsigned long k = 0;
+  unsigned long i;
+
+  for (i=0; i<set->num; i++) {
+    if ((function == -1) || (set->samples[i].function == function))
+      n++;
+  }
+  if (n == 0)
+    return p;
+
+  for (i=0; i<set->num; i++) {
+    if ((function != -1) && (set->samples[i].function != function))
+      continue;
+    if (k == (n-1)*50/100)
+      p.p50 = set->samples[i].us / 1000.0;
+    if (k == (n-1)*95/100)
+      p.p95 = set->samples[i].us / 1000.0;
+    if (k == (n-1)*99/100)
+      p.p99 = set->samples[i].us / 1000.0;
+    p.max = set->samples[i].us / 1000.0;
+    k++;
+  }
+  return p;
+}
+
+
+/*
+ * Write the latency percentiles of the trace and the replay as JSON.
+ */
+static void json_latency(FILE *fp, int function)
+{
+  percentiles_t t = get_percentiles(&trace_samples, function);
+  percentiles_t r = get_percentiles(&replay_samples, function);
+
+  fprintf(fp, "\"trace_latency_ms\": {\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f}, ",
+          t.p50, t.p95, t.p99, t.max);
+  fprintf(fp, "\"replay_latency_ms\": {\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+          r.p50, r.p95, r.p99, r.max);
+}
+
+
+/*
+ * Print the results as text and optionally as JSON.
+ */
+static void report(double elapsed)
+{
+  counters_t total;
+  percentiles_t p;
+  char start_str[32];
+  time_t start_sec = trace_start / 1000000;
+  FILE *fp = NULL;
+  int first = 1;
+  int i;
+
+  memset(&total, 0, sizeof(total));
+  for (i=0; i<NUM_FUNCTIONS; i++) {
+    total.sent += counters[i].sent;
+    total.ok += counters[i].ok;
+    total.exceptions += counters[i].exceptions;
+    total.mismatches += counters[i].mismatches;
+    total.timeouts += counters[i].timeouts;
+    total.conn_errors += counters[i].conn_errors;
+    total.skipped += counters[i].skipped;
+  }
+  qsort(trace_samples.samples, trace_samples.num, sizeof(sample_t), compare_samples);
+  qsort(replay_samples.samples, replay_samples.num, sizeof(sample_t), compare_samples);
+
+  strftime(start_str, sizeof(start_str), "%Y-%m-%d %H:%M:%S", localtime(&start_sec));
+  printf("Trace:       %s, started %s, %.2f s\n", trace_file, start_str, trace_end_us / 1000000.0);
+  printf("Replay:      %.2f s at %.2fx speed, %d connections\n", elapsed, speed, num_conns);
+  printf("Requests:    %lu sent, %lu ok, %lu exceptions, %lu timeouts, %lu connection errors\n",
+         total.sent, total.ok, total.exceptions, total.timeouts, total.conn_errors);
+  printf("             %lu writes skipped, %lu replies differing from the trace\n",
+         total.skipped, total.mismatches);
+  printf("Throughput:  %.1f requests/s\n", total.ok / elapsed);
+  printf("Latency ms:  %-8s %8s %8s %8s %8s %10s\n", "", "p50", "p95", "p99", "max", "ok");
+  for (i=-1; i<NUM_FUNCTIONS; i++) {
+    char name[16];
+
+    if ((i >= 0) && (counters[i].sent == 0))
+      continue;
+    if (i == -1)
+      snprintf(name, sizeof(name), "all");
+    else
+      snprintf(name, sizeof(name), "FC %02X", i);
+
+    p = get_percentiles(&trace_samples, i);
+    printf("  %-10s %-8s %8.2f %8.2f %8.2f %8.2f\n", name, "trace", p.p50, p.p95, p.p99, p.max);
+    p = get_percentiles(&replay_samples, i);
+    printf("  %-10s %-8s %8.2f %8.2f %8.2f %8.2f %10lu\n", "", "replay", p.p50, p.p95, p.p99, p.max,
+           (i == -1) ? total.ok : counters[i].ok);
+  }
+
+  if (json_file == NULL)
+    return;
+  if (strcmp(json_file, "-") == 0) {
+    fp = stdout;
+  }
+  else if ((fp = fopen(json_file, "w")) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", json_file, strerror(errno));
+    return;
+  }
+
+  fprintf(fp, "{\"trace\": \"%s\", \"trace_start\": \"%s\", \"trace_duration_s\": %.3f,\n",
+          trace_file, start_str, trace_end_us / 1000000.0);
+  fprintf(fp, " \"speed\": %.2f, \"connections\": %d, \"duration_s\": %.3f,\n", speed, num_conns, elapsed);
+  fprintf(fp, " \"sent\": %lu, \"ok\": %lu, \"exceptions\": %lu, \"timeouts\": %lu, \"conn_errors\": %lu,\n",
+          total.sent, total.ok, total.exceptions, total.timeouts, total.conn_errors);
+  fprintf(fp, " \"skipped\": %lu, \"mismatches\": %lu, \"throughput\": %.1f,\n",
+          total.skipped, total.mismatches, total.ok / elapsed);
+  fprintf(fp, " ");
+  json_latency(fp, -1);
+  fprintf(fp, ",\n \"functions\": {");
+  for (i=0; i<NUM_FUNCTIONS; i++) {
+    if (counters[i].sent + counters[i].skipped == 0)
+      continue;
+    fprintf(fp, "%s\n  \"%d\": {\"sent\": %lu, \"ok\": %lu, \"exceptions\": %lu, \"timeouts\": %lu, "
+            "\"conn_errors\": %lu, \"skipped\": %lu, \"mismatches\": %lu, ",
+            first ? "" : ",", i, counters[i].sent, counters[i].ok, counters[i].exceptions,
+            counters[i].timeouts, counters[i].conn_errors, counters[i].skipped, counters[i].mismatches);
+    json_latency(fp, i);
+    fprintf(fp, "}");
+    first = 0;
+  }
+  fprintf(fp, "\n }\n}\n");
+
+  if (fp != stdout)
+    fclose(fp);
+}
+
+
+static void usage(const char *prog)
+{
+  printf("Modbus TCP trace replay, version %s\n", VERSION);
+  printf("usage: %s [-h <IP_ADDR>] [-p <TCP_PORT>] [-s <SPEED>] [-c <CONN>] [-w]\n", prog);
+  printf("          [-t <MSEC>] [-j <FILE>] <TRACE_FILE>\n");
+  printf("       <IP_ADDR> can be \"unix\" or \"unix:<NAME>\" for a local Unix domain socket\n");
+  printf("       without -p the requests are sent to the port of the traced server\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+  struct pollfd pfds[MAX_CONNECTIONS];
+  trace_req_t req;
+  uint64_t start, now, due = 0;
+  int have_req;
+  int wait_ms;
+  int opt;
+  int i;
+
+
+  /* Parse command line */
+  while ((opt = getopt(argc, argv, "h:p:s:c:wt:j:")) != -1) {
+    switch (opt) {
+      case 'h': ip_addr = optarg; break;
+      case 'p': tcp_port = atoi(optarg); break;
+      case 's': speed = atof(optarg); break;
+      case 'c': num_conns = atoi(optarg); break;
+      case 'w': writes = 1; break;
+      case 't': timeout_ms = atoi(optarg); break;
+      case 'j': json_file = optarg; break;
+      default:
+        usage(argv[0]);
+        return 0;
+    }
+  }
+  if ((optind != argc - 1) || (speed <= 0) || (num_conns < 1) || (num_conns > MAX_CONNECTIONS) ||
+      (timeout_ms < 1)) {
+    usage(argv[0]);
+    return -1;
+  }
+  trace_file = argv[optind];
+
+  if (trace_open() == -1)
+    return -1;
+
+  for (i=0; i<num_conns; i++) {
+    if (replay_connect(&conns[i]) == -1) {
+      fprintf(stderr, "Connection to %s : %d failed: %s\n", ip_addr, tcp_port, strerror(errno));
+      return -1;
+    }
+  }
+
+  start = time_us();
+  have_req = trace_read(&req);
+
+  /* Main loop: send the requests when due and collect the replies */
+  while (1) {
+    int outstanding = 0;
+
+    now = time_us();
+
+    for (i=0; i<num_conns; i++) {
+      replay_conn_t *conn = &conns[i];
+      int j;
+
+      if (conn->fd == -1)
+        continue;
+      for (j=0; j<MAX_OUTSTANDING; j++) {
+        if (conn->slots[j].used && (now - conn->slots[j].sent_us > (uint64_t)timeout_ms * 1000)) {
+          /* The reply may still come, so the connection is reopened */
+          replay_reconnect(conn, 1);
+          break;
+        }
+      }
+    }
+
+    while (have_req) {
+      due = start + (uint64_t)(req.time_us / speed);
+      if (due > now)
+        break;
+      if (!writes && is_write(&req)) {
+        counters[req.pdu[0] & 0x7F].skipped++;
+      }
+      else if (send_request(&req, due) == -1) {
+        /* Retried when replies made room, the delay counts as latency */
+        break;
+      }
+      have_req = trace_read(&req);
+    }
+
+    for (i=0; i<num_conns; i++)
+      outstanding += conns[i].outstanding;
+
+    if (!have_req && (outstanding == 0))
+      break;
+
+    /* Wait for replies or until the next request is due */
+    wait_ms = 10;
+    if (have_req && (due > now) && (due - now < 10000))
+      wait_ms = (int)((due - now + 999) / 1000);
+    for (i=0; i<num_conns; i++) {
+      pfds[i].fd = conns[i].fd;
+      pfds[i].events = POLLIN;
+    }
+    if (poll(pfds, num_conns, wait_ms) > 0) {
+      for (i=0; i<num_conns; i++) {
+        if ((conns[i].fd != -1) && (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)))
+          receive_replies(&conns[i]);
+      }
+    }
+  }
+
+  report((time_us() - start) / 1000000.0);
+
+  for (i=0; i<num_conns; i++) {
+    if (conns[i].fd != -1)
+      close(conns[i].fd);
+  }
+  fclose(trace_fp);
+  free(trace_samples.samples);
+  free(replay_samples.samples);
+  return 0;
+}
@@ -0,0 +1,414 @@
+/******************************************************************
+*
+* Pulse counter daemon: high frequency capture mode
+* (see pulsecount_capture.h)
+*
+*
+* Author: Ondrej Wisniewski
+*
+* Changelog:
+*   17-10-2026: Initial version
+*
+* Copyright 2013-2015, DEK Italia
+*
+* This file is part of the Telegea platform.
+*
+* Telegea is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+*
+******************************************************************/
+
+#define _GNU_SOURCE                       /* CPU affinity */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+
+#include "bcm2835.h"
+#include "pulsecount_capture.h"
+
+typedef struct
+{
+   struct timespec time;
+   uint32_t events;                       /* pins with an event since the last sample */
+   uint32_t levels;                       /* levels of the pins */
+}
+CAPTURE_SAMPLE_t;
+
+static const CAPTURE_BACKEND_t *capture_backend;
+static uint32_t capture_mask;
+static unsigned long capture_period_ns;
+static int capture_cpu;
+static pthread_t capture_thread;
+static volatile int capture_running = 0;
+static int event_fd = -1;
+
+/* Sample ring, written by the capture thread, read by capture_drain() */
+static CAPTURE_SAMPLE_t ring[CAPTURE_RING];
+static unsigned long ring_head;
+static unsigned long ring_tail;
+static int ring_signaled;
+
+/* Edge detection state of capture_drain() */
+static uint32_t last_levels;
+static uint32_t pending;
+
+static CAPTURE_STATS_t stats;
+
+
+/**********************************************************
+ * Function: push_sample()
+ *
+ * Description:
+ *           Queue a sample and wake up the consumer if it
+ *           wasn't woken up since it last drained the ring
+ *********************************************************/
+static void push_sample(const CAPTURE_SAMPLE_t *sample)
+{
+   unsigned long head = ring_head;
+   uint64_t one = 1;
+
+   if (head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) >= CAPTURE_RING)
+   {
+      stats.overruns++;
+      return;
+   }
+   ring[head % CAPTURE_RING] = *sample;
+   __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+
+   if (!__atomic_exchange_n(&ring_signaled, 1, __ATOMIC_SEQ_CST))
+   {
+      if (write(event_fd, &one, sizeof(one)) < 0) {}
+   }
+}
+
+
+/**********************************************************
+ * Function: capture_loop()
+ *
+ * Description:
+ *           Capture thread: take a sample every period, on
+ *           absolute times so the rate doesn't drift. After
+ *           a late wake up the missed periods are skipped and
+ *           the thread still sleeps until the next period
+ *           boundary, so with real time priority it never
+ *           keeps the CPU from the counting loop.
+ *********************************************************/
+static void *capture_loop(void *arg)
+{
+   CAPTURE_SAMPLE_t sample;
+   struct timespec next, cpu;
+   uint32_t levels = last_levels;
+   uint64_t next_ns, sample_ns;
+   cpu_set_t cpus;
+   struct sched_param sp;
+
+   if (capture_cpu >= 0)
+   {
+      CPU_ZERO(&cpus);
+      CPU_SET(capture_cpu, &cpus);
+      if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+         syslog(LOG_DAEMON | LOG_ERR, "Unable to pin the capture thread to CPU %d", capture_cpu);
+   }
+   sp.sched_priority = sched_get_priority_min(SCHED_FIFO);
+   if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0)
+      syslog(LOG_DAEMON | LOG_NOTICE, "Capture thread runs without real time priority");
+
+   clock_gettime(CLOCK_MONOTONIC, &next);
+   next_ns = (uint64_t)next.tv_sec * 1000000000 + next.tv_nsec;
+   while (capture_running)
+   {
+      capture_backend->sample(capture_mask, &sample.events, &sample.levels);
+      clock_gettime(CLOCK_MONOTONIC, &sample.time);
+      stats.samples++;
+
+      if (sample.events || (sample.levels != levels))
+         push_sample(&sample);
+      levels = sample.levels;
+
+      /* Next sample time, periods missed by a late wake up are skipped */
+      next_ns += capture_period_ns;
+      sample_ns = (uint64_t)sample.time.tv_sec * 1000000000 + sample.time.tv_nsec;
+      if (sample_ns >= next_ns)
+      {
+         stats.late += (sample_ns - next_ns) / capture_period_ns + 1;
+         next_ns += ((sample_ns - next_ns) / capture_period_ns + 1) * capture_period_ns;
+      }
+      next.tv_sec = next_ns / 1000000000;
+      next.tv_nsec = next_ns % 1000000000;
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+   }
+
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+   stats.cpu_ns = (uint64_t)cpu.tv_sec * 1000000000 + cpu.tv_nsec;
+   return NULL;
+}
+
+
+int capture_start(const CAPTURE_BACKEND_t *backend, uint32_t mask, unsigned long rate, int cpu)
+{
+   uint32_t events;
+
+   if ((rate == 0) || (rate > CAPTURE_MAX_RATE))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid capture rate %lu Hz (1 to %d Hz)", rate, CAPTURE_MAX_RATE);
+      return -1;
+   }
+
+   event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (event_fd < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "eventfd() failed: %s", strerror(errno));
+      return -1;
+   }
+   if (backend->open(mask) != 0)
+   {
+      close(event_fd);
+      event_fd = -1;
+      return -1;
+   }
+
+   capture_backend = backend;
+   capture_mask = mask;
+   capture_period_ns = 1000000000 / rate;
+   capture_cpu = cpu;
+   memset(&stats, 0, sizeof(stats));
+   ring_head = ring_tail = 0;
+   ring_signaled = 0;
+
+   /* The levels before the first sample, older events are dropped */
+   backend->sample(mask, &events, &last_levels);
+   pending = 0;
+
+   capture_running = 1;
+   if (pthread_create(&capture_thread, NULL, capture_loop, NULL) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Error creating the capture thread");
+      capture_running = 0;
+      backend->close(mask);
+      close(event_fd);
+      event_fd = -1;
+      return -1;
+   }
+
+   syslog(LOG_DAEMON | LOG_NOTICE, "Capturing pins 0x%08x with %s at %lu Hz", mask, backend->name, rate);
+   return 0;
+}
+
+
+int capture_fd(void)
+{
+   return event_fd;
+}
+
+
+void capture_drain(capture_edge_cb edge, void *arg)
+{
+   const CAPTURE_SAMPLE_t *sample;
+   unsigned long tail = ring_tail;
+   unsigned long head;
+   uint32_t changed, hidden;
+   uint64_t count;
+   int pin;
+
+   /* Samples queued from now on wake us up again */
+   if (read(event_fd, &count, sizeof(count)) < 0) {}
+   __atomic_store_n(&ring_signaled, 0, __ATOMIC_SEQ_CST);
+   head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+
+   for (; tail != head; tail++)
+   {
+      sample = &ring[tail % CAPTURE_RING];
+
+      /* A level change is an edge. An event without level change is a
+       * pulse (or gap) between two samples, unless it's the late event
+       * of an edge which happened between the event and level reads */
+      changed = sample->levels ^ last_levels;
+      hidden = sample->events & ~changed & ~pending;
+      pending = changed & ~sample->events;
+      last_levels = sample->levels;
+
+      for (pin=0; pin<CAPTURE_PINS; pin++)
+      {
+         if (changed & (1u << pin))
+         {
+            edge(pin, (sample->levels >> pin) & 1, &sample->time, arg);
+         }
+         else if (hidden & (1u << pin))
+         {
+            edge(pin, !((sample->levels >> pin) & 1), &sample->time, arg);
+            edge(pin, (sample->levels >> pin) & 1, &sample->time, arg);
+            stats.hidden++;
+         }
+      }
+   }
+   __atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+}
+
+
+void capture_stop(void)
+{
+   if (!capture_running) return;
+
+   capture_running = 0;
+   pthread_join(capture_thread, NULL);
+   capture_backend->close(capture_mask);
+}
+
+
+void capture_stats(CAPTURE_STATS_t *s)
+{
+   *s = stats;
+}
+
+
+/*
+ * BCM2835 backend: GPIO registers mapped from /dev/mem by shtlib,
+ * edges detected by the synchronous rising and falling edge detect
+ */
+
+static int bcm2835_open(uint32_t mask)
+{
+   int pin;
+
+   if (!bcm2835_init())
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to map the BCM2835 GPIO registers");
+      return -1;
+   }
+   for (pin=0; pin<CAPTURE_PINS; pin++)
+   {
+      if (!(mask & (1u << pin))) continue;
+      bcm2835_gpio_fsel(pin, BCM2835_GPIO_FSEL_INPT);
+      bcm2835_gpio_ren(pin);
+      bcm2835_gpio_fen(pin);
+   }
+   bcm2835_gpio_set_eds_multi(mask);
+   return 0;
+}
+
+static void bcm2835_sample(uint32_t mask, uint32_t *events, uint32_t *levels)
+{
+   /* Events first: an edge after the level read shows up in the next sample */
+   *events = bcm2835_gpio_eds_multi(mask);
+   if (*events) bcm2835_gpio_set_eds_multi(*events);
+   *levels = bcm2835_gpio_lev_multi(mask);
+}
+
+static void bcm2835_release(uint32_t mask)
+{
+   int pin;
+
+   for (pin=0; pin<CAPTURE_PINS; pin++)
+   {
+      if (!(mask & (1u << pin))) continue;
+      bcm2835_gpio_clr_ren(pin);
+      bcm2835_gpio_clr_fen(pin);
+   }
+   bcm2835_gpio_set_eds_multi(mask);
+   bcm2835_close();
+}
+
+const CAPTURE_BACKEND_t capture_bcm2835 = { "bcm2835", bcm2835_open, bcm2835_sample, bcm2835_release };
+
+
+/*
+ * Fake backend: the registers are computed from active low pulse
+ * trains, pulse k of a pin starts at start + phase + k*period
+ */
+
+static uint64_t fake_period_ns = 100000000;   /* 10 Hz */
+static uint64_t fake_width_ns = 50000000;
+static uint64_t fake_start_ns;
+static uint64_t fake_last_ns;
+static uint32_t fake_mask;
+
+static uint64_t fake_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Time of a pin relative to the start of its first pulse, < 0 before */
+static int64_t fake_rel(int pin, uint64_t t)
+{
+   return (int64_t)(t - fake_start_ns) - (int64_t)(pin * fake_period_ns / CAPTURE_PINS);
+}
+
+/* Number of edges of a pin up to a time */
+static uint64_t fake_edges(int pin, uint64_t t)
+{
+   int64_t rel = fake_rel(pin, t);
+
+   if (rel < 0) return 0;
+   return 2 * (rel / fake_period_ns) + 1 + ((uint64_t)rel % fake_period_ns >= fake_width_ns ? 1 : 0);
+}
+
+void capture_fake_config(double freq, unsigned int duty)
+{
+   fake_period_ns = (freq > 0) ? 1e9 / freq : 1000000000;
+   if ((duty == 0) || (duty >= 100)) duty = 50;
+   fake_width_ns = fake_period_ns * duty / 100;
+   if (fake_width_ns == 0) fake_width_ns = 1;
+}
+
+uint64_t capture_fake_pulses(int pin)
+{
+   int64_t rel = fake_rel(pin, fake_last_ns);
+
+   if (!(fake_mask & (1u << pin)) || (rel < (int64_t)fake_width_ns)) return 0;
+   return (rel - fake_width_ns) / fake_period_ns + 1;
+}
+
+static int fake_open(uint32_t mask)
+{
+   /* Pulses start after the first (reference) sample */
+   fake_mask = mask;
+   fake_last_ns = fake_now();
+   fake_start_ns = fake_last_ns + 1000000;
+   return 0;
+}
+
+static void fake_sample(uint32_t mask, uint32_t *events, uint32_t *levels)
+{
+   uint64_t now = fake_now();
+   int64_t rel;
+   int pin;
+
+   *events = 0;
+   *levels = mask;
+   for (pin=0; pin<CAPTURE_PINS; pin++)
+   {
+      if (!(mask & (1u << pin))) continue;
+      if (fake_edges(pin, now) != fake_edges(pin, fake_last_ns))
+         *events |= 1u << pin;
+      rel = fake_rel(pin, now);
+      if ((rel >= 0) && ((uint64_t)rel % fake_period_ns < fake_width_ns))
+         *levels &= ~(1u << pin);
+   }
+   fake_last_ns = now;
+}
+
+static void fake_close(uint32_t mask)
+{
+}
+
+const CAPTURE_BACKEND_t capture_fake = { "fake registers", fake_open, fake_sample, fake_close };
@@ -0,0 +1,163 @@
+/******************************************************************
+*
+* Pulse counter daemon: high frequency capture mode
+*
+*
+* Author: Ondrej Wisniewski
+*
+* In capture mode the pins are not used through the kernel GPIO
+* drivers. A dedicated thread, pinned to a CPU, samples the event
+* detect status and the level of all counter pins at a fixed rate,
+* each with a single register read. The event detect bits latch the
+* edges between two samples, so a pulse shorter than the sample
+* period is still seen.
+*
+* Samples with a change are queued in a ring (single producer, single
+* consumer, no lock) and the counting loop is woken up through an
+* eventfd. capture_drain() turns the queued samples into edges, in the
+* thread of the counting loop.
+*
+* The registers are read through a backend: CAPTURE_BCM2835 maps the
+* GPIO registers of the BCM2835 (shtlib), CAPTURE_FAKE computes them
+* from generated pulse trains to measure the throughput and the miss
+* rate without the hardware (see pulsecount_capture_bench.c).
+*
+* Only the pins 0 to 31 (the first register bank) can be captured.
+*
+* Changelog:
+*   17-10-2026: Initial version
+*
+* Copyright 2013-2015, DEK Italia
+*
+* This file is part of the Telegea platform.
+*
+* Telegea is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+*
+******************************************************************/
+
+#ifndef _PULSECOUNT_CAPTURE_H_
+#define _PULSECOUNT_CAPTURE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define CAPTURE_PINS 32                   /* pins of one register */
+#define CAPTURE_RING 4096                 /* queued samples */
+
+/* Highest sample rate, a sample plus a wake up take some 10 us on
+ * the single core Raspberry Pi 1, which needs most of its time for
+ * the counting loop and the Modbus server at higher rates
+ */
+#define CAPTURE_MAX_RATE 20000
+
+/* Register access of a capture backend */
+typedef struct
+{
+   const char *name;
+   int  (*open)(uint32_t mask);           /* prepare the pins, 0 on success */
+   void (*sample)(uint32_t mask, uint32_t *events, uint32_t *levels); /* read and clear the events */
+   void (*close)(uint32_t mask);
+}
+CAPTURE_BACKEND_t;
+
+extern const CAPTURE_BACKEND_t capture_bcm2835;
+extern const CAPTURE_BACKEND_t capture_fake;
+
+typedef struct
+{
+   unsigned long samples;                 /* samples taken */
+   unsigned long late;                    /* sample periods missed by a late wake up */
+   unsigned long overruns;                /* samples dropped, the ring was full */
+   unsigned long hidden;                  /* pulses (or gaps) shorter than a sample period */
+   uint64_t cpu_ns;                       /* CPU time of the capture thread */
+}
+CAPTURE_STATS_t;
+
+/* Called by capture_drain() for every edge: pin, its level after
+ * the edge (0 or 1) and the time of the sample (CLOCK_MONOTONIC)
+ */
+typedef void (*capture_edge_cb)(int pin, int level, const struct timespec *time, void *arg);
+
+
+/**********************************************************
+ * Function: capture_start()
+ *
+ * Description:
+ *           Prepare the pins of a mask with a backend and
+ *           start the capture thread, sampling at rate Hz
+ *           (up to CAPTURE_MAX_RATE) on the CPU cpu (-1 for
+ *           any)
+ *
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+int capture_start(const CAPTURE_BACKEND_t *backend, uint32_t mask, unsigned long rate, int cpu);
+
+/**********************************************************
+ * Function: capture_fd()
+ *
+ * Description:
+ *           Get the eventfd which is readable when samples
+ *           are queued
+ *
+ * Returns:  file descriptor
+ *********************************************************/
+int capture_fd(void);
+
+/**********************************************************
+ * Function: capture_drain()
+ *
+ * Description:
+ *           Turn the queued samples into edges
+ *********************************************************/
+void capture_drain(capture_edge_cb edge, void *arg);
+
+/**********************************************************
+ * Function: capture_stop()
+ *
+ * Description:
+ *           Stop the capture thread and release the pins,
+ *           queued samples can still be drained
+ *********************************************************/
+void capture_stop(void);
+
+/**********************************************************
+ * Function: capture_stats()
+ *
+ * Description:
+ *           Get the capture statistics
+ *********************************************************/
+void capture_stats(CAPTURE_STATS_t *stats);
+
+/**********************************************************
+ * Function: capture_fake_config()
+ *
+ * Description:
+ *           Set the pulse trains of the fake backend: active
+ *           low pulses of freq Hz with duty % on every pin,
+ *           the pins are shifted in phase
+ *********************************************************/
+void capture_fake_config(double freq, unsigned int duty);
+
+/**********************************************************
+ * Function: capture_fake_pulses()
+ *
+ * Description:
+ *           Get the number of pulses the fake backend ended
+ *           on a pin up to its last sample
+ *
+ * Returns:  number of pulses
+ *********************************************************/
+uint64_t capture_fake_pulses(int pin);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * PURPOSE: Benchmark of the pulsecountd capture mode without the
+ * hardware. The capture thread samples the fake register backend,
+ * which generates active low pulse trains on the pins, and the pulses
+ * are counted from the edges as pulsecountd does. At the end the
+ * counted pulses are compared with the generated ones.
+ *
+ * USAGE = pulsecount_capture_bench [options]
+ *
+ *   -n <PINS>     number of pins (default 8)
+ *   -f <HZ>       pulse frequency on each pin (default 1000)
+ *   -d <DUTY>     duty cycle in % (default 50)
+ *   -r <HZ>       sample rate (default 10000)
+ *   -p <CPU>      CPU to pin the capture thread to (default: any)
+ *   -t <SEC>      duration in seconds (default 10)
+ *
+ * Reports the sample rate reached, the samples missed by late wake
+ * ups, the samples dropped because the counting loop didn't keep up,
+ * the CPU load of the capture thread, the pulses detected between two
+ * samples only (by the event detect bits) and the miss rate. A pulse
+ * and the gap before the next one must both be longer than the sample
+ * period to be counted reliably, so no pulse is missed up to
+ * frequencies of about half the sample rate at 50% duty.
+ *
+ * Build instructions:
+ * gcc pulsecount_capture_bench.c pulsecount_capture.c -o pulsecount_capture_bench -lsht -lpthread -lrt
+ *
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "pulsecount_capture.h"
+
+static uint64_t counted[CAPTURE_PINS];
+static int pulse_started[CAPTURE_PINS];
+
+
+/**********************************************************
+ * Function: count_edge()
+ *
+ * Description:
+ *           Count a pulse at its end (rising edge, the
+ *           pulses are active low)
+ *********************************************************/
+static void count_edge(int pin, int level, const struct timespec *time, void *arg)
+{
+   if (level == 0)
+   {
+      pulse_started[pin] = 1;
+   }
+   else if (pulse_started[pin])
+   {
+      pulse_started[pin] = 0;
+      counted[pin]++;
+   }
+}
+
+
+static void usage(void)
+{
+   printf("Usage: pulsecount_capture_bench [-n <PINS>] [-f <HZ>] [-d <DUTY>] [-r <HZ>] [-p <CPU>] [-t <SEC>]\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+   int num_pins = 8;
+   double freq = 1000;
+   unsigned int duty = 50;
+   unsigned long rate = 10000;
+   int cpu = -1;
+   int duration = 10;
+   struct pollfd pfd;
+   struct timespec start, now;
+   CAPTURE_STATS_t stats;
+   uint64_t generated = 0, total = 0, missed = 0;
+   double elapsed;
+   uint32_t mask;
+   int c, pin;
+
+   while ((c = getopt(argc, argv, "n:f:d:r:p:t:")) != -1)
+   {
+      switch (c)
+      {
+         case 'n': num_pins = atoi(optarg); break;
+         case 'f': freq = atof(optarg); break;
+         case 'd': duty = atoi(optarg); break;
+         case 'r': rate = strtoul(optarg, NULL, 10); break;
+         case 'p': cpu = atoi(optarg); break;
+         case 't': duration = atoi(optarg); break;
+         default: usage(); return 1;
+      }
+   }
+   if ((num_pins < 1) || (num_pins > CAPTURE_PINS) || (freq <= 0) || (duration < 1))
+   {
+      usage();
+      return 1;
+   }
+
+   openlog("pulsecount_capture_bench", LOG_PERROR, LOG_USER);
+   mask = (num_pins == CAPTURE_PINS) ? 0xFFFFFFFF : (1u << num_pins) - 1;
+   capture_fake_config(freq, duty);
+   if (capture_start(&capture_fake, mask, rate, cpu) != 0)
+      return 2;
+
+   /* Count the pulses like the counting loop of pulsecountd */
+   pfd.fd = capture_fd();
+   pfd.events = POLLIN;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   do
+   {
+      if (poll(&pfd, 1, 100) > 0)
+         capture_drain(count_edge, NULL);
+      clock_gettime(CLOCK_MONOTONIC, &now);
+   }
+   while (now.tv_sec - start.tv_sec < duration);
+
+   capture_stop();
+   capture_drain(count_edge, NULL);
+   capture_stats(&stats);
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+   for (pin=0; pin<num_pins; pin++)
+   {
+      generated += capture_fake_pulses(pin);
+      total += counted[pin];
+      if (counted[pin] < capture_fake_pulses(pin))
+         missed += capture_fake_pulses(pin) - counted[pin];
+   }
+
+   printf("Pins:            %d, %.0f Hz pulses, %u%% duty\n", num_pins, freq, duty);
+   printf("Sample rate:     %lu Hz set, %.0f Hz reached\n", rate, stats.samples / elapsed);
+   printf("Late samples:    %lu (%.3f%%)\n", stats.late,
+          100.0 * stats.late / (stats.samples + stats.late));
+   printf("Dropped samples: %lu\n", stats.overruns);
+   printf("Capture CPU:     %.1f%%\n", 100.0 * stats.cpu_ns / 1e9 / elapsed);
+   printf("Pulses:          %llu generated, %llu counted, %lu between samples\n",
+          (unsigned long long)generated, (unsigned long long)total, stats.hidden);
+   printf("Missed:          %llu (%.3f%%)\n", (unsigned long long)missed,
+          generated ? 100.0 * missed / generated : 0.0);
+
+   return missed ? 3 : 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * PURPOSE: Export the completed 1 or 15 minute intervals, or the pulse
+ * events of a counter, from the log of pulsecountd (pulsecount_log.h)
+ * as comma separated values. With a cursor file only the records
+ * written since the last call are printed, so an uploader gets every
+ * interval exactly once by calling it periodically:
+ *
+ *   pulsecount_export -c /media/data/upload.cursor -l 900 >> upload.csv
+ *
+ * USAGE = pulsecount_export [options]
+ *
+ *   -c <FILE>     cursor file, holds the position after the last record
+ *                 printed (default: print all records in the log)
+ *   -l <SEC>      print intervals of this length only (60 or 900)
+ *   -e <N>        print the pulse events of counter N instead (1 for the
+ *                 first counter on the pulsecountd command line)
+ *
+ * Interval lines are: start (UNIX time), length (s), pin, pulses of
+ * counter 1, pulses of counter 2, partial (1 if the counter started or
+ * the clock was set during the interval).
+ * Event lines are: pulse end (UNIX time in ns), width (ms), virtual
+ * counter (1 or 2, 0 if not counted), rejected by the width filter.
+ *
+ * Records which were overwritten before they were exported are
+ * reported on stderr. The cursor file is only updated after all lines
+ * were written to stdout.
+ *
+ * Build instructions:
+ * gcc pulsecount_export.c -o pulsecount_export -lrt
+ *
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "pulsecount_log.h"
+
+#define BATCH 64
+
+
+/**********************************************************
+ * Function: read_cursor()
+ *
+ * Description:
+ *           Read the cursor file, a missing file gives a
+ *           cursor at the oldest record
+ *********************************************************/
+static void read_cursor(const char *name, pulsecount_cursor_t *cursor)
+{
+   FILE *f;
+
+   memset(cursor, 0, sizeof(*cursor));
+   if (name == NULL) return;
+
+   f = fopen(name, "r");
+   if (f == NULL) return;
+   if (fscanf(f, "%u %u", &cursor->epoch, &cursor->seq) != 2)
+      memset(cursor, 0, sizeof(*cursor));
+   fclose(f);
+}
+
+
+/**********************************************************
+ * Function: write_cursor()
+ *
+ * Description:
+ *           Replace the cursor file
+ *
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+static int write_cursor(const char *name, const pulsecount_cursor_t *cursor)
+{
+   char tmp_name[256];
+   FILE *f;
+
+   snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+   f = fopen(tmp_name, "w");
+   if (f == NULL)
+   {
+      fprintf(stderr, "Open %s: %s\n", tmp_name, strerror(errno));
+      return -1;
+   }
+   fprintf(f, "%u %u\n", cursor->epoch, cursor->seq);
+   if ((fflush(f) != 0) || (fsync(fileno(f)) != 0) || (fclose(f) != 0) ||
+       (rename(tmp_name, name) != 0))
+   {
+      fprintf(stderr, "Unable to write %s: %s\n", name, strerror(errno));
+      unlink(tmp_name);
+      return -1;
+   }
+   return 0;
+}
+
+
+static void usage(void)
+{
+   printf("Usage: pulsecount_export [-c <FILE>] [-l <SEC>] [-e <N>]\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+   const char *cursor_file = NULL;
+   unsigned long length = 0;
+   int counter = 0;
+   const pulsecount_log_t *log;
+   pulsecount_cursor_t cursor;
+   pulsecount_interval_t intervals[BATCH];
+   pulsecount_event_t events[BATCH];
+   uint32_t lost, total_lost = 0;
+   int c, fd, i, n;
+
+   while ((c = getopt(argc, argv, "c:l:e:")) != -1)
+   {
+      switch (c)
+      {
+         case 'c': cursor_file = optarg; break;
+         case 'l': length = strtoul(optarg, NULL, 10); break;
+         case 'e': counter = atoi(optarg); break;
+         default: usage(); return 1;
+      }
+   }
+   if ((counter < 0) || (counter > PULSECOUNT_SHM_SLOTS))
+   {
+      usage();
+      return 1;
+   }
+
+   fd = shm_open(PULSECOUNT_LOG_NAME, O_RDONLY, 0);
+   if (fd < 0)
+   {
+      fprintf(stderr, "shm_open(%s): %s (is pulsecountd running?)\n", PULSECOUNT_LOG_NAME, strerror(errno));
+      return 2;
+   }
+   log = mmap(NULL, PULSECOUNT_LOG_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if ((log == MAP_FAILED) || (__atomic_load_n(&log->magic, __ATOMIC_ACQUIRE) != PULSECOUNT_LOG_MAGIC) ||
+       (log->version != PULSECOUNT_LOG_VERSION))
+   {
+      fprintf(stderr, "%s is not a pulsecountd log of version %d\n", PULSECOUNT_LOG_NAME, PULSECOUNT_LOG_VERSION);
+      return 2;
+   }
+
+   read_cursor(cursor_file, &cursor);
+
+   do
+   {
+      if (counter)
+      {
+         n = pulsecount_log_events(log, counter-1, &cursor, events, BATCH, &lost);
+         for (i=0; i<n; i++)
+         {
+            printf("%llu,%u,%d,%d\n", (unsigned long long)events[i].time_ns, events[i].width_ms,
+                   (events[i].flags & (PULSECOUNT_EVENT_REJECTED|PULSECOUNT_EVENT_IGNORED)) ? 0 :
+                   (events[i].flags & PULSECOUNT_EVENT_COUNTER2) ? 2 : 1,
+                   (events[i].flags & PULSECOUNT_EVENT_REJECTED) ? 1 : 0);
+         }
+      }
+      else
+      {
+         n = pulsecount_log_intervals(log, &cursor, intervals, BATCH, &lost);
+         for (i=0; i<n; i++)
+         {
+            if (length && (intervals[i].length != length)) continue;
+            printf("%u,%u,%u,%u,%u,%d\n", intervals[i].start, intervals[i].length, intervals[i].pin,
+                   intervals[i].count[0], intervals[i].count[1],
+                   (intervals[i].flags & PULSECOUNT_INTERVAL_PARTIAL) ? 1 : 0);
+         }
+      }
+      total_lost += lost;
+   }
+   while (n == BATCH);
+
+   if (total_lost)
+      fprintf(stderr, "%u records were overwritten before they were exported\n", total_lost);
+
+   if (fflush(stdout) != 0)
+   {
+      fprintf(stderr, "Unable to write the records: %s\n", strerror(errno));
+      return 3;
+   }
+   if (cursor_file && (write_cursor(cursor_file, &cursor) != 0))
+      return 3;
+
+   return 0;
+}
@@ -0,0 +1,384 @@
+/******************************************************************
+*
+* Pulse counter daemon: persistent counter journal
+* (see pulsecount_journal.h)
+*
+*
+* Author: Ondrej Wisniewski
+*
+* Changelog:
+*   17-10-2026: Initial version
+*
+* Copyright 2013-2015, DEK Italia
+*
+* This file is part of the Telegea platform.
+*
+* Telegea is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+*
+******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+
+#include "pulsecount_journal.h"
+
+/* Offset of the CRC in a record */
+#define CRC_LENGTH offsetof(JOURNAL_RECORD_t, crc)
+
+typedef struct
+{
+   int pin;
+   int n;
+   uint64_t total;                        /* total count of the last commit */
+   uint64_t pending;                      /* pulses added since the last commit */
+}
+JOURNAL_ENTRY_t;
+
+static JOURNAL_ENTRY_t entries[JOURNAL_ENTRIES];
+static int num_entries = 0;
+static int journal_fd = -1;
+static int dir_fd = -1;
+static char journal_name[128];
+static off_t journal_size;
+static uint32_t seq;
+
+static unsigned long num_commits;
+static unsigned long num_records;
+static unsigned long num_compactions;
+
+
+/**********************************************************
+ * Function: crc32()
+ *
+ * Description:
+ *           Calculate the CRC-32 (IEEE 802.3) of a buffer
+ *
+ * Returns:  CRC
+ *********************************************************/
+static uint32_t crc32(const void *buf, size_t len)
+{
+   static uint32_t table[256];
+   const uint8_t *p = buf;
+   uint32_t crc = 0xFFFFFFFF;
+   uint32_t c;
+   int i, k;
+
+   if (table[1] == 0)
+   {
+      for (i=0; i<256; i++)
+      {
+         c = i;
+         for (k=0; k<8; k++)
+            c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : (c >> 1);
+         table[i] = c;
+      }
+   }
+
+   while (len--)
+      crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+   return crc ^ 0xFFFFFFFF;
+}
+
+
+/**********************************************************
+ * Function: set_record()
+ *
+ * Description:
+ *           Fill in a record of an entry
+ *********************************************************/
+static void set_record(JOURNAL_RECORD_t *rec, const JOURNAL_ENTRY_t *entry, int type, uint64_t value)
+{
+   memset(rec, 0, sizeof(*rec));
+   rec->magic = JOURNAL_MAGIC;
+   rec->pin = entry->pin;
+   rec->n = entry->n;
+   rec->type = type;
+   rec->value = value;
+   rec->seq = seq;
+   rec->crc = crc32(rec, CRC_LENGTH);
+}
+
+
+/**********************************************************
+ * Function: find_entry()
+ *
+ * Description:
+ *           Find the entry of a counter, add it if requested
+ *
+ * Returns:  pointer to the entry, NULL if not found
+ *********************************************************/
+static JOURNAL_ENTRY_t *find_entry(int pin, int n, int add)
+{
+   int i;
+
+   for (i=0; i<num_entries; i++)
+   {
+      if ((entries[i].pin == pin) && (entries[i].n == n))
+         return &entries[i];
+   }
+
+   if (!add) return NULL;
+
+   if (num_entries == JOURNAL_ENTRIES)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Journal full, counter %d_%d not journaled", pin, n+1);
+      return NULL;
+   }
+   memset(&entries[num_entries], 0, sizeof(JOURNAL_ENTRY_t));
+   entries[num_entries].pin = pin;
+   entries[num_entries].n = n;
+   return &entries[num_entries++];
+}
+
+
+/**********************************************************
+ * Function: replay()
+ *
+ * Description:
+ *           Read the journal records up to the first invalid
+ *           one and sum up the totals of the counters
+ *
+ * Returns:  number of valid records
+ *********************************************************/
+static int replay(int fd)
+{
+   JOURNAL_RECORD_t rec[64];
+   JOURNAL_ENTRY_t *entry;
+   ssize_t len;
+   int count = 0;
+   int i, n;
+
+   while ((len = read(fd, rec, sizeof(rec))) > 0)
+   {
+      n = len / sizeof(JOURNAL_RECORD_t);
+      for (i=0; i<n; i++)
+      {
+         if ((rec[i].magic != JOURNAL_MAGIC) || (rec[i].crc != crc32(&rec[i], CRC_LENGTH)) ||
+             (rec[i].n > 1) || ((rec[i].type != JOURNAL_DELTA) && (rec[i].type != JOURNAL_TOTAL)))
+         {
+            syslog(LOG_DAEMON | LOG_NOTICE, "Journal %s: invalid record %d, ignoring the rest",
+                   journal_name, count);
+            return count;
+         }
+
+         entry = find_entry(rec[i].pin, rec[i].n, 1);
+         if (entry != NULL)
+         {
+            if (rec[i].type == JOURNAL_TOTAL)
+               entry->total = rec[i].value;
+            else
+               entry->total += rec[i].value;
+         }
+         if ((int32_t)(rec[i].seq - seq) > 0)
+            seq = rec[i].seq;
+         count++;
+      }
+      if (len % sizeof(JOURNAL_RECORD_t))
+      {
+         syslog(LOG_DAEMON | LOG_NOTICE, "Journal %s: incomplete record %d, ignoring it",
+                journal_name, count);
+         break;
+      }
+   }
+
+   return count;
+}
+
+
+/**********************************************************
+ * Function: compact()
+ *
+ * Description:
+ *           Replace the journal with one holding the totals
+ *           of all counters (written to a new file, synced
+ *           and renamed, so one of both is always complete)
+ *
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+static int compact(void)
+{
+   JOURNAL_RECORD_t rec[JOURNAL_ENTRIES];
+   char tmp_name[sizeof(journal_name)+4];
+   ssize_t len;
+   int fd;
+   int i;
+
+   seq++;
+   for (i=0; i<num_entries; i++)
+      set_record(&rec[i], &entries[i], JOURNAL_TOTAL, entries[i].total);
+   len = num_entries * sizeof(JOURNAL_RECORD_t);
+
+   snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", journal_name);
+   fd = open(tmp_name, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0644);
+   if (fd < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Open %s: %s", tmp_name, strerror(errno));
+      return -1;
+   }
+   if ((write(fd, rec, len) != len) || (fdatasync(fd) < 0))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to write %s: %s", tmp_name, strerror(errno));
+      close(fd);
+      unlink(tmp_name);
+      return -1;
+   }
+   if (rename(tmp_name, journal_name) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to rename %s: %s", tmp_name, strerror(errno));
+      close(fd);
+      unlink(tmp_name);
+      return -1;
+   }
+   fsync(dir_fd);
+
+   if (journal_fd >= 0) close(journal_fd);
+   journal_fd = fd;
+   journal_size = len;
+   num_compactions++;
+
+   return 0;
+}
+
+
+int journal_open(const char *dir)
+{
+   int fd;
+   int count;
+
+   snprintf(journal_name, sizeof(journal_name), "%s/%s", dir, JOURNAL_FILE);
+
+   dir_fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+   if (dir_fd < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Open %s: %s", dir, strerror(errno));
+      return -1;
+   }
+
+   num_entries = 0;
+   seq = 0;
+   fd = open(journal_name, O_RDONLY|O_CLOEXEC);
+   if (fd >= 0)
+   {
+      count = replay(fd);
+      close(fd);
+      syslog(LOG_DAEMON | LOG_NOTICE, "Journal %s: %d counters restored from %d records",
+             journal_name, num_entries, count);
+   }
+   else if (errno != ENOENT)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Open %s: %s", journal_name, strerror(errno));
+   }
+
+   num_commits = num_records = num_compactions = 0;
+   if (compact() != 0)
+   {
+      close(dir_fd);
+      dir_fd = -1;
+      return -1;
+   }
+
+   return 0;
+}
+
+
+int journal_restore(int pin, int n, uint64_t *total)
+{
+   JOURNAL_ENTRY_t *entry = find_entry(pin, n, 0);
+
+   if (entry != NULL)
+   {
+      *total = entry->total;
+      return 1;
+   }
+
+   find_entry(pin, n, 1);
+   *total = 0;
+   return 0;
+}
+
+
+void journal_add(int pin, int n, uint64_t delta)
+{
+   JOURNAL_ENTRY_t *entry = find_entry(pin, n, 1);
+
+   if (entry != NULL) entry->pending += delta;
+}
+
+
+int journal_commit(void)
+{
+   JOURNAL_RECORD_t rec[JOURNAL_ENTRIES];
+   ssize_t len;
+   int count = 0;
+   int i;
+
+   if (journal_fd < 0) return -1;
+
+   seq++;
+   for (i=0; i<num_entries; i++)
+   {
+      if (entries[i].pending)
+         set_record(&rec[count++], &entries[i], JOURNAL_DELTA, entries[i].pending);
+   }
+   if (count == 0) return 0;
+
+   len = count * sizeof(JOURNAL_RECORD_t);
+   if ((write(journal_fd, rec, len) != len) || (fdatasync(journal_fd) < 0))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to write %s: %s", journal_name, strerror(errno));
+      /* Drop what was written, the pulses stay pending */
+      if (ftruncate(journal_fd, journal_size) < 0)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Unable to truncate %s: %s", journal_name, strerror(errno));
+      }
+      return -1;
+   }
+   journal_size += len;
+   num_commits++;
+   num_records += count;
+
+   for (i=0; i<num_entries; i++)
+   {
+      entries[i].total += entries[i].pending;
+      entries[i].pending = 0;
+   }
+
+   if (journal_size > JOURNAL_MAX_SIZE)
+      compact();
+
+   return 0;
+}
+
+
+void journal_close(void)
+{
+   if (journal_fd >= 0) close(journal_fd);
+   if (dir_fd >= 0) close(dir_fd);
+   journal_fd = dir_fd = -1;
+}
+
+
+void journal_stats(unsigned long *commits, unsigned long *records, unsigned long *compactions)
+{
+   *commits = num_commits;
+   *records = num_records;
+   *compactions = num_compactions;
+}
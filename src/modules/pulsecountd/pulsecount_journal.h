@@ -0,0 +1,129 @@
+/******************************************************************
+*
+* Pulse counter daemon: persistent counter journal
+*
+*
+* Author: Ondrej Wisniewski
+*
+* The pulse counts are kept across restarts and reboots in the
+* journal file JOURNAL_FILE in a directory on the data partition.
+* Counts are journaled in batches: the deltas since the last commit
+* are appended as records and synced to disk with one write and one
+* fdatasync() per commit. When the file grows beyond
+* JOURNAL_MAX_SIZE it's compacted to one record with the total of
+* each counter, written to a new file which replaces the journal.
+*
+* Each record has a CRC-32. At startup the records are replayed
+* until the first invalid one (e.g. a commit cut by a power loss),
+* which gives the totals of the last complete records.
+*
+* Counters are identified by pin and virtual counter number, so a
+* total is restored to the counter on the same pin.
+*
+* Changelog:
+*   17-10-2026: Initial version
+*
+* Copyright 2013-2015, DEK Italia
+*
+* This file is part of the Telegea platform.
+*
+* Telegea is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+*
+******************************************************************/
+
+#ifndef _PULSECOUNT_JOURNAL_H_
+#define _PULSECOUNT_JOURNAL_H_
+
+#include <stdint.h>
+
+#define JOURNAL_FILE     "pulsecountd.journal"
+#define JOURNAL_MAGIC    0x314A4350       /* "PCJ1" */
+#define JOURNAL_MAX_SIZE (64*1024)        /* size which triggers a compaction */
+#define JOURNAL_ENTRIES  64               /* max counters in the journal */
+
+/* Record types */
+#define JOURNAL_DELTA 1                   /* pulses counted since the last commit */
+#define JOURNAL_TOTAL 2                   /* total count (written by compaction) */
+
+typedef struct
+{
+   uint32_t magic;
+   uint16_t pin;                          /* GPIO pin Kernel Id or line offset */
+   uint8_t  n;                            /* virtual counter, 0 or 1 */
+   uint8_t  type;
+   uint64_t value;
+   uint32_t seq;                          /* commit number */
+   uint32_t crc;                          /* CRC-32 of the record up to here */
+}
+JOURNAL_RECORD_t;
+
+
+/**********************************************************
+ * Function: journal_open()
+ *
+ * Description:
+ *           Open (or create) the journal in a directory and
+ *           replay it, then compact it
+ *
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+int journal_open(const char *dir);
+
+/**********************************************************
+ * Function: journal_restore()
+ *
+ * Description:
+ *           Get the restored total of a counter. The counter
+ *           is added to the journal if it isn't there yet.
+ *
+ * Returns:  1 if a total was restored, 0 otherwise
+ *********************************************************/
+int journal_restore(int pin, int n, uint64_t *total);
+
+/**********************************************************
+ * Function: journal_add()
+ *
+ * Description:
+ *           Add pulses counted by a counter to the next commit
+ *********************************************************/
+void journal_add(int pin, int n, uint64_t delta);
+
+/**********************************************************
+ * Function: journal_commit()
+ *
+ * Description:
+ *           Write the pulses added since the last commit to
+ *           disk, compact the journal if it grew too big
+ *
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+int journal_commit(void);
+
+/**********************************************************
+ * Function: journal_close()
+ *
+ * Description:
+ *           Close the journal (pending pulses are not written)
+ *********************************************************/
+void journal_close(void);
+
+/**********************************************************
+ * Function: journal_stats()
+ *
+ * Description:
+ *           Get the journal statistics since it was opened
+ *********************************************************/
+void journal_stats(unsigned long *commits, unsigned long *records, unsigned long *compactions);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * PURPOSE: Benchmark of the pulsecountd counter journal. Commits batches
+ * of pulses of several counters to a journal as fast as the storage
+ * allows and reports the commit rate and latency, and the pulse rate the
+ * journal sustains with that batch size. At the end the journal is
+ * replayed and the restored totals are checked against the counted ones.
+ *
+ * USAGE = pulsecount_journal_bench [options]
+ *
+ *   -d <DIR>      directory of the journal (default /tmp), use the
+ *                 partition pulsecountd journals to but not its
+ *                 directory: the journal must not exist yet
+ *   -c <COUNT>    number of counters (default 8)
+ *   -b <PULSES>   pulses per commit, spread over the counters
+ *                 (default 1000, as pulsecountd)
+ *   -t <SEC>      duration in seconds (default 10)
+ *
+ * Every commit is synced to the storage, so on an SD card the commit
+ * rate is the one of small synchronous writes. pulsecountd commits at
+ * most once per second, so the sustained pulse rate reported is an
+ * upper limit of what can be counted without losing more than one
+ * batch on a power loss.
+ *
+ * Build instructions:
+ * gcc pulsecount_journal_bench.c pulsecount_journal.c -o pulsecount_journal_bench
+ *
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <stdint.h>
+
+#include "pulsecount_journal.h"
+
+#define MAX_COUNTERS 32
+#define MAX_SAMPLES 1000000
+
+static uint64_t totals[MAX_COUNTERS];
+static uint32_t latency[MAX_SAMPLES];      /* commit latencies in us */
+
+
+/**********************************************************
+ * Function: time_us()
+ *
+ * Description:
+ *           Get the monotonic time in microseconds
+ *********************************************************/
+static uint64_t time_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/**********************************************************
+ * Function: cmp_u32()
+ *
+ * Description:
+ *           Compare function for qsort()
+ *********************************************************/
+static int cmp_u32(const void *a, const void *b)
+{
+   uint32_t x = *(const uint32_t *)a;
+   uint32_t y = *(const uint32_t *)b;
+
+   return (x > y) - (x < y);
+}
+
+
+static void usage(void)
+{
+   printf("Usage: pulsecount_journal_bench [-d <DIR>] [-c <COUNT>] [-b <PULSES>] [-t <SEC>]\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+   const char *dir = "/tmp";
+   int num_counters = 8;
+   long batch = 1000;
+   int duration = 10;
+   char name[256];
+   uint64_t start, now, t0, total, pulses = 0;
+   unsigned long commits, records, compactions, samples = 0;
+   unsigned long errors = 0, mismatches = 0;
+   double elapsed;
+   int c, i;
+
+   while ((c = getopt(argc, argv, "d:c:b:t:")) != -1)
+   {
+      switch (c)
+      {
+         case 'd': dir = optarg; break;
+         case 'c': num_counters = atoi(optarg); break;
+         case 'b': batch = atol(optarg); break;
+         case 't': duration = atoi(optarg); break;
+         default: usage(); return 1;
+      }
+   }
+   if ((num_counters < 1) || (num_counters > MAX_COUNTERS) || (batch < 1) || (duration < 1))
+   {
+      usage();
+      return 1;
+   }
+
+   snprintf(name, sizeof(name), "%s/%s", dir, JOURNAL_FILE);
+   if (access(name, F_OK) == 0)
+   {
+      printf("%s exists, use another directory\n", name);
+      return 1;
+   }
+
+   openlog("pulsecount_journal_bench", LOG_PERROR, LOG_USER);
+   if (journal_open(dir) != 0)
+   {
+      return 1;
+   }
+   for (i=0; i<num_counters; i++)
+      journal_restore(i+1, 0, &totals[i]);
+
+   /* Commit batches of pulses */
+   start = time_us();
+   do
+   {
+      for (i=0; i<num_counters; i++)
+      {
+         total = batch / num_counters + ((i < batch % num_counters) ? 1 : 0);
+         if (total == 0) continue;
+         journal_add(i+1, 0, total);
+         totals[i] += total;
+      }
+
+      t0 = time_us();
+      if (journal_commit() != 0) errors++;
+      now = time_us();
+      if (samples < MAX_SAMPLES) latency[samples++] = now - t0;
+      pulses += batch;
+   }
+   while (now - start < (uint64_t)duration * 1000000);
+   elapsed = (now - start) / 1e6;
+
+   journal_stats(&commits, &records, &compactions);
+   journal_close();
+
+   /* Replay the journal and check the totals */
+   if (journal_open(dir) != 0)
+   {
+      return 1;
+   }
+   for (i=0; i<num_counters; i++)
+   {
+      if (!journal_restore(i+1, 0, &total) || (total != totals[i]))
+         mismatches++;
+   }
+   journal_close();
+   unlink(name);
+
+   qsort(latency, samples, sizeof(latency[0]), cmp_u32);
+
+   printf("Journal:         %s\n", name);
+   printf("Counters:        %d, %ld pulses per commit\n", num_counters, batch);
+   printf("Duration:        %.1f s\n", elapsed);
+   printf("Commits:         %lu (%.0f/s), %lu errors\n", commits, commits / elapsed, errors);
+   printf("Records:         %lu (%.0f/s), %lu compactions\n", records, records / elapsed, compactions);
+   printf("Commit latency:  p50 %u us, p99 %u us, max %u us\n",
+          latency[samples / 2], latency[samples * 99 / 100], latency[samples - 1]);
+   printf("Sustained rate:  %.0f pulses/s\n", pulses / elapsed);
+   printf("Restore check:   %s (%lu of %d counters differ)\n",
+          mismatches ? "FAILED" : "ok", mismatches, num_counters);
+
+   return (mismatches || errors) ? 2 : 0;
+}
@@ -0,0 +1,245 @@
+/******************************************************************
+*
+* Pulse counter daemon: shared memory pulse and interval log
+*
+*
+* Author: Ondrej Wisniewski
+*
+* Besides the counter table (pulsecount_shm.h) pulsecountd publishes
+* the POSIX shared memory object PULSECOUNT_LOG_NAME
+* (/dev/shm/pulsecountd_log) with two kinds of rings:
+*
+*  - per counter, the last PULSECOUNT_EVENTS pulses, with the time of
+*    the pulse end (the kernel timestamp with a GPIO character device)
+*    and the pulse width, also of the pulses which were not counted
+*
+*  - for all counters, the last PULSECOUNT_INTERVALS completed 1 and
+*    15 minute intervals with the pulses counted in each, aligned to
+*    the clock (hh:mm:00, hh:00/15/30/45:00), written about one second
+*    after the interval ended
+*
+* Every record has a sequence number, starting at 1 and incremented
+* for each record of a ring. A reader keeps a cursor with the number
+* of the next record it wants and gets the records written since then
+* with pulsecount_log_intervals() or pulsecount_log_events(), without
+* any system call or lock, never reading a record twice:
+*
+*   fd = shm_open(PULSECOUNT_LOG_NAME, O_RDONLY, 0);
+*   log = mmap(NULL, PULSECOUNT_LOG_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+*   n = pulsecount_log_intervals(log, &cursor, buf, 64, &lost);
+*
+* The cursor also holds the start time of pulsecountd, so after a
+* restart of pulsecountd the reader starts again from the oldest
+* record. Records overwritten before they were read are counted in
+* lost. A cursor of 0 starts at the oldest record still in the ring.
+*
+* Changelog:
+*   17-10-2026: Initial version
+*
+* Copyright 2013-2015, DEK Italia
+*
+* This file is part of the Telegea platform.
+*
+* Telegea is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+*
+******************************************************************/
+
+#ifndef _PULSECOUNT_LOG_H_
+#define _PULSECOUNT_LOG_H_
+
+#include <stdint.h>
+
+#include "pulsecount_shm.h"
+
+#define PULSECOUNT_LOG_NAME      "/pulsecountd_log"
+#define PULSECOUNT_LOG_MAGIC     0x474C4350   /* "PCLG" */
+#define PULSECOUNT_LOG_VERSION   1
+#define PULSECOUNT_EVENTS        64           /* pulses per counter */
+#define PULSECOUNT_INTERVALS     4096         /* intervals of all counters */
+
+/* Event flags */
+#define PULSECOUNT_EVENT_COUNTER2 0x01        /* counted by virtual counter 2 */
+#define PULSECOUNT_EVENT_REJECTED 0x02        /* rejected by the width filter */
+#define PULSECOUNT_EVENT_IGNORED  0x04        /* not counted, virtual counter state unknown */
+
+/* Interval flags */
+#define PULSECOUNT_INTERVAL_PARTIAL 0x01      /* counter started or time changed in the interval */
+
+typedef struct
+{
+   uint32_t seq;                              /* record number, 0 while written */
+   uint16_t width_ms;                         /* pulse width (up to 65535 ms) */
+   uint8_t  flags;
+   uint8_t  reserved;
+   uint64_t time_ns;                          /* pulse end, UNIX time in ns */
+}
+pulsecount_event_t;
+
+typedef struct
+{
+   uint32_t seq;                              /* record number, 0 while written */
+   uint8_t  slot;                             /* slot of the counter table */
+   uint8_t  flags;
+   uint16_t pin;                              /* GPIO pin Kernel Id or line offset */
+   uint32_t start;                            /* interval start, UNIX time */
+   uint32_t length;                           /* interval length in s (60 or 900) */
+   uint32_t count[2];                         /* pulses of counter 1 and 2 */
+}
+pulsecount_interval_t;
+
+typedef struct
+{
+   uint32_t epoch;                            /* start time of pulsecountd */
+   uint32_t seq;                              /* number of the next record */
+}
+pulsecount_cursor_t;
+
+typedef struct
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t epoch;                            /* start time of pulsecountd, UNIX time */
+   uint32_t interval_head;                    /* number of the next interval record */
+   uint32_t event_head[PULSECOUNT_SHM_SLOTS]; /* number of the next event of a counter */
+   pulsecount_interval_t interval[PULSECOUNT_INTERVALS];
+   pulsecount_event_t event[PULSECOUNT_SHM_SLOTS][PULSECOUNT_EVENTS];
+}
+pulsecount_log_t;
+
+#define PULSECOUNT_LOG_SIZE sizeof(pulsecount_log_t)
+
+
+/**********************************************************
+ * Function: pulsecount_log_start()
+ *
+ * Description:
+ *           Check the cursor of a ring against the current
+ *           head: reset it after a restart of pulsecountd,
+ *           move it to the oldest record if it fell behind
+ *
+ * Returns:  number of records lost
+ *********************************************************/
+static inline uint32_t pulsecount_log_start(const volatile pulsecount_log_t *log,
+                                            pulsecount_cursor_t *cursor,
+                                            uint32_t head, uint32_t size)
+{
+   uint32_t oldest = (head > size) ? head - size : 1;
+   uint32_t lost = 0;
+
+   if ((cursor->epoch != log->epoch) || (cursor->seq == 0) || (cursor->seq > head))
+   {
+      cursor->epoch = log->epoch;
+      cursor->seq = oldest;
+   }
+   else if (cursor->seq < oldest)
+   {
+      lost = oldest - cursor->seq;
+      cursor->seq = oldest;
+   }
+   return lost;
+}
+
+
+/**********************************************************
+ * Function: pulsecount_log_intervals()
+ *
+ * Description:
+ *           Copy the interval records written since the
+ *           cursor, up to max, and advance the cursor
+ *
+ * Returns:  number of records copied
+ *********************************************************/
+static inline int pulsecount_log_intervals(const volatile pulsecount_log_t *log,
+                                           pulsecount_cursor_t *cursor,
+                                           pulsecount_interval_t *buf, int max,
+                                           uint32_t *lost)
+{
+   const volatile pulsecount_interval_t *rec;
+   uint32_t head = __atomic_load_n(&log->interval_head, __ATOMIC_ACQUIRE);
+   int n = 0;
+
+   *lost = pulsecount_log_start(log, cursor, head, PULSECOUNT_INTERVALS);
+   while ((cursor->seq != head) && (n < max))
+   {
+      rec = &log->interval[cursor->seq % PULSECOUNT_INTERVALS];
+      if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) == cursor->seq)
+      {
+         buf[n].slot = rec->slot;
+         buf[n].flags = rec->flags;
+         buf[n].pin = rec->pin;
+         buf[n].start = rec->start;
+         buf[n].length = rec->length;
+         buf[n].count[0] = rec->count[0];
+         buf[n].count[1] = rec->count[1];
+         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+         buf[n].seq = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+         if (buf[n].seq == cursor->seq) n++;
+         else (*lost)++;
+      }
+      else
+      {
+         /* Overwritten while we were reading */
+         (*lost)++;
+      }
+      cursor->seq++;
+   }
+   return n;
+}
+
+
+/**********************************************************
+ * Function: pulsecount_log_events()
+ *
+ * Description:
+ *           Copy the pulse events of a counter slot written
+ *           since the cursor, up to max, and advance the
+ *           cursor
+ *
+ * Returns:  number of events copied
+ *********************************************************/
+static inline int pulsecount_log_events(const volatile pulsecount_log_t *log, int slot,
+                                        pulsecount_cursor_t *cursor,
+                                        pulsecount_event_t *buf, int max,
+                                        uint32_t *lost)
+{
+   const volatile pulsecount_event_t *rec;
+   uint32_t head = __atomic_load_n(&log->event_head[slot], __ATOMIC_ACQUIRE);
+   int n = 0;
+
+   *lost = pulsecount_log_start(log, cursor, head, PULSECOUNT_EVENTS);
+   while ((cursor->seq != head) && (n < max))
+   {
+      rec = &log->event[slot][cursor->seq % PULSECOUNT_EVENTS];
+      if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) == cursor->seq)
+      {
+         buf[n].width_ms = rec->width_ms;
+         buf[n].flags = rec->flags;
+         buf[n].reserved = 0;
+         buf[n].time_ns = rec->time_ns;
+         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+         buf[n].seq = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+         if (buf[n].seq == cursor->seq) n++;
+         else (*lost)++;
+      }
+      else
+      {
+         /* Overwritten while we were reading */
+         (*lost)++;
+      }
+      cursor->seq++;
+   }
+   return n;
+}
+
+#endif
@@ -0,0 +1,122 @@
+/******************************************************************
+*
+* Pulse counter daemon: shared memory counter table
+*
+*
+* Author: Ondrej Wisniewski
+*
+* pulsecountd publishes its counters in the POSIX shared memory
+* object PULSECOUNT_SHM_NAME (/dev/shm/pulsecountd), one slot per
+* counter in the order of the command line. Other processes map it
+* read only and get a consistent snapshot of a slot with
+* pulsecount_shm_read() without any system call or lock:
+*
+*   fd = shm_open(PULSECOUNT_SHM_NAME, O_RDONLY, 0);
+*   shm = mmap(NULL, PULSECOUNT_SHM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+*   pulsecount_shm_read(&shm->slot[n], &snap);
+*   value = pulsecount_scaled(snap.count[0], snap.divisor_milli);
+*
+* Each slot is a sequence lock: the counting loop (the only writer)
+* makes seq odd while it changes the slot, a reader retries until it
+* copied the slot with the same even seq before and after.
+*
+* Changelog:
+*   17-10-2026: Initial version
+*
+* Copyright 2013-2015, DEK Italia
+*
+* This file is part of the Telegea platform.
+*
+* Telegea is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+*
+******************************************************************/
+
+#ifndef _PULSECOUNT_SHM_H_
+#define _PULSECOUNT_SHM_H_
+
+#include <stdint.h>
+
+#define PULSECOUNT_SHM_NAME    "/pulsecountd"
+#define PULSECOUNT_SHM_MAGIC   0x544E4350   /* "PCNT" */
+#define PULSECOUNT_SHM_VERSION 1
+#define PULSECOUNT_SHM_SLOTS   32
+
+/* Slot flags */
+#define PULSECOUNT_SLOT_ACTIVE 0x01         /* counter is counting */
+#define PULSECOUNT_SLOT_DUAL   0x02         /* dual virtual counters */
+
+typedef struct
+{
+   uint32_t seq;                            /* odd while the slot is written */
+   uint32_t flags;
+   uint32_t pin;                            /* GPIO pin Kernel Id or line offset */
+   uint32_t divisor_milli;                  /* divisor in 1/1000 */
+   uint64_t count[2];                       /* raw pulse counts of counter 1 and 2 */
+}
+pulsecount_slot_t;
+
+typedef struct
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t num_slots;
+   uint32_t pid;                            /* process id of pulsecountd */
+   pulsecount_slot_t slot[PULSECOUNT_SHM_SLOTS];
+}
+pulsecount_shm_t;
+
+#define PULSECOUNT_SHM_SIZE sizeof(pulsecount_shm_t)
+
+
+/**********************************************************
+ * Function: pulsecount_shm_read()
+ *
+ * Description:
+ *           Copy a consistent snapshot of a counter slot
+ *********************************************************/
+static inline void pulsecount_shm_read(const volatile pulsecount_slot_t *slot,
+                                       pulsecount_slot_t *snap)
+{
+   uint32_t seq;
+
+   do
+   {
+      seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      snap->flags = slot->flags;
+      snap->pin = slot->pin;
+      snap->divisor_milli = slot->divisor_milli;
+      snap->count[0] = slot->count[0];
+      snap->count[1] = slot->count[1];
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   }
+   while ((seq & 1) || (seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED)));
+
+   snap->seq = seq;
+}
+
+
+/**********************************************************
+ * Function: pulsecount_scaled()
+ *
+ * Description:
+ *           Apply the divisor of a slot to a raw pulse count
+ *
+ * Returns:  count / divisor
+ *********************************************************/
+static inline uint64_t pulsecount_scaled(uint64_t count, uint32_t divisor_milli)
+{
+   return (divisor_milli ? (count * 1000) / divisor_milli : 0);
+}
+
+#endif
@@ -0,0 +1,572 @@
+/*
+ * PURPOSE: Pulse generator for pulsecountd without meters, and a
+ * benchmark of the pulse rate pulsecountd counts without losses.
+ *
+ * The pulses are active low, as with the meters, and are generated on
+ * the simulated GPIOs of one of:
+ *
+ *  - a simulated sysfs directory (script/gpio_sysfs_sim.sh), for a
+ *    pulsecountd built with "make GPIO_SIM=<DIR>": each level is
+ *    written to <DIR>/gpio<PIN>/value
+ *
+ *  - a gpio-sim chip (script/gpio_sim.sh), for pulsecountd with
+ *    "-c <chip>": each level is set by pulling the line up or down, the
+ *    kernel timestamps the edges as with real lines
+ *
+ * USAGE = pulsecount_sim -g <DIR> | -c <NAME> [options] <PIN> [<PIN> ...]
+ *
+ *   -g <DIR>      simulated sysfs directory
+ *   -c <NAME>     gpio-sim chip, the name given to gpio_sim.sh create
+ *   -f <HZ>       pulse rate on each pin (default 10)
+ *   -w <MS>       pulse width (default half the pulse period)
+ *   -j <PCT>      jitter, each period varies randomly by up to PCT %
+ *   -b <N>[:<US>] contact bounce, N glitches of US us (default 100) at
+ *                 the start of each pulse
+ *   -n <COUNT>    pulses on each pin (default: for the duration)
+ *   -t <SEC>      duration (default 10)
+ *   -B <HZ,...>   benchmark with these pulse rates
+ *   -N <N,...>    benchmark with the first N pins (default all pins)
+ *
+ * The pins are shifted in phase. Without -B the pulses generated on
+ * each pin are printed at the end.
+ *
+ * With -B pulsecountd must already count the same pins. For each
+ * number of pins and each rate a pulse train of the duration is
+ * generated, the pulses counted by pulsecountd (read from its shared
+ * memory counter table, pulsecount_shm.h) are compared with the pulses
+ * generated, and the highest rate up to which no pulse was lost is
+ * reported for each number of pins. Bounce glitches are pulses as well
+ * for pulsecountd, so set its width filter (-w) when using -b.
+ *
+ * Build instructions:
+ * gcc pulsecount_sim.c -o pulsecount_sim -lrt
+ *
+ * Author: O. Wisniewski
+ * Version: 0.1
+ * Date: 2026/10/17
+ *
+ * Copyright 2013-2015, DEK Italia
+ *
+ * This file is part of the Telegea platform.
+ *
+ * Telegea is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "pulsecount_shm.h"
+
+#define GPIO_SIM_CONFIGFS "/sys/kernel/config/gpio-sim"
+#define MAX_RATES 32
+#define SETTLE_MS 200          /* counts unchanged for this long after a train */
+#define SETTLE_MAX_MS 5000
+
+typedef struct
+{
+   int pin;
+   int fd;                     /* value file or pull attribute */
+   int slot;                   /* slot of pulsecountd, -1 if not counted */
+   int edge;                   /* next edge of the pulse, 0 is its start */
+   uint64_t start_ns;          /* start of the current pulse */
+   uint64_t next_ns;           /* time of the next edge */
+   uint64_t pulses;            /* pulses generated */
+}
+SIM_PIN_t;
+
+static SIM_PIN_t pins[PULSECOUNT_SHM_SLOTS];
+static int num_pins;
+static int use_gpio_sim;
+
+/* Pulse train */
+static double rate = 10;
+static double width_ms;
+static double jitter;
+static int bounces;
+static unsigned long bounce_us = 100;
+static unsigned long count;
+static int duration = 10;
+
+static volatile int stop;
+
+
+static void handleSignal(int signum)
+{
+   stop = 1;
+}
+
+
+static uint64_t now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/**********************************************************
+ * Function: read_line()
+ *
+ * Description:
+ *           Read the first line of a file
+ *
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+static int read_line(const char *name, char *buf, int len)
+{
+   FILE *f = fopen(name, "r");
+
+   if ((f == NULL) || (fgets(buf, len, f) == NULL))
+   {
+      fprintf(stderr, "Unable to read %s: %s\n", name, strerror(errno));
+      if (f) fclose(f);
+      return -1;
+   }
+   fclose(f);
+   buf[strcspn(buf, "\n")] = 0;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: set_level()
+ *
+ * Description:
+ *           Set the simulated input level of a pin
+ *********************************************************/
+static void set_level(SIM_PIN_t *p, int level)
+{
+   const char *val;
+
+   if (use_gpio_sim)
+      val = level ? "pull-up" : "pull-down";
+   else
+      val = level ? "1\n" : "0\n";
+
+   if (pwrite(p->fd, val, strlen(val), 0) < 0)
+      fprintf(stderr, "Unable to set pin %d: %s\n", p->pin, strerror(errno));
+}
+
+
+/**********************************************************
+ * Function: open_pins()
+ *
+ * Description:
+ *           Open the files setting the level of the pins,
+ *           in the simulated sysfs directory dir or of the
+ *           gpio-sim chip name, and set the pins idle (high)
+ *
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+static int open_pins(const char *dir, const char *name)
+{
+   char path[256], dev[64], chip[64];
+   int i;
+
+   if (use_gpio_sim)
+   {
+      snprintf(path, sizeof(path), "%s/%s/dev_name", GPIO_SIM_CONFIGFS, name);
+      if (read_line(path, dev, sizeof(dev)) != 0) return -1;
+      snprintf(path, sizeof(path), "%s/%s/bank0/chip_name", GPIO_SIM_CONFIGFS, name);
+      if (read_line(path, chip, sizeof(chip)) != 0) return -1;
+   }
+
+   for (i=0; i<num_pins; i++)
+   {
+      if (use_gpio_sim)
+         snprintf(path, sizeof(path), "/sys/devices/platform/%s/%s/sim_gpio%d/pull", dev, chip, pins[i].pin);
+      else
+         snprintf(path, sizeof(path), "%s/gpio%d/value", dir, pins[i].pin);
+
+      pins[i].fd = open(path, O_WRONLY);
+      if (pins[i].fd < 0)
+      {
+         fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+         return -1;
+      }
+      set_level(&pins[i], 1);
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: check_train()
+ *
+ * Description:
+ *           Check that the bounce glitches fit in a pulse
+ *           and the pulse in the shortest period
+ *
+ * Returns:  0 if the pulse train can be generated, -1
+ *           otherwise
+ *********************************************************/
+static int check_train(void)
+{
+   if (2 * bounces * bounce_us >= width_ms * 1000)
+   {
+      fprintf(stderr, "Bounce glitches longer than the pulse width of %.3f ms\n", width_ms);
+      return -1;
+   }
+   if (width_ms >= 1000 * (1 - jitter) / rate)
+   {
+      fprintf(stderr, "Pulse width %.3f ms too long for %.0f Hz\n", width_ms, rate);
+      return -1;
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: generate()
+ *
+ * Description:
+ *           Generate the pulse train on the first n pins,
+ *           from now for the duration or count pulses. The
+ *           edges of all pins are set in time order by one
+ *           thread, sleeping until the next one.
+ *
+ * Returns:  maximum delay of an edge in us
+ *********************************************************/
+static unsigned long generate(int n)
+{
+   uint64_t period_ns = 1e9 / rate;
+   uint64_t width_ns = width_ms * 1e6;
+   uint64_t start, end, late, max_late = 0;
+   int edges = 2*bounces + 2;
+   struct timespec ts;
+   SIM_PIN_t *p;
+   int i, active;
+
+   start = now_ns() + 1000000;
+   end = start + (uint64_t)duration * 1000000000;
+   for (i=0; i<n; i++)
+   {
+      pins[i].pulses = 0;
+      pins[i].edge = 0;
+      pins[i].start_ns = start + period_ns * i / n;
+      pins[i].next_ns = pins[i].start_ns;
+   }
+
+   for (active = n; active && !stop; )
+   {
+      /* Next edge of all pins */
+      p = NULL;
+      for (i=0; i<n; i++)
+      {
+         if (pins[i].next_ns && ((p == NULL) || (pins[i].next_ns < p->next_ns)))
+            p = &pins[i];
+      }
+
+      ts.tv_sec = p->next_ns / 1000000000;
+      ts.tv_nsec = p->next_ns % 1000000000;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+         if (stop) return max_late / 1000;
+      late = now_ns() - p->next_ns;
+      if (late > max_late) max_late = late;
+
+      /* Pulse low, bounce glitches high, pulse end high */
+      set_level(p, (p->edge & 1) || (p->edge == edges-1));
+
+      if (++p->edge < edges-1)
+      {
+         p->next_ns = p->start_ns + p->edge * bounce_us * 1000;
+      }
+      else if (p->edge == edges-1)
+      {
+         p->next_ns = p->start_ns + width_ns;
+      }
+      else
+      {
+         p->pulses++;
+         p->edge = 0;
+         p->start_ns += period_ns + (int64_t)(period_ns * jitter * (2*drand48() - 1));
+         p->next_ns = p->start_ns;
+         if ((count && (p->pulses >= count)) || (!count && (p->start_ns >= end)))
+         {
+            p->next_ns = 0;
+            active--;
+         }
+      }
+   }
+
+   return max_late / 1000;
+}
+
+
+/**********************************************************
+ * Function: open_shm()
+ *
+ * Description:
+ *           Map the counter table of pulsecountd and find
+ *           the slots of the pins
+ *
+ * Returns:  counter table, NULL on error
+ *********************************************************/
+static const pulsecount_shm_t *open_shm(void)
+{
+   const pulsecount_shm_t *shm;
+   pulsecount_slot_t snap;
+   int fd, i, k;
+
+   fd = shm_open(PULSECOUNT_SHM_NAME, O_RDONLY, 0);
+   if (fd < 0)
+   {
+      fprintf(stderr, "shm_open(%s): %s (is pulsecountd running?)\n", PULSECOUNT_SHM_NAME, strerror(errno));
+      return NULL;
+   }
+   shm = mmap(NULL, PULSECOUNT_SHM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if ((shm == MAP_FAILED) || (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != PULSECOUNT_SHM_MAGIC) ||
+       (shm->version != PULSECOUNT_SHM_VERSION) || (kill(shm->pid, 0) != 0))
+   {
+      fprintf(stderr, "%s is not the counter table of a running pulsecountd\n", PULSECOUNT_SHM_NAME);
+      return NULL;
+   }
+
+   for (i=0; i<num_pins; i++)
+   {
+      pins[i].slot = -1;
+      for (k=0; k<shm->num_slots; k++)
+      {
+         pulsecount_shm_read(&shm->slot[k], &snap);
+         if ((snap.flags & PULSECOUNT_SLOT_ACTIVE) && (snap.pin == pins[i].pin))
+            pins[i].slot = k;
+      }
+      if (pins[i].slot < 0)
+      {
+         fprintf(stderr, "Pin %d is not counted by pulsecountd\n", pins[i].pin);
+         return NULL;
+      }
+   }
+   return shm;
+}
+
+
+/**********************************************************
+ * Function: counted()
+ *
+ * Description:
+ *           Get the pulses pulsecountd counted on a pin, by
+ *           both virtual counters
+ *
+ * Returns:  pulses counted
+ *********************************************************/
+static uint64_t counted(const pulsecount_shm_t *shm, const SIM_PIN_t *p)
+{
+   pulsecount_slot_t snap;
+
+   pulsecount_shm_read(&shm->slot[p->slot], &snap);
+   return snap.count[0] + snap.count[1];
+}
+
+
+/**********************************************************
+ * Function: settle()
+ *
+ * Description:
+ *           Wait until pulsecountd counted the last edges of
+ *           the first n pins, i.e. their counts didn't change
+ *           for SETTLE_MS
+ *
+ * Returns:  sum of the counts
+ *********************************************************/
+static uint64_t settle(const pulsecount_shm_t *shm, int n)
+{
+   uint64_t sum, last = 0;
+   int i, stable = 0, waited;
+
+   for (waited = 0; waited < SETTLE_MAX_MS; waited += 10)
+   {
+      for (sum = 0, i=0; i<n; i++)
+         sum += counted(shm, &pins[i]);
+      stable = (waited && (sum == last)) ? stable + 10 : 0;
+      if (stable >= SETTLE_MS) break;
+      last = sum;
+      usleep(10000);
+   }
+   return sum;
+}
+
+
+/**********************************************************
+ * Function: parse_list()
+ *
+ * Description:
+ *           Parse a comma separated list of numbers
+ *
+ * Returns:  number of entries
+ *********************************************************/
+static int parse_list(char *s, double *list, int max)
+{
+   char *tok;
+   int n = 0;
+
+   for (tok = strtok(s, ","); tok && (n < max); tok = strtok(NULL, ","))
+      list[n++] = atof(tok);
+   return n;
+}
+
+
+/**********************************************************
+ * Function: benchmark()
+ *
+ * Description:
+ *           Run the pulse trains of all rates with the first
+ *           N pins of each number of pins and print the
+ *           results
+ *
+ * Returns:  0 if no pulse was lost, 3 otherwise
+ *********************************************************/
+static int benchmark(double *rates, int num_rates, double *sizes, int num_sizes, int fixed_width)
+{
+   const pulsecount_shm_t *shm;
+   uint64_t before, after, generated;
+   double max_lossless[MAX_RATES];
+   unsigned long max_late;
+   int i, r, s, n, lossy, result = 0;
+
+   shm = open_shm();
+   if (shm == NULL) return 2;
+
+   printf("Pins    Rate/Hz  Generated    Counted     Missed  Late/us\n");
+   for (s=0; (s<num_sizes) && !stop; s++)
+   {
+      n = sizes[s];
+      max_lossless[s] = 0;
+      lossy = 0;
+      for (r=0; (r<num_rates) && !stop; r++)
+      {
+         rate = rates[r];
+         if (!fixed_width) width_ms = 500 / rate;
+         if (check_train() != 0)
+            return 1;
+
+         before = settle(shm, n);
+         max_late = generate(n);
+         after = settle(shm, n);
+         for (generated = 0, i=0; i<n; i++)
+            generated += pins[i].pulses;
+
+         printf("%4d %10.0f %10llu %10llu %9.3f%% %8lu\n", n, rate,
+                (unsigned long long)generated, (unsigned long long)(after - before),
+                generated ? 100.0 * ((int64_t)generated - (int64_t)(after - before)) / generated : 0.0,
+                max_late);
+         fflush(stdout);
+
+         if (after - before != generated)
+         {
+            lossy = 1;
+            result = 3;
+         }
+         else if (!lossy)
+         {
+            max_lossless[s] = rate;
+         }
+      }
+   }
+
+   for (s=0; s<num_sizes; s++)
+      printf("Max lossless rate with %d pins: %.0f Hz\n", (int)sizes[s], max_lossless[s]);
+
+   return result;
+}
+
+
+static void usage(void)
+{
+   printf("Usage: pulsecount_sim -g <DIR> | -c <NAME> [-f <HZ>] [-w <MS>] [-j <PCT>] [-b <N>[:<US>]]\n"
+          "                      [-n <COUNT>] [-t <SEC>] [-B <HZ>,...] [-N <N>,...] <PIN> [<PIN> ...]\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+   const char *dir = NULL, *name = NULL;
+   double rates[MAX_RATES], sizes[MAX_RATES];
+   int num_rates = 0, num_sizes = 0;
+   unsigned long max_late;
+   char *p;
+   int c, i;
+
+   while ((c = getopt(argc, argv, "g:c:f:w:j:b:n:t:B:N:")) != -1)
+   {
+      switch (c)
+      {
+         case 'g': dir = optarg; break;
+         case 'c': name = optarg; use_gpio_sim = 1; break;
+         case 'f': rate = atof(optarg); break;
+         case 'w': width_ms = atof(optarg); break;
+         case 'j': jitter = atof(optarg) / 100; break;
+         case 'b':
+            bounces = strtol(optarg, &p, 10);
+            if (*p == ':') bounce_us = strtoul(p+1, NULL, 10);
+            break;
+         case 'n': count = strtoul(optarg, NULL, 10); break;
+         case 't': duration = atoi(optarg); break;
+         case 'B': num_rates = parse_list(optarg, rates, MAX_RATES); break;
+         case 'N': num_sizes = parse_list(optarg, sizes, MAX_RATES); break;
+         default: usage(); return 1;
+      }
+   }
+   for (i=optind; (i<argc) && (num_pins<PULSECOUNT_SHM_SLOTS); i++)
+      pins[num_pins++].pin = atoi(argv[i]);
+
+   if (((dir == NULL) == (name == NULL)) || (num_pins == 0) || (rate <= 0) ||
+       (jitter < 0) || (jitter >= 1) || (bounces < 0) || (duration < 1))
+   {
+      usage();
+      return 1;
+   }
+   for (i=0; i<num_sizes; i++)
+   {
+      if ((sizes[i] < 1) || (sizes[i] > num_pins))
+      {
+         fprintf(stderr, "Only %d pins given\n", num_pins);
+         return 1;
+      }
+   }
+   if (num_sizes == 0)
+      sizes[num_sizes++] = num_pins;
+
+   signal(SIGINT, handleSignal);
+   signal(SIGTERM, handleSignal);
+   srand48(getpid());
+
+   if (open_pins(dir, name) != 0)
+      return 2;
+
+   if (num_rates)
+      return benchmark(rates, num_rates, sizes, num_sizes, width_ms != 0);
+
+   if (width_ms == 0)
+      width_ms = 500 / rate;
+   if (check_train() != 0)
+      return 1;
+
+   max_late = generate(num_pins);
+   for (i=0; i<num_pins; i++)
+      printf("Pin %d: %llu pulses\n", pins[i].pin, (unsigned long long)pins[i].pulses);
+   printf("Max edge delay: %lu us\n", max_late);
+
+   return 0;
+}
@@ -9,9 +9,11 @@
 *  - Count pulses on GPIO pins
 *  - Filtering of glitches
 *  - Handle active high or active low logic
+*  - GPIO sysfs or GPIO character device (kernel edge timestamps)
+*  - Capture mode for kHz pulse trains (BCM2835 registers sampled)
 *
 * Build command:
-*  gcc pulsecountd.c -o pulsecountd -lrt -lmbsrv `pkg-config --libs --cflags libmodbus`
+*  gcc pulsecountd.c pulsecount_journal.c pulsecount_capture.c -o pulsecountd -lrt -lpthread -lmbsrv -lsht `pkg-config --libs --cflags libmodbus`
 *   
 * Changelog:
 *   04-11-2013: Initial version
@@ -22,6 +24,31 @@
 *   14-10-2014: Added filtering of glitches, 
 *               Added handling of active high or active low logic
 *   19-11-2014: Permit fractional numbers as divisors
+*   17-10-2026: Count all pins in one process with a single epoll loop,
+*               Modbus server thread reads the counter table directly
+*   17-10-2026: Added GPIO character device backend (option -c)
+*   17-10-2026: Added pulse width filter (option -w), rejected pulses and
+*               pulse width histogram registers
+*   17-10-2026: Counters published in shared memory (pulsecount_shm.h),
+*               export files refreshed once per second
+*   17-10-2026: Added 32 and 64 bit counter registers (option -o for the
+*               word order)
+*   17-10-2026: Added pulse rate registers (instantaneous, 1/5/15 min)
+*   17-10-2026: Counters kept across restarts in a journal (option -j)
+*   17-10-2026: State files of virtual counters watched with inotify and
+*               cached, instead of read per pulse and waited for at start
+*   17-10-2026: Pulse events and 1/15 min intervals published in shared
+*               memory (pulsecount_log.h)
+*   17-10-2026: High frequency capture mode sampling the BCM2835 event
+*               detect register on a dedicated thread (option -s)
+*   17-10-2026: Fixed the rate window sums during the first 15 min after
+*               boot (ring index wrapped)
+*   17-10-2026: 32/64 bit and rate values read once per request instead
+*               of latched for all clients
+*   17-10-2026: Counters journaled by a thread of their own, commits no
+*               longer delay the counting loop
+*   17-10-2026: All signals blocked before the capture and journal threads
+*               are created
 *
 * Copyright 2013-2015, DEK Italia
 * 
@@ -49,32 +76,89 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
-#include <poll.h>
 #include <signal.h>
 #include <syslog.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/gpio.h>
 
 #include "modbustcp_server_lib.h"
+#include "pulsecount_shm.h"
+#include "pulsecount_journal.h"
+#include "pulsecount_log.h"
+#include "pulsecount_capture.h"
 
 
-#define VERSION "0.7"
+#define VERSION "0.21"
 
 /* GPIO sysfs interface */
-#define EXPORT_FILE    "/sys/class/gpio/export"
-#define UNEXPORT_FILE  "/sys/class/gpio/unexport"
-#define GPIO_BASE_FILE "/sys/class/gpio/gpio"
+#ifndef GPIO_SYSFS_DIR
+#define GPIO_SYSFS_DIR "/sys/class/gpio"
+#endif
+#define EXPORT_FILE    GPIO_SYSFS_DIR "/export"
+#define UNEXPORT_FILE  GPIO_SYSFS_DIR "/unexport"
+#define GPIO_BASE_FILE GPIO_SYSFS_DIR "/gpio"
+
+/* GPIO character device interface (kernel headers 5.10 or later),
+ * edge events read from a line with one read() 
+ */
+#define GPIO_DEV_DIR "/dev/"
+#define LINE_EVENTS 16
 
-/* export file for pulse counters */
+/* export file for pulse counters, refreshed every EXPORT_INTERVAL ms */
 #define PULSECOUNT_FILE "/tmp/pulsecount"
-#define MAX_COUNTERS 8 
+#define EXPORT_INTERVAL 1000
+#define MAX_COUNTERS PULSECOUNT_SHM_SLOTS
+
+/* Counts are journaled after JOURNAL_PULSES pulses, or JOURNAL_INTERVAL
+ * seconds after the first pulse not journaled yet, by the journal
+ * thread, so a slow write to the SD card doesn't delay the counting
+ */
+#define JOURNAL_PULSES 1000
+#define JOURNAL_INTERVAL 60
 
 #define DEBUG 0
 
 #define MODBUS_SLAVE_ADDRESS MODBUS_SLAVE_COUNTER_MODULE
 
 #define FIRST_REG 1
-#define LAST_REG 16
+#define LAST_REG (2*MAX_COUNTERS)
+
+/* Pulse width filter registers, FILTER_REGS per counter */
+#define FIRST_FILTER_REG 101
+#define FILTER_REGS 16
+#define LAST_FILTER_REG (FIRST_FILTER_REG + FILTER_REGS*MAX_COUNTERS - 1)
+
+/* Pulse width histogram: bin 0 counts pulses shorter than 1 ms, 
+ * bin k pulses of 2^(k-1) to 2^k-1 ms, the last bin all longer ones
+ */
+#define WIDTH_BINS 12
+
+/* Counter registers with 32 and 64 bit values */
+#define FIRST_REG32 1001
+#define LAST_REG32 (FIRST_REG32 + 4*MAX_COUNTERS - 1)
+#define FIRST_REG64 2001
+#define LAST_REG64 (FIRST_REG64 + 8*MAX_COUNTERS - 1)
+
+/* Pulse rate registers: instantaneous rate and the averages over the
+ * RATE_WINDOWS, from pulses per second in a ring of RATE_SECONDS
+ */
+#define FIRST_RATE_REG 3001
+#define LAST_RATE_REG (FIRST_RATE_REG + 8*MAX_COUNTERS - 1)
+#define RATE_WINDOWS 3
+#define RATE_SECONDS 900
+
+/* Intervals of the interval log, completed INTERVAL_GRACE seconds after
+ * their end (edges may be read late)
+ */
+#define INTERVAL_KINDS 2
+#define INTERVAL_GRACE 1
 
 /*
  * Modbus register map of the COUNTER slave module:
@@ -97,6 +181,46 @@
  *  14   /tmp/pulsecount<7>_2   R   counter 7_2
  *  15   /tmp/pulsecount<8>_1   R   counter 8_1
  *  16   /tmp/pulsecount<8>_2   R   counter 8_2
+ *  ...
+ *  2N-1 /tmp/pulsecount<N>_1   R   counter N_1
+ *  2N   /tmp/pulsecount<N>_2   R   counter N_2
+ *
+ * Pulse width filter of counter N, at B = 101 + 16*(N-1):
+ *
+ *  B     -                      R   pulses rejected by the filter
+ *  B+1   -                      R   min pulse width (ms)
+ *  B+2   -                      R   max pulse width (ms, 0 = no limit)
+ *  B+3   -                      R   width of the last pulse (ms)
+ *  B+4   -                      R   histogram: pulses < 1 ms
+ *  B+5   -                      R   histogram: pulses 1 ms
+ *  B+6   -                      R   histogram: pulses 2-3 ms
+ *  ...
+ *  B+14  -                      R   histogram: pulses 512-1023 ms
+ *  B+15  -                      R   histogram: pulses >= 1024 ms
+ *
+ * Counter N with 32 and 64 bit values, in 2 and 4 registers:
+ *
+ *  1001+4*(N-1)  shared memory  R   counter N_1 (32 bit)
+ *  1003+4*(N-1)  shared memory  R   counter N_2 (32 bit)
+ *  2001+8*(N-1)  shared memory  R   counter N_1 (64 bit)
+ *  2005+8*(N-1)  shared memory  R   counter N_2 (64 bit)
+ *
+ * Pulse rates of counter N (both virtual counters), in 1/1000 of the
+ * counter unit (pulses/divisor) per hour, 32 bit values:
+ *
+ *  3001+8*(N-1)  -              R   instantaneous (last pulse interval)
+ *  3003+8*(N-1)  -              R   average over the last minute
+ *  3005+8*(N-1)  -              R   average over the last 5 minutes
+ *  3007+8*(N-1)  -              R   average over the last 15 minutes
+ *
+ * A request reads each value once, so a value read with one request
+ * is consistent. A value read with one request per register may be
+ * torn, as the counter can change between the requests. The word
+ * order is most significant word first by default (option -o).
+ *
+ * The registers are read from the counter table in memory, the files
+ * are written for scripts only. The pulse counts of the filter 
+ * registers are the low 16 bits of the actual counts.
  */
 
 typedef enum {
@@ -110,7 +234,8 @@ typedef struct
    int   pin;
    float divisor;
    char  statefile[32];
-   pid_t child_pid;
+   unsigned long min_width;
+   unsigned long max_width;
 }
 COUNTERPARAM_t;
 
@@ -118,37 +243,90 @@ typedef struct
 {
    int pin;                    /* GPIO pin Kernel Id */
    int value_fd;               /* GPIO sysfs value file descripter */
-   int state_fd;               /* State file descripter */
+   char statefile[32];         /* State file of virtual counters, empty if none */
+   int state_wd;               /* inotify watch of the state file directory, -1 if none */
+   unsigned char selector;     /* virtual counter selected by the state file, 0 if unknown */
    int export1_fd;             /* Counter 1 export file descripter */
    int export2_fd;             /* Counter 2 export file descripter */
-   unsigned long pulse_count1; /* Counter 1 */
-   unsigned long pulse_count2; /* Counter 2 */
-   float divisor;
+   int watch_fd;               /* inotify watch of a simulated value file, -1 if none */
+   volatile pulsecount_slot_t *slot; /* Counter 1 and 2 in shared memory */
+   uint64_t exported[2];       /* values in the export files */
+   uint64_t journaled[2];      /* counts in the journal */
+   int active;                 /* set up and counting */
+   unsigned char pulse_started;
+   struct timespec pulse_start_time;
+   unsigned long min_width;    /* shortest pulse counted (ms) */
+   unsigned long max_width;    /* longest pulse counted (ms), 0 for no limit */
+   unsigned long last_width;   /* width of the last pulse (ms) */
+   unsigned long rejected;     /* pulses rejected by the width filter */
+   unsigned long width_hist[WIDTH_BINS]; /* widths of all pulses */
+   struct timespec last_pulse_time;
+   unsigned long last_pulse_ms;     /* monotonic time of the last pulse, 0 if none */
+   unsigned long pulse_interval_us; /* interval of the last two pulses, 0 if none */
+   unsigned long rate_start_sec;    /* monotonic time the rates start at */
+   unsigned long rate_sec;          /* second of the current rate_ring entry */
+   unsigned long rate_sum[RATE_WINDOWS]; /* pulses in the rate windows */
+   unsigned short rate_ring[RATE_SECONDS]; /* pulses per second */
+   unsigned long interval_start[INTERVAL_KINDS]; /* UNIX time of the current intervals */
+   uint32_t interval_count[INTERVAL_KINDS][2];   /* pulses in the current intervals */
+   unsigned char interval_flags[INTERVAL_KINDS];
 }
 COUNTER_t;
 
 /* Global variables */
-static COUNTER_t counter;
+
+/* Counter table, written by the counting loop only. The Modbus server
+ * thread reads single filter values, which are aligned machine words
+ * and therefore never seen half written, and the pulse counts from
+ * the shared memory slots like any other process.
+ */
+static COUNTER_t counters[MAX_COUNTERS];
+static pulsecount_shm_t *shm;
+static pulsecount_log_t *pulse_log;
 COUNTERPARAM_t counter_param[MAX_COUNTERS];
 
-static int cont = 1;
-static pid_t parentpid;
-static pid_t modbus_server_pid;
+static volatile sig_atomic_t cont = 1;
+
+/* GPIO character device to count on, sysfs is used if empty */
+static char gpio_chip[64] = "";
+
+/* Capture mode: sample rate (0 for edge events), CPU of the capture
+ * thread, pulse frequency of the fake registers (0 for the hardware) */
+static unsigned long capture_rate = 0;
+static int capture_cpu = -1;
+static double capture_fake_freq = 0;
+static COUNTER_t *capture_counter[CAPTURE_PINS];
+
+/* Directory of the counter journal, no journal if empty */
+static char journal_dir[64] = "";
+static int journal = 0;
+static int journal_event_fd = -1;       /* wakes the journal thread at exit */
+
+/* Least significant word of 32/64 bit registers first */
+static int lsw_first = 0;
+
+/* Length of the rate windows (in s) */
+static const unsigned long rate_window[RATE_WINDOWS] = { 60, 300, 900 };
+
+/* Length of the logged intervals (in s) */
+static const unsigned long interval_length[INTERVAL_KINDS] = { 60, 900 };
+
+/* UNIX time - monotonic time (in ns), updated once per second */
+static int64_t realtime_offset;
 
 
 /*********************************************************************
- * Function: setup()
+ * Function: exportPin()
  * 
- * Description: Setup of globally used resources
+ * Description: Setup of a GPIO pin with the GPIO sysfs interface
  * 
- * Parameters: param     - Parameter struct containing (in)
- *                         Pin number, divisor and status file name
+ * Parameters: pin       - GPIO pin Kernel Id
  *             counter_p - Pointer to counter struct (out)
  * 
  * Return:     0 if cuccessful, >0 in case of error
  * 
  ********************************************************************/
-static int setup(COUNTERPARAM_t param, COUNTER_t* counter_p)
+static int exportPin(int pin, COUNTER_t* counter_p)
 {
   int fd;
   char b[64];
@@ -160,21 +338,20 @@ static int setup(COUNTERPARAM_t param, COUNTER_t* counter_p)
     perror(EXPORT_FILE);
     return 1;
   }  
-  snprintf(b, sizeof(b), "%d", param.pin);
+  snprintf(b, sizeof(b), "%d", pin);
   if (pwrite(fd, (void *)b, strlen(b), 0) < 0) {
     syslog(LOG_DAEMON | LOG_ERR, "Unable to export pin=%d (already in use?): %s",
-            param.pin, strerror(errno));
+            pin, strerror(errno));
     return 2;
   }  
   close(fd);
   
-  /* Save pin Id and divisor */
-  counter_p->pin=param.pin;
-  counter_p->divisor=param.divisor;
+  /* Save pin Id */
+  counter_p->pin=pin;
   
   // Define edge interrupt (only both edges are supported on FoxG20)  
   // to be used later with the poll() function for edge detection
-  snprintf(b, sizeof(b), "%s%d/edge", GPIO_BASE_FILE, param.pin);
+  snprintf(b, sizeof(b), "%s%d/edge", GPIO_BASE_FILE, pin);
   fd = open(b, O_RDWR);
   if (fd < 0) {
     syslog(LOG_DAEMON | LOG_ERR, "Open %s: %s", b, strerror(errno));
@@ -188,7 +365,7 @@ static int setup(COUNTERPARAM_t param, COUNTER_t* counter_p)
   close(fd);
   
   // Define gpio direction as input
-  snprintf(b, sizeof(b), "%s%d/direction", GPIO_BASE_FILE, param.pin);
+  snprintf(b, sizeof(b), "%s%d/direction", GPIO_BASE_FILE, pin);
   fd = open(b, O_RDWR);
   if (fd < 0) {
     syslog(LOG_DAEMON | LOG_ERR, "Open %s: %s", b, strerror(errno));
@@ -202,13 +379,117 @@ static int setup(COUNTERPARAM_t param, COUNTER_t* counter_p)
   close(fd);
   
   // Open gpio value file for fast reading/writing when requested
-  snprintf(b, sizeof(b), "%s%d/value", GPIO_BASE_FILE, param.pin);
+  snprintf(b, sizeof(b), "%s%d/value", GPIO_BASE_FILE, pin);
   fd = open(b, O_RDWR);
   if (fd < 0) {
     syslog(LOG_DAEMON | LOG_ERR, "Open %s: %s", b, strerror(errno));
     return 7;
   }
   counter_p->value_fd=fd;
+  
+  return 0;
+}
+
+
+/*********************************************************************
+ * Function: requestLine()
+ * 
+ * Description: Setup of a GPIO line with the GPIO character device, 
+ *              the line is requested as input with events on both 
+ *              edges, timestamped by the kernel
+ * 
+ * Parameters: line      - line offset on gpio_chip
+ *             counter_p - Pointer to counter struct (out)
+ * 
+ * Return:     0 if cuccessful, >0 in case of error
+ * 
+ ********************************************************************/
+static int requestLine(int line, COUNTER_t* counter_p)
+{
+#ifdef GPIO_V2_GET_LINE_IOCTL
+  struct gpio_v2_line_request req;
+  int fd;
+  
+  fd = open(gpio_chip, O_RDONLY|O_CLOEXEC);
+  if (fd < 0) {
+    syslog(LOG_DAEMON | LOG_ERR, "Open %s: %s", gpio_chip, strerror(errno));
+    return 1;
+  }
+  
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = line;
+  req.num_lines = 1;
+  req.config.flags = GPIO_V2_LINE_FLAG_INPUT | 
+                     GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+  req.event_buffer_size = 4*LINE_EVENTS;
+  strncpy(req.consumer, "pulsecountd", sizeof(req.consumer)-1);
+  if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+    syslog(LOG_DAEMON | LOG_ERR, "Unable to request line=%d of %s (already in use?): %s",
+            line, gpio_chip, strerror(errno));
+    close(fd);
+    return 2;
+  }
+  close(fd);
+  
+  // Events are read until none is left
+  fcntl(req.fd, F_SETFL, O_NONBLOCK);
+  
+  /* Save line offset */
+  counter_p->pin=line;
+  counter_p->value_fd=req.fd;
+  
+  return 0;
+#else
+  syslog(LOG_DAEMON | LOG_ERR, "GPIO character device not supported by this build");
+  return 1;
+#endif
+}
+
+
+/*********************************************************************
+ * Function: setup()
+ * 
+ * Description: Setup of globally used resources
+ * 
+ * Parameters: param     - Parameter struct containing (in)
+ *                         Pin number, divisor and status file name
+ *             counter_p - Pointer to counter struct (out)
+ * 
+ * Return:     0 if cuccessful, >0 in case of error
+ * 
+ ********************************************************************/
+static int setup(COUNTERPARAM_t param, COUNTER_t* counter_p)
+{
+  int fd;
+  int ret;
+  char b[64];
+  
+  // Prepare the GPIO pin with the selected interface
+  if (capture_rate)
+  {
+    // The capture thread prepares the pins
+    if (param.pin >= CAPTURE_PINS) {
+      syslog(LOG_DAEMON | LOG_ERR, "Pin=%d can't be captured (0 to %d only)", param.pin, CAPTURE_PINS-1);
+      return 1;
+    }
+    counter_p->pin=param.pin;
+    counter_p->value_fd=0;
+    ret = 0;
+  }
+  else if (gpio_chip[0])
+    ret = requestLine(param.pin, counter_p);
+  else
+    ret = exportPin(param.pin, counter_p);
+  if (ret != 0)
+    return ret;
+  
+  /* Publish pin and divisor (fixed point), save pulse width filter */
+  counter_p->slot->pin=param.pin;
+  counter_p->slot->divisor_milli=(uint32_t)(param.divisor*1000 + 0.5);
+  if (strlen(param.statefile))
+    counter_p->slot->flags=PULSECOUNT_SLOT_DUAL;
+  counter_p->min_width=param.min_width;
+  counter_p->max_width=param.max_width;
 
   // Open (or create) pulse count export file 1
   snprintf(b, sizeof(b), "%s%d_1", PULSECOUNT_FILE, param.pin);
@@ -240,22 +521,15 @@ static int setup(COUNTERPARAM_t param, COUNTER_t* counter_p)
     }
     counter_p->export2_fd=fd;
     
-    // wait for statefile to be created (this ugly hack will do for now)
-    sleep(3);
-    
-    // Open status file
-    snprintf(b, sizeof(b), "%s", param.statefile);
-    fd = open(b, O_RDONLY);
-    if (fd < 0) {
-      syslog(LOG_DAEMON | LOG_ERR, "Open %s: %s", b, strerror(errno));
-      return 10;
-    }
-    counter_p->state_fd=fd;
+    // The state file is read when it's created or written (see watchState())
+    snprintf(counter_p->statefile, sizeof(counter_p->statefile), "%s", param.statefile);
+    counter_p->selector=0;
   }
   else 
   {
     counter_p->export2_fd=0;
-    counter_p->state_fd=0;
+    counter_p->statefile[0]=0;
+    counter_p->selector=1;
   }
   
   return 0;
@@ -263,279 +537,1387 @@ static int setup(COUNTERPARAM_t param, COUNTER_t* counter_p)
 
 
 /*********************************************************************
- * Function:    cleanup()
+ * Function:    createShm()
  * 
- * Description: Cleanup of globally used resources
+ * Description: Create the shared memory counter table
  * 
- * Parameters:  none
+ * Return:      0 if successful, -1 in case of error
  * 
  ********************************************************************/
-static void cleanup(COUNTER_t counter)
+static int createShm(void)
 {
   int fd;
-  char b[8];
-
-  // close pulse count export files
-  close(counter.export1_fd);
-  if (counter.export2_fd)
-     close(counter.export2_fd);
-
-  // close GPIO value file
-  close(counter.value_fd);
-
-  // close state file
-  if (counter.state_fd)
-     close(counter.state_fd);
-
-  // free GPIO pin connected to sensors data pin to be used with GPIO sysfs  
-  if (counter.pin)
-  {
-     fd = open(UNEXPORT_FILE, O_WRONLY);
-     if (fd < 0) {
-        perror(UNEXPORT_FILE);
-        return;
-     }
-     snprintf(b, sizeof(b), "%d", counter.pin);
-     if (pwrite(fd, b, strlen(b), 0) < 0) {
-        syslog(LOG_DAEMON | LOG_ERR, "Unable to unexport pin=%d: %s",
-               counter.pin, strerror(errno));
-        return;
-     }
-     close(fd);
+  
+  fd = shm_open(PULSECOUNT_SHM_NAME, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    syslog(LOG_DAEMON | LOG_ERR, "shm_open(%s): %s", PULSECOUNT_SHM_NAME, strerror(errno));
+    return -1;
+  }
+  if (ftruncate(fd, PULSECOUNT_SHM_SIZE) < 0) {
+    syslog(LOG_DAEMON | LOG_ERR, "Unable to size %s: %s", PULSECOUNT_SHM_NAME, strerror(errno));
+    close(fd);
+    return -1;
   }
+  shm = mmap(NULL, PULSECOUNT_SHM_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) {
+    syslog(LOG_DAEMON | LOG_ERR, "Unable to map %s: %s", PULSECOUNT_SHM_NAME, strerror(errno));
+    return -1;
+  }
+  
+  // The object is zero filled, readers check the header
+  shm->version = PULSECOUNT_SHM_VERSION;
+  shm->num_slots = PULSECOUNT_SHM_SLOTS;
+  shm->pid = getpid();
+  __atomic_store_n(&shm->magic, PULSECOUNT_SHM_MAGIC, __ATOMIC_RELEASE);
+  
+  return 0;
 }
 
 
 /*********************************************************************
- * Function:    digitalRead()
+ * Function:    createLog()
  * 
- * Description: Read from the data pin
+ * Description: Create the shared memory pulse and interval log
  * 
- * Parameters:  none
+ * Return:      0 if successful, -1 in case of error
  * 
  ********************************************************************/
-static PIN_STATE_t digitalRead(int value_fd)
+static int createLog(void)
 {
-  int fd=value_fd;
-  char d[2]={0,0};
-
-  if (fd) {
-    if (pread(fd, (void*)d, 1, 0) != 1) {
-      syslog(LOG_DAEMON | LOG_ERR, "Unable to pread gpio value: %s",
-                                    strerror(errno));
-    }
+  int fd;
+  int i;
+  
+  fd = shm_open(PULSECOUNT_LOG_NAME, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    syslog(LOG_DAEMON | LOG_ERR, "shm_open(%s): %s", PULSECOUNT_LOG_NAME, strerror(errno));
+    return -1;
   }
-  return (d[0] == '0' ? LOW : HIGH);
+  if (ftruncate(fd, PULSECOUNT_LOG_SIZE) < 0) {
+    syslog(LOG_DAEMON | LOG_ERR, "Unable to size %s: %s", PULSECOUNT_LOG_NAME, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  pulse_log = mmap(NULL, PULSECOUNT_LOG_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (pulse_log == MAP_FAILED) {
+    syslog(LOG_DAEMON | LOG_ERR, "Unable to map %s: %s", PULSECOUNT_LOG_NAME, strerror(errno));
+    return -1;
+  }
+  
+  // Record numbers start at 1, readers check the header
+  pulse_log->version = PULSECOUNT_LOG_VERSION;
+  pulse_log->epoch = time(NULL);
+  pulse_log->interval_head = 1;
+  for (i=0; i<PULSECOUNT_SHM_SLOTS; i++)
+    pulse_log->event_head[i] = 1;
+  __atomic_store_n(&pulse_log->magic, PULSECOUNT_LOG_MAGIC, __ATOMIC_RELEASE);
+  
+  return 0;
 }
 
 
 /*********************************************************************
- * Function:    stateRead()
+ * Function:    realtimeOffset()
  * 
- * Description: Read from the state file
+ * Description: Get the offset of the UNIX time from the monotonic time
+ *              the edges are timestamped with
  * 
- * Parameters:  none
+ * Return:      offset in ns
  * 
  ********************************************************************/
-static unsigned char stateRead(int state_fd)
+static int64_t realtimeOffset(void)
 {
-  int fd=state_fd;
-  char d[2]={0,0};
-
-  if (fd) {
-    if (pread(fd, (void*)d, 1, 0) != 1) {
-      syslog(LOG_DAEMON | LOG_ERR, "Unable to pread state value: %s",
-                                    strerror(errno));
-    }
-    return (atoi(d));
-  }
-  else
-    return (1);
+  struct timespec mono, real;
+  
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &real);
+  return ((int64_t)real.tv_sec - mono.tv_sec) * 1000000000 + (real.tv_nsec - mono.tv_nsec);
 }
 
 
-/**********************************************************
- * Function: time_diff_ms()
+/*********************************************************************
+ * Function:    logEvent()
  * 
- * Description:
- *           Calculate the difference between two time 
- *           values in milliseconds
+ * Description: Add a pulse to the event ring of a counter in the log
  * 
- * Returns:  time difference (in ms)
- *********************************************************/
-static unsigned long time_diff_ms(struct timespec now_ts, struct timespec prev_ts)
+ * Parameters:  counter_p - counter the pulse ended on
+ *              edge_time - time of the pulse end (CLOCK_MONOTONIC)
+ *              width     - pulse width (in ms)
+ *              flags     - PULSECOUNT_EVENT_* flags
+ * 
+ ********************************************************************/
+static void logEvent(COUNTER_t* counter_p, const struct timespec *edge_time,
+                     unsigned long width, int flags)
 {
-   unsigned long diff_sec;
-   unsigned long diff_msec;
-   
-   if (now_ts.tv_nsec > prev_ts.tv_nsec)
-   {
-      /* normal difference */
-      diff_msec = (now_ts.tv_nsec - prev_ts.tv_nsec)/1000000;
-      diff_sec = now_ts.tv_sec - prev_ts.tv_sec;
-   }
-   else
-   {  /* handle zero crossing */
-      diff_msec = (1000000000 - prev_ts.tv_nsec + now_ts.tv_nsec)/1000000;
-      diff_sec = now_ts.tv_sec - prev_ts.tv_sec - 1;
-   }
-   
-   /* return difference in milliseconds (this will *
-    * overflow if difference is greater 49,7 days) */
-   return ((diff_sec*1000) + diff_msec);
+  int slot = counter_p->slot - shm->slot;
+  uint32_t seq = pulse_log->event_head[slot];
+  volatile pulsecount_event_t *rec = &pulse_log->event[slot][seq % PULSECOUNT_EVENTS];
+  
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  rec->width_ms = (width < 0xFFFF) ? width : 0xFFFF;
+  rec->flags = flags;
+  rec->time_ns = (int64_t)edge_time->tv_sec*1000000000 + edge_time->tv_nsec + realtime_offset;
+  __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+  __atomic_store_n(&pulse_log->event_head[slot], seq + 1, __ATOMIC_RELEASE);
 }
 
 
 /*********************************************************************
- * Function:    waitForEdge()
+ * Function:    intervalClose()
  * 
- * Description: Waits for an edge change on the data pin
+ * Description: Add the current interval of a counter to the interval
+ *              ring of the log and start a new one
  * 
- * Parameters:  none
+ * Parameters:  counter_p - counter to update
+ *              k         - interval kind (index of interval_length)
+ *              start     - UNIX time of the new interval
+ *              flags     - PULSECOUNT_INTERVAL_* flags of the new one
  * 
  ********************************************************************/
-static int waitForEdge(PIN_STATE_t* value, int value_fd)
+static void intervalClose(COUNTER_t* counter_p, int k, unsigned long start, int flags)
 {
-  struct pollfd a_poll;
-  int fd=value_fd;
-  int res;
+  uint32_t seq = pulse_log->interval_head;
+  volatile pulsecount_interval_t *rec = &pulse_log->interval[seq % PULSECOUNT_INTERVALS];
   
-  a_poll.fd = fd;
-  a_poll.events = POLLPRI;
-  a_poll.revents = 0;
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  rec->slot = counter_p->slot - shm->slot;
+  rec->flags = counter_p->interval_flags[k];
+  rec->pin = counter_p->pin;
+  rec->start = counter_p->interval_start[k];
+  rec->length = interval_length[k];
+  rec->count[0] = counter_p->interval_count[k][0];
+  rec->count[1] = counter_p->interval_count[k][1];
+  __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+  __atomic_store_n(&pulse_log->interval_head, seq + 1, __ATOMIC_RELEASE);
   
-  //digitalRead();
-  res = poll(&a_poll, 1, -1);
-  if (res < 0) {   // error
-    syslog(LOG_DAEMON | LOG_ERR, "poll() failed: %s", strerror(errno));
-    return 1;
-  }
-
-  if (a_poll.revents & (POLLPRI | POLLERR)) {
-    *value=digitalRead(fd);
-    return 0;
-  }
-  else {
-    syslog(LOG_DAEMON | LOG_ERR, "poll() detected unknown event");
-    return 2;
-  }
+  counter_p->interval_start[k] = start;
+  counter_p->interval_count[k][0] = counter_p->interval_count[k][1] = 0;
+  counter_p->interval_flags[k] = flags;
 }
- 
+
 
 /*********************************************************************
- * Function:    doExit()
+ * Function:    intervalAdvance()
  * 
- * Description: Signal handler function to do a clean shutdown
+ * Description: Complete the current intervals of a counter which ended
+ *              before a time. When the time jumped (the clock was set)
+ *              the interval is completed early and the one of the new
+ *              time starts, both flagged as partial.
  * 
- * Parameters:  the received signal
+ * Parameters:  counter_p - counter to update
+ *              now       - UNIX time (in s)
  * 
  ********************************************************************/
-static void doExit(int signum)
+static void intervalAdvance(COUNTER_t* counter_p, unsigned long now)
 {
-  pid_t pid=getpid();
+  unsigned long start, len;
+  int k;
   
-  syslog(LOG_DAEMON | LOG_NOTICE, "caught signal %d in process %d", signum, pid);
-  
-  switch (signum) {
-    case SIGTERM:
-    case SIGINT:
-      /* Terminating parent process */
-      if (pid==parentpid)
-      {  
-        /* Make parent terminate */
-        cont = 0;
-      }
-      else
-      {   
-        /* Clean up child process and terminate */
-        if (pid != modbus_server_pid)
-           cleanup(counter);
-        kill(pid, SIGKILL);
-      }
-      break;
-      
-    default:
-      syslog(LOG_DAEMON | LOG_ERR, "unexpected signal received");
+  for (k=0; k<INTERVAL_KINDS; k++)
+  {
+    start = counter_p->interval_start[k];
+    len = interval_length[k];
+    
+    if ((now + len <= start) || (now >= start + 2*len))
+    {
+      counter_p->interval_flags[k] |= PULSECOUNT_INTERVAL_PARTIAL;
+      intervalClose(counter_p, k, now - now % len, PULSECOUNT_INTERVAL_PARTIAL);
+    }
+    else if (now >= start + len)
+    {
+      intervalClose(counter_p, k, start + len, 0);
+    }
   }
 }
 
 
-/**********************************************************
- * FUNCTION: read_register_handler
+/*********************************************************************
+ * Function:    intervalPulse()
  * 
- * DESCRIPTION: 
- *           Handles the read single register request
+ * Description: Account a counted pulse in the current intervals of a
+ *              counter
  * 
- * PARAMETERS: 
- *           int reg_addr - register address to read from
- *           int* reg_val - pointer to register value
+ * Parameters:  counter_p - counter the pulse was counted on
+ *              n         - 0 for counter 1, 1 for counter 2
+ *              edge_time - time of the pulse end (CLOCK_MONOTONIC)
  * 
- * RETURN:   0 on success
- *          -1 otherwise
- *********************************************************/
-int read_register_handler(int addr, int *reg_val_p)
+ ********************************************************************/
+static void intervalPulse(COUNTER_t* counter_p, int n, const struct timespec *edge_time)
 {
-  int fd;
-  char b[32];
-  char d[11];
-  int suffix;
-  int pin;
-  
-  /* Check addr range */
-  if((addr < FIRST_REG) || (addr > LAST_REG)) {
-    syslog(LOG_DAEMON | LOG_ERR, "Address %d out of range", addr);
-    return -1;
-  }
-  
-  suffix=(addr%2)?1:2;
-  pin=counter_param[(addr-1)/2].pin;
-   
-  /* Open counter file containing requested counter value */
-  snprintf(b, sizeof(b), "%s%d_%d", PULSECOUNT_FILE, pin, suffix);
-  fd = open(b, O_RDONLY);
-  if (fd < 0) {
-    syslog(LOG_DAEMON | LOG_ERR, "Open %s: %s", b, strerror(errno));
-    return -1;
-  }
-
-  /* Read counter value */
-  if (pread(fd, (void *)d, 10, 0) != 10) {
-    syslog(LOG_DAEMON | LOG_ERR, "Unable to pread counter value: %s",
-                     strerror(errno));
-    close(fd);
-    return -1;
-  }
-  
-  d[10]=0;
-  *reg_val_p = atoi(d);
+  int64_t time_ns = (int64_t)edge_time->tv_sec*1000000000 + edge_time->tv_nsec + realtime_offset;
+  int k;
   
-  close(fd);
-  return 0;
+  /* A pulse read late, after its interval was completed, counts in the current one */
+  intervalAdvance(counter_p, time_ns / 1000000000);
+  for (k=0; k<INTERVAL_KINDS; k++)
+    counter_p->interval_count[k][n]++;
 }
 
 
 /*********************************************************************
+ * Function:    countPulse()
  * 
- * MAIN process
+ * Description: Increment a pulse count in the shared memory slot of a
+ *              counter (sequence lock write, single writer)
  * 
- ********************************************************************/ 
-int main(int argc, char* argv[])
-{
-  pid_t pid;
+ * Parameters:  slot - shared memory slot of the counter
+ *              n    - 0 for counter 1, 1 for counter 2
+ * 
+ ********************************************************************/
+static void countPulse(volatile pulsecount_slot_t *slot, int n)
+{
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->count[n]++;
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*********************************************************************
+ * Function:    rateAdvance()
+ * 
+ * Description: Move the pulse rate ring of a counter to a new second,
+ *              the seconds dropping out of the rate windows are taken
+ *              off their sums
+ * 
+ * Parameters:  counter_p - counter to update
+ *              sec       - current monotonic time (in s)
+ * 
+ ********************************************************************/
+static void rateAdvance(COUNTER_t* counter_p, unsigned long sec)
+{
+  int w;
+  
+  if (sec - counter_p->rate_sec >= RATE_SECONDS)
+  {
+    /* No pulse in any window */
+    memset(counter_p->rate_ring, 0, sizeof(counter_p->rate_ring));
+    memset(counter_p->rate_sum, 0, sizeof(counter_p->rate_sum));
+    counter_p->rate_sec = sec;
+    return;
+  }
+  
+  while ((long)(sec - counter_p->rate_sec) > 0)
+  {
+    counter_p->rate_sec++;
+    for (w=0; w<RATE_WINDOWS; w++)
+    {
+      /* rate_sec is below the window length up to 15 min after boot */
+      counter_p->rate_sum[w] -= counter_p->rate_ring[(counter_p->rate_sec + RATE_SECONDS - rate_window[w]) % RATE_SECONDS];
+    }
+    counter_p->rate_ring[counter_p->rate_sec % RATE_SECONDS] = 0;
+  }
+}
+
+
+/*********************************************************************
+ * Function:    ratePulse()
+ * 
+ * Description: Account a counted pulse in the pulse rates of a counter
+ * 
+ * Parameters:  counter_p - counter the pulse was counted on
+ *              edge_time - time of the pulse end (CLOCK_MONOTONIC)
+ * 
+ ********************************************************************/
+static void ratePulse(COUNTER_t* counter_p, const struct timespec *edge_time)
+{
+  long diff_sec = edge_time->tv_sec - counter_p->last_pulse_time.tv_sec;
+  int w;
+  
+  /* Instantaneous rate from the last interval (up to an hour) */
+  if (counter_p->last_pulse_ms && (diff_sec >= 0) && (diff_sec < 3600))
+    counter_p->pulse_interval_us = (unsigned long)diff_sec*1000000 + 
+                                   (edge_time->tv_nsec - counter_p->last_pulse_time.tv_nsec)/1000;
+  else
+    counter_p->pulse_interval_us = 0;
+  counter_p->last_pulse_time = *edge_time;
+  counter_p->last_pulse_ms = (unsigned long)edge_time->tv_sec*1000 + edge_time->tv_nsec/1000000;
+  
+  /* Events read late may be from the last second, they count now */
+  rateAdvance(counter_p, edge_time->tv_sec);
+  if (counter_p->rate_ring[counter_p->rate_sec % RATE_SECONDS] < 0xFFFF)
+  {
+    counter_p->rate_ring[counter_p->rate_sec % RATE_SECONDS]++;
+    for (w=0; w<RATE_WINDOWS; w++) counter_p->rate_sum[w]++;
+  }
+}
+
+
+/*********************************************************************
+ * Function:    setCount()
+ * 
+ * Description: Set a pulse count in the shared memory slot of a 
+ *              counter (sequence lock write, single writer)
+ * 
+ * Parameters:  slot  - shared memory slot of the counter
+ *              n     - 0 for counter 1, 1 for counter 2
+ *              count - new pulse count
+ * 
+ ********************************************************************/
+static void setCount(volatile pulsecount_slot_t *slot, int n, uint64_t count)
+{
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->count[n] = count;
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*********************************************************************
+ * Function:    restoreCounter()
+ * 
+ * Description: Restore the pulse counts of a counter from the journal
+ * 
+ * Parameters:  counter_p - counter to restore
+ * 
+ ********************************************************************/
+static void restoreCounter(COUNTER_t* counter_p)
+{
+  uint64_t total;
+  int n;
+  
+  for (n=0; n<(counter_p->statefile[0] ? 2 : 1); n++)
+  {
+    if (journal_restore(counter_p->pin, n, &total))
+    {
+      setCount(counter_p->slot, n, total);
+      syslog(LOG_DAEMON | LOG_NOTICE, "Restored %llu pulses of counter %d_%d", 
+                                      (unsigned long long)total, counter_p->pin, n+1);
+    }
+    counter_p->journaled[n] = total;
+  }
+}
+
+
+/*********************************************************************
+ * Function:    journalCounters()
+ * 
+ * Description: Write the pulses counted since the last call to the
+ *              journal (journal thread)
+ * 
+ ********************************************************************/
+static void journalCounters(void)
+{
+  COUNTER_t *counter_p;
+  pulsecount_slot_t snap;
+  uint64_t count;
+  int i, n;
+  
+  for (i=0; i<MAX_COUNTERS; i++)
+  {
+    counter_p = &counters[i];
+    if (!counter_p->active) continue;
+    
+    pulsecount_shm_read(counter_p->slot, &snap);
+    for (n=0; n<2; n++)
+    {
+      count = snap.count[n];
+      if (count == counter_p->journaled[n]) continue;
+      journal_add(counter_p->pin, n, count - counter_p->journaled[n]);
+      counter_p->journaled[n] = count;
+    }
+  }
+  
+  /* Pulses not written stay in the journal for the next commit */
+  journal_commit();
+}
+
+
+/*********************************************************************
+ * Function:    pendingPulses()
+ * 
+ * Description: Get the number of pulses not journaled yet (journal
+ *              thread)
+ * 
+ * Return:      number of pulses
+ * 
+ ********************************************************************/
+static uint64_t pendingPulses(void)
+{
+  pulsecount_slot_t snap;
+  uint64_t pending = 0;
+  int i;
+  
+  for (i=0; i<MAX_COUNTERS; i++)
+  {
+    if (!counters[i].active) continue;
+    pulsecount_shm_read(counters[i].slot, &snap);
+    pending += (snap.count[0] - counters[i].journaled[0]) + 
+               (snap.count[1] - counters[i].journaled[1]);
+  }
+  return pending;
+}
+
+
+/*********************************************************************
+ * Function:    journalThread()
+ * 
+ * Description: Thread journaling the counters in batches. It reads 
+ *              the counts from the counter table like any other 
+ *              reader, so the counting loop never waits for a commit
+ *              (a write and fdatasync, taking up to some 100 ms on a
+ *              busy SD card). Woken up at exit, it saves the final
+ *              counts and closes the journal.
+ * 
+ ********************************************************************/
+static void *journalThread(void *arg)
+{
+  struct pollfd pfd;
+  struct timespec now, journal_time;
+  uint64_t pending;
+  int stop = 0;
+  
+  pfd.fd = journal_event_fd;
+  pfd.events = POLLIN;
+  clock_gettime(CLOCK_MONOTONIC, &journal_time);
+  while (!stop)
+  {
+    stop = (poll(&pfd, 1, EXPORT_INTERVAL) > 0);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    pending = pendingPulses();
+    if (pending == 0)
+      journal_time = now;
+    else if (stop || (pending >= JOURNAL_PULSES) || (now.tv_sec - journal_time.tv_sec >= JOURNAL_INTERVAL))
+    {
+      journalCounters();
+      journal_time = now;
+    }
+  }
+  
+  journal_close();
+  return NULL;
+}
+
+
+/*********************************************************************
+ * Function:    exportCounter()
+ * 
+ * Description: Write the values of a counter which changed since the
+ *              last call to its export files
+ * 
+ * Parameters:  counter_p - counter to export
+ * 
+ ********************************************************************/
+static void exportCounter(COUNTER_t* counter_p)
+{
+  char str[24];
+  uint64_t value;
+  int fd;
+  int n;
+  
+  for (n=0; n<2; n++)
+  {
+    fd = n ? counter_p->export2_fd : counter_p->export1_fd;
+    if (!fd) continue;
+    
+    // Only the counting loop writes the slot, no need for a snapshot
+    value = pulsecount_scaled(counter_p->slot->count[n], counter_p->slot->divisor_milli);
+    if (value == counter_p->exported[n]) continue;
+    
+    snprintf(str, sizeof(str), "%010llu\n", (unsigned long long)value);
+    if (pwrite(fd, str, strlen(str), 0) < 0) {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to write counter of pin=%d: %s",
+              counter_p->pin, strerror(errno));
+      continue;
+    }
+    counter_p->exported[n] = value;
+  }
+}
+
+
+/*********************************************************************
+ * Function:    cleanup()
+ * 
+ * Description: Cleanup of globally used resources
+ * 
+ * Parameters:  none
+ * 
+ ********************************************************************/
+static void cleanup(COUNTER_t counter)
+{
+  int fd;
+  char b[8];
+
+  // close pulse count export files
+  if (counter.export1_fd)
+     close(counter.export1_fd);
+  if (counter.export2_fd)
+     close(counter.export2_fd);
+
+  // close GPIO value file
+  if (counter.value_fd)
+     close(counter.value_fd);
+
+  // free GPIO pin connected to sensors data pin to be used with GPIO sysfs  
+  // (a line of the GPIO character device is freed by closing its fd, a
+  // captured pin by the capture thread)
+  if (counter.pin && !gpio_chip[0] && !capture_rate)
+  {
+     fd = open(UNEXPORT_FILE, O_WRONLY);
+     if (fd < 0) {
+        perror(UNEXPORT_FILE);
+        return;
+     }
+     snprintf(b, sizeof(b), "%d", counter.pin);
+     if (pwrite(fd, b, strlen(b), 0) < 0) {
+        syslog(LOG_DAEMON | LOG_ERR, "Unable to unexport pin=%d: %s",
+               counter.pin, strerror(errno));
+        return;
+     }
+     close(fd);
+  }
+}
+
+
+/*********************************************************************
+ * Function:    digitalRead()
+ * 
+ * Description: Read from the data pin
+ * 
+ * Parameters:  none
+ * 
+ ********************************************************************/
+static PIN_STATE_t digitalRead(int value_fd)
+{
+  int fd=value_fd;
+  char d[2]={0,0};
+
+  if (fd) {
+    if (pread(fd, (void*)d, 1, 0) != 1) {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to pread gpio value: %s",
+                                    strerror(errno));
+    }
+  }
+  return (d[0] == '0' ? LOW : HIGH);
+}
+
+
+/*********************************************************************
+ * Function:    stateRead()
+ * 
+ * Description: Read the state file of a virtual counter and save the
+ *              selected counter. It's called when the file changed, 
+ *              the pulses are routed by the saved selection.
+ * 
+ * Parameters:  counter_p - counter with virtual counters
+ * 
+ ********************************************************************/
+static void stateRead(COUNTER_t* counter_p)
+{
+  char d[2]={0,0};
+  unsigned char selector;
+  int fd;
+
+  fd = open(counter_p->statefile, O_RDONLY|O_CLOEXEC);
+  if (fd < 0) {
+    // Not created yet, the directory watch reports its creation
+    if (errno != ENOENT)
+      syslog(LOG_DAEMON | LOG_ERR, "Open %s: %s", counter_p->statefile, strerror(errno));
+    return;
+  }
+  if (pread(fd, (void*)d, 1, 0) < 0) {
+    syslog(LOG_DAEMON | LOG_ERR, "Unable to pread state value: %s",
+                                  strerror(errno));
+  }
+  close(fd);
+  
+  selector = atoi(d);
+  if (selector != counter_p->selector) {
+#if DEBUG
+    syslog(LOG_DAEMON | LOG_DEBUG, "Pin=%d counts on virtual counter %d", 
+                                    counter_p->pin, selector);
+#endif
+    counter_p->selector = selector;
+  }
+}
+
+
+/*********************************************************************
+ * Function:    statefileName()
+ * 
+ * Description: Get the name of the state file of a virtual counter
+ *              without its directory
+ * 
+ * Parameters:  counter_p - counter with virtual counters
+ * 
+ * Return:      file name
+ * 
+ ********************************************************************/
+static const char *statefileName(const COUNTER_t* counter_p)
+{
+  const char *p = strrchr(counter_p->statefile, '/');
+  
+  return (p ? p+1 : counter_p->statefile);
+}
+
+
+/**********************************************************
+ * Function: time_diff_ms()
+ * 
+ * Description:
+ *           Calculate the difference between two time 
+ *           values in milliseconds
+ * 
+ * Returns:  time difference (in ms)
+ *********************************************************/
+static unsigned long time_diff_ms(struct timespec now_ts, struct timespec prev_ts)
+{
+   unsigned long diff_sec;
+   unsigned long diff_msec;
+   
+   if (now_ts.tv_nsec > prev_ts.tv_nsec)
+   {
+      /* normal difference */
+      diff_msec = (now_ts.tv_nsec - prev_ts.tv_nsec)/1000000;
+      diff_sec = now_ts.tv_sec - prev_ts.tv_sec;
+   }
+   else
+   {  /* handle zero crossing */
+      diff_msec = (1000000000 - prev_ts.tv_nsec + now_ts.tv_nsec)/1000000;
+      diff_sec = now_ts.tv_sec - prev_ts.tv_sec - 1;
+   }
+   
+   /* return difference in milliseconds (this will *
+    * overflow if difference is greater 49,7 days) */
+   return ((diff_sec*1000) + diff_msec);
+}
+
+
+/**********************************************************
+ * Function: width_bin()
+ * 
+ * Description:
+ *           Get the histogram bin of a pulse width
+ * 
+ * Returns:  bin index (0 to WIDTH_BINS-1)
+ *********************************************************/
+static int width_bin(unsigned long width)
+{
+   int bin = 0;
+   
+   while ((width > 0) && (bin < WIDTH_BINS-1))
+   {
+      width >>= 1;
+      bin++;
+   }
+   return bin;
+}
+
+
+/*********************************************************************
+ * Function:    initInotify()
+ * 
+ * Description: Create the inotify instance of the counting loop and
+ *              add it to its epoll set, if not done yet
+ * 
+ * Parameters:  epoll_fd   - epoll set of the counting loop
+ *              inotify_fd - inotify instance, -1 if not created yet
+ * 
+ * Return:      0 if successful, -1 in case of error
+ * 
+ ********************************************************************/
+static int initInotify(int epoll_fd, int *inotify_fd)
+{
+  struct epoll_event ev;
+  
+  if (*inotify_fd != -1)
+    return 0;
+  
+  *inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (*inotify_fd == -1) {
+    syslog(LOG_DAEMON | LOG_ERR, "inotify_init1() failed: %s", strerror(errno));
+    return -1;
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, *inotify_fd, &ev);
+  return 0;
+}
+
+
+/*********************************************************************
+ * Function:    watchState()
+ * 
+ * Description: Watch the state file of a virtual counter for changes.
+ *              The directory is watched, so the file may be created
+ *              (or replaced) after the start. The current state is
+ *              read if the file already exists.
+ * 
+ * Parameters:  epoll_fd   - epoll set of the counting loop
+ *              inotify_fd - inotify instance (created on first use)
+ *              counter_p  - counter with virtual counters
+ * 
+ * Return:      0 if successful, -1 in case of error
+ * 
+ ********************************************************************/
+static int watchState(int epoll_fd, int *inotify_fd, COUNTER_t* counter_p)
+{
+  char dir[sizeof(counter_p->statefile)];
+  char *p;
+  
+  counter_p->state_wd = -1;
+  if (initInotify(epoll_fd, inotify_fd) != 0)
+    return -1;
+  
+  snprintf(dir, sizeof(dir), "%s", counter_p->statefile);
+  p = strrchr(dir, '/');
+  if (p == NULL)
+    strcpy(dir, ".");
+  else if (p == dir)
+    p[1] = 0;
+  else
+    p[0] = 0;
+  
+  counter_p->state_wd = inotify_add_watch(*inotify_fd, dir, 
+                                          IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO);
+  if (counter_p->state_wd == -1) {
+    syslog(LOG_DAEMON | LOG_ERR, "Unable to watch %s: %s", dir, strerror(errno));
+    return -1;
+  }
+  
+  stateRead(counter_p);
+  if (counter_p->selector == 0)
+    syslog(LOG_DAEMON | LOG_NOTICE, "State of pin=%d not known yet, waiting for %s", 
+                                    counter_p->pin, counter_p->statefile);
+  return 0;
+}
+
+
+/*********************************************************************
+ * Function:    watchEdges()
+ * 
+ * Description: Add the GPIO value file or line of a counter to the 
+ *              epoll set of the counting loop. Value files which can't 
+ *              be polled for edges (simulated GPIOs, regular files) are
+ *              watched for writes with inotify instead.
+ * 
+ * Parameters:  epoll_fd   - epoll set of the counting loop
+ *              inotify_fd - inotify instance (created on first use)
+ *              counter_p  - counter to watch
+ * 
+ * Return:      0 if successful, -1 in case of error
+ * 
+ ********************************************************************/
+static int watchEdges(int epoll_fd, int *inotify_fd, COUNTER_t* counter_p)
+{
+  struct epoll_event ev;
+  char b[64];
+
+  counter_p->watch_fd = -1;
+
+  // sysfs signals edges as priority data, a line as readable events
+  ev.events = gpio_chip[0] ? EPOLLIN : (EPOLLPRI | EPOLLERR);
+  ev.data.ptr = counter_p;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, counter_p->value_fd, &ev) == 0)
+    return 0;
+  
+  if (errno != EPERM) {
+    syslog(LOG_DAEMON | LOG_ERR, "Unable to watch pin=%d: %s", counter_p->pin, strerror(errno));
+    return -1;
+  }
+  
+  // Not an edge capable GPIO, watch the value file for writes
+  if (initInotify(epoll_fd, inotify_fd) != 0)
+    return -1;
+  snprintf(b, sizeof(b), "%s%d/value", GPIO_BASE_FILE, counter_p->pin);
+  counter_p->watch_fd = inotify_add_watch(*inotify_fd, b, IN_MODIFY);
+  if (counter_p->watch_fd == -1) {
+    syslog(LOG_DAEMON | LOG_ERR, "Unable to watch %s: %s", b, strerror(errno));
+    return -1;
+  }
+  syslog(LOG_DAEMON | LOG_NOTICE, "Pin=%d has no edge events, watching writes to %s", counter_p->pin, b);
+  return 0;
+}
+
+
+/*********************************************************************
+ * Function:    handleEdge()
+ * 
+ * Description: Track the pulse on a counter after an edge and count
+ *              the pulse when it ended
+ * 
+ * Parameters:  counter_p    - counter the edge was detected on
+ *              pulse_active - pin is in its active state after the edge
+ *              edge_time    - time of the edge (CLOCK_MONOTONIC)
+ * 
+ ********************************************************************/
+static void handleEdge(COUNTER_t* counter_p, int pulse_active, const struct timespec *edge_time)
+{
+  unsigned long width;
+  
+  if (pulse_active)
+  {
+    /* Pulse started */
+    if (counter_p->pulse_started == 0)
+    {
+      counter_p->pulse_start_time = *edge_time;
+      counter_p->pulse_started = 1;
+    }
+    else
+    {
+#if DEBUG
+      syslog(LOG_DAEMON | LOG_DEBUG, "Warning: detected starting pulse out of sequence on pin %d",
+                                      counter_p->pin);
+#endif
+    }
+    return;
+  }
+  
+  /* Pulse ended */
+  if (counter_p->pulse_started == 1)
+  {
+    width = time_diff_ms(*edge_time, counter_p->pulse_start_time);
+#if DEBUG
+    syslog(LOG_DAEMON | LOG_DEBUG, "Detected pulse with length %lu ms on pin %d", 
+                                    width, counter_p->pin);
+#endif
+    counter_p->pulse_started = 0;
+  }
+  else
+  {
+#if DEBUG
+    syslog(LOG_DAEMON | LOG_DEBUG, "Warning: detected ending pulse out of sequence on pin %d",
+                                    counter_p->pin);
+#endif
+    return;
+  }
+  
+  /* Check pulse length and filter glitches (contact bounce) */
+  counter_p->last_width = width;
+  counter_p->width_hist[width_bin(width)]++;
+  if ((width < counter_p->min_width) || 
+      (counter_p->max_width && (width > counter_p->max_width)))
+  {
+#if DEBUG
+    syslog(LOG_DAEMON | LOG_DEBUG, "Rejected pulse with length %lu ms on pin %d", 
+                                    width, counter_p->pin);
+#endif
+    counter_p->rejected++;
+    logEvent(counter_p, edge_time, width, PULSECOUNT_EVENT_REJECTED);
+    return;
+  }
+  
+  /* Increment the virtual counter selected by the state file */
+  switch (counter_p->selector)
+  {
+     case 1:
+        /* Increment counter 1, the export file is written later */
+        countPulse(counter_p->slot, 0);
+        ratePulse(counter_p, edge_time);
+        intervalPulse(counter_p, 0, edge_time);
+        logEvent(counter_p, edge_time, width, 0);
+        break;
+        
+     case 2:
+        /* Increment counter 2, the export file is written later */
+        countPulse(counter_p->slot, 1);
+        ratePulse(counter_p, edge_time);
+        intervalPulse(counter_p, 1, edge_time);
+        logEvent(counter_p, edge_time, width, PULSECOUNT_EVENT_COUNTER2);
+        break;
+        
+     default:
+        /* unknown state, do nothing */
+        logEvent(counter_p, edge_time, width, PULSECOUNT_EVENT_IGNORED);
+  }
+}
+
+
+/*********************************************************************
+ * Function:    readEdge()
+ * 
+ * Description: Read the data pin of a sysfs counter after an edge, the
+ *              edge time is taken when the counting loop wakes up
+ * 
+ * Parameters:  counter_p    - counter the edge was detected on
+ *              active_value - pin state during a pulse
+ * 
+ ********************************************************************/
+static void readEdge(COUNTER_t* counter_p, PIN_STATE_t active_value)
+{
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  handleEdge(counter_p, digitalRead(counter_p->value_fd) == active_value, &now);
+}
+
+
+/*********************************************************************
+ * Function:    readLineEvents()
+ * 
+ * Description: Read the pending edge events of a GPIO character device
+ *              line, up to LINE_EVENTS per read(). The edge times are
+ *              the kernel timestamps taken in the interrupt handler.
+ * 
+ * Parameters:  counter_p    - counter the events are pending on
+ *              active_value - pin state during a pulse
+ * 
+ ********************************************************************/
+static void readLineEvents(COUNTER_t* counter_p, PIN_STATE_t active_value)
+{
+#ifdef GPIO_V2_GET_LINE_IOCTL
+  struct gpio_v2_line_event events[LINE_EVENTS];
+  struct timespec edge_time;
+  ssize_t len;
+  int i, n;
+  
+  do
+  {
+    len = read(counter_p->value_fd, events, sizeof(events));
+    if (len < 0) {
+      if ((errno != EAGAIN) && (errno != EINTR))
+        syslog(LOG_DAEMON | LOG_ERR, "Unable to read events of line=%d: %s",
+                                      counter_p->pin, strerror(errno));
+      return;
+    }
+    
+    n = len / sizeof(events[0]);
+    for (i=0; i<n; i++)
+    {
+      edge_time.tv_sec = events[i].timestamp_ns / 1000000000;
+      edge_time.tv_nsec = events[i].timestamp_ns % 1000000000;
+      handleEdge(counter_p, 
+                 (events[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE) == (active_value == HIGH),
+                 &edge_time);
+    }
+  }
+  while (n == LINE_EVENTS);
+#endif
+}
+
+
+/*********************************************************************
+ * Function:    handleWrites()
+ * 
+ * Description: Handle the writes reported by inotify: each write to a
+ *              simulated value file is treated as an edge, a written
+ *              state file is read again
+ * 
+ * Parameters:  inotify_fd   - inotify instance
+ *              active_value - pin state during a pulse
+ * 
+ ********************************************************************/
+static void handleWrites(int inotify_fd, PIN_STATE_t active_value)
+{
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *event;
+  ssize_t len;
+  char *p;
+  int i;
+  
+  while ((len = read(inotify_fd, buf, sizeof(buf))) > 0)
+  {
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len)
+    {
+      event = (const struct inotify_event *)p;
+      for (i=0; i<MAX_COUNTERS; i++)
+      {
+        if (!counters[i].active) continue;
+        
+        if (counters[i].watch_fd == event->wd)
+          readEdge(&counters[i], active_value);
+        
+        // Events were lost, read all state files again
+        if ((event->mask & IN_Q_OVERFLOW) && counters[i].statefile[0])
+          stateRead(&counters[i]);
+        else if ((counters[i].state_wd == event->wd) && event->len &&
+                 !strcmp(event->name, statefileName(&counters[i])))
+          stateRead(&counters[i]);
+      }
+    }
+  }
+}
+
+
+/*********************************************************************
+ * Function:    captureEdge()
+ * 
+ * Description: Handle an edge found by the capture mode, called by
+ *              capture_drain() in the counting loop
+ * 
+ * Parameters:  pin       - GPIO pin of the edge
+ *              level     - pin level after the edge
+ *              edge_time - time of the sample (CLOCK_MONOTONIC)
+ *              arg       - pin state during a pulse
+ * 
+ ********************************************************************/
+static void captureEdge(int pin, int level, const struct timespec *edge_time, void *arg)
+{
+  PIN_STATE_t active_value = *(PIN_STATE_t *)arg;
+  
+  if (capture_counter[pin])
+    handleEdge(capture_counter[pin], (level ? HIGH : LOW) == active_value, edge_time);
+}
+
+
+/*********************************************************************
+ * Function:    startCapture()
+ * 
+ * Description: Start the capture mode for the active counters and add
+ *              it to the epoll set of the counting loop
+ * 
+ * Parameters:  epoll_fd - epoll set of the counting loop
+ * 
+ * Return:      0 if successful, -1 in case of error
+ * 
+ ********************************************************************/
+static int startCapture(int epoll_fd)
+{
+  const CAPTURE_BACKEND_t *backend = &capture_bcm2835;
+  struct epoll_event ev;
+  uint32_t mask = 0;
+  int i;
+  
+  for (i=0; i<MAX_COUNTERS; i++)
+  {
+    if (!counters[i].active) continue;
+    capture_counter[counters[i].pin] = &counters[i];
+    mask |= 1u << counters[i].pin;
+  }
+  
+  if (capture_fake_freq > 0)
+  {
+    capture_fake_config(capture_fake_freq, 50);
+    backend = &capture_fake;
+  }
+  if (capture_start(backend, mask, capture_rate, capture_cpu) != 0)
+    return -1;
+  
+  // Tagged with the address of the sample rate, counters have their own
+  ev.events = EPOLLIN;
+  ev.data.ptr = &capture_rate;
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, capture_fd(), &ev);
+}
+
+
+/*********************************************************************
+ * Function:    doExit()
+ * 
+ * Description: Signal handler function to do a clean shutdown
+ * 
+ * Parameters:  the received signal
+ * 
+ ********************************************************************/
+static void doExit(int signum)
+{
+  /* Make the counting loop terminate */
+  cont = 0;
+}
+
+
+/**********************************************************
+ * FUNCTION: read_register_handler
+ * 
+ * DESCRIPTION: 
+ *           Handles the read single register request
+ * 
+ * PARAMETERS: 
+ *           int reg_addr - register address to read from
+ *           int* reg_val - pointer to register value
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ *********************************************************/
+int read_register_handler(int addr, int *reg_val_p)
+{
+  COUNTER_t *counter_p;
+  pulsecount_slot_t snap;
+  int offset;
+  
+  /* Pulse width filter registers */
+  if ((addr >= FIRST_FILTER_REG) && (addr <= LAST_FILTER_REG)) {
+    counter_p=&counters[(addr-FIRST_FILTER_REG)/FILTER_REGS];
+    if (!counter_p->active) {
+      syslog(LOG_DAEMON | LOG_ERR, "Counter at address %d not in use", addr);
+      return -1;
+    }
+    
+    offset = (addr-FIRST_FILTER_REG)%FILTER_REGS;
+    switch (offset)
+    {
+      case 0:  *reg_val_p = counter_p->rejected & 0xFFFF; break;
+      case 1:  *reg_val_p = (counter_p->min_width > 0xFFFF) ? 0xFFFF : counter_p->min_width; break;
+      case 2:  *reg_val_p = (counter_p->max_width > 0xFFFF) ? 0xFFFF : counter_p->max_width; break;
+      case 3:  *reg_val_p = (counter_p->last_width > 0xFFFF) ? 0xFFFF : counter_p->last_width; break;
+      default: *reg_val_p = counter_p->width_hist[offset-4] & 0xFFFF;
+    }
+    return 0;
+  }
+  
+  /* Check addr range */
+  if((addr < FIRST_REG) || (addr > LAST_REG)) {
+    syslog(LOG_DAEMON | LOG_ERR, "Address %d out of range", addr);
+    return -1;
+  }
+  
+  counter_p=&counters[(addr-1)/2];
+  if (!counter_p->active || ((addr%2 == 0) && !counter_p->statefile[0])) {
+    syslog(LOG_DAEMON | LOG_ERR, "Counter at address %d not in use", addr);
+    return -1;
+  }
+  
+  /* Apply divisor to a snapshot of the requested counter value */
+  pulsecount_shm_read(counter_p->slot, &snap);
+  *reg_val_p = pulsecount_scaled(snap.count[(addr%2) ? 0 : 1], snap.divisor_milli);
+  
+  return 0;
+}
+
+
+/**********************************************************
+ * FUNCTION: read_wide_registers
+ * 
+ * DESCRIPTION: 
+ *           Handles the read of 32 and 64 bit counter registers,
+ *           reading each value once per request
+ * 
+ * PARAMETERS: 
+ *           int start_addr     - first register address to read
+ *           int count          - number of registers
+ *           uint16_t *reg_vals - register values (out)
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ *********************************************************/
+static int read_wide_registers(int start_addr, int count, uint16_t *reg_vals)
+{
+  COUNTER_t *counter_p;
+  pulsecount_slot_t snap;
+  uint64_t value = 0;
+  int addr, rel, words, word;
+  int i, k, n;
+  
+  for (i=0; i<count; i++)
+  {
+    addr = start_addr+i;
+    if (addr >= FIRST_REG64) {
+      rel = addr-FIRST_REG64;
+      words = 4;
+    }
+    else {
+      rel = addr-FIRST_REG32;
+      words = 2;
+    }
+    k = rel/(2*words);
+    n = (rel/words)%2;
+    word = rel%words;
+    
+    counter_p=&counters[k];
+    if (!counter_p->active || ((n == 1) && !counter_p->statefile[0])) {
+      syslog(LOG_DAEMON | LOG_ERR, "Counter at address %d not in use", addr);
+      return -1;
+    }
+    
+    /* Read the value on its first register, or on the first one requested */
+    if ((word == 0) || (i == 0)) {
+      pulsecount_shm_read(counter_p->slot, &snap);
+      value = pulsecount_scaled(snap.count[n], snap.divisor_milli);
+    }
+    
+    /* Index of the 16 bit word in the value, 0 for the least significant */
+    if (!lsw_first) word = words-1-word;
+    reg_vals[i] = (value >> (16*word)) & 0xFFFF;
+  }
+  
+  return 0;
+}
+
+
+/**********************************************************
+ * FUNCTION: read_rate_registers
+ * 
+ * DESCRIPTION: 
+ *           Handles the read of pulse rate registers, reading
+ *           each value once per request
+ * 
+ * PARAMETERS: 
+ *           int start_addr     - first register address to read
+ *           int count          - number of registers
+ *           uint16_t *reg_vals - register values (out)
+ * 
+ * RETURN:   0 on success
+ *          -1 otherwise
+ *********************************************************/
+static int read_rate_registers(int start_addr, int count, uint16_t *reg_vals)
+{
+  COUNTER_t *counter_p;
+  struct timespec now;
+  unsigned long since_ms, interval_us, window;
+  uint64_t divisor_milli, value = 0;
+  int addr, rel, word;
+  int i, k, v;
+  
+  for (i=0; i<count; i++)
+  {
+    addr = start_addr+i;
+    rel = addr-FIRST_RATE_REG;
+    k = rel/8;
+    v = (rel/2)%4;
+    word = rel%2;
+    
+    counter_p=&counters[k];
+    if (!counter_p->active) {
+      syslog(LOG_DAEMON | LOG_ERR, "Counter at address %d not in use", addr);
+      return -1;
+    }
+    
+    /* Compute the value on its first register, or on the first one requested */
+    if ((word == 0) || (i == 0)) {
+      divisor_milli = counter_p->slot->divisor_milli;
+      value = 0;
+      if (v == 0) {
+        /* Instantaneous rate, lower while the next pulse is late */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        since_ms = (unsigned long)now.tv_sec*1000 + now.tv_nsec/1000000 - counter_p->last_pulse_ms;
+        interval_us = counter_p->pulse_interval_us;
+        if (interval_us && (since_ms < 3600000)) {
+          if (since_ms*1000 > interval_us) interval_us = since_ms*1000;
+          value = 3600000000000000ULL / (interval_us*divisor_milli);
+        }
+      }
+      else {
+        /* Average over a window, or the time since start if shorter */
+        window = counter_p->rate_sec - counter_p->rate_start_sec + 1;
+        if (window > rate_window[v-1]) window = rate_window[v-1];
+        value = (uint64_t)counter_p->rate_sum[v-1]*3600000000ULL / (window*divisor_milli);
+      }
+      if (value > 0xFFFFFFFF) value = 0xFFFFFFFF;
+    }
+    
+    if (!lsw_first) word = 1-word;
+    reg_vals[i] = (value >> (16*word)) & 0xFFFF;
+  }
+  
+  return 0;
+}
+
+
+/*********************************************************************
+ * Function:    modbusServer()
+ * 
+ * Description: Thread running the Modbus TCP server loop
+ * 
+ ********************************************************************/
+static void *modbusServer(void *arg)
+{
+  sigset_t sigs;
+  
+  /* Statistics and trace signals of the Modbus server go to this thread */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGUSR1);
+  sigaddset(&sigs, SIGUSR2);
+  pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+  
+  modbustcp_server(MODBUS_SLAVE_ADDRESS,  // Modbus slave address
+                   read_register_handler, // Read register handler
+                   NULL                   // Write register handler
+                  );
+  
+  syslog(LOG_DAEMON | LOG_ERR, "Modbus server terminated");
+  return NULL;
+}
+
+
+/*********************************************************************
+ * 
+ * MAIN process
+ * 
+ ********************************************************************/ 
+int main(int argc, char* argv[])
+{
   int num_counters=0;
   int last_counter;
   int i, k;
-  PIN_STATE_t pin_value;
   PIN_STATE_t active_value=LOW;
-  struct timespec pulse_start_time, pulse_end_time;
-  unsigned char pulse_started;
+  unsigned long min_width, max_width;
+  int epoll_fd;
+  int inotify_fd=-1;
+  struct epoll_event events[MAX_COUNTERS+1];
+  int nfds;
+  pthread_t modbus_thread, journal_thread;
+  struct timespec now, export_time;
+  uint64_t one = 1;
+  unsigned long unix_sec;
+  CAPTURE_STATS_t stats;
+  sigset_t sigs;
   
    
   /* Parse input parameters */
-  if ((argc==1) || ((argc==2) && !strcmp(argv[1], "-h")))
+  memset(counter_param, 0, sizeof(counter_param));
+  for (i=1; (i<argc-1) && (argv[i][0] == '-'); i+=2)
+  {
+    if (!strcmp(argv[i], "-c"))
+    {
+      /* Count on lines of a GPIO character device */
+      if (strchr(argv[i+1], '/'))
+        snprintf(gpio_chip, sizeof(gpio_chip), "%s", argv[i+1]);
+      else
+        snprintf(gpio_chip, sizeof(gpio_chip), "%s%s", GPIO_DEV_DIR, argv[i+1]);
+    }
+    else if (!strcmp(argv[i], "-w"))
+    {
+      /* Pulse width filter of a counter */
+      if ((sscanf(argv[i+1], "%d:%lu:%lu", &k, &min_width, &max_width) != 3) ||
+          (k < 1) || (k > MAX_COUNTERS))
+      {
+        printf("Invalid pulse width filter %s\n", argv[i+1]);
+        return 1;
+      }
+      counter_param[k-1].min_width = min_width;
+      counter_param[k-1].max_width = max_width;
+    }
+    else if (!strcmp(argv[i], "-s"))
+    {
+      /* Capture mode: sample rate and CPU */
+      if ((sscanf(argv[i+1], "%lu:%d", &capture_rate, &capture_cpu) < 1) || (capture_rate == 0))
+      {
+        printf("Invalid capture rate %s\n", argv[i+1]);
+        return 1;
+      }
+    }
+    else if (!strcmp(argv[i], "-F"))
+    {
+      /* Capture mode on fake registers, for tests without hardware */
+      capture_fake_freq = atof(argv[i+1]);
+    }
+    else if (!strcmp(argv[i], "-j"))
+    {
+      /* Directory of the counter journal */
+      snprintf(journal_dir, sizeof(journal_dir), "%s", argv[i+1]);
+    }
+    else if (!strcmp(argv[i], "-o"))
+    {
+      /* Word order of 32/64 bit registers */
+      if (!strcmp(argv[i+1], "lsw"))
+        lsw_first = 1;
+      else if (strcmp(argv[i+1], "msw"))
+      {
+        printf("Invalid word order %s\n", argv[i+1]);
+        return 1;
+      }
+    }
+    else break;
+  }
+  if ((i>=argc) || (argv[i][0] == '-'))
   {
     printf("Usage:\n");
-    printf("  pulsecountd <pin1> <div1> [<statefile1>] [<pin2> <div2> [<statefile2>] ... [<pinN> <divN> [<statefileN>]]]\n");
+    printf("  pulsecountd [-c <chip>] [-w <N>:<min>:<max> ...] [-o msw|lsw] [-j <dir>] [-s <rate>[:<cpu>]] <pin1> <div1> [<statefile1>] [<pin2> <div2> [<statefile2>] ... [<pinN> <divN> [<statefileN>]]]\n");
+    printf("      chip:       GPIO character device to count on (e.g. gpiochip0), pinX are\n");
+    printf("                  line offsets of the chip then (default: GPIO sysfs interface)\n");
+    printf("      N:min:max:  count only pulses of counter N with a width of min to max ms\n");
+    printf("                  (max 0 for no limit, default: all pulses are counted)\n");
+    printf("      msw|lsw:    word order of 32/64 bit registers, most (default) or\n");
+    printf("                  least significant word first\n");
+    printf("      dir:        directory of the journal which keeps the counters\n");
+    printf("                  across restarts (default: counters start at 0)\n");
+    printf("      rate:cpu:   capture mode, sample the BCM2835 event detect register of\n");
+    printf("                  GPIO 1-31 at rate Hz on a thread pinned to cpu (optional),\n");
+    printf("                  for pulse trains of up to rate/2 Hz (-F <Hz> samples fake\n");
+    printf("                  registers with pulses of that frequency instead)\n");
     printf("      pinX:       kernel Id of GPIO pin to count pulses on (use 0 for dummy pin)\n");
     printf("      divX:       divisor for pulse count values\n");
     printf("      statefileX: file containing the counter selection\n");
@@ -544,12 +1926,27 @@ int main(int argc, char* argv[])
     return 1;
   }
  
-  memset(counter_param, 0, sizeof(counter_param));
-  for (i=1, k=0; i<(argc); i++, k++)
+  for (k=0; i<(argc); i++, k++)
   {
+    if (k == MAX_COUNTERS)
+    {
+      printf("Too many counters, max number of counters is %d\n", MAX_COUNTERS);
+      return 1;
+    }
+    if (i == argc-1)
+    {
+      printf("Missing divisor of counter %d\n", k+1);
+      return 1;
+    }
+    
     /* Get pin Id and divisor for each counter */
     counter_param[k].pin = atoi(argv[i++]);
     counter_param[k].divisor = atof(argv[i]);
+    if (counter_param[k].pin && (counter_param[k].divisor < 0.001))
+    {
+      printf("Invalid divisor of counter %d\n", k+1);
+      return 1;
+    }
      
     /* is this the last parameter? */
     if (i<(argc-1))
@@ -573,197 +1970,202 @@ int main(int argc, char* argv[])
   openlog("pulsecountd", LOG_PID|LOG_CONS, LOG_USER);
   syslog(LOG_DAEMON | LOG_NOTICE, "Starting Pulse counter daemon (version %s)", VERSION);
   syslog(LOG_DAEMON | LOG_NOTICE, "Using %s logic", (active_value==HIGH)?"ACTIVE_HIGH":"ACTIVE_LOW" );
+  if (capture_rate)
+    syslog(LOG_DAEMON | LOG_NOTICE, "Using GPIO capture mode at %lu Hz", capture_rate);
+  else
+    syslog(LOG_DAEMON | LOG_NOTICE, "Using GPIO %s", gpio_chip[0] ? gpio_chip : "sysfs interface");
 
   /* Install signal handler for SIGTERM and SIGINT ("CTRL C") 
-   * to be used to cleanly terminate parent annd child  processes
+   * to be used to cleanly terminate the counting loop
    */
   signal(SIGTERM, doExit);
   signal(SIGINT, doExit);
   
-  /* Save the parent pid (used in signal handler) */
-  parentpid = getpid();
-
-  /* Init counter struct */
-  memset((void*)&counter, 0, sizeof(counter));
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1)
+  {
+    syslog(LOG_DAEMON | LOG_ERR, "epoll_create1() failed: %s", strerror(errno));
+    return 2;
+  }
+  
+  if ((createShm() != 0) || (createLog() != 0))
+    return 2;
+  realtime_offset = realtimeOffset();
   
-  syslog(LOG_DAEMON | LOG_NOTICE, "Creating %d counter processes", num_counters);
+  syslog(LOG_DAEMON | LOG_NOTICE, "Setting up %d counters", num_counters);
   
-  /* Create a child process for each counter */
+  /* Set up the counters, a counter which fails is left out */
+  memset((void*)counters, 0, sizeof(counters));
   for (i=0; i<last_counter; i++)
   {  
     /* Check for dummy pin */
     if (counter_param[i].pin == 0) continue;
     
-    /* Create child */
-    pid=fork();
+    counters[i].slot = &shm->slot[i];
     
-    if (pid == -1)
+    if ((setup(counter_param[i], &counters[i]) != 0) ||
+        (!capture_rate && (watchEdges(epoll_fd, &inotify_fd, &counters[i]) != 0)) ||
+        (counters[i].statefile[0] && (watchState(epoll_fd, &inotify_fd, &counters[i]) != 0)))
     {
-      syslog(LOG_DAEMON | LOG_ERR, "Error creating child process for counter %d", i+1);
-      return 2;
+      syslog(LOG_DAEMON | LOG_ERR, "Counter %d on GPIO pin with Kernel Id %d not available", 
+                                   i+1, counter_param[i].pin);
+      continue;
     }
     
-    if (pid != 0)
+    /* A pulse ongoing at start is not counted (its end is out of sequence),
+     * reading the sysfs value also arms edge detection */
+    counters[i].pulse_started = 0;
+    if (!gpio_chip[0] && !capture_rate) digitalRead(counters[i].value_fd);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    counters[i].rate_start_sec = counters[i].rate_sec = now.tv_sec;
+    for (k=0; k<INTERVAL_KINDS; k++)
     {
-      /***** We are in the parent process *****/
-
-      /* Save child pid */
-      counter_param[i].child_pid=pid;
+      counters[i].interval_start[k] = pulse_log->epoch - pulse_log->epoch % interval_length[k];
+      counters[i].interval_flags[k] = PULSECOUNT_INTERVAL_PARTIAL;
     }
+    counters[i].active = 1;
+    counters[i].slot->flags |= PULSECOUNT_SLOT_ACTIVE;
+    
+    if (capture_rate)
+      syslog(LOG_DAEMON | LOG_NOTICE, "Capturing pulses on GPIO %d", counter_param[i].pin);
+    else if (gpio_chip[0])
+      syslog(LOG_DAEMON | LOG_NOTICE, "Counting pulses on line %d of %s", 
+                                      counter_param[i].pin, gpio_chip);
     else
+      syslog(LOG_DAEMON | LOG_NOTICE, "Counting pulses on GPIO pin with Kernel Id %d", 
+                                      counter_param[i].pin);
+    if (counters[i].min_width || counters[i].max_width)
+      syslog(LOG_DAEMON | LOG_NOTICE, "Counter %d counts pulses of %lu to %lu ms", 
+                                      i+1, counters[i].min_width, counters[i].max_width);
+  }
+  
+  /* Restore the counters from the journal */
+  if (journal_dir[0])
+  {
+    if (journal_open(journal_dir) == 0)
     {
-      /***** We are in the child process *****/
-         
-      syslog(LOG_DAEMON | LOG_NOTICE, "Started child process counting pulses on GPIO pin with Kernel Id %d", 
-                                                                                      counter_param[i].pin);
-      
-      /* Init */
-      if (setup(counter_param[i], &counter) != 0)
+      journal = 1;
+      for (i=0; i<last_counter; i++)
       {
-        /* Setup failed, wait to be terminated */
-        while (1) usleep(100000);
-      }
-      
-      /* Wait for possibly ongoing pulse to end */   
-      while (digitalRead(counter.value_fd) == active_value) usleep(100000);
-      pulse_started = 0;
-      
-      
-      /***** Main child loop *****/
-      while (1)
-      {
-        if (waitForEdge(&pin_value, counter.value_fd) == 0)
-        {
-          if (pin_value == active_value)
-          {
-            /* Pulse started */
-            if (pulse_started == 0)
-            {
-              clock_gettime(CLOCK_REALTIME, &pulse_start_time);
-              pulse_started = 1;
-            }
-            else
-            {
-#if DEBUG
-              syslog(LOG_DAEMON | LOG_DEBUG, "Warning: detected starting pulse out of sequence on pin %d",
-                                              counter_param[i].pin);
-#endif
-            }
-          }
-          else
-          {
-            char str[20];
-            
-            /* Pulse ended */
-            if (pulse_started == 1)
-            {
-              clock_gettime(CLOCK_REALTIME, &pulse_end_time);
-#if DEBUG
-              syslog(LOG_DAEMON | LOG_DEBUG, "Detected pulse with length %lu ms on pin %d", 
-                                              time_diff_ms(pulse_end_time, pulse_start_time), counter_param[i].pin);
-#endif
-              pulse_started = 0;
-            }
-            else
-            {
-#if DEBUG
-              syslog(LOG_DAEMON | LOG_DEBUG, "Warning: detected ending pulse out of sequence on pin %d",
-                                              counter_param[i].pin);
-#endif
-              continue;
-            }
-            
-            /* TODO: check pulse lenght and filter glitches */
-            
-            /* Check statefile for which virtual counter to increment */
-            switch (stateRead(counter.state_fd))
-            {
-               case 1:
-                  /* Increment counter 1, apply divisor and save value */
-                  counter.pulse_count1++;
-                  sprintf(str, "%010lu\n", (unsigned long)(counter.pulse_count1/counter.divisor));
-                  pwrite(counter.export1_fd, str, strlen(str), 0);
-                  break;
-                  
-               case 2:
-                  /* Increment counter 2, apply divisor and save value */
-                  counter.pulse_count2++;
-                  sprintf(str, "%010lu\n", (unsigned long)(counter.pulse_count2/counter.divisor));
-                  pwrite(counter.export2_fd, str, strlen(str), 0);
-                  break;
-                  
-               default:
-                  /* unknown state, do nothing */
-                  ;
-                  //printf("unknown value %d in statefile\n", stateRead(counter.state_fd));
-            }
-          }
-        }
-        else
-        {
-          /* waitForEdge failed, wait to be terminated */
-          while (1) usleep(100000);
-        }
+        if (counters[i].active) restoreCounter(&counters[i]);
       }
     }
+    else
+      syslog(LOG_DAEMON | LOG_ERR, "Counters are not kept across restarts");
   }
   
-  /* Create child process for TCP server */
-  modbus_server_pid=fork();
-  if (modbus_server_pid == -1)
+  /* Signals are blocked in all threads created from here, termination
+   * signals are handled by the counting loop, statistics and trace
+   * signals by the Modbus server */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGUSR1);
+  sigaddset(&sigs, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+  
+  /* Start sampling the pins in capture mode */
+  if (capture_rate && (startCapture(epoll_fd) != 0))
   {
-    syslog(LOG_DAEMON | LOG_ERR, "Error creating child process for Modbus server");
-    return 3;
+    syslog(LOG_DAEMON | LOG_ERR, "Unable to start the capture mode");
+    return 2;
   }
-    
-  if (modbus_server_pid == 0)
+  
+  /* Register ranges with 32/64 bit values */
+  modbustcp_server_map(FIRST_REG32, LAST_REG32, read_wide_registers, NULL);
+  modbustcp_server_map(FIRST_REG64, LAST_REG64, read_wide_registers, NULL);
+  modbustcp_server_map(FIRST_RATE_REG, LAST_RATE_REG, read_rate_registers, NULL);
+  
+  /* Start the Modbus TCP server in its own thread */
+  if (pthread_create(&modbus_thread, NULL, modbusServer, NULL) != 0)
   {
-    /***** We are in the child process *****/
-    
-    modbus_server_pid = getpid();
-   
-    /* Start Modbus TCP server loop */
-    modbustcp_server(MODBUS_SLAVE_ADDRESS,  // Modbus slave address
-                     read_register_handler, // Read register handler
-                     NULL                   // Write register handler
-                    );
+    syslog(LOG_DAEMON | LOG_ERR, "Error creating thread for Modbus server");
+    return 3;
   }
-  else
+  if (journal)
   {
-    /***** We are in the parent process *****/
-
-    /* Wait for termination signal */
-    while (cont) sleep(1);
+    journal_event_fd = eventfd(0, EFD_CLOEXEC);
+    if ((journal_event_fd < 0) || (pthread_create(&journal_thread, NULL, journalThread, NULL) != 0))
+    {
+      syslog(LOG_DAEMON | LOG_ERR, "Error creating thread for the journal, counters are not kept across restarts");
+      journal_close();
+      journal = 0;
+    }
   }
-
   
-  /* Wait for all counter child processes to terminate */
-  for (i=0; i<last_counter; i++)
+  /* Termination signals go to the counting loop */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGINT);
+  pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+  
+  
+  /***** Main counting loop *****/
+  clock_gettime(CLOCK_MONOTONIC, &export_time);
+  while (cont)
   {
-    /* Check for dummy pin */
-    if (counter_param[i].pin == 0) continue;
+    nfds = epoll_wait(epoll_fd, events, MAX_COUNTERS+1, EXPORT_INTERVAL);
+    if (nfds == -1)
+    {
+      if (errno == EINTR) continue;
+      syslog(LOG_DAEMON | LOG_ERR, "epoll_wait() failed: %s", strerror(errno));
+      break;
+    }
     
-    kill(counter_param[i].child_pid, SIGTERM);
-    if (waitpid(counter_param[i].child_pid, NULL, 0) == counter_param[i].child_pid)
+    /* Refresh the export files for scripts and the pulse rates */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (time_diff_ms(now, export_time) >= EXPORT_INTERVAL)
     {
-      syslog(LOG_DAEMON | LOG_NOTICE, "Child process %d successfully terminated", counter_param[i].child_pid);
+      realtime_offset = realtimeOffset();
+      unix_sec = (now.tv_sec*1000000000LL + now.tv_nsec + realtime_offset) / 1000000000;
+      for (i=0; i<last_counter; i++)
+      {
+        if (!counters[i].active) continue;
+        exportCounter(&counters[i]);
+        rateAdvance(&counters[i], now.tv_sec);
+        intervalAdvance(&counters[i], unix_sec - INTERVAL_GRACE);
+      }
+      export_time = now;
     }
-    else
+    
+    for (i=0; i<nfds; i++)
     {
-      syslog(LOG_DAEMON | LOG_ERR, "Error terminating child process %d", counter_param[i].child_pid);
+      if (events[i].data.ptr == NULL)
+        handleWrites(inotify_fd, active_value);
+      else if (events[i].data.ptr == &capture_rate)
+        capture_drain(captureEdge, &active_value);
+      else if (gpio_chip[0])
+        readLineEvents((COUNTER_t *)events[i].data.ptr, active_value);
+      else
+        readEdge((COUNTER_t *)events[i].data.ptr, active_value);
     }
   }
   
-  /* Terminate Modbus server */
-  kill(modbus_server_pid, SIGTERM);
-  if (waitpid(modbus_server_pid, NULL, 0) == modbus_server_pid)
+  /* Count the pulses captured until now */
+  if (capture_rate)
   {
-    syslog(LOG_DAEMON | LOG_NOTICE, "Modbus server process %d successfully terminated", modbus_server_pid);
+    capture_stop();
+    capture_drain(captureEdge, &active_value);
+    capture_stats(&stats);
+    syslog(LOG_DAEMON | LOG_NOTICE, "Capture: %lu samples, %lu late, %lu dropped, %lu pulses between samples",
+                                    stats.samples, stats.late, stats.overruns, stats.hidden);
   }
-  else
+  
+  /* Save the final counts */
+  if (journal)
+  {
+    if (write(journal_event_fd, &one, sizeof(one)) < 0) {}
+    pthread_join(journal_thread, NULL);
+  }
+  
+  /* Release the GPIO pins, the Modbus server thread ends with the process */
+  for (i=0; i<last_counter; i++)
   {
-    syslog(LOG_DAEMON | LOG_ERR, "Error terminating Modbus server process %d", modbus_server_pid);
+    if (counters[i].active) exportCounter(&counters[i]);
+    if (counter_param[i].pin) cleanup(counters[i]);
   }
+  shm_unlink(PULSECOUNT_SHM_NAME);
+  shm_unlink(PULSECOUNT_LOG_NAME);
   
   syslog(LOG_DAEMON | LOG_NOTICE, "Exiting Pulse counter daemon");
   closelog();
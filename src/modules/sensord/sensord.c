@@ -11,8 +11,8 @@
  *  gcc sensord.c -o sensord -lmbsrv -ldht -lsht `pkg-config --libs --cflags libmodbus`
  *
  * Author:  O. Wisniewski
- * Version: 0.6
- * Date:    2015/04/23
+ * Version: 0.9
+ * Date:    2026/10/17
  * 
  * Copyright 2013-2015, DEK Italia
  * 
@@ -48,7 +48,7 @@
 #include "dht.h"
 #include "sht21.h"
 
-#define VERSION "0.6"
+#define VERSION "0.9"
 
 #define MODBUS_SLAVE_ADDRESS MODBUS_SLAVE_SENSOR_MODULE
 
@@ -77,6 +77,15 @@
 
 #define NUM_SENSOR_READ_RETRY 4
 
+/* 
+ * Time to live (in ms) of sensor values cached by the Modbus 
+ * server. Concurrent requests for the same register always 
+ * share one sensor reading, even after the TTL expired.
+ */
+#define CACHE_TTL_1W   2000
+#define CACHE_TTL_DHT 10000  // a DHT reading takes at least 2s
+#define CACHE_TTL_SHT  5000
+
 
 /*
  * Modbus register map of the SENSOR slave module:
@@ -521,6 +530,23 @@ int main(int argc, char* argv[])
       syslog(LOG_DAEMON | LOG_ERR, "Failed to increase process priority\n");
    }
 
+   /* Cache sensor values in the Modbus server */
+   modbustcp_server_cache(FIRST_1W_REG,  LAST_1W_REG,  CACHE_TTL_1W);
+   modbustcp_server_cache(FIRST_DHT_REG, LAST_DHT_REG, CACHE_TTL_DHT);
+   modbustcp_server_cache(FIRST_SHT_REG, LAST_SHT_REG, CACHE_TTL_SHT);
+
+   /* Read the sensors in worker threads, so a slow sensor doesn't hold
+    * up requests for cached values. The DHT and SHT sensors share the
+    * GPIO driver and are read one at a time (single range).
+    */
+   modbustcp_server_slow(FIRST_1W_REG,  LAST_1W_REG);
+   modbustcp_server_slow(FIRST_DHT_REG, LAST_SHT_REG);
+
+   /* Latency statistics per sensor type (written on SIGUSR1) */
+   modbustcp_server_stats_range(FIRST_1W_REG,  LAST_1W_REG,  "1-wire");
+   modbustcp_server_stats_range(FIRST_DHT_REG, LAST_DHT_REG, "DHT");
+   modbustcp_server_stats_range(FIRST_SHT_REG, LAST_SHT_REG, "SHT");
+
    /* Start Modbus TCP server loop */
    modbustcp_server(MODBUS_SLAVE_ADDRESS,  // Modbus slave address
                     read_register_handler, // Read register handler
@@ -56,7 +56,7 @@ import syslog
 #import socket
 #import sys
 
-version="0.3"
+version="0.4"
 
 # Constant definitions
 clientId="smartbox"
@@ -79,7 +79,10 @@ def do_modbusRequest(cprm):
         # At least 3 parameters present
         modAddr = cprm[1]
         regAddr = cprm[2]
-        tcpPort = str(int(modAddr)+portbase)
+        if gwPort:
+            tcpPort = str(gwPort)
+        else:
+            tcpPort = str(int(modAddr)+portbase)
         #print("modAddr="+modAddr)
         #print("regAddr="+regAddr)
         
@@ -209,6 +212,7 @@ parser.add_argument('--brokerAddr', '-b', type=str, help='Broker address', requi
 parser.add_argument('--plantId', '-p', type=int, help='Plant Id', required=True)
 parser.add_argument('--extCmd',  '-c', type=str, help='ModbusTCP master command', required=True)
 parser.add_argument('--ipAddr',  '-i', type=str, help='ModbusTCP slave IP address', required=True)
+parser.add_argument('--gwPort',  '-g', type=int, help='ModbusTCP gateway port (default: port of each slave)')
 args = parser.parse_args()
 
 # Get parameters
@@ -216,6 +220,7 @@ brokerAddr = args.brokerAddr
 plantId  = str(args.plantId)
 extCmd   = args.extCmd
 ipAddr   = args.ipAddr
+gwPort   = args.gwPort
 clientId = clientId + plantId
 
 # Init syslog
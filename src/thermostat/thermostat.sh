@@ -109,13 +109,13 @@ function set_control {
 
    # Switch on/off heating/cooling control device 1 (if enabled)
    if [ $HEATCOOL_CTRL1_ENABLED -ne 0 ]; then
-      $MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP 500$HEATCOOL_CTRL1_MOD_ADDR $WRITE $HEATCOOL_CTRL1_MOD_ADDR $HEATCOOL_CTRL1_REG_ADDR $STATE >/dev/null 2>&1
+      $MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP ${MODBUS_GATEWAY_PORT:-500$HEATCOOL_CTRL1_MOD_ADDR} $WRITE $HEATCOOL_CTRL1_MOD_ADDR $HEATCOOL_CTRL1_REG_ADDR $STATE >/dev/null 2>&1
       CTRL1_STATE=$STATE
       $LOGCMD "Switch heating/cooling control device 1"
    fi
    # Switch on/off heating/cooling control device 2 (if enabled)
    if [ $HEATCOOL_CTRL2_ENABLED -ne 0 ]; then
-      $MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP 500$HEATCOOL_CTRL2_MOD_ADDR $WRITE $HEATCOOL_CTRL2_MOD_ADDR $HEATCOOL_CTRL2_REG_ADDR $STATE >/dev/null 2>&1
+      $MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP ${MODBUS_GATEWAY_PORT:-500$HEATCOOL_CTRL2_MOD_ADDR} $WRITE $HEATCOOL_CTRL2_MOD_ADDR $HEATCOOL_CTRL2_REG_ADDR $STATE >/dev/null 2>&1
       CTRL2_STATE=$STATE
       $LOGCMD "Switch heating/cooling control device 2"
    fi
@@ -137,11 +137,11 @@ function get_control {
 
    # Read state of heating/cooling control device (if enabled)
    if [ $HEATCOOL_CTRL1_ENABLED -ne 0 ]; then
-      CTRL1_STATE=$($MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP 500$HEATCOOL_CTRL1_MOD_ADDR $READ $HEATCOOL_CTRL1_MOD_ADDR $HEATCOOL_CTRL1_REG_ADDR | tail -1 | cut -d " "  -f 3)
+      CTRL1_STATE=$($MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP ${MODBUS_GATEWAY_PORT:-500$HEATCOOL_CTRL1_MOD_ADDR} $READ $HEATCOOL_CTRL1_MOD_ADDR $HEATCOOL_CTRL1_REG_ADDR | tail -1 | cut -d " "  -f 3)
    fi
    # Read state of heating-only control device (if enabled)
    if [ $HEATCOOL_CTRL2_ENABLED -ne 0 ]; then
-      CTRL2_STATE=$($MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP 500$HEATCOOL_CTRL2_MOD_ADDR $READ $HEATCOOL_CTRL2_MOD_ADDR $HEATCOOL_CTRL2_REG_ADDR | tail -1 | cut -d " "  -f 3)
+      CTRL2_STATE=$($MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP ${MODBUS_GATEWAY_PORT:-500$HEATCOOL_CTRL2_MOD_ADDR} $READ $HEATCOOL_CTRL2_MOD_ADDR $HEATCOOL_CTRL2_REG_ADDR | tail -1 | cut -d " "  -f 3)
    fi
    
    if [[ $CTRL1_STATE -eq $ON || $CTRL2_STATE -eq $ON ]]; then
@@ -232,7 +232,7 @@ while [ 1 ]; do
    #########################################################
    # Measure current temperature
    #########################################################
-   CURRENT_TEMP=$($MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP 500$TEMP_MOD_ADDR $READ $TEMP_MOD_ADDR $TEMP_REG_ADDR | tail -1 | cut -d " "  -f 3)
+   CURRENT_TEMP=$($MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP ${MODBUS_GATEWAY_PORT:-500$TEMP_MOD_ADDR} $READ $TEMP_MOD_ADDR $TEMP_REG_ADDR | tail -1 | cut -d " "  -f 3)
    CURRENT_TEMP=$(echo "scale=1; $CURRENT_TEMP/10" | bc -l)
    #CURRENT_TEMP=$(echo "scale=1; $CURRENT_TEMP-$TEMP_OFFSET" | bc -l)
 
@@ -258,7 +258,7 @@ while [ 1 ]; do
    #########################################################
    # Get control state (on/off)
    #########################################################
-   #CTRL_STATE=$($MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP 500$CTRL_MOD_ADDR $READ $CTRL_MOD_ADDR $CTRL_REG_ADDR | tail -1 | cut -d " "  -f 3)
+   #CTRL_STATE=$($MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP ${MODBUS_GATEWAY_PORT:-500$CTRL_MOD_ADDR} $READ $CTRL_MOD_ADDR $CTRL_REG_ADDR | tail -1 | cut -d " "  -f 3)
    get_control
    CTRL_STATE=$?
    #$LOGCMD "DBG: heater state: $CTRL_STATE"
@@ -269,7 +269,7 @@ while [ 1 ]; do
       if [ $CTRL_ERR_CNT -ge $MAX_ERROR ]; then
          # Too many consecutive failed readings, try to switch off the control unit
          $LOGCMD "Unable to read control state, switching off"
-         $MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP 500$CTRL_MOD_ADDR $WRITE $CTRL_MOD_ADDR $CTRL_REG_ADDR $OFF >/dev/null 2>&1      
+         $MODBUS_CLIENT_PROG $MODBUS_DEVICE_IP ${MODBUS_GATEWAY_PORT:-500$CTRL_MOD_ADDR} $WRITE $CTRL_MOD_ADDR $CTRL_REG_ADDR $OFF >/dev/null 2>&1      
          echo "3:Emergency stop" > $LCD_FILE
       fi
       continue